@@ -735,6 +735,10 @@ x.StreamVersion = uint32(xc.stream_version)
 x.ColoProxyScript = C.GoString(xc.colo_proxy_script)
 if err := x.UserspaceColoProxy.fromC(&xc.userspace_colo_proxy);err != nil {
 return fmt.Errorf("converting field UserspaceColoProxy: %v", err)
+}
+x.CopyThreads = uint32(xc.copy_threads)
+if err := x.PostcopyResume.fromC(&xc.postcopy_resume);err != nil {
+return fmt.Errorf("converting field PostcopyResume: %v", err)
 }
 
  return nil}
@@ -750,11 +754,72 @@ if x.ColoProxyScript != "" {
 xc.colo_proxy_script = C.CString(x.ColoProxyScript)}
 if err := x.UserspaceColoProxy.toC(&xc.userspace_colo_proxy); err != nil {
 return fmt.Errorf("converting field UserspaceColoProxy: %v", err)
+}
+xc.copy_threads = C.uint32_t(x.CopyThreads)
+if err := x.PostcopyResume.toC(&xc.postcopy_resume); err != nil {
+return fmt.Errorf("converting field PostcopyResume: %v", err)
 }
 
  return nil
  }
 
+// NewDomainSuspendParams returns an instance of DomainSuspendParams initialized with defaults.
+func NewDomainSuspendParams() (*DomainSuspendParams, error) {
+var (
+x DomainSuspendParams
+xc C.libxl_domain_suspend_params)
+
+C.libxl_domain_suspend_params_init(&xc)
+defer C.libxl_domain_suspend_params_dispose(&xc)
+
+if err := x.fromC(&xc); err != nil {
+return nil, err }
+
+return &x, nil}
+
+func (x *DomainSuspendParams) fromC(xc *C.libxl_domain_suspend_params) error {
+ x.MaxDowntimeMs = uint32(xc.max_downtime_ms)
+if err := x.AutoConverge.fromC(&xc.auto_converge);err != nil {
+return fmt.Errorf("converting field AutoConverge: %v", err)
+}
+if err := x.Compress.fromC(&xc.compress);err != nil {
+return fmt.Errorf("converting field Compress: %v", err)
+}
+x.StreamThreads = uint32(xc.stream_threads)
+if err := x.Sparse.fromC(&xc.sparse);err != nil {
+return fmt.Errorf("converting field Sparse: %v", err)
+}
+if err := x.Postcopy.fromC(&xc.postcopy);err != nil {
+return fmt.Errorf("converting field Postcopy: %v", err)
+}
+x.RecvFd = int(xc.recv_fd)
+
+ return nil}
+
+func (x *DomainSuspendParams) toC(xc *C.libxl_domain_suspend_params) (err error){defer func(){
+if err != nil{
+C.libxl_domain_suspend_params_dispose(xc)}
+}()
+
+xc.max_downtime_ms = C.uint32_t(x.MaxDowntimeMs)
+if err := x.AutoConverge.toC(&xc.auto_converge); err != nil {
+return fmt.Errorf("converting field AutoConverge: %v", err)
+}
+if err := x.Compress.toC(&xc.compress); err != nil {
+return fmt.Errorf("converting field Compress: %v", err)
+}
+xc.stream_threads = C.uint32_t(x.StreamThreads)
+if err := x.Sparse.toC(&xc.sparse); err != nil {
+return fmt.Errorf("converting field Sparse: %v", err)
+}
+if err := x.Postcopy.toC(&xc.postcopy); err != nil {
+return fmt.Errorf("converting field Postcopy: %v", err)
+}
+xc.recv_fd = C.int(x.RecvFd)
+
+ return nil
+ }
+
 // NewSchedParams returns an instance of SchedParams initialized with defaults.
 func NewSchedParams() (*SchedParams, error) {
 var (
@@ -4041,6 +4106,29 @@ func (x *SchedCredit2Params) toC(xc *C.libxl_sched_credit2_params) (err error){x
  return nil
  }
 
+// NewSchedRtdsParams returns an instance of SchedRtdsParams initialized with defaults.
+func NewSchedRtdsParams() (*SchedRtdsParams, error) {
+var (
+x SchedRtdsParams
+xc C.libxl_sched_rtds_params)
+
+C.libxl_sched_rtds_params_init(&xc)
+
+if err := x.fromC(&xc); err != nil {
+return nil, err }
+
+return &x, nil}
+
+func (x *SchedRtdsParams) fromC(xc *C.libxl_sched_rtds_params) error {
+ x.Runqueue = SchedRtdsRunqueue(xc.runqueue)
+
+ return nil}
+
+func (x *SchedRtdsParams) toC(xc *C.libxl_sched_rtds_params) (err error){xc.runqueue = C.libxl_sched_rtds_runqueue(x.Runqueue)
+
+ return nil
+ }
+
 // NewDomainRemusInfo returns an instance of DomainRemusInfo initialized with defaults.
 func NewDomainRemusInfo() (*DomainRemusInfo, error) {
 var (
@@ -37,6 +37,7 @@ ErrorQmpCommandNotFound Error = -29
 ErrorQmpDeviceNotActive Error = -30
 ErrorQmpDeviceNotFound Error = -31
 ErrorQemuApi Error = -32
+ErrorPostcopyFailed Error = -33
 )
 
 type DomainType int
@@ -450,6 +451,18 @@ CheckpointedStream int
 StreamVersion uint32
 ColoProxyScript string
 UserspaceColoProxy Defbool
+CopyThreads uint32
+PostcopyResume Defbool
+}
+
+type DomainSuspendParams struct {
+MaxDowntimeMs uint32
+AutoConverge Defbool
+Compress Defbool
+StreamThreads uint32
+Sparse Defbool
+Postcopy Defbool
+RecvFd int
 }
 
 type SchedParams struct {
@@ -1205,6 +1218,20 @@ type SchedCredit2Params struct {
 RatelimitUs int
 }
 
+type SchedRtdsRunqueue int
+const(
+SchedRtdsRunqueueUnknown SchedRtdsRunqueue = 0
+SchedRtdsRunqueueCpu SchedRtdsRunqueue = 1
+SchedRtdsRunqueueCore SchedRtdsRunqueue = 2
+SchedRtdsRunqueueSocket SchedRtdsRunqueue = 3
+SchedRtdsRunqueueNode SchedRtdsRunqueue = 4
+SchedRtdsRunqueueAll SchedRtdsRunqueue = 5
+)
+
+type SchedRtdsParams struct {
+Runqueue SchedRtdsRunqueue
+}
+
 type DomainRemusInfo struct {
 Interval int
 AllowUnsafe Defbool
@@ -1498,6 +1498,44 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_CREATEINFO_XEND_SUSPEND_EVTCHN_COMPAT
 
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS
+ *
+ * libxl_domain_suspend_with_params() is available, taking a
+ * libxl_domain_suspend_params with the downtime budget, auto-convergence,
+ * compression and the number of threads to use for writing the stream.
+ * libxl_domain_restore_params contains 'copy_threads', the number of threads
+ * to use for copying page data into the restored domain.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS_SPARSE
+ *
+ * libxl_domain_suspend_params contains 'sparse', to write a save file which
+ * leaves out pages of zeroes and can be mapped when restoring.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS_SPARSE 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS_POSTCOPY
+ *
+ * libxl_domain_suspend_params contains 'postcopy' and 'recv_fd', for a
+ * post-copy live migration, and libxl_domain_restore_params contains
+ * 'postcopy_resume', to resume the domain as soon as the receiver can.
+ * ERROR_POSTCOPY_FAILED is returned by libxl_domain_suspend_with_params()
+ * if the migration failed once the receiver may have resumed the domain.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS_POSTCOPY 1
+
+/*
+ * LIBXL_HAVE_SCHED_RTDS_PARAMS indicates the existence of a
+ * libxl_sched_rtds_params structure, containing RTDS scheduler wide
+ * parameters (i.e., how the CPUs of a cpupool are arranged in runqueues),
+ * and of libxl_sched_rtds_params_{get,set}().
+ */
+#define LIBXL_HAVE_SCHED_RTDS_PARAMS 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1857,6 +1895,33 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
 
+/*
+ * As libxl_domain_suspend(), with further parameters for live migration:
+ *
+ * max_downtime_ms: keep sending memory while the domain is running until
+ *   the remainder is predicted to be sent within this many ms, rather than
+ *   for a fixed number of rounds.  0 (default) for the fixed policy.
+ * auto_converge: throttle the domain's vCPUs if it dirties memory faster than
+ *   it can be sent.  Needs the credit2 scheduler.
+ * compress: compress memory in the stream.  The receiver must support it.
+ * stream_threads: threads for writing (and compressing) memory.
+ * sparse: leave out pages of zeroes and place memory at page boundaries of
+ *   the file, for restoring by mapping it.  fd must be a regular file, and
+ *   compress must not be set.
+ * postcopy: once the domain is suspended, send its device model state
+ *   ahead of the memory left, which the receiver then requests as the
+ *   domain touches it, on recv_fd.  Needs LIBXL_SUSPEND_LIVE and an HVM
+ *   domain.  If ERROR_POSTCOPY_FAILED is returned, the receiver may have
+ *   resumed the domain, which must then not be resumed here: it is lost.
+ *   The receiver resumes the domain right away if its
+ *   libxl_domain_restore_params' postcopy_resume is set.
+ */
+int libxl_domain_suspend_with_params(libxl_ctx *ctx, uint32_t domid, int fd,
+                                     int flags, /* LIBXL_SUSPEND_* */
+                                     const libxl_domain_suspend_params *params,
+                                     const libxl_asyncop_how *ao_how)
+                                     LIBXL_EXTERNAL_CALLERS_ONLY;
+
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
  * Suspended domain can be resumed with libxl_domain_resume()
@@ -2745,6 +2810,11 @@ int libxl_sched_credit2_params_get(libxl_ctx *ctx, uint32_t poolid,
                                    libxl_sched_credit2_params *scinfo);
 int libxl_sched_credit2_params_set(libxl_ctx *ctx, uint32_t poolid,
                                    libxl_sched_credit2_params *scinfo);
+int libxl_sched_rtds_params_get(libxl_ctx *ctx, uint32_t poolid,
+                                libxl_sched_rtds_params *scinfo);
+/* The runqueue arrangement can only be set while the cpupool has no cpus. */
+int libxl_sched_rtds_params_set(libxl_ctx *ctx, uint32_t poolid,
+                                libxl_sched_rtds_params *scinfo);
 
 /* Scheduler Per-domain parameters */
 
@@ -882,6 +882,14 @@ long long xc_logdirty_control(xc_interface *xch,
 int xc_get_paging_mempool_size(xc_interface *xch, uint32_t domid, uint64_t *size);
 int xc_set_paging_mempool_size(xc_interface *xch, uint32_t domid, uint64_t size);
 
+/*
+ * Progress of the release of a dying domain's memory (x86 only), see
+ * XEN_DOMCTL_get_relinquish_progress.
+ */
+typedef struct xen_domctl_relinquish_progress xc_relinquish_progress_t;
+int xc_get_relinquish_progress(xc_interface *xch, uint32_t domid,
+                               xc_relinquish_progress_t *progress);
+
 int xc_sched_credit_domain_set(xc_interface *xch,
                                uint32_t domid,
                                struct xen_domctl_sched_credit *sdom);
@@ -909,6 +917,12 @@ int xc_sched_credit2_domain_get(xc_interface *xch,
                                 uint32_t domid,
                                 struct xen_domctl_sched_credit2 *sdom);
 
+int xc_sched_rtds_params_set(xc_interface *xch,
+                             uint32_t cpupool_id,
+                             struct xen_sysctl_rtds_schedule *schedule);
+int xc_sched_rtds_params_get(xc_interface *xch,
+                             uint32_t cpupool_id,
+                             struct xen_sysctl_rtds_schedule *schedule);
 int xc_sched_rtds_domain_set(xc_interface *xch,
                              uint32_t domid,
                              struct xen_domctl_sched_rtds *sdom);
@@ -1495,10 +1509,9 @@ int xc_tbuf_enable(xc_interface *xch, unsigned long pages,
 int xc_tbuf_disable(xc_interface *xch);
 
 /**
- * This function sets the size of the trace buffers. Setting the size
- * is currently a one-shot operation that may be performed either at boot
- * time or via this interface, not both. The buffer size must be set before
- * enabling tracing.
+ * This function sets the size of the trace buffers of all cpus.  The size
+ * can be changed while tracing is disabled, discarding the contents of the
+ * buffers.  The buffer size must be set before enabling tracing.
  *
  * @parm xch a handle to an open hypervisor interface
  * @parm size the size in pages per cpu for the trace buffers
@@ -1507,11 +1520,24 @@ int xc_tbuf_disable(xc_interface *xch);
 int xc_tbuf_set_size(xc_interface *xch, unsigned long size);
 
 /**
- * This function retrieves the current size of the trace buffers.
- * Note that the size returned is in terms of bytes, not pages.
+ * This function sets the size of the trace buffers of the cpus in mask,
+ * with tracing disabled.  The contents of all buffers are discarded.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm mask the cpus to resize the trace buffers of
+ * @parm size the size in pages for the trace buffers
+ * @return 0 on success, -1 on failure.
+ */
+int xc_tbuf_set_cpu_size(xc_interface *xch, xc_cpumap_t mask,
+                         unsigned long size);
+
+/**
+ * This function retrieves the current size of the trace buffers, or of the
+ * largest one if their sizes differ.
+ * Note that the size returned is in terms of pages, not bytes.
 
  * @parm xch a handle to an open hypervisor interface
- * @parm size will contain the size in bytes for the trace buffers
+ * @parm size will contain the size in pages for the trace buffers
  * @return 0 on success, -1 on failure.
  */
 int xc_tbuf_get_size(xc_interface *xch, unsigned long *size);
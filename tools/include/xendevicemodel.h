@@ -51,6 +51,22 @@ int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id);
 
+/**
+ * This function instantiates an IOREQ Server with a posted write ring per
+ * vCPU, which can be mapped using xenforeignmemory_map_resource() with
+ * frame XENMEM_resource_ioreq_server_frame_ring(vcpu).
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm handle_bufioreq how should the IOREQ Server handle buffered
+ *                       requests (HVM_IOREQSRV_BUFIOREQ_*)?
+ * @parm id pointer to an ioservid_t to receive the IOREQ Server id.
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_create_posted_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    ioservid_t *id);
+
 /**
  * This function retrieves the necessary information to allow an
  * emulator to use an IOREQ Server.
@@ -86,6 +102,24 @@ int xendevicemodel_map_io_range_to_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int is_mmio,
     uint64_t start, uint64_t end);
 
+/**
+ * This function registers a range of memory or I/O ports for emulation,
+ * with writes to it being posted to the ring of the writing vCPU rather
+ * than waited for. The IOREQ Server must have been created by
+ * xendevicemodel_create_posted_ioreq_server().
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm id the IOREQ Server id.
+ * @parm is_mmio is this a range of ports or memory
+ * @parm start start of range
+ * @parm end end of range (inclusive).
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_map_posted_io_range_to_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int is_mmio,
+    uint64_t start, uint64_t end);
+
 /**
  * This function deregisters a range of memory or I/O ports for emulation.
  *
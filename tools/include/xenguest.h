@@ -26,6 +26,51 @@
 
 #define XCFLAGS_LIVE      (1 << 0)
 #define XCFLAGS_DEBUG     (1 << 1)
+/* Compress page data in the stream.  Needs a receiver supporting it. */
+#define XCFLAGS_COMPRESS  (1 << 2)
+
+/*
+ * Number of threads used for writing page data to the stream.  0 (default)
+ * writes synchronously from the saving thread.  With n > 0 a writer thread is
+ * used, plus n - 1 threads for transforming page data if applicable.
+ */
+#define XCFLAGS_PIPELINE_SHIFT 8
+#define XCFLAGS_PIPELINE_MAX   0xffU
+#define XCFLAGS_PIPELINE_MASK  (XCFLAGS_PIPELINE_MAX << XCFLAGS_PIPELINE_SHIFT)
+#define XCFLAGS_PIPELINE(n)    (((uint32_t)(n) << XCFLAGS_PIPELINE_SHIFT) & \
+                                XCFLAGS_PIPELINE_MASK)
+
+/*
+ * Downtime budget in ms for live migration.  When set, the precopy phase
+ * continues until the remaining dirty pages are predicted to be sent within
+ * the budget, rather than for a fixed number of rounds.  Ignored if the
+ * caller provides a precopy_policy callback.  Callers must reject budgets
+ * above XCFLAGS_DOWNTIME_MAX, which would be truncated.
+ */
+#define XCFLAGS_DOWNTIME_SHIFT 16
+#define XCFLAGS_DOWNTIME_MAX   0xffffU
+#define XCFLAGS_DOWNTIME_MASK  (XCFLAGS_DOWNTIME_MAX << XCFLAGS_DOWNTIME_SHIFT)
+#define XCFLAGS_DOWNTIME(ms)   (((uint32_t)(ms) << XCFLAGS_DOWNTIME_SHIFT) & \
+                                XCFLAGS_DOWNTIME_MASK)
+/*
+ * Throttle the guest's vCPUs, using the credit2 scheduler's cap, if it dirties
+ * memory too quickly for the precopy phase to converge.
+ */
+#define XCFLAGS_AUTO_CONVERGE  (1 << 3)
+/*
+ * Write page data page aligned and leave out pages of zeroes, so a restore
+ * from the image file can map the data rather than read it.  Needs a
+ * seekable fd, and is incompatible with XCFLAGS_COMPRESS.
+ */
+#define XCFLAGS_SPARSE         (1 << 4)
+/*
+ * Post-copy live migration of HVM guests: after the precopy phase, send the
+ * guest's state but not its remaining dirty memory, which is sent after the
+ * receiver has resumed the guest, pages it faults on first.  Needs recv_fd,
+ * and a receiver supporting it.  A failure after the receiver has resumed
+ * the guest loses the guest.
+ */
+#define XCFLAGS_POSTCOPY       (1 << 5)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -503,6 +548,16 @@ struct save_callbacks {
      */
     int (*wait_checkpoint)(void *data);
 
+    /*
+     * Called for a post-copy stream once the POSTCOPY_TRANSITION record has
+     * been written, for the caller to send the state it holds for the guest
+     * (e.g. the device model's) which the receiver needs before resuming it.
+     * The remaining memory is sent after this returns.  Optional.
+     *
+     * returns 1 for success, 0 for failure.
+     */
+    int (*postcopy_transition)(void *data);
+
     /* Enable qemu-dm logging dirty pages to xen */
     int (*switch_qemu_logdirty)(uint32_t domid, unsigned enable, void *data); /* HVM only */
 
@@ -583,8 +638,28 @@ struct restore_callbacks {
     void (*restore_results)(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
                             void *data);
 
+    /*
+     * Called for a post-copy stream once the guest's state has been
+     * restored, after restore_results.  Any state the sender's
+     * postcopy_transition callback sent follows in the stream, for this
+     * callback to read.  The guest may be resumed once it has returned, while
+     * xc_domain_restore() keeps receiving its remaining memory on demand:
+     * paging requests are only served after it has returned.  Optional,
+     * without it the guest stays paused until all memory has been received.
+     *
+     * returns 1 for success, 0 for failure.
+     */
+    int (*postcopy_transition)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void *data;
+
+    /*
+     * Not a callback: number of threads for populating and copying page
+     * data into the guest.  0 (default) copies synchronously while reading
+     * the stream.
+     */
+    unsigned int nr_copy_threads;
 };
 
 /**
@@ -686,6 +686,23 @@ int xc_set_paging_mempool_size(xc_interface *xch, uint32_t domid, uint64_t size)
     return do_domctl(xch, &domctl);
 }
 
+int xc_get_relinquish_progress(xc_interface *xch, uint32_t domid,
+                               xc_relinquish_progress_t *progress)
+{
+    int rc;
+    struct xen_domctl domctl = {
+        .cmd         = XEN_DOMCTL_get_relinquish_progress,
+        .domain      = domid,
+    };
+
+    rc = do_domctl(xch, &domctl);
+    if ( rc )
+        return rc;
+
+    *progress = domctl.u.relinquish_progress;
+    return 0;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         uint64_t max_memkb)
@@ -54,7 +54,8 @@ int xc_tbuf_set_size(xc_interface *xch, unsigned long size)
 int xc_tbuf_get_size(xc_interface *xch, unsigned long *size)
 {
     struct t_info *t_info;
-    int rc;
+    const uint32_t *t_info_words;
+    int rc, cpu, max_cpus;
     struct xen_sysctl sysctl = {};
 
     sysctl.cmd = XEN_SYSCTL_tbuf_op;
@@ -69,10 +70,24 @@ int xc_tbuf_get_size(xc_interface *xch, unsigned long *size)
                     sysctl.u.tbuf_op.size, PROT_READ | PROT_WRITE,
                     sysctl.u.tbuf_op.buffer_mfn);
 
-    if ( t_info == NULL || t_info->tbuf_size == 0 )
-        rc = -1;
+    if ( t_info == NULL )
+        return -1;
+
+    if ( t_info->tbuf_size )
+        *size = t_info->tbuf_size;
     else
-	*size = t_info->tbuf_size;
+    {
+        /* Buffers differ in size, report the largest one. */
+        max_cpus = xc_get_max_cpus(xch);
+        t_info_words = (const uint32_t *)t_info;
+        *size = 0;
+        for ( cpu = 0; cpu < max_cpus; cpu++ )
+            if ( t_info->mfn_offset[cpu] &&
+                 t_info_words[t_info->mfn_offset[cpu] - 1] > *size )
+                *size = t_info_words[t_info->mfn_offset[cpu] - 1];
+        if ( *size == 0 )
+            rc = -1;
+    }
 
     xenforeignmemory_unmap(xch->fmem, t_info, sysctl.u.tbuf_op.size);
 
@@ -158,6 +173,52 @@ int xc_tbuf_set_cpu_mask(xc_interface *xch, xc_cpumap_t mask)
     return ret;
 }
 
+int xc_tbuf_set_cpu_size(xc_interface *xch, xc_cpumap_t mask,
+                         unsigned long size)
+{
+    struct xen_sysctl sysctl = {};
+    DECLARE_HYPERCALL_BOUNCE(mask, 0, XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    int ret = -1;
+    int bits, cpusize;
+
+    cpusize = xc_get_cpumap_size(xch);
+    if (cpusize <= 0)
+    {
+        PERROR("Could not get number of cpus");
+        return -1;
+    }
+
+    HYPERCALL_BOUNCE_SET_SIZE(mask, cpusize);
+
+    bits = xc_get_max_cpus(xch);
+    if (bits <= 0)
+    {
+        PERROR("Could not get number of bits");
+        return -1;
+    }
+
+    if ( xc_hypercall_bounce_pre(xch, mask) )
+    {
+        PERROR("Could not allocate memory for xc_tbuf_set_cpu_size hypercall");
+        goto out;
+    }
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_set_cpu_size;
+    sysctl.u.tbuf_op.size = size;
+
+    set_xen_guest_handle(sysctl.u.tbuf_op.cpu_mask.bitmap, mask);
+    sysctl.u.tbuf_op.cpu_mask.nr_bits = bits;
+
+    ret = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, mask);
+
+ out:
+    return ret;
+}
+
 int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask)
 {
     struct xen_sysctl sysctl = {};
@@ -165,9 +165,9 @@ static int xendevicemodel_op(
     return ret;
 }
 
-int xendevicemodel_create_ioreq_server(
+static int create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
-    ioservid_t *id)
+    unsigned int flags, ioservid_t *id)
 {
     struct xen_dm_op op;
     struct xen_dm_op_create_ioreq_server *data;
@@ -179,6 +179,7 @@ int xendevicemodel_create_ioreq_server(
     data = &op.u.create_ioreq_server;
 
     data->handle_bufioreq = handle_bufioreq;
+    data->flags = flags;
 
     rc = xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
     if (rc)
@@ -189,6 +190,21 @@ int xendevicemodel_create_ioreq_server(
     return 0;
 }
 
+int xendevicemodel_create_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    ioservid_t *id)
+{
+    return create_ioreq_server(dmod, domid, handle_bufioreq, 0, id);
+}
+
+int xendevicemodel_create_posted_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    ioservid_t *id)
+{
+    return create_ioreq_server(dmod, domid, handle_bufioreq,
+                               XEN_DMOP_posted_ring, id);
+}
+
 int xendevicemodel_get_ioreq_server_info(
     xendevicemodel_handle *dmod, domid_t domid, ioservid_t id,
     xen_pfn_t *ioreq_gfn, xen_pfn_t *bufioreq_gfn,
@@ -229,9 +245,9 @@ int xendevicemodel_get_ioreq_server_info(
     return 0;
 }
 
-int xendevicemodel_map_io_range_to_ioreq_server(
+static int map_io_range_to_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int is_mmio,
-    uint64_t start, uint64_t end)
+    uint64_t start, uint64_t end, unsigned int flags)
 {
     struct xen_dm_op op;
     struct xen_dm_op_ioreq_server_range *data;
@@ -242,6 +258,7 @@ int xendevicemodel_map_io_range_to_ioreq_server(
     data = &op.u.map_io_range_to_ioreq_server;
 
     data->id = id;
+    data->flags = flags;
     data->type = is_mmio ? XEN_DMOP_IO_RANGE_MEMORY : XEN_DMOP_IO_RANGE_PORT;
     data->start = start;
     data->end = end;
@@ -249,6 +266,22 @@ int xendevicemodel_map_io_range_to_ioreq_server(
     return xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
 }
 
+int xendevicemodel_map_io_range_to_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int is_mmio,
+    uint64_t start, uint64_t end)
+{
+    return map_io_range_to_ioreq_server(dmod, domid, id, is_mmio,
+                                        start, end, 0);
+}
+
+int xendevicemodel_map_posted_io_range_to_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int is_mmio,
+    uint64_t start, uint64_t end)
+{
+    return map_io_range_to_ioreq_server(dmod, domid, id, is_mmio,
+                                        start, end, XEN_DMOP_IO_RANGE_posted);
+}
+
 int xendevicemodel_unmap_io_range_from_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int is_mmio,
     uint64_t start, uint64_t end)
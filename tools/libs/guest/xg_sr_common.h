@@ -3,11 +3,18 @@
 
 #include <stdbool.h>
 
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
+
 #include "xg_private.h"
 #include "xg_save_restore.h"
 #include "xc_bitops.h"
 
 #include "xg_sr_stream_format.h"
+#include "xg_sr_pipeline.h"
+#include "xg_sr_compress.h"
+#include "xg_sr_workqueue.h"
+#include "xg_sr_precopy.h"
 
 /* String representation of Domain Header types. */
 const char *dhdr_type_to_str(uint32_t type);
@@ -17,6 +24,7 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_restore_batch;
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -246,6 +254,41 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /* Threads for writing page data, 0 to write synchronously. */
+            unsigned int nr_pipeline_threads;
+            bool use_pipeline;
+            struct xc_sr_pipeline pipeline;
+
+            /* Send PAGE_DATA_COMPRESSED rather than PAGE_DATA records. */
+            bool compress;
+            struct xc_sr_compress_stats compress_stats;
+
+            /*
+             * Send PAGE_DATA_SPARSE records.  While page data pipeline
+             * batches are in flight, sparse_offset is the image file offset
+             * following them.
+             */
+            bool sparse;
+            bool sparse_offset_valid;
+            off_t sparse_offset;
+            uint64_t nr_sparse_zero;
+
+            /*
+             * Post-copy: pfns whose data is still to be sent after the
+             * transition, pushed in order unless faulted on first.
+             */
+            bool postcopy;
+            unsigned long *postcopy_pfns, nr_postcopy_pfns;
+            xen_pfn_t postcopy_cursor;
+            uint64_t nr_postcopy_faults;
+
+            /* Adaptive precopy policy, if a downtime budget was given. */
+            bool adaptive_precopy;
+            struct xc_sr_precopy precopy;
+            /* Scheduling parameters before throttling the guest. */
+            bool throttled;
+            struct xen_domctl_sched_credit2 orig_sched;
         } save;
 
         struct /* Restore data. */
@@ -259,6 +302,7 @@ struct xc_sr_context
 
             /* From Image Header. */
             uint32_t format_version;
+            bool compressed;
 
             /* From Domain Header. */
             uint32_t guest_type;
@@ -297,6 +341,61 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Threads for copying page data, 0 to copy synchronously. */
+            unsigned int nr_copy_threads;
+            bool use_workqueue;
+            struct xc_sr_workqueue copy_wq;
+
+            /*
+             * PAGE_DATA records waiting for their pfns to be populated, in
+             * a single hypercall once enough have been collected.
+             */
+#define MAX_PENDING_BATCHES 16
+#define MAX_PENDING_PFNS    (8 * MAX_BATCH_SIZE)
+            struct xc_sr_restore_batch *pending[MAX_PENDING_BATCHES];
+            unsigned int nr_pending, nr_pending_pfns;
+
+            /*
+             * Pfns with page data pending or being copied.  A record
+             * containing one of them again has to wait for the earlier
+             * copy to complete.
+             */
+            unsigned long *copy_pfns, nr_copy_pfns;
+
+            uint64_t nr_populate_calls, nr_copy_flushes;
+
+            /*
+             * Image file size if the stream is a regular file, whose page
+             * data can be mapped, -1 otherwise.  sparse_data is the file
+             * offset of the page data of the PAGE_DATA_SPARSE record being
+             * processed if it was left in the file, -1 otherwise.
+             */
+            off_t image_size, sparse_data;
+            uint64_t nr_sparse_zero, nr_sparse_mapped;
+
+            /*
+             * Post-copy: pfns whose data is still to come are paged out at
+             * the transition, and paged in from the stream.  Faults on them
+             * are reported on send_back_fd, and the requests wait until the
+             * data has arrived.
+             */
+            struct
+            {
+                bool begun, transitioned;
+                unsigned long *pending, nr_pending;
+                unsigned long *requested;
+
+                void *ring_page;
+                vm_event_back_ring_t back_ring;
+                xenevtchn_handle *xce;
+                int port;
+
+                vm_event_request_t *waiting;
+                unsigned int nr_waiting, max_waiting;
+
+                uint64_t nr_faults, nr_loaded;
+            } postcopy;
         } restore;
     };
 
@@ -444,6 +543,21 @@ static inline int write_record(struct xc_sr_context *ctx,
  */
 int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 
+/*
+ * The two halves of read_record(), for callers wanting to look at the header
+ * before reading the data.  read_record_header() validates the length.
+ */
+int read_record_header(struct xc_sr_context *ctx, int fd,
+                       struct xc_sr_rhdr *rhdr);
+int read_record_data(struct xc_sr_context *ctx, int fd,
+                     const struct xc_sr_rhdr *rhdr, struct xc_sr_record *rec);
+
+/*
+ * Drop a pfn from the pages still to come in a post-copy stream, for pages
+ * whose contents are set up by the restore side instead.
+ */
+void postcopy_drop_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn);
+
 /*
  * This would ideally be private in restore.c, but is needed by
  * x86_pv_localise_page() if we receive pagetables frames ahead of the
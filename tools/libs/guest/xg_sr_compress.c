@@ -0,0 +1,357 @@
+#include <string.h>
+
+#include "xg_sr_common.h"
+#include "../../xen/include/xen/lz4.h"
+
+/*
+ * Minimal LZ4 block compressor for single pages.  Greedy matching with a
+ * single entry hash table, which is good enough for the low entropy pages
+ * where compression pays off, and cheap enough to not slow down migration
+ * of incompressible ones.  Decompression uses the LZ4 decoder shared with
+ * the domain builder.
+ */
+#define LZ4_MINMATCH      4
+#define LZ4_LASTLITERALS  5
+#define LZ4_MFLIMIT       12
+#define LZ4_RUN_MASK      15
+#define LZ4_HASH_BITS     12
+
+/* Only keep compressed data saving at least an eighth of the page. */
+#define LZ4_MAX_OUTPUT    (PAGE_SIZE - PAGE_SIZE / 8)
+
+#define DUP_HASH_BITS     11
+#define DUP_HASH_SIZE     (1U << DUP_HASH_BITS)
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+/*
+ * Emit one sequence of literals [anchor, ip), followed by a match of mlen
+ * octets at offset if mlen is not 0.
+ *
+ * @returns the new output position, or NULL if the output would exceed oend.
+ */
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *oend,
+                                 const uint8_t *anchor, const uint8_t *ip,
+                                 unsigned int offset, size_t mlen)
+{
+    size_t lit = ip - anchor;
+    uint8_t *token = op++;
+
+    /* Worst case length of token extensions, literals and offset. */
+    if ( op + lit + lit / 255 + 1 + 2 + (mlen / 255 + 1) > oend )
+        return NULL;
+
+    if ( lit >= LZ4_RUN_MASK )
+    {
+        *token = LZ4_RUN_MASK << 4;
+        op = lz4_put_length(op, lit - LZ4_RUN_MASK);
+    }
+    else
+        *token = lit << 4;
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if ( !mlen )
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    mlen -= LZ4_MINMATCH;
+    if ( mlen >= LZ4_RUN_MASK )
+    {
+        *token |= LZ4_RUN_MASK;
+        op = lz4_put_length(op, mlen - LZ4_RUN_MASK);
+    }
+    else
+        *token |= mlen;
+
+    return op;
+}
+
+/*
+ * Compress a page into dst.
+ *
+ * @returns the compressed length, or 0 if it would exceed dst_max.
+ */
+static size_t lz4_compress_page(const uint8_t *src, uint8_t *dst,
+                                size_t dst_max)
+{
+    uint16_t table[1U << LZ4_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *ref;
+    const uint8_t *const end = src + PAGE_SIZE;
+    const uint8_t *const mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *const matchlimit = end - LZ4_LASTLITERALS;
+    uint8_t *op = dst;
+    const uint8_t *const oend = dst + dst_max;
+    unsigned int h;
+    size_t mlen;
+
+    /* Stale entries only cause a failed comparison below. */
+    memset(table, 0, sizeof(table));
+
+    for ( ip++; ip < mflimit; )
+    {
+        h = lz4_hash(read32(ip));
+        ref = src + table[h];
+        table[h] = ip - src;
+
+        if ( ref >= ip || read32(ref) != read32(ip) )
+        {
+            ip++;
+            continue;
+        }
+
+        while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+        {
+            ip--;
+            ref--;
+        }
+
+        for ( mlen = LZ4_MINMATCH;
+              ip + mlen < matchlimit && ip[mlen] == ref[mlen]; mlen++ )
+            ;
+
+        op = lz4_put_sequence(op, oend, anchor, ip, ip - ref, mlen);
+        if ( !op )
+            return 0;
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    /* The last sequence holds the remaining literals only. */
+    op = lz4_put_sequence(op, oend, anchor, end, 0, 0);
+
+    return op ? op - dst : 0;
+}
+
+bool xc_sr_page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+static uint64_t page_hash(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+unsigned int xc_sr_compress_pages(void *const *pages, unsigned int nr_pages,
+                                  uint32_t *enc, struct iovec *iov, void *buf,
+                                  struct xc_sr_compress_stats *stats)
+{
+    /* Index + 1 of the pages with a given hash, 0 for empty entries. */
+    uint16_t dup_table[DUP_HASH_SIZE] = { 0 };
+    uint64_t hashes[nr_pages];
+    unsigned int i, j, h, iovcnt = 0, nr_dup_entries = 0;
+    uint8_t *out = buf;
+    size_t len;
+
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        if ( xc_sr_page_is_zero(pages[i]) )
+        {
+            enc[i] = PAGE_DATA_ENC_ZERO << PAGE_DATA_ENC_SHIFT;
+            if ( stats )
+                stats->nr_zero++;
+            continue;
+        }
+
+        hashes[i] = page_hash(pages[i]);
+        for ( h = hashes[i] & (DUP_HASH_SIZE - 1); dup_table[h];
+              h = (h + 1) & (DUP_HASH_SIZE - 1) )
+        {
+            j = dup_table[h] - 1;
+            if ( hashes[j] == hashes[i] &&
+                 !memcmp(pages[j], pages[i], PAGE_SIZE) )
+                break;
+        }
+
+        if ( dup_table[h] )
+        {
+            enc[i] = (PAGE_DATA_ENC_DUP << PAGE_DATA_ENC_SHIFT) |
+                     (dup_table[h] - 1);
+            if ( stats )
+                stats->nr_dup++;
+            continue;
+        }
+
+        /* Keep the table at most half full, to bound probing. */
+        if ( nr_dup_entries < DUP_HASH_SIZE / 2 )
+        {
+            dup_table[h] = i + 1;
+            nr_dup_entries++;
+        }
+
+        len = lz4_compress_page(pages[i], out, LZ4_MAX_OUTPUT);
+        if ( len )
+        {
+            enc[i] = (PAGE_DATA_ENC_LZ4 << PAGE_DATA_ENC_SHIFT) | len;
+
+            /* Compressed data of consecutive pages is contiguous in buf. */
+            if ( iovcnt && iov[iovcnt - 1].iov_base +
+                           iov[iovcnt - 1].iov_len == (void *)out )
+                iov[iovcnt - 1].iov_len += len;
+            else
+            {
+                iov[iovcnt].iov_base = out;
+                iov[iovcnt].iov_len = len;
+                iovcnt++;
+            }
+            out += len;
+
+            if ( stats )
+            {
+                stats->nr_lz4++;
+                stats->bytes_out += len;
+            }
+        }
+        else
+        {
+            enc[i] = PAGE_DATA_ENC_RAW << PAGE_DATA_ENC_SHIFT;
+            iov[iovcnt].iov_base = pages[i];
+            iov[iovcnt].iov_len = PAGE_SIZE;
+            iovcnt++;
+
+            if ( stats )
+            {
+                stats->nr_raw++;
+                stats->bytes_out += PAGE_SIZE;
+            }
+        }
+    }
+
+    if ( stats )
+        stats->bytes_in += (uint64_t)nr_pages * PAGE_SIZE;
+
+    return iovcnt;
+}
+
+ssize_t xc_sr_compressed_length(const uint32_t *enc, unsigned int nr_pages)
+{
+    unsigned int i, arg;
+    ssize_t len = 0;
+
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        arg = enc[i] & PAGE_DATA_ENC_ARG_MASK;
+
+        switch ( enc[i] >> PAGE_DATA_ENC_SHIFT )
+        {
+        case PAGE_DATA_ENC_RAW:
+            if ( arg )
+                return -1;
+            len += PAGE_SIZE;
+            break;
+
+        case PAGE_DATA_ENC_ZERO:
+            if ( arg )
+                return -1;
+            break;
+
+        case PAGE_DATA_ENC_DUP:
+            if ( arg >= i )
+                return -1;
+            break;
+
+        case PAGE_DATA_ENC_LZ4:
+            if ( !arg || arg >= PAGE_SIZE )
+                return -1;
+            len += arg;
+            break;
+
+        default:
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+unsigned int xc_sr_decompress_pages(const uint32_t *enc, unsigned int nr_pages,
+                                    const void *data, void *out)
+{
+    const unsigned char *ip = data;
+    unsigned char *op = out;
+    unsigned int i, arg;
+    size_t len;
+
+    for ( i = 0; i < nr_pages; i++, op += PAGE_SIZE )
+    {
+        arg = enc[i] & PAGE_DATA_ENC_ARG_MASK;
+
+        switch ( enc[i] >> PAGE_DATA_ENC_SHIFT )
+        {
+        case PAGE_DATA_ENC_RAW:
+            memcpy(op, ip, PAGE_SIZE);
+            ip += PAGE_SIZE;
+            break;
+
+        case PAGE_DATA_ENC_ZERO:
+            memset(op, 0, PAGE_SIZE);
+            break;
+
+        case PAGE_DATA_ENC_DUP:
+            memcpy(op, out + (size_t)arg * PAGE_SIZE, PAGE_SIZE);
+            break;
+
+        case PAGE_DATA_ENC_LZ4:
+            len = PAGE_SIZE;
+            if ( lz4_decompress_unknownoutputsize(ip, arg, op, &len) ||
+                 len != PAGE_SIZE )
+                return i + 1;
+            ip += arg;
+            break;
+
+        default:
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,66 @@
+#ifndef __SR_COMPRESS__H
+#define __SR_COMPRESS__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Page encoding for PAGE_DATA_COMPRESSED records of the migration stream.
+ *
+ * Pages of zeroes and pages with the same contents as an earlier page of
+ * the same record are sent without data.  Other pages are LZ4 block
+ * compressed, or sent as is if that doesn't save anything.
+ */
+
+struct xc_sr_compress_stats
+{
+    /* Pages sent with each of the encodings. */
+    uint64_t nr_zero, nr_dup, nr_lz4, nr_raw;
+    /* Octets of page data before and after encoding. */
+    uint64_t bytes_in, bytes_out;
+};
+
+/*
+ * Encode nr_pages pages.  Fills one descriptor per page into enc[], and up
+ * to nr_pages iovec entries for the page data into iov[].  Raw pages are
+ * referenced in place, compressed data is stored in buf, which needs to
+ * hold at least nr_pages * PAGE_SIZE octets.  stats is updated if not NULL.
+ *
+ * @returns the number of iovec entries used.
+ */
+unsigned int xc_sr_compress_pages(void *const *pages, unsigned int nr_pages,
+                                  uint32_t *enc, struct iovec *iov, void *buf,
+                                  struct xc_sr_compress_stats *stats);
+
+/* Is a page all zeroes? */
+bool xc_sr_page_is_zero(const void *page);
+
+/*
+ * Length of the page data described by enc[].
+ *
+ * @returns the length, or -1 if a descriptor is invalid.
+ */
+ssize_t xc_sr_compressed_length(const uint32_t *enc, unsigned int nr_pages);
+
+/*
+ * Decode nr_pages pages described by enc[] from data into out, which needs
+ * to hold nr_pages * PAGE_SIZE octets.  The caller needs to have validated
+ * the data length with xc_sr_compressed_length().
+ *
+ * @returns 0 for success, or the index of the first bad page + 1.
+ */
+unsigned int xc_sr_decompress_pages(const uint32_t *enc, unsigned int nr_pages,
+                                    const void *data, void *out);
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
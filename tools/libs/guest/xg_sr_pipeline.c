@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "xg_sr_common.h"
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_pipeline *p = arg;
+    struct xc_sr_pipeline_slot *slot;
+    int rc, err;
+
+    pthread_mutex_lock(&p->lock);
+
+    for ( ; ; )
+    {
+        while ( !p->shutdown && p->transform_seq == p->submit_seq )
+            pthread_cond_wait(&p->cond, &p->lock);
+
+        if ( p->shutdown )
+            break;
+
+        slot = &p->slots[p->transform_seq++ % p->depth];
+        slot->state = SLOT_TRANSFORMING;
+        pthread_mutex_unlock(&p->lock);
+
+        rc = p->transform(slot->batch, p->transform_arg);
+        err = errno;
+
+        pthread_mutex_lock(&p->lock);
+        if ( rc && !p->error )
+            p->error = err ?: EIO;
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+    struct xc_sr_pipeline *p = arg;
+    struct xc_sr_pipeline_slot *slot;
+    struct xc_sr_pipeline_batch *batch;
+    bool failed;
+    int rc, err;
+
+    pthread_mutex_lock(&p->lock);
+
+    for ( ; ; )
+    {
+        slot = &p->slots[p->write_seq % p->depth];
+
+        while ( !p->shutdown && slot->state != SLOT_READY )
+            pthread_cond_wait(&p->cond, &p->lock);
+
+        if ( p->shutdown )
+            break;
+
+        batch = slot->batch;
+        failed = p->error;
+        pthread_mutex_unlock(&p->lock);
+
+        /* After a failure batches are only released, not written. */
+        rc = failed ? 0 : writev_exact(p->fd, batch->iov, batch->iovcnt);
+        err = errno;
+        batch->written = !failed && !rc;
+        batch->release(batch);
+
+        pthread_mutex_lock(&p->lock);
+        if ( rc && !p->error )
+            p->error = err ?: EIO;
+        slot->batch = NULL;
+        slot->state = SLOT_FREE;
+        p->write_seq++;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void pipeline_stop(struct xc_sr_pipeline *p)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0; i < p->nr_threads; i++ )
+        pthread_join(i ? p->workers[i - 1] : p->writer, NULL);
+    p->nr_threads = 0;
+}
+
+int xc_sr_pipeline_init(struct xc_sr_pipeline *p, int fd, unsigned int depth,
+                        unsigned int nr_workers,
+                        xc_sr_pipeline_transform_t transform, void *arg)
+{
+    int rc;
+
+    *p = (struct xc_sr_pipeline){
+        .fd = fd,
+        .depth = depth ?: 1,
+        .transform = transform,
+        .transform_arg = arg,
+        .nr_workers = transform ? nr_workers : 0,
+    };
+
+    if ( p->transform && !p->nr_workers )
+        p->nr_workers = 1;
+
+    p->slots = calloc(p->depth, sizeof(*p->slots));
+    p->workers = calloc(p->nr_workers ?: 1, sizeof(*p->workers));
+    if ( !p->slots || !p->workers )
+        goto nomem;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    rc = pthread_create(&p->writer, NULL, pipeline_writer, p);
+    if ( rc )
+        goto err;
+    p->nr_threads = 1;
+
+    while ( p->nr_threads <= p->nr_workers )
+    {
+        rc = pthread_create(&p->workers[p->nr_threads - 1], NULL,
+                            pipeline_worker, p);
+        if ( rc )
+            goto err;
+        p->nr_threads++;
+    }
+
+    return 0;
+
+ err:
+    pipeline_stop(p);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->workers);
+    free(p->slots);
+    p->slots = NULL;
+    errno = rc;
+    return -1;
+
+ nomem:
+    free(p->workers);
+    free(p->slots);
+    p->slots = NULL;
+    errno = ENOMEM;
+    return -1;
+}
+
+int xc_sr_pipeline_submit(struct xc_sr_pipeline *p,
+                          struct xc_sr_pipeline_batch *batch)
+{
+    struct xc_sr_pipeline_slot *slot;
+    int err;
+
+    pthread_mutex_lock(&p->lock);
+
+    slot = &p->slots[p->submit_seq % p->depth];
+    if ( !p->error && slot->state != SLOT_FREE )
+    {
+        p->nr_submit_waits++;
+        while ( !p->error && slot->state != SLOT_FREE )
+            pthread_cond_wait(&p->cond, &p->lock);
+    }
+
+    if ( p->error )
+    {
+        err = p->error;
+        pthread_mutex_unlock(&p->lock);
+        batch->release(batch);
+        errno = err;
+        return -1;
+    }
+
+    slot->batch = batch;
+    slot->state = p->transform ? SLOT_SUBMITTED : SLOT_READY;
+    p->submit_seq++;
+    p->nr_batches++;
+    pthread_cond_broadcast(&p->cond);
+
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+int xc_sr_pipeline_drain(struct xc_sr_pipeline *p)
+{
+    int err;
+
+    pthread_mutex_lock(&p->lock);
+    while ( !p->error && p->write_seq != p->submit_seq )
+        pthread_cond_wait(&p->cond, &p->lock);
+    err = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    if ( err )
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+void xc_sr_pipeline_destroy(struct xc_sr_pipeline *p)
+{
+    unsigned int i;
+
+    if ( !p->slots )
+        return;
+
+    pipeline_stop(p);
+
+    for ( i = 0; i < p->depth; i++ )
+        if ( p->slots[i].batch )
+            p->slots[i].batch->release(p->slots[i].batch);
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->workers);
+    free(p->slots);
+    p->slots = NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
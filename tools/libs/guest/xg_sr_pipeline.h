@@ -0,0 +1,123 @@
+#ifndef __SR_PIPELINE__H
+#define __SR_PIPELINE__H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Pipeline for writing PAGE_DATA records of the migration stream.
+ *
+ * The thread saving the domain maps batches of guest pages and submits them
+ * to the pipeline.  An optional transform stage is run on a pool of worker
+ * threads, and a single writer thread writes the batches to the stream in
+ * submission order.  At most 'depth' batches are in flight at any time,
+ * submission blocks until a slot is available.
+ *
+ * The pipeline doesn't know about the stream format.  It writes the iovec[]
+ * of each batch as is and calls the release hook of the batch afterwards.
+ */
+
+struct xc_sr_pipeline_batch
+{
+    /* Data to be written to the stream.  May be altered by transform. */
+    struct iovec *iov;
+    int iovcnt;
+
+    /* Set by the writer thread once the batch is in the stream. */
+    bool written;
+
+    /* Called once the batch isn't needed any longer, including on error. */
+    void (*release)(struct xc_sr_pipeline_batch *batch);
+};
+
+/*
+ * Optional per-batch transformation, called on a worker thread.
+ *
+ * @returns 0 for success, -1 for failure, with errno appropriately set.
+ */
+typedef int (*xc_sr_pipeline_transform_t)(struct xc_sr_pipeline_batch *batch,
+                                          void *arg);
+
+struct xc_sr_pipeline_slot
+{
+    enum {
+        SLOT_FREE,
+        SLOT_SUBMITTED,
+        SLOT_TRANSFORMING,
+        SLOT_READY,
+    } state;
+    struct xc_sr_pipeline_batch *batch;
+};
+
+struct xc_sr_pipeline
+{
+    int fd;
+
+    xc_sr_pipeline_transform_t transform;
+    void *transform_arg;
+
+    pthread_mutex_t lock;
+    /* Signalled on any slot state change, and on error or shutdown. */
+    pthread_cond_t cond;
+
+    struct xc_sr_pipeline_slot *slots;
+    unsigned int depth;
+
+    /* Sequence numbers of next batch to submit, transform and write. */
+    uint64_t submit_seq, transform_seq, write_seq;
+
+    /* errno of the first failure, 0 if none. */
+    int error;
+    bool shutdown;
+
+    pthread_t writer;
+    pthread_t *workers;
+    unsigned int nr_workers, nr_threads;
+
+    /* Statistics, protected by lock. */
+    uint64_t nr_batches, nr_submit_waits;
+};
+
+/*
+ * Set up a pipeline writing to fd, with nr_workers threads running
+ * transform (if not NULL) and at most depth batches in flight.
+ *
+ * @returns 0 for success, -1 for failure, with errno appropriately set.
+ */
+int xc_sr_pipeline_init(struct xc_sr_pipeline *p, int fd, unsigned int depth,
+                        unsigned int nr_workers,
+                        xc_sr_pipeline_transform_t transform, void *arg);
+
+/*
+ * Queue a batch for writing.  Ownership of the batch is passed to the
+ * pipeline in all cases, its release hook will be called.
+ *
+ * @returns 0 for success, -1 for failure of this or an earlier batch, with
+ * errno appropriately set.
+ */
+int xc_sr_pipeline_submit(struct xc_sr_pipeline *p,
+                          struct xc_sr_pipeline_batch *batch);
+
+/*
+ * Wait for all submitted batches to be written.  Needs to be called before
+ * writing any other data to the stream.
+ *
+ * @returns 0 for success, -1 for failure, with errno appropriately set.
+ */
+int xc_sr_pipeline_drain(struct xc_sr_pipeline *p);
+
+/* Stop all threads and release batches still in flight. */
+void xc_sr_pipeline_destroy(struct xc_sr_pipeline *p);
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
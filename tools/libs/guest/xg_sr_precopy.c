@@ -0,0 +1,112 @@
+#include "xg_sr_common.h"
+
+/* Stop regardless of the prediction once few enough pages are dirty. */
+#define PRECOPY_TARGET_DIRTY_COUNT 50
+#define PRECOPY_MAX_ITERATIONS     30
+
+/* Rounds without progress before giving up, unless auto-converging. */
+#define PRECOPY_MAX_STALLED        2
+
+/* Throttle steps, in percent of the guest's CPU time. */
+#define PRECOPY_THROTTLE_INITIAL   20
+#define PRECOPY_THROTTLE_STEP      10
+#define PRECOPY_THROTTLE_MAX       95
+
+static uint64_t rate(uint64_t pages, uint64_t ns)
+{
+    return pages * 1000000000ULL / (ns ?: 1);
+}
+
+/* Average with the previous rounds, to smooth out bursts. */
+static uint64_t smooth(uint64_t old, uint64_t sample)
+{
+    return old ? (old + sample) / 2 : sample;
+}
+
+void xc_sr_precopy_init(struct xc_sr_precopy *p, unsigned int max_downtime_ms,
+                        bool auto_converge)
+{
+    *p = (struct xc_sr_precopy){
+        .max_downtime_ms = max_downtime_ms,
+        .auto_converge = auto_converge,
+        .last_dirty_count = -1,
+    };
+}
+
+int xc_sr_precopy_decide(struct xc_sr_precopy *p, struct precopy_stats stats,
+                         uint64_t now_ns)
+{
+    long last = p->last_dirty_count;
+    bool stalled;
+
+    /* After sending a round, whose size was recorded before sending it. */
+    if ( stats.dirty_count < 0 )
+    {
+        if ( last > 0 )
+            p->send_rate = smooth(p->send_rate,
+                                  rate(last, now_ns - p->send_ns));
+
+        return stats.iteration >= PRECOPY_MAX_ITERATIONS
+            ? XGS_POLICY_STOP_AND_COPY : XGS_POLICY_CONTINUE_PRECOPY;
+    }
+
+    /*
+     * Before sending a round, just after reading the dirty bitmap.  The first
+     * round sends all of the guest's memory, so there is nothing to measure
+     * or predict yet.
+     */
+    p->last_dirty_count = stats.dirty_count;
+
+    if ( stats.iteration == 0 )
+    {
+        p->clean_ns = p->send_ns = now_ns;
+        return XGS_POLICY_CONTINUE_PRECOPY;
+    }
+
+    p->dirty_rate = smooth(p->dirty_rate,
+                           rate(stats.dirty_count, now_ns - p->clean_ns));
+    p->clean_ns = p->send_ns = now_ns;
+
+    p->predicted_downtime_ms = p->send_rate
+        ? stats.dirty_count * 1000ULL / p->send_rate : UINT64_MAX;
+
+    if ( stats.dirty_count < PRECOPY_TARGET_DIRTY_COUNT ||
+         p->predicted_downtime_ms <= p->max_downtime_ms )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    /*
+     * The dirty set only shrinks if pages are sent faster than they are
+     * dirtied.  Require some margin, as well as actual progress since the
+     * previous round.
+     */
+    stalled = p->dirty_rate * 10 >= p->send_rate * 9 ||
+              stats.dirty_count * 10 > last * 9;
+
+    if ( stalled )
+    {
+        if ( p->auto_converge )
+        {
+            if ( p->throttle >= PRECOPY_THROTTLE_MAX )
+                return XGS_POLICY_STOP_AND_COPY;
+
+            p->throttle = p->throttle
+                ? MIN(p->throttle + PRECOPY_THROTTLE_STEP,
+                      PRECOPY_THROTTLE_MAX)
+                : PRECOPY_THROTTLE_INITIAL;
+        }
+        else if ( ++p->nr_stalled >= PRECOPY_MAX_STALLED )
+            return XGS_POLICY_STOP_AND_COPY;
+    }
+
+    return XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,66 @@
+#ifndef __SR_PRECOPY__H
+#define __SR_PRECOPY__H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Adaptive precopy policy for live migration.
+ *
+ * Each round measures the rate at which the guest dirties pages and the rate
+ * at which pages are sent, and predicts the downtime of suspending the guest
+ * and sending the remaining dirty pages.  The precopy phase ends as soon as
+ * the prediction fits the downtime budget.  If the guest dirties pages too
+ * quickly for the dirty set to shrink, the policy either gives up after a
+ * few rounds, or, with auto-convergence, asks for the guest's vCPUs to be
+ * throttled in increasing steps.
+ */
+
+struct xc_sr_precopy
+{
+    /* Configuration. */
+    unsigned int max_downtime_ms;
+    bool auto_converge;
+
+    /* Timestamps (ns) of the last dirty bitmap read and of the round start. */
+    uint64_t clean_ns, send_ns;
+
+    /* Smoothed dirty and send rates, in pages per second. */
+    uint64_t dirty_rate, send_rate;
+
+    /* Dirty count of the previous round, -1 if none. */
+    long last_dirty_count;
+
+    /* Rounds the dirty set didn't shrink sufficiently in. */
+    unsigned int nr_stalled;
+
+    /* Percentage of CPU time to take away from the guest. */
+    unsigned int throttle;
+
+    /* Downtime predicted by the last decision, for logging. */
+    uint64_t predicted_downtime_ms;
+};
+
+/* Prepare for a new precopy phase. */
+void xc_sr_precopy_init(struct xc_sr_precopy *p, unsigned int max_downtime_ms,
+                        bool auto_converge);
+
+/*
+ * Decide on how to proceed, with arguments as for precopy_policy_t and the
+ * current time.  Raises p->throttle if the guest should be throttled further.
+ *
+ * @returns XGS_POLICY_CONTINUE_PRECOPY or XGS_POLICY_STOP_AND_COPY.
+ */
+int xc_sr_precopy_decide(struct xc_sr_precopy *p, struct precopy_stats stats,
+                         uint64_t now_ns);
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,4 +1,7 @@
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 
@@ -49,6 +52,7 @@ static int read_headers(struct xc_sr_context *ctx)
     }
 
     ctx->restore.format_version = ihdr.version;
+    ctx->restore.compressed = ihdr.options & IHDR_OPT_COMPRESSED;
 
     if ( read_exact(ctx->fd, &dhdr, sizeof(dhdr)) )
     {
@@ -304,343 +308,1600 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Page data of a PAGE_DATA record, copied into the guest on a worker thread
+ * when the copy workqueue is in use.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+struct xc_sr_restore_batch
 {
-    xc_interface *xch = ctx->xch;
-    struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned int i, pages_of_data = 0;
-    int rc = -1;
+    struct xc_sr_work work;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    struct xc_sr_context *ctx;
+
+    unsigned int count, nr_pages;
+    xen_pfn_t *pfns;
+    uint32_t *types;
+    /* Gfns of the nr_pages pages with data. */
+    xen_pfn_t *mfns;
 
     /*
-     * v2 compatibility only exists for x86 streams.  This is a bit of a
-     * bodge, but it is less bad than duplicating handle_page_data() between
-     * different architectures.
+     * page_data points into buffer, which is owned by the batch.  buffer is
+     * a mapping of the image file of length mapped, if not 0.
      */
-#if defined(__i386__) || defined(__x86_64__)
-    /* v2 compat.  Infer the position of STATIC_DATA_END. */
-    if ( ctx->restore.format_version < 3 && !ctx->restore.seen_static_data_end )
+    void *page_data, *buffer;
+    size_t mapped;
+};
+
+static void release_page_data(void *buffer, size_t mapped)
+{
+    if ( mapped )
+        munmap(buffer, mapped);
+    else
+        free(buffer);
+}
+
+static void release_restore_batch(struct xc_sr_work *work)
+{
+    struct xc_sr_restore_batch *batch =
+        container_of(work, struct xc_sr_restore_batch, work);
+
+    free(batch->mfns);
+    free(batch->types);
+    free(batch->pfns);
+    release_page_data(batch->buffer, batch->mapped);
+    free(batch);
+}
+
+/*
+ * Map the pages of a batch and copy the data into place.  Runs on a worker
+ * thread, so mustn't log.
+ */
+static int copy_restore_batch(struct xc_sr_work *work)
+{
+    struct xc_sr_restore_batch *batch =
+        container_of(work, struct xc_sr_restore_batch, work);
+    struct xc_sr_context *ctx = batch->ctx;
+    xc_interface *xch = ctx->xch;
+    int *map_errs = malloc(batch->nr_pages * sizeof(*map_errs));
+    void *mapping = NULL;
+    unsigned int i;
+    int rc = -1, err;
+
+    if ( !map_errs )
     {
-        rc = handle_static_data_end(ctx);
-        if ( rc )
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                   PROT_READ | PROT_WRITE, batch->nr_pages,
+                                   batch->mfns, map_errs);
+    if ( !mapping )
+        goto err;
+
+    for ( i = 0; i < batch->nr_pages; ++i )
+    {
+        if ( map_errs[i] )
         {
-            ERROR("Inferred STATIC_DATA_END record failed");
+            errno = map_errs[i] < 0 ? -map_errs[i] : EIO;
             goto err;
         }
-        rc = -1;
     }
 
-    if ( !ctx->restore.seen_static_data_end )
+    memcpy(mapping, batch->page_data, batch->nr_pages * PAGE_SIZE);
+    rc = 0;
+
+ err:
+    err = errno;
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, batch->nr_pages);
+    free(map_errs);
+    errno = err;
+
+    return rc;
+}
+
+/*
+ * Populate the pfns of all pending records with a single hypercall, then
+ * hand the records over to the copy workers.  Page types are set and pages
+ * localised here, as neither is safe to do concurrently.
+ */
+static int dispatch_page_data(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_batch *batch;
+    unsigned int b, i, n = 0, nr_pending = ctx->restore.nr_pending;
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+    void *page;
+    int rc = -1;
+
+    if ( !nr_pending )
+        return 0;
+
+    pfns = malloc(ctx->restore.nr_pending_pfns * sizeof(*pfns));
+    types = malloc(ctx->restore.nr_pending_pfns * sizeof(*types));
+    if ( !pfns || !types )
     {
-        ERROR("No STATIC_DATA_END seen");
+        ERROR("Unable to allocate enough memory for %u pfns",
+              ctx->restore.nr_pending_pfns);
         goto err;
     }
-#endif
 
-    if ( rec->length < sizeof(*pages) )
+    for ( b = 0; b < nr_pending; ++b )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
-        goto err;
+        batch = ctx->restore.pending[b];
+        memcpy(&pfns[n], batch->pfns, batch->count * sizeof(*pfns));
+        memcpy(&types[n], batch->types, batch->count * sizeof(*types));
+        n += batch->count;
     }
 
-    if ( pages->count < 1 )
+    rc = populate_pfns(ctx, n, pfns, types);
+    if ( rc )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("Failed to populate pfns for %u batches of %u pages",
+              nr_pending, n);
         goto err;
     }
+    ctx->restore.nr_populate_calls++;
+    rc = -1;
 
-    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    for ( b = 0; b < nr_pending; ++b )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        batch = ctx->restore.pending[b];
+
+        batch->mfns = malloc(batch->count * sizeof(*batch->mfns));
+        if ( !batch->mfns )
+        {
+            ERROR("Unable to allocate enough memory for %u mfns",
+                  batch->count);
+            goto err;
+        }
+
+        for ( i = 0; i < batch->count; ++i )
+        {
+            ctx->restore.ops.set_page_type(ctx, batch->pfns[i],
+                                           batch->types[i]);
+
+            if ( page_type_has_stream_data(batch->types[i]) )
+                batch->mfns[batch->nr_pages++] =
+                    ctx->restore.ops.pfn_to_gfn(ctx, batch->pfns[i]);
+        }
+
+        for ( i = 0, page = batch->page_data; i < batch->count; ++i )
+        {
+            if ( !page_type_has_stream_data(batch->types[i]) )
+                continue;
+
+            /* Undo page normalisation done by the saver. */
+            if ( ctx->restore.ops.localise_page(ctx, batch->types[i], page) )
+            {
+                ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                      batch->pfns[i],
+                      batch->types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+                goto err;
+            }
+
+            page += PAGE_SIZE;
+        }
+
+        ctx->restore.pending[b] = NULL;
+
+        if ( !batch->nr_pages )
+        {
+            release_restore_batch(&batch->work);
+            continue;
+        }
+
+        /* The workqueue takes ownership of the batch, even on error. */
+        if ( xc_sr_workqueue_queue(&ctx->restore.copy_wq, &batch->work) )
+        {
+            PERROR("Failed to copy page data into the guest");
+            goto err;
+        }
+    }
+
+    rc = 0;
+
+ err:
+    for ( b = 0; b < nr_pending; ++b )
+    {
+        if ( ctx->restore.pending[b] )
+            release_restore_batch(&ctx->restore.pending[b]->work);
+        ctx->restore.pending[b] = NULL;
+    }
+    ctx->restore.nr_pending = ctx->restore.nr_pending_pfns = 0;
+
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Populate and copy all pending page data, and wait for the copies to
+ * complete.  Needed before processing any other record, which may depend on
+ * the contents of guest memory.
+ */
+static int flush_page_data(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
+
+    if ( !ctx->restore.use_workqueue ||
+         (!ctx->restore.nr_pending && !ctx->restore.nr_copy_pfns) )
+        return 0;
+
+    rc = dispatch_page_data(ctx);
+
+    if ( xc_sr_workqueue_flush(&ctx->restore.copy_wq) && !rc )
+    {
+        PERROR("Failed to copy page data into the guest");
+        rc = -1;
+    }
+
+    memset(ctx->restore.copy_pfns, 0, bitmap_size(ctx->restore.p2m_size));
+    ctx->restore.nr_copy_pfns = 0;
+    ctx->restore.nr_copy_flushes++;
+
+    return rc;
+}
+
+/*
+ * Defer the page data of a record to the copy workers.  Ownership of pfns,
+ * types and buffer (holding page_data, mapped as for xc_sr_restore_batch) is
+ * passed over in all cases.
+ */
+static int queue_page_data(struct xc_sr_context *ctx, unsigned int count,
+                           xen_pfn_t *pfns, uint32_t *types, void *page_data,
+                           void *buffer, size_t mapped)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_batch *batch = malloc(sizeof(*batch));
+    bool conflict = false;
+    unsigned int i;
+    int rc;
+
+    if ( !batch )
+    {
+        ERROR("Unable to allocate batch of %u pfns", count);
+        release_page_data(buffer, mapped);
+        free(types);
+        free(pfns);
+        return -1;
+    }
+
+    *batch = (struct xc_sr_restore_batch){
+        .work.fn = copy_restore_batch,
+        .work.release = release_restore_batch,
+        .ctx = ctx,
+        .count = count,
+        .pfns = pfns,
+        .types = types,
+        .page_data = page_data,
+        .buffer = buffer,
+        .mapped = mapped,
+    };
+
+    /*
+     * Pages sent again (e.g. dirtied during a live migration) must not be
+     * copied concurrently with their earlier contents.
+     */
+    for ( i = 0; i < count && !conflict; ++i )
+        if ( page_type_has_stream_data(types[i]) )
+            conflict = pfns[i] >= ctx->restore.p2m_size ||
+                       test_bit(pfns[i], ctx->restore.copy_pfns);
+
+    if ( conflict )
+    {
+        rc = flush_page_data(ctx);
+        if ( rc )
+        {
+            release_restore_batch(&batch->work);
+            return rc;
+        }
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        if ( pfns[i] < ctx->restore.p2m_size )
+            set_bit(pfns[i], ctx->restore.copy_pfns);
+        ctx->restore.nr_copy_pfns++;
+    }
+
+    ctx->restore.pending[ctx->restore.nr_pending++] = batch;
+    ctx->restore.nr_pending_pfns += count;
+
+    if ( ctx->restore.nr_pending == MAX_PENDING_BATCHES ||
+         ctx->restore.nr_pending_pfns >= MAX_PENDING_PFNS )
+        return dispatch_page_data(ctx);
+
+    return 0;
+}
+
+/*
+ * Populate the pages of zeroes of a PAGE_DATA_SPARSE record.  Memory newly
+ * populated by Xen is zeroed, so only pages populated by earlier records
+ * need clearing.
+ */
+static int process_zero_pages(struct xc_sr_context *ctx, unsigned int count,
+                              const xen_pfn_t *pfns, const uint32_t *types)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
+    int *map_errs = malloc(count * sizeof(*map_errs));
+    void *mapping = NULL;
+    unsigned int i, nr_clear = 0;
+    bool flush = false;
+    int rc = -1;
+
+    if ( !mfns || !map_errs )
+    {
+        ERROR("Failed to allocate %zu bytes to process pages of zeroes",
+              count * (sizeof(*mfns) + sizeof(*map_errs)));
         goto err;
     }
 
-    pfns = malloc(pages->count * sizeof(*pfns));
-    types = malloc(pages->count * sizeof(*types));
-    if ( !pfns || !types )
+    /* Earlier data for the pages still to be copied would overwrite them. */
+    for ( i = 0; i < count && !flush; ++i )
+        flush = pfn_is_populated(ctx, pfns[i]) ||
+                (ctx->restore.use_workqueue &&
+                 (pfns[i] >= ctx->restore.p2m_size ||
+                  test_bit(pfns[i], ctx->restore.copy_pfns)));
+
+    if ( flush && flush_page_data(ctx) )
+        goto err;
+
+    for ( i = 0; i < count; ++i )
+        if ( pfn_is_populated(ctx, pfns[i]) )
+            mfns[nr_clear++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+
+    if ( populate_pfns(ctx, count, pfns, types) )
     {
-        ERROR("Unable to allocate enough memory for %u pfns",
-              pages->count);
+        ERROR("Failed to populate pfns for %u pages of zeroes", count);
         goto err;
     }
 
-    for ( i = 0; i < pages->count; ++i )
+    for ( i = 0; i < count; ++i )
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+    if ( nr_clear )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                       PROT_READ | PROT_WRITE, nr_clear,
+                                       mfns, map_errs);
+        if ( !mapping )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            PERROR("Unable to map %u pages to clear", nr_clear);
             goto err;
         }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( !is_known_page_type(type) )
+        for ( i = 0; i < nr_clear; ++i )
         {
-            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
-            goto err;
+            if ( map_errs[i] )
+            {
+                ERROR("Mapping gfn %#"PRIpfn" to clear failed with %d",
+                      mfns[i], map_errs[i]);
+                goto err;
+            }
         }
 
-        if ( page_type_has_stream_data(type) )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
+        memset(mapping, 0, nr_clear * PAGE_SIZE);
+    }
+
+    ctx->restore.nr_sparse_zero += count;
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_clear);
+    free(map_errs);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Map the page data of a PAGE_DATA_SPARSE record which was left in the image
+ * file.  Data not at a page boundary of the file, e.g. if the image was
+ * copied to a different offset, is read into a buffer instead.
+ *
+ * @returns the data, or NULL for failure.  *mapped is set to the length of
+ * the mapping, or 0 for a buffer.
+ */
+static void *map_sparse_data(struct xc_sr_context *ctx, unsigned int nr_pages,
+                             size_t *mapped)
+{
+    xc_interface *xch = ctx->xch;
+    off_t offset = ctx->restore.sparse_data;
+    size_t done, len = (size_t)nr_pages * PAGE_SIZE;
+    ssize_t r;
+    void *data;
 
-        pfns[i] = pfn;
-        types[i] = type;
+    if ( offset + len > ctx->restore.image_size )
+    {
+        ERROR("Page data at %#"PRIx64"+%#zx beyond end of image (%#"PRIx64")",
+              (uint64_t)offset, len, (uint64_t)ctx->restore.image_size);
+        return NULL;
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    if ( !(offset & (PAGE_SIZE - 1)) )
     {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
-        goto err;
+        /* Private and writeable, as localising may modify pages in place. */
+        data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, ctx->fd,
+                    offset);
+        if ( data != MAP_FAILED )
+        {
+            /* Start reading ahead for the copy. */
+            madvise(data, len, MADV_WILLNEED);
+            ctx->restore.nr_sparse_mapped += nr_pages;
+            *mapped = len;
+            return data;
+        }
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
- err:
-    free(types);
-    free(pfns);
+    data = malloc(len);
+    if ( !data )
+    {
+        ERROR("Unable to allocate enough memory for %u pages", nr_pages);
+        return NULL;
+    }
 
-    return rc;
+    for ( done = 0; done < len; done += r )
+    {
+        r = pread(ctx->fd, data + done, len - done, offset + done);
+        if ( r == -1 && errno == EINTR )
+            r = 0;
+        else if ( r <= 0 )
+        {
+            PERROR("Failed to read page data at %#"PRIx64,
+                   (uint64_t)offset + done);
+            free(data);
+            return NULL;
+        }
+    }
+
+    *mapped = 0;
+    return data;
 }
 
 /*
- * Send checkpoint dirty pfn list to primary.
+ * Write a POSTCOPY_FAULT or POSTCOPY_COMPLETE record to the sender.
  */
-static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
+static int postcopy_send_record(struct xc_sr_context *ctx, uint32_t type,
+                                const uint64_t *pfns, unsigned int count)
 {
     xc_interface *xch = ctx->xch;
-    int rc = -1;
-    unsigned int count, written;
-    uint64_t i, *pfns = NULL;
-    xc_shadow_op_stats_t stats = { 0, ctx->restore.p2m_size };
-    struct xc_sr_record rec = {
-        .type = REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST,
+    struct xc_sr_rec_postcopy_pfns hdr = { .count = count };
+    struct xc_sr_rhdr rhdr = {
+        .type = type,
+        .length = type == REC_TYPE_POSTCOPY_FAULT
+                  ? sizeof(hdr) + count * sizeof(*pfns) : 0,
     };
-    struct iovec iov[2] = {
-        { &rec, sizeof(rec) },
+    struct iovec iov[] = {
+        { &rhdr, sizeof(rhdr) },
+        { &hdr, sizeof(hdr) },
+        { (void *)pfns, count * sizeof(*pfns) },
     };
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->restore.dirty_bitmap_hbuf);
 
-    if ( xc_logdirty_control(
-             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
-             0, &stats) != ctx->restore.p2m_size )
+    if ( writev_exact(ctx->restore.send_back_fd, iov,
+                      rhdr.length ? ARRAY_SIZE(iov) : 1) )
     {
-        PERROR("Failed to retrieve logdirty bitmap");
-        goto err;
+        PERROR("Failed to write %s record", rec_type_to_str(type));
+        return -1;
     }
 
-    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
-    {
-        if ( test_bit(i, dirty_bitmap) )
-            count++;
+    return 0;
+}
+
+static void postcopy_put_response(struct xc_sr_context *ctx,
+                                  const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &ctx->restore.postcopy.back_ring;
+    vm_event_response_t *rsp =
+        RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt);
+
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->version = VM_EVENT_INTERFACE_VERSION;
+    rsp->vcpu_id = req->vcpu_id;
+    rsp->flags = req->flags;
+    rsp->reason = req->reason;
+    rsp->u.mem_paging.gfn = req->u.mem_paging.gfn;
+
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+}
+
+/*
+ * Consume the paging requests of the guest.  Faults on pages still to come
+ * are reported to the sender, and wait for the page data.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    vm_event_back_ring_t *back_ring = &ctx->restore.postcopy.back_ring;
+    vm_event_request_t req, *waiting;
+    uint64_t faults[64], gfn;
+    unsigned int nr_faults = 0, nr_responses = 0;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION )
+        {
+            ERROR("Paging request version %u, expected %u", req.version,
+                  VM_EVENT_INTERFACE_VERSION);
+            return -1;
+        }
+
+        gfn = req.u.mem_paging.gfn;
+
+        if ( gfn < ctx->restore.p2m_size &&
+             test_bit(gfn, ctx->restore.postcopy.pending) )
+        {
+            if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+            {
+                /* Released by the guest, its data is no longer needed. */
+                clear_bit(gfn, ctx->restore.postcopy.pending);
+                ctx->restore.postcopy.nr_pending--;
+            }
+            else
+            {
+                if ( !test_and_set_bit(gfn, ctx->restore.postcopy.requested) )
+                {
+                    faults[nr_faults++] = gfn;
+                    ctx->restore.postcopy.nr_faults++;
+                }
+
+                if ( nr_faults == ARRAY_SIZE(faults) )
+                {
+                    if ( postcopy_send_record(ctx, REC_TYPE_POSTCOPY_FAULT,
+                                              faults, nr_faults) )
+                        return -1;
+                    nr_faults = 0;
+                }
+
+                if ( ctx->restore.postcopy.nr_waiting ==
+                     ctx->restore.postcopy.max_waiting )
+                {
+                    unsigned int max = 2 * ctx->restore.postcopy.max_waiting
+                                       ?: 16;
+
+                    waiting = realloc(ctx->restore.postcopy.waiting,
+                                      max * sizeof(*waiting));
+                    if ( !waiting )
+                    {
+                        ERROR("Unable to allocate memory for %u paging "
+                              "requests", max);
+                        return -1;
+                    }
+                    ctx->restore.postcopy.waiting = waiting;
+                    ctx->restore.postcopy.max_waiting = max;
+                }
+
+                ctx->restore.postcopy.waiting[
+                    ctx->restore.postcopy.nr_waiting++] = req;
+                continue;
+            }
+        }
+
+        /* Already paged in, or not ours. */
+        if ( (req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ||
+             (req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL) )
+        {
+            postcopy_put_response(ctx, &req);
+            nr_responses++;
+        }
+    }
+
+    if ( nr_faults &&
+         postcopy_send_record(ctx, REC_TYPE_POSTCOPY_FAULT, faults,
+                              nr_faults) )
+        return -1;
+
+    if ( nr_responses &&
+         xenevtchn_notify(ctx->restore.postcopy.xce,
+                          ctx->restore.postcopy.port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Load the data of pages received after the post-copy transition, and
+ * resume the requests waiting for them.  Pages without data are loaded as
+ * zeroes, as they have been populated already.
+ */
+static int postcopy_load_pages(struct xc_sr_context *ctx, unsigned int count,
+                               const xen_pfn_t *pfns, const uint32_t *types,
+                               void *page_data)
+{
+    static const char zeroes[PAGE_SIZE];
+    xc_interface *xch = ctx->xch;
+    unsigned int i, nr_responses = 0;
+    void *page;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( page_type_has_stream_data(types[i]) )
+        {
+            page = page_data;
+            page_data += PAGE_SIZE;
+        }
+        else
+            page = (void *)zeroes;
+
+        /* Cleared by the restore side, or released by the guest. */
+        if ( !test_bit(pfns[i], ctx->restore.postcopy.pending) )
+            continue;
+
+        if ( xc_mem_paging_load(xch, ctx->domid, pfns[i], page) )
+        {
+            PERROR("Failed to page in pfn %#"PRIpfn, pfns[i]);
+            return -1;
+        }
+
+        clear_bit(pfns[i], ctx->restore.postcopy.pending);
+        ctx->restore.postcopy.nr_pending--;
+        ctx->restore.postcopy.nr_loaded++;
+    }
+
+    for ( i = 0; i < ctx->restore.postcopy.nr_waiting; )
+    {
+        vm_event_request_t *req = &ctx->restore.postcopy.waiting[i];
+
+        if ( test_bit(req->u.mem_paging.gfn, ctx->restore.postcopy.pending) )
+        {
+            ++i;
+            continue;
+        }
+
+        postcopy_put_response(ctx, req);
+        nr_responses++;
+        *req = ctx->restore.postcopy.waiting[
+            --ctx->restore.postcopy.nr_waiting];
+    }
+
+    if ( nr_responses &&
+         xenevtchn_notify(ctx->restore.postcopy.xce,
+                          ctx->restore.postcopy.port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Validate a PAGE_DATA, PAGE_DATA_COMPRESSED or PAGE_DATA_SPARSE record from
+ * the stream, and pass the results to process_page_data() to actually
+ * perform the legwork.  With the copy workqueue in use, the record is
+ * deferred to it instead.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    struct xc_sr_rec_page_data_sparse_header *sparse = rec->data;
+    unsigned int i, pages_of_data = 0, nr_zero = 0;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL, type;
+    uint32_t *enc;
+    /* Owned copy of the page data, mapped as for xc_sr_restore_batch. */
+    void *page_data, *buffer = NULL;
+    size_t mapped = 0;
+    size_t enc_len;
+    ssize_t data_len;
+
+    /*
+     * v2 compatibility only exists for x86 streams.  This is a bit of a
+     * bodge, but it is less bad than duplicating handle_page_data() between
+     * different architectures.
+     */
+#if defined(__i386__) || defined(__x86_64__)
+    /* v2 compat.  Infer the position of STATIC_DATA_END. */
+    if ( ctx->restore.format_version < 3 && !ctx->restore.seen_static_data_end )
+    {
+        rc = handle_static_data_end(ctx);
+        if ( rc )
+        {
+            ERROR("Inferred STATIC_DATA_END record failed");
+            goto err;
+        }
+        rc = -1;
+    }
+
+    if ( !ctx->restore.seen_static_data_end )
+    {
+        ERROR("No STATIC_DATA_END seen");
+        goto err;
+    }
+#endif
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+
+    if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        goto err;
+    }
+
+    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    for ( i = 0; i < pages->count; ++i )
+    {
+        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
+        }
+
+        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
+        {
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            goto err;
+        }
+
+        if ( rec->type == REC_TYPE_PAGE_DATA_SPARSE &&
+             (pages->pfn[i] & PAGE_DATA_SPARSE_ZERO) )
+        {
+            if ( !page_type_has_stream_data(type) )
+            {
+                ERROR("Page of zeroes of type %#"PRIx32" for pfn %#"PRIpfn
+                      " (index %u)", type, pfn, i);
+                goto err;
+            }
+
+            /* Pages of zeroes are collected at the end of the arrays. */
+            nr_zero++;
+            pfns[pages->count - nr_zero] = pfn;
+            types[pages->count - nr_zero] = type;
+            continue;
+        }
+
+        if ( page_type_has_stream_data(type) )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            pages_of_data++;
+
+        pfns[i - nr_zero] = pfn;
+        types[i - nr_zero] = type;
+    }
+
+    page_data = &pages->pfn[pages->count];
+
+    if ( rec->type == REC_TYPE_PAGE_DATA_COMPRESSED )
+    {
+        if ( !ctx->restore.compressed )
+        {
+            ERROR("PAGE_DATA_COMPRESSED record in stream without compression");
+            goto err;
+        }
+
+        enc = page_data;
+        enc_len = ROUNDUP(sizeof(*enc) * pages_of_data, REC_ALIGN_ORDER);
+
+        if ( rec->length < (sizeof(*pages) +
+                            (sizeof(uint64_t) * pages->count) + enc_len) )
+        {
+            ERROR("PAGE_DATA_COMPRESSED record (length %u) too short to "
+                  "contain %u encodings", rec->length, pages_of_data);
+            goto err;
+        }
+
+        data_len = xc_sr_compressed_length(enc, pages_of_data);
+        if ( data_len < 0 )
+        {
+            ERROR("Invalid page encoding in PAGE_DATA_COMPRESSED record");
+            goto err;
+        }
+
+        if ( rec->length != (sizeof(*pages) +
+                             (sizeof(uint64_t) * pages->count) +
+                             enc_len + data_len) )
+        {
+            ERROR("PAGE_DATA_COMPRESSED record wrong size: length %u, "
+                  "expected %zu + %zu + %zu + %zd", rec->length,
+                  sizeof(*pages), (sizeof(uint64_t) * pages->count),
+                  enc_len, data_len);
+            goto err;
+        }
+
+        if ( pages_of_data )
+        {
+            buffer = malloc(PAGE_SIZE * pages_of_data);
+            if ( !buffer )
+            {
+                ERROR("Unable to allocate enough memory for %u pages",
+                      pages_of_data);
+                goto err;
+            }
+
+            i = xc_sr_decompress_pages(enc, pages_of_data,
+                                       page_data + enc_len, buffer);
+            if ( i )
+            {
+                ERROR("Failed to decompress page data (index %u)", i - 1);
+                goto err;
+            }
+        }
+
+        page_data = buffer;
+    }
+    else if ( rec->type == REC_TYPE_PAGE_DATA_SPARSE )
+    {
+        if ( sparse->pad >= PAGE_SIZE ||
+             rec->length != (sizeof(*sparse) +
+                             (sizeof(uint64_t) * sparse->count) +
+                             sparse->pad + (PAGE_SIZE * pages_of_data)) )
+        {
+            ERROR("PAGE_DATA_SPARSE record wrong size: length %u, expected "
+                  "%zu + %zu + %u + %lu", rec->length, sizeof(*sparse),
+                  (sizeof(uint64_t) * sparse->count), sparse->pad,
+                  (PAGE_SIZE * pages_of_data));
+            goto err;
+        }
+
+        if ( nr_zero )
+        {
+            rc = process_zero_pages(ctx, nr_zero,
+                                    &pfns[pages->count - nr_zero],
+                                    &types[pages->count - nr_zero]);
+            if ( rc )
+                goto err;
+            rc = -1;
+        }
+
+        if ( ctx->restore.sparse_data < 0 )
+            page_data += sparse->pad;
+        else if ( pages_of_data )
+        {
+            page_data = buffer = map_sparse_data(ctx, pages_of_data, &mapped);
+            if ( !buffer )
+                goto err;
+        }
+
+        /* Nothing left? */
+        if ( pages->count == nr_zero )
+        {
+            rc = 0;
+            goto err;
+        }
+    }
+    else if ( rec->length != (sizeof(*pages) +
+                              (sizeof(uint64_t) * pages->count) +
+                              (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    if ( ctx->restore.postcopy.transitioned )
+        rc = postcopy_load_pages(ctx, pages->count - nr_zero, pfns, types,
+                                 page_data);
+    else if ( ctx->restore.use_workqueue && !ctx->restore.verify )
+    {
+        /* The batch takes over the arrays and the buffer of the data. */
+        if ( !buffer )
+        {
+            buffer = rec->data;
+            rec->data = NULL;
+        }
+
+        rc = queue_page_data(ctx, pages->count - nr_zero, pfns, types,
+                             page_data, buffer, mapped);
+        buffer = NULL;
+        types = NULL;
+        pfns = NULL;
+    }
+    else
+        rc = process_page_data(ctx, pages->count - nr_zero, pfns, types,
+                               page_data);
+ err:
+    ctx->restore.sparse_data = -1;
+    if ( buffer )
+        release_page_data(buffer, mapped);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Send checkpoint dirty pfn list to primary.
+ */
+static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = -1;
+    unsigned int count, written;
+    uint64_t i, *pfns = NULL;
+    xc_shadow_op_stats_t stats = { 0, ctx->restore.p2m_size };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST,
+    };
+    struct iovec iov[2] = {
+        { &rec, sizeof(rec) },
+    };
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->restore.dirty_bitmap_hbuf);
+
+    if ( xc_logdirty_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
+             0, &stats) != ctx->restore.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        goto err;
+    }
+
+    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
+    {
+        if ( test_bit(i, dirty_bitmap) )
+            count++;
+    }
+
+
+    pfns = malloc(count * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
+              count * sizeof(*pfns));
+        goto err;
+    }
+
+    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    {
+        if ( !test_bit(i, dirty_bitmap) )
+            continue;
+
+        if ( written > count )
+        {
+            ERROR("Dirty pfn list exceed");
+            goto err;
+        }
+
+        pfns[written++] = i;
+    }
+
+    rec.length = count * sizeof(*pfns);
+
+    iov[1].iov_base = pfns;
+    iov[1].iov_len = rec.length;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write dirty bitmap to stream");
+        goto err;
+    }
+
+    rc = 0;
+ err:
+    free(pfns);
+    return rc;
+}
+
+static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
+static int handle_checkpoint(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = 0, ret;
+    unsigned int i;
+
+    if ( ctx->stream_type == XC_STREAM_PLAIN )
+    {
+        ERROR("Found checkpoint in non-checkpointed stream");
+        rc = -1;
+        goto err;
+    }
+
+    ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
+    switch ( ret )
+    {
+    case XGR_CHECKPOINT_SUCCESS:
+        break;
+
+    case XGR_CHECKPOINT_FAILOVER:
+        if ( ctx->restore.buffer_all_records )
+            rc = BROKEN_CHANNEL;
+        else
+            /* We don't have a consistent state */
+            rc = -1;
+        goto err;
+
+    default: /* Other fatal error */
+        rc = -1;
+        goto err;
+    }
+
+    if ( ctx->restore.buffer_all_records )
+    {
+        IPRINTF("All records buffered");
+
+        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
+        {
+            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
+            if ( rc )
+                goto err;
+        }
+        ctx->restore.buffered_rec_num = 0;
+
+        rc = flush_page_data(ctx);
+        if ( rc )
+            goto err;
+        IPRINTF("All records processed");
+    }
+    else
+        ctx->restore.buffer_all_records = true;
+
+    if ( ctx->stream_type == XC_STREAM_COLO )
+    {
+#define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
+    do {                                                    \
+        if ( ret == 1 )                                     \
+            rc = 0; /* Success */                           \
+        else                                                \
+        {                                                   \
+            if ( ret == 2 )                                 \
+                rc = BROKEN_CHANNEL;                        \
+            else                                            \
+                rc = -1; /* Some unspecified error */       \
+            goto err;                                       \
+        }                                                   \
+    } while (0)
+
+        /* COLO */
+
+        /* We need to resume guest */
+        rc = ctx->restore.ops.stream_complete(ctx);
+        if ( rc )
+            goto err;
+
+        ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                                ctx->restore.console_gfn,
+                                                ctx->restore.callbacks->data);
+
+        /* Resume secondary vm */
+        ret = ctx->restore.callbacks->postcopy(ctx->restore.callbacks->data);
+        HANDLE_CALLBACK_RETURN_VALUE(ret);
+
+        /* Wait for a new checkpoint */
+        ret = ctx->restore.callbacks->wait_checkpoint(
+            ctx->restore.callbacks->data);
+        HANDLE_CALLBACK_RETURN_VALUE(ret);
+
+        /* suspend secondary vm */
+        ret = ctx->restore.callbacks->suspend(ctx->restore.callbacks->data);
+        HANDLE_CALLBACK_RETURN_VALUE(ret);
+
+#undef HANDLE_CALLBACK_RETURN_VALUE
+
+        rc = send_checkpoint_dirty_pfn_list(ctx);
+        if ( rc )
+            goto err;
+    }
+
+ err:
+    return rc;
+}
+
+static int buffer_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int new_alloc_num;
+    struct xc_sr_record *p;
+
+    if ( ctx->restore.buffered_rec_num >= ctx->restore.allocated_rec_num )
+    {
+        new_alloc_num = ctx->restore.allocated_rec_num + DEFAULT_BUF_RECORDS;
+        p = realloc(ctx->restore.buffered_records,
+                    new_alloc_num * sizeof(struct xc_sr_record));
+        if ( !p )
+        {
+            ERROR("Failed to realloc memory for buffered records");
+            return -1;
+        }
+
+        ctx->restore.buffered_records = p;
+        ctx->restore.allocated_rec_num = new_alloc_num;
+    }
+
+    memcpy(&ctx->restore.buffered_records[ctx->restore.buffered_rec_num++],
+           rec, sizeof(*rec));
+
+    return 0;
+}
+
+int handle_static_data_end(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int missing = 0;
+    int rc = 0;
+
+    if ( ctx->restore.seen_static_data_end )
+    {
+        ERROR("Multiple STATIC_DATA_END records found");
+        return -1;
+    }
+
+    ctx->restore.seen_static_data_end = true;
+
+    rc = ctx->restore.ops.static_data_complete(ctx, &missing);
+    if ( rc )
+        return rc;
+
+    if ( ctx->restore.callbacks->static_data_done &&
+         (rc = ctx->restore.callbacks->static_data_done(
+             missing, ctx->restore.callbacks->data) != 0) )
+        ERROR("static_data_done() callback failed: %d\n", rc);
+
+    return rc;
+}
+
+void postcopy_drop_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    if ( ctx->restore.postcopy.pending && pfn < ctx->restore.p2m_size &&
+         test_and_clear_bit(pfn, ctx->restore.postcopy.pending) )
+        ctx->restore.postcopy.nr_pending--;
+}
+
+/*
+ * Enable paging for the guest, with the ring page at the pfn the guest's
+ * HVM params give for it.
+ */
+static int postcopy_setup_paging(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    uint64_t ring_pfn;
+    xen_pfn_t pfn;
+    uint32_t port;
+    int rc;
+
+    if ( xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn) || !ring_pfn )
+    {
+        PERROR("No paging ring pfn for postcopy");
+        return -1;
+    }
+
+    /* The ring page is not guest memory. */
+    postcopy_drop_pfn(ctx, ring_pfn);
+
+    pfn = ring_pfn;
+    ctx->restore.postcopy.ring_page =
+        xc_map_foreign_pages(xch, ctx->domid, PROT_READ | PROT_WRITE, &pfn, 1);
+    if ( !ctx->restore.postcopy.ring_page )
+    {
+        if ( xc_domain_populate_physmap_exact(xch, ctx->domid, 1, 0, 0,
+                                              &pfn) )
+        {
+            PERROR("Failed to populate paging ring pfn %#"PRIpfn, pfn);
+            return -1;
+        }
+
+        ctx->restore.postcopy.ring_page =
+            xc_map_foreign_pages(xch, ctx->domid, PROT_READ | PROT_WRITE,
+                                 &pfn, 1);
+        if ( !ctx->restore.postcopy.ring_page )
+        {
+            PERROR("Failed to map paging ring pfn %#"PRIpfn, pfn);
+            return -1;
+        }
+    }
+
+    if ( xc_mem_paging_enable(xch, ctx->domid, &port) )
+    {
+        PERROR("Failed to enable paging for postcopy");
+        munmap(ctx->restore.postcopy.ring_page, PAGE_SIZE);
+        ctx->restore.postcopy.ring_page = NULL;
+        return -1;
+    }
+
+    ctx->restore.postcopy.xce = xenevtchn_open(NULL, 0);
+    if ( !ctx->restore.postcopy.xce )
+    {
+        PERROR("Failed to open event channel handle");
+        return -1;
+    }
+
+    rc = xenevtchn_bind_interdomain(ctx->restore.postcopy.xce, ctx->domid,
+                                    port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        return -1;
+    }
+    ctx->restore.postcopy.port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)ctx->restore.postcopy.ring_page);
+    BACK_RING_INIT(&ctx->restore.postcopy.back_ring,
+                   (vm_event_sring_t *)ctx->restore.postcopy.ring_page,
+                   PAGE_SIZE);
+
+    /* Now that the ring is set up, remove it from the guest's physmap. */
+    if ( xc_domain_decrease_reservation_exact(xch, ctx->domid, 1, 0, &pfn) )
+        PERROR("Failed to remove paging ring from guest physmap");
+
+    return 0;
+}
+
+static void postcopy_teardown_paging(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !ctx->restore.postcopy.ring_page )
+        return;
+
+    if ( xc_mem_paging_disable(xch, ctx->domid) )
+        PERROR("Failed to disable paging");
+
+    if ( ctx->restore.postcopy.xce )
+    {
+        if ( ctx->restore.postcopy.port > 0 )
+            xenevtchn_unbind(ctx->restore.postcopy.xce,
+                             ctx->restore.postcopy.port);
+        xenevtchn_close(ctx->restore.postcopy.xce);
+        ctx->restore.postcopy.xce = NULL;
+    }
+
+    munmap(ctx->restore.postcopy.ring_page, PAGE_SIZE);
+    ctx->restore.postcopy.ring_page = NULL;
+}
+
+static int handle_postcopy_begin(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( ctx->restore.postcopy.begun )
+    {
+        ERROR("Multiple POSTCOPY_BEGIN records found");
+        return -1;
+    }
+
+    if ( !(ctx->dominfo.flags & XEN_DOMINF_hvm_guest) ||
+         ctx->stream_type != XC_STREAM_PLAIN ||
+         ctx->restore.send_back_fd < 0 )
+    {
+        ERROR("Postcopy needs a plain stream of an HVM guest and a back "
+              "channel");
+        return -1;
+    }
+
+    ctx->restore.postcopy.pending = bitmap_alloc(ctx->restore.p2m_size);
+    ctx->restore.postcopy.requested = bitmap_alloc(ctx->restore.p2m_size);
+    if ( !ctx->restore.postcopy.pending || !ctx->restore.postcopy.requested )
+    {
+        ERROR("Unable to allocate memory for postcopy bitmaps");
+        return -1;
+    }
+
+    ctx->restore.postcopy.begun = true;
+
+    return 0;
+}
+
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns *hdr = rec->data;
+    unsigned int i;
+    xen_pfn_t pfn;
+    uint32_t type;
+
+    if ( !ctx->restore.postcopy.begun || ctx->restore.postcopy.transitioned )
+    {
+        ERROR("POSTCOPY_PFNS record outside of postcopy setup");
+        return -1;
+    }
+
+    if ( rec->length < sizeof(*hdr) ||
+         rec->length != sizeof(*hdr) + hdr->count * sizeof(uint64_t) )
+    {
+        ERROR("POSTCOPY_PFNS record wrong size: length %u", rec->length);
+        return -1;
+    }
+
+    for ( i = 0; i < hdr->count; ++i )
+    {
+        pfn = hdr->pfn[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) ||
+             pfn >= ctx->restore.p2m_size )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            return -1;
+        }
+
+        type = (hdr->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
+        {
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            return -1;
+        }
+
+        /*
+         * No data follows for other pages, which mustn't be populated, or
+         * paged in, after the transition.
+         */
+        if ( !page_type_has_stream_data(type) )
+            continue;
+
+        if ( !test_and_set_bit(pfn, ctx->restore.postcopy.pending) )
+            ctx->restore.postcopy.nr_pending++;
+    }
+
+    return 0;
+}
+
+/*
+ * Page out the pages whose data is still to come, complete the restore of
+ * the guest's state and let the caller resume it.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *pfns = NULL, p;
+    unsigned int i, count = 0;
+    int rc = -1;
+
+    if ( !ctx->restore.postcopy.begun || ctx->restore.postcopy.transitioned )
+    {
+        ERROR("POSTCOPY_TRANSITION record outside of postcopy setup");
+        return -1;
     }
 
+    if ( postcopy_setup_paging(ctx) )
+        goto err;
 
-    pfns = malloc(count * sizeof(*pfns));
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
     if ( !pfns )
     {
-        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
-              count * sizeof(*pfns));
+        ERROR("Unable to allocate memory for postcopy pfns");
         goto err;
     }
 
-    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    for ( p = 0; p < ctx->restore.p2m_size; ++p )
     {
-        if ( !test_bit(i, dirty_bitmap) )
+        if ( test_bit(p, ctx->restore.postcopy.pending) )
+            pfns[count++] = p;
+
+        if ( count < MAX_BATCH_SIZE &&
+             (!count || p < ctx->restore.p2m_size - 1) )
             continue;
 
-        if ( written > count )
-        {
-            ERROR("Dirty pfn list exceed");
+        /* Only populated pages can be paged out. */
+        if ( populate_pfns(ctx, count, pfns, NULL) )
             goto err;
-        }
 
-        pfns[written++] = i;
+        for ( i = 0; i < count; ++i )
+        {
+            if ( xc_mem_paging_nominate(xch, ctx->domid, pfns[i]) ||
+                 xc_mem_paging_evict(xch, ctx->domid, pfns[i]) )
+            {
+                PERROR("Failed to page out pfn %#"PRIpfn, pfns[i]);
+                goto err;
+            }
+        }
+        count = 0;
     }
 
-    rec.length = count * sizeof(*pfns);
+    DPRINTF("Postcopy: %lu pages paged out", ctx->restore.postcopy.nr_pending);
 
-    iov[1].iov_base = pfns;
-    iov[1].iov_len = rec.length;
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        goto err;
+    rc = -1;
 
-    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    ctx->restore.postcopy.transitioned = true;
+
+    if ( ctx->restore.callbacks->restore_results )
+        ctx->restore.callbacks->restore_results(
+            ctx->restore.xenstore_gfn, ctx->restore.console_gfn,
+            ctx->restore.callbacks->data);
+
+    if ( ctx->restore.callbacks->postcopy_transition &&
+         ctx->restore.callbacks->postcopy_transition(
+             ctx->restore.callbacks->data) != 1 )
     {
-        PERROR("Failed to write dirty bitmap to stream");
+        ERROR("postcopy_transition() callback failed");
         goto err;
     }
 
     rc = 0;
+
  err:
     free(pfns);
     return rc;
 }
 
-static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
-static int handle_checkpoint(struct xc_sr_context *ctx)
+/*
+ * Wait for the stream to become readable, handling paging requests of the
+ * guest meanwhile.
+ */
+static int postcopy_wait(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    int rc = 0, ret;
-    unsigned int i;
-
-    if ( ctx->stream_type == XC_STREAM_PLAIN )
-    {
-        ERROR("Found checkpoint in non-checkpointed stream");
-        rc = -1;
-        goto err;
-    }
+    struct pollfd pfd[] = {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(ctx->restore.postcopy.xce), .events = POLLIN },
+    };
+    int port;
 
-    ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
-    switch ( ret )
+    for ( ; ; )
     {
-    case XGR_CHECKPOINT_SUCCESS:
-        break;
-
-    case XGR_CHECKPOINT_FAILOVER:
-        if ( ctx->restore.buffer_all_records )
-            rc = BROKEN_CHANNEL;
-        else
-            /* We don't have a consistent state */
-            rc = -1;
-        goto err;
+        if ( postcopy_handle_requests(ctx) )
+            return -1;
 
-    default: /* Other fatal error */
-        rc = -1;
-        goto err;
-    }
+        if ( poll(pfd, ARRAY_SIZE(pfd), -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
 
-    if ( ctx->restore.buffer_all_records )
-    {
-        IPRINTF("All records buffered");
+            PERROR("Failed to poll the stream and paging event channel");
+            return -1;
+        }
 
-        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
+        if ( pfd[1].revents & POLLIN )
         {
-            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
-            if ( rc )
-                goto err;
+            port = xenevtchn_pending(ctx->restore.postcopy.xce);
+            if ( port == -1 ||
+                 xenevtchn_unmask(ctx->restore.postcopy.xce, port) )
+            {
+                PERROR("Failed to acknowledge paging event");
+                return -1;
+            }
         }
-        ctx->restore.buffered_rec_num = 0;
-        IPRINTF("All records processed");
-    }
-    else
-        ctx->restore.buffer_all_records = true;
-
-    if ( ctx->stream_type == XC_STREAM_COLO )
-    {
-#define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
-    do {                                                    \
-        if ( ret == 1 )                                     \
-            rc = 0; /* Success */                           \
-        else                                                \
-        {                                                   \
-            if ( ret == 2 )                                 \
-                rc = BROKEN_CHANNEL;                        \
-            else                                            \
-                rc = -1; /* Some unspecified error */       \
-            goto err;                                       \
-        }                                                   \
-    } while (0)
-
-        /* COLO */
 
-        /* We need to resume guest */
-        rc = ctx->restore.ops.stream_complete(ctx);
-        if ( rc )
-            goto err;
-
-        ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
-                                                ctx->restore.console_gfn,
-                                                ctx->restore.callbacks->data);
-
-        /* Resume secondary vm */
-        ret = ctx->restore.callbacks->postcopy(ctx->restore.callbacks->data);
-        HANDLE_CALLBACK_RETURN_VALUE(ret);
+        /* Data, or an error for the read to report. */
+        if ( pfd[0].revents )
+            return 0;
+    }
+}
 
-        /* Wait for a new checkpoint */
-        ret = ctx->restore.callbacks->wait_checkpoint(
-            ctx->restore.callbacks->data);
-        HANDLE_CALLBACK_RETURN_VALUE(ret);
+/*
+ * Read from the stream, handling paging requests of the guest whenever no
+ * data is available rather than only between records.  A guest faulting
+ * while a large PAGE_DATA record is in flight would otherwise wait for all
+ * of it to arrive first.
+ */
+static int postcopy_read_exact(struct xc_sr_context *ctx, void *data,
+                               size_t size)
+{
+    char *buf = data;
+    ssize_t len;
 
-        /* suspend secondary vm */
-        ret = ctx->restore.callbacks->suspend(ctx->restore.callbacks->data);
-        HANDLE_CALLBACK_RETURN_VALUE(ret);
+    while ( size )
+    {
+        if ( postcopy_wait(ctx) )
+            return -1;
 
-#undef HANDLE_CALLBACK_RETURN_VALUE
+        len = read(ctx->fd, buf, size);
+        if ( len == -1 && (errno == EINTR || errno == EAGAIN) )
+            continue;
+        if ( len == 0 )
+            errno = 0;
+        if ( len <= 0 )
+            return -1;
 
-        rc = send_checkpoint_dirty_pfn_list(ctx);
-        if ( rc )
-            goto err;
+        buf += len;
+        size -= len;
     }
 
- err:
-    return rc;
+    return 0;
 }
 
-static int buffer_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+/*
+ * As read_record(), once the guest may be running.
+ */
+static int postcopy_read_record(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
-    unsigned int new_alloc_num;
-    struct xc_sr_record *p;
+    struct xc_sr_rhdr rhdr;
+    size_t datasz;
 
-    if ( ctx->restore.buffered_rec_num >= ctx->restore.allocated_rec_num )
+    if ( postcopy_read_exact(ctx, &rhdr, sizeof(rhdr)) )
     {
-        new_alloc_num = ctx->restore.allocated_rec_num + DEFAULT_BUF_RECORDS;
-        p = realloc(ctx->restore.buffered_records,
-                    new_alloc_num * sizeof(struct xc_sr_record));
-        if ( !p )
+        PERROR("Failed to read Record Header from stream");
+        return -1;
+    }
+
+    if ( rhdr.length > REC_LENGTH_MAX )
+    {
+        ERROR("Record (0x%08x, %s) length %#x exceeds max (%#x)", rhdr.type,
+              rec_type_to_str(rhdr.type), rhdr.length, REC_LENGTH_MAX);
+        return -1;
+    }
+
+    datasz = ROUNDUP(rhdr.length, REC_ALIGN_ORDER);
+    rec->data = NULL;
+
+    if ( datasz )
+    {
+        rec->data = malloc(datasz);
+        if ( !rec->data )
         {
-            ERROR("Failed to realloc memory for buffered records");
+            ERROR("Unable to allocate %zu bytes for record data (0x%08x, %s)",
+                  datasz, rhdr.type, rec_type_to_str(rhdr.type));
             return -1;
         }
 
-        ctx->restore.buffered_records = p;
-        ctx->restore.allocated_rec_num = new_alloc_num;
+        if ( postcopy_read_exact(ctx, rec->data, datasz) )
+        {
+            PERROR("Failed to read %zu bytes of data for record (0x%08x, %s)",
+                   datasz, rhdr.type, rec_type_to_str(rhdr.type));
+            free(rec->data);
+            rec->data = NULL;
+            return -1;
+        }
     }
 
-    memcpy(&ctx->restore.buffered_records[ctx->restore.buffered_rec_num++],
-           rec, sizeof(*rec));
+    rec->type   = rhdr.type;
+    rec->length = rhdr.length;
 
     return 0;
 }
 
-int handle_static_data_end(struct xc_sr_context *ctx)
+/*
+ * All pages have been received.  Disable paging and let the sender know.
+ */
+static int handle_postcopy_end(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    unsigned int missing = 0;
-    int rc = 0;
 
-    if ( ctx->restore.seen_static_data_end )
+    if ( !ctx->restore.postcopy.transitioned )
     {
-        ERROR("Multiple STATIC_DATA_END records found");
+        ERROR("END record before POSTCOPY_TRANSITION");
         return -1;
     }
 
-    ctx->restore.seen_static_data_end = true;
-
-    rc = ctx->restore.ops.static_data_complete(ctx, &missing);
-    if ( rc )
-        return rc;
+    if ( ctx->restore.postcopy.nr_pending )
+    {
+        ERROR("%lu pages not received by the end of the stream",
+              ctx->restore.postcopy.nr_pending);
+        return -1;
+    }
 
-    if ( ctx->restore.callbacks->static_data_done &&
-         (rc = ctx->restore.callbacks->static_data_done(
-             missing, ctx->restore.callbacks->data) != 0) )
-        ERROR("static_data_done() callback failed: %d\n", rc);
+    postcopy_teardown_paging(ctx);
 
-    return rc;
+    return postcopy_send_record(ctx, REC_TYPE_POSTCOPY_COMPLETE, NULL, 0);
 }
 
 static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
@@ -648,12 +1909,26 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /* Other records may depend on all page data having been copied. */
+    if ( rec->type != REC_TYPE_PAGE_DATA &&
+         rec->type != REC_TYPE_PAGE_DATA_COMPRESSED &&
+         rec->type != REC_TYPE_PAGE_DATA_SPARSE )
+    {
+        rc = flush_page_data(ctx);
+        if ( rc )
+            goto out;
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
+        if ( ctx->restore.postcopy.begun )
+            rc = handle_postcopy_end(ctx);
         break;
 
     case REC_TYPE_PAGE_DATA:
+    case REC_TYPE_PAGE_DATA_COMPRESSED:
+    case REC_TYPE_PAGE_DATA_SPARSE:
         rc = handle_page_data(ctx, rec);
         break;
 
@@ -670,24 +1945,121 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_static_data_end(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_BEGIN:
+        rc = handle_postcopy_begin(ctx);
+        break;
+
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
     return rc;
 }
 
+/*
+ * Read a record from an image file.  The page data of PAGE_DATA_SPARSE
+ * records is skipped, for handle_page_data() to map it from the file.
+ */
+static int read_image_record(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_sparse_header *sparse;
+    struct xc_sr_rhdr rhdr;
+    size_t hdrsz;
+    off_t pos;
+
+    if ( read_record_header(ctx, ctx->fd, &rhdr) )
+        return -1;
+
+    if ( rhdr.type != REC_TYPE_PAGE_DATA_SPARSE ||
+         rhdr.length < sizeof(*sparse) )
+        return read_record_data(ctx, ctx->fd, &rhdr, rec);
+
+    sparse = malloc(sizeof(*sparse));
+    if ( !sparse )
+    {
+        ERROR("Unable to allocate memory for PAGE_DATA_SPARSE header");
+        return -1;
+    }
+
+    if ( read_exact(ctx->fd, sparse, sizeof(*sparse)) )
+    {
+        PERROR("Failed to read PAGE_DATA_SPARSE header");
+        goto err;
+    }
+
+    hdrsz = sizeof(*sparse) + sizeof(uint64_t) * sparse->count;
+    if ( hdrsz + sparse->pad > rhdr.length )
+    {
+        ERROR("PAGE_DATA_SPARSE record too short: length %u, count %u, "
+              "pad %u", rhdr.length, sparse->count, sparse->pad);
+        goto err;
+    }
+
+    rec->data = realloc(sparse, hdrsz);
+    if ( !rec->data )
+    {
+        ERROR("Unable to allocate memory for %u pfns", sparse->count);
+        goto err;
+    }
+    sparse = rec->data;
+
+    if ( read_exact(ctx->fd, sparse->pfn, hdrsz - sizeof(*sparse)) )
+    {
+        PERROR("Failed to read PAGE_DATA_SPARSE pfns");
+        goto err;
+    }
+
+    pos = lseek(ctx->fd, 0, SEEK_CUR);
+    if ( pos == -1 ||
+         lseek(ctx->fd, ROUNDUP(rhdr.length, REC_ALIGN_ORDER) - hdrsz,
+               SEEK_CUR) == -1 )
+    {
+        PERROR("Failed to seek past PAGE_DATA_SPARSE page data");
+        goto err;
+    }
+
+    ctx->restore.sparse_data = pos + sparse->pad;
+    rec->type = rhdr.type;
+    rec->length = rhdr.length;
+
+    return 0;
+
+ err:
+    free(sparse);
+    rec->data = NULL;
+    return -1;
+}
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    struct stat st;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    /* Page data of PAGE_DATA_SPARSE records can be mapped from image files. */
+    ctx->restore.sparse_data = -1;
+    ctx->restore.image_size = -1;
+    if ( ctx->stream_type == XC_STREAM_PLAIN && !fstat(ctx->fd, &st) &&
+         S_ISREG(st.st_mode) )
+        ctx->restore.image_size = st.st_size;
+
     if ( ctx->stream_type == XC_STREAM_COLO )
     {
         dirty_bitmap = xc_hypercall_buffer_alloc_pages(
@@ -725,6 +2097,27 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    if ( ctx->restore.nr_copy_threads )
+    {
+        ctx->restore.copy_pfns = bitmap_alloc(ctx->restore.p2m_size);
+        if ( !ctx->restore.copy_pfns )
+        {
+            ERROR("Unable to allocate memory for copy_pfns bitmap");
+            rc = -1;
+            goto err;
+        }
+
+        rc = xc_sr_workqueue_init(&ctx->restore.copy_wq,
+                                  ctx->restore.nr_copy_threads,
+                                  2 * ctx->restore.nr_copy_threads);
+        if ( rc )
+        {
+            PERROR("Unable to start page data copy threads");
+            goto err;
+        }
+        ctx->restore.use_workqueue = true;
+    }
+
  err:
     return rc;
 }
@@ -739,6 +2132,38 @@ static void cleanup(struct xc_sr_context *ctx)
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
+    if ( ctx->restore.use_workqueue )
+    {
+        for ( i = 0; i < ctx->restore.nr_pending; i++ )
+            release_restore_batch(&ctx->restore.pending[i]->work);
+        ctx->restore.nr_pending = 0;
+
+        DPRINTF("Page data copy: %"PRIu64" batches, %"PRIu64" populate calls,"
+                " %"PRIu64" flushes, %"PRIu64" waits",
+                ctx->restore.copy_wq.nr_work, ctx->restore.nr_populate_calls,
+                ctx->restore.nr_copy_flushes,
+                ctx->restore.copy_wq.nr_queue_waits);
+        xc_sr_workqueue_destroy(&ctx->restore.copy_wq);
+        ctx->restore.use_workqueue = false;
+    }
+    free(ctx->restore.copy_pfns);
+
+    if ( ctx->restore.postcopy.begun )
+    {
+        DPRINTF("Postcopy: %"PRIu64" faults, %"PRIu64" pages paged in",
+                ctx->restore.postcopy.nr_faults,
+                ctx->restore.postcopy.nr_loaded);
+        postcopy_teardown_paging(ctx);
+    }
+    free(ctx->restore.postcopy.waiting);
+    free(ctx->restore.postcopy.requested);
+    free(ctx->restore.postcopy.pending);
+
+    if ( ctx->restore.nr_sparse_zero || ctx->restore.nr_sparse_mapped )
+        DPRINTF("Sparse image: %"PRIu64" pages of zeroes, %"PRIu64
+                " pages mapped", ctx->restore.nr_sparse_zero,
+                ctx->restore.nr_sparse_mapped);
+
     if ( ctx->stream_type == XC_STREAM_COLO )
         xc_hypercall_buffer_free_pages(
             xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->restore.p2m_size)));
@@ -767,7 +2192,12 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
-        rc = read_record(ctx, ctx->fd, &rec);
+        if ( ctx->restore.postcopy.transitioned )
+            rc = postcopy_read_record(ctx, &rec);
+        else if ( ctx->restore.image_size >= 0 )
+            rc = read_image_record(ctx, &rec);
+        else
+            rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
             if ( ctx->restore.buffer_all_records )
@@ -821,10 +2251,18 @@ static int restore(struct xc_sr_context *ctx)
      * With Remus, if we reach here, there must be some error on primary,
      * failover from the last checkpoint state.
      */
-    rc = ctx->restore.ops.stream_complete(ctx);
+    rc = flush_page_data(ctx);
     if ( rc )
         goto err;
 
+    /* With postcopy, stream_complete was called at the transition. */
+    if ( !ctx->restore.postcopy.transitioned )
+    {
+        rc = ctx->restore.ops.stream_complete(ctx);
+        if ( rc )
+            goto err;
+    }
+
     IPRINTF("Restore successful");
     goto done;
 
@@ -867,6 +2305,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.xenstore_domid = store_domid;
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
+    ctx.restore.nr_copy_threads = callbacks ? callbacks->nr_copy_threads : 0;
 
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
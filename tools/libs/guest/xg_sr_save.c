@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
 
 #include "xg_sr_common.h"
 
@@ -14,7 +16,8 @@ static int write_headers(struct xc_sr_context *ctx, uint16_t guest_type)
         .marker  = IHDR_MARKER,
         .id      = htonl(IHDR_ID),
         .version = htonl(3),
-        .options = htons(IHDR_OPT_LITTLE_ENDIAN),
+        .options = htons(IHDR_OPT_LITTLE_ENDIAN |
+                         (ctx->save.compress ? IHDR_OPT_COMPRESSED : 0)),
     };
     struct xc_sr_dhdr dhdr = {
         .type       = guest_type,
@@ -74,6 +77,208 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
     return write_record(ctx, &checkpoint);
 }
 
+/*
+ * A PAGE_DATA record ready for writing into the stream.  Holds the guest
+ * mapping and local pages referenced by the iovec[] until it is released.
+ */
+struct xc_sr_save_batch
+{
+    struct xc_sr_pipeline_batch pb;
+
+    struct xc_sr_context *ctx;
+
+    void *guest_mapping;
+    unsigned int nr_pages_mapped;
+    void **local_pages;
+    unsigned int nr_pfns;
+    uint64_t *rec_pfns;
+
+    struct xc_sr_record rec;
+    struct xc_sr_rec_page_data_header hdr;
+
+    /* PAGE_DATA_COMPRESSED only. */
+    uint32_t *enc;
+    void *compress_buf;
+    struct xc_sr_compress_stats stats;
+};
+
+static void release_batch(struct xc_sr_pipeline_batch *pb)
+{
+    struct xc_sr_save_batch *batch =
+        container_of(pb, struct xc_sr_save_batch, pb);
+    struct xc_sr_context *ctx = batch->ctx;
+    struct xc_sr_compress_stats *stats = &ctx->save.compress_stats;
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    /*
+     * Only account for batches which made it into the stream.  While the
+     * pipeline is in use, these are released on its writer thread alone, so
+     * the statistics don't need locking.  Other batches may be released on
+     * the saving thread concurrently, on error.
+     */
+    if ( pb->written )
+    {
+        stats->nr_zero += batch->stats.nr_zero;
+        stats->nr_dup += batch->stats.nr_dup;
+        stats->nr_lz4 += batch->stats.nr_lz4;
+        stats->nr_raw += batch->stats.nr_raw;
+        stats->bytes_in += batch->stats.bytes_in;
+        stats->bytes_out += batch->stats.bytes_out;
+    }
+
+    free(batch->compress_buf);
+    free(batch->enc);
+    free(batch->rec_pfns);
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    for ( i = 0; batch->local_pages && i < batch->nr_pfns; ++i )
+        free(batch->local_pages[i]);
+    free(batch->local_pages);
+    free(batch->pb.iov);
+    free(batch);
+}
+
+/*
+ * Turns the PAGE_DATA record of a batch into a PAGE_DATA_COMPRESSED one.
+ * Runs on a pipeline worker thread if the pipeline is in use, so mustn't
+ * log.
+ *
+ * @returns 0 for success, -1 for failure, with errno appropriately set.
+ */
+static int compress_batch(struct xc_sr_pipeline_batch *pb, void *arg)
+{
+    static const char zeroes[1U << REC_ALIGN_ORDER];
+    struct xc_sr_save_batch *batch =
+        container_of(pb, struct xc_sr_save_batch, pb);
+    struct iovec *iov = pb->iov;
+    unsigned int i, nr_pages = pb->iovcnt - 4;
+    unsigned int iovcnt;
+    size_t enc_len, data_len = 0;
+
+    /* Nothing to gain from a record without page data. */
+    if ( !nr_pages )
+        return 0;
+
+    enc_len = ROUNDUP(nr_pages * sizeof(*batch->enc), REC_ALIGN_ORDER);
+    batch->enc = calloc(1, enc_len);
+    batch->compress_buf = malloc(nr_pages * PAGE_SIZE);
+    if ( !batch->enc || !batch->compress_buf )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    {
+        void *pages[nr_pages];
+
+        for ( i = 0; i < nr_pages; ++i )
+            pages[i] = iov[4 + i].iov_base;
+
+        iovcnt = xc_sr_compress_pages(pages, nr_pages, batch->enc, &iov[5],
+                                      batch->compress_buf, &batch->stats);
+    }
+
+    iov[4].iov_base = batch->enc;
+    iov[4].iov_len = enc_len;
+
+    for ( i = 0; i < iovcnt; ++i )
+        data_len += iov[5 + i].iov_len;
+    iovcnt += 5;
+
+    batch->rec.type = REC_TYPE_PAGE_DATA_COMPRESSED;
+    batch->rec.length = sizeof(batch->hdr);
+    batch->rec.length += batch->nr_pfns * sizeof(*batch->rec_pfns);
+    batch->rec.length += enc_len + data_len;
+
+    if ( ROUNDUP(data_len, REC_ALIGN_ORDER) != data_len )
+    {
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = ROUNDUP(data_len, REC_ALIGN_ORDER) - data_len;
+        iovcnt++;
+    }
+
+    pb->iovcnt = iovcnt;
+
+    return 0;
+}
+
+/*
+ * Lays out the PAGE_DATA record of a batch as a PAGE_DATA_SPARSE one: pages
+ * of zeroes are left out, and the remaining data placed at a page boundary
+ * of the image file.
+ *
+ * @returns the number of iovec entries used, or -1 for failure.
+ */
+static int sparse_batch(struct xc_sr_context *ctx,
+                        struct xc_sr_save_batch *batch, void **guest_data)
+{
+    static const char zeroes[PAGE_SIZE];
+    xc_interface *xch = ctx->xch;
+    struct iovec *iov = batch->pb.iov;
+    unsigned int i, nr_pages = 0, iovcnt = 5;
+    off_t data_offset;
+    size_t len;
+
+    if ( !ctx->save.sparse_offset_valid )
+    {
+        ctx->save.sparse_offset = lseek(ctx->fd, 0, SEEK_CUR);
+        if ( ctx->save.sparse_offset < 0 )
+        {
+            PERROR("Unable to get the offset of the image file");
+            return -1;
+        }
+    }
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        if ( !guest_data[i] )
+            continue;
+
+        if ( xc_sr_page_is_zero(guest_data[i]) )
+        {
+            batch->rec_pfns[i] |= PAGE_DATA_SPARSE_ZERO;
+            ctx->save.nr_sparse_zero++;
+            continue;
+        }
+
+        iov[iovcnt].iov_base = guest_data[i];
+        iov[iovcnt].iov_len = PAGE_SIZE;
+        iovcnt++;
+        nr_pages++;
+    }
+
+    data_offset = ctx->save.sparse_offset + sizeof(struct xc_sr_rhdr) +
+                  sizeof(batch->hdr) + iov[3].iov_len;
+
+    /* The pad field of xc_sr_rec_page_data_sparse_header. */
+    batch->hdr._res1 = -data_offset & (PAGE_SIZE - 1);
+    iov[4].iov_base = (void *)zeroes;
+    iov[4].iov_len = batch->hdr._res1;
+
+    batch->rec.type = REC_TYPE_PAGE_DATA_SPARSE;
+    len = batch->rec.length = sizeof(batch->hdr) + iov[3].iov_len +
+                              batch->hdr._res1 + nr_pages * PAGE_SIZE;
+
+    if ( ROUNDUP(len, REC_ALIGN_ORDER) != len )
+    {
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = ROUNDUP(len, REC_ALIGN_ORDER) - len;
+        iovcnt++;
+    }
+
+    /*
+     * Only batches queued to the pipeline are written later, all other
+     * writes to the image are synchronous.
+     */
+    ctx->save.sparse_offset += sizeof(struct xc_sr_rhdr) +
+                               ROUNDUP(len, REC_ALIGN_ORDER);
+    ctx->save.sparse_offset_valid = ctx->save.use_pipeline;
+
+    return iovcnt;
+}
+
 /*
  * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
  * is constructed in ctx->save.batch_pfns.
@@ -83,27 +288,39 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
  * - construct and writes a PAGE_DATA record into the stream.
+ *
+ * With compression, the record is converted to PAGE_DATA_COMPRESSED before
+ * writing, by the pipeline workers if available.  For sparse images, it is
+ * written as PAGE_DATA_SPARSE.
+ *
+ * If the page data pipeline is in use, the record is handed over to it
+ * instead of being written directly.
  */
 static int write_batch(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
     xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
     void **guest_data = NULL;
-    void **local_pages = NULL;
     int *errors = NULL, rc = -1;
-    unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
+    unsigned int i, p, nr_pages = 0;
     unsigned int nr_pfns = ctx->save.nr_batch_pfns;
     void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec = {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct iovec *iov; int iovcnt = 0;
+    struct xc_sr_save_batch *batch;
 
     assert(nr_pfns != 0);
 
+    batch = calloc(1, sizeof(*batch));
+    if ( !batch )
+    {
+        ERROR("Unable to allocate batch of %u pages", nr_pfns);
+        return -1;
+    }
+    batch->pb.release = release_batch;
+    batch->ctx = ctx;
+    batch->nr_pfns = nr_pfns;
+    batch->rec.type = REC_TYPE_PAGE_DATA;
+
     /* Mfns of the batch pfns. */
     mfns = malloc(nr_pfns * sizeof(*mfns));
     /* Types of the batch pfns. */
@@ -113,11 +330,12 @@ static int write_batch(struct xc_sr_context *ctx)
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
     guest_data = calloc(nr_pfns, sizeof(*guest_data));
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    batch->local_pages = calloc(nr_pfns, sizeof(*batch->local_pages));
+    /* iovec[] for writev(), with room for the compressed record layout. */
+    iov = batch->pb.iov = malloc((nr_pfns + 6) * sizeof(*iov));
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    if ( !mfns || !types || !errors || !guest_data || !batch->local_pages ||
+         !iov )
     {
         ERROR("Unable to allocate arrays for a batch of %u pages",
               nr_pfns);
@@ -161,14 +379,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(
+        batch->guest_mapping = xenforeignmemory_map(
             xch->fmem, ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -182,11 +400,11 @@ static int write_batch(struct xc_sr_context *ctx)
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
-                local_pages[i] = page;
+                batch->local_pages[i] = page;
 
             if ( rc )
             {
@@ -208,38 +426,48 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    batch->rec_pfns = malloc(nr_pfns * sizeof(*batch->rec_pfns));
+    if ( !batch->rec_pfns )
     {
         ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
+              nr_pfns * sizeof(*batch->rec_pfns));
         goto err;
     }
 
-    hdr.count = nr_pfns;
+    batch->hdr.count = nr_pfns;
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    batch->rec.length = sizeof(batch->hdr);
+    batch->rec.length += nr_pfns * sizeof(*batch->rec_pfns);
+    batch->rec.length += nr_pages * PAGE_SIZE;
 
     for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+        batch->rec_pfns[i] =
+            ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    iov[0].iov_base = &batch->rec.type;
+    iov[0].iov_len = sizeof(batch->rec.type);
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    iov[1].iov_base = &batch->rec.length;
+    iov[1].iov_len = sizeof(batch->rec.length);
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    iov[2].iov_base = &batch->hdr;
+    iov[2].iov_len = sizeof(batch->hdr);
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    iov[3].iov_base = batch->rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*batch->rec_pfns);
 
     iovcnt = 4;
 
-    if ( nr_pages )
+    if ( ctx->save.sparse )
+    {
+        rc = sparse_batch(ctx, batch, guest_data);
+        if ( rc < 0 )
+            goto err;
+        iovcnt = rc;
+        nr_pages = 0;
+        rc = -1;
+    }
+    else if ( nr_pages )
     {
         for ( i = 0; i < nr_pfns; ++i )
         {
@@ -253,24 +481,40 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    /* Sanity check we have prepared all the pages we expected to. */
+    assert(nr_pages == 0);
+    batch->pb.iovcnt = iovcnt;
+
+    if ( ctx->save.compress && !ctx->save.use_pipeline &&
+         compress_batch(&batch->pb, NULL) )
+    {
+        PERROR("Failed to compress page data");
+        goto err;
+    }
+
+    if ( ctx->save.use_pipeline )
+    {
+        /* The pipeline takes ownership of the batch, even on error. */
+        rc = xc_sr_pipeline_submit(&ctx->save.pipeline, &batch->pb);
+        batch = NULL;
+    }
+    else
+    {
+        rc = writev_exact(ctx->fd, iov, batch->pb.iovcnt);
+        batch->pb.written = !rc;
+    }
+
+    if ( rc )
     {
         PERROR("Failed to write page data to stream");
         goto err;
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
     rc = ctx->save.nr_batch_pfns = 0;
 
  err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
+    if ( batch )
+        release_batch(&batch->pb);
     free(guest_data);
     free(errors);
     free(types);
@@ -301,6 +545,28 @@ static int flush_batch(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Wait for all batches handed to the page data pipeline to be written.  This
+ * needs to happen before any other record is written to the stream.
+ */
+static int drain_batches(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !ctx->save.use_pipeline )
+        return 0;
+
+    ctx->save.sparse_offset_valid = false;
+
+    if ( xc_sr_pipeline_drain(&ctx->save.pipeline) )
+    {
+        PERROR("Failed to write page data to stream");
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Add a single pfn to the batch, flushing the batch if full.
  */
@@ -392,6 +658,10 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    rc = drain_batches(ctx);
+    if ( rc )
+        return rc;
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
@@ -489,6 +759,99 @@ static int simple_precopy_policy(struct precopy_stats stats, void *user)
         : XGS_POLICY_CONTINUE_PRECOPY;
 }
 
+/*
+ * Throttle the guest by capping its vCPUs to (100 - throttle)% of the CPU
+ * time they are allowed to use.  Only the credit2 scheduler is supported.
+ */
+static int throttle_domain(struct xc_sr_context *ctx, unsigned int throttle)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit2 sdom;
+    unsigned int base;
+
+    if ( !ctx->save.throttled )
+    {
+        if ( xc_sched_credit2_domain_get(xch, ctx->domid,
+                                         &ctx->save.orig_sched) )
+        {
+            PERROR("Unable to get credit2 parameters of domain %u",
+                   ctx->domid);
+            return -1;
+        }
+        ctx->save.throttled = true;
+    }
+
+    base = ctx->save.orig_sched.cap ?: (ctx->dominfo.max_vcpu_id + 1) * 100;
+    sdom = (struct xen_domctl_sched_credit2){
+        .cap = max(base * (100 - throttle) / 100, 1U),
+    };
+
+    if ( xc_sched_credit2_domain_set(xch, ctx->domid, &sdom) )
+    {
+        PERROR("Unable to cap domain %u to %u", ctx->domid, sdom.cap);
+        return -1;
+    }
+
+    DPRINTF("Throttled domain %u by %u%%, cap %u",
+            ctx->domid, throttle, sdom.cap);
+
+    return 0;
+}
+
+static void unthrottle_domain(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !ctx->save.throttled )
+        return;
+
+    if ( xc_sched_credit2_domain_set(xch, ctx->domid, &ctx->save.orig_sched) )
+        PERROR("Unable to restore cap %u of domain %u",
+               ctx->save.orig_sched.cap, ctx->domid);
+    ctx->save.throttled = false;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Precopy policy used if a downtime budget was given.  See xg_sr_precopy.h.
+ * Auto-convergence without an explicit budget aims for DEFAULT_MAX_DOWNTIME_MS.
+ */
+#define DEFAULT_MAX_DOWNTIME_MS 300
+
+static int adaptive_precopy_policy(struct precopy_stats stats, void *user)
+{
+    struct xc_sr_context *ctx = user;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_precopy *p = &ctx->save.precopy;
+    unsigned int throttle = p->throttle;
+    int decision = xc_sr_precopy_decide(p, stats, now_ns());
+
+    if ( stats.dirty_count < 0 || !stats.iteration )
+        return decision;
+
+    DPRINTF("Precopy round %u: %ld dirty, dirty rate %"PRIu64" pages/s, "
+            "send rate %"PRIu64" pages/s, predicted downtime %"PRIu64" ms",
+            stats.iteration, stats.dirty_count, p->dirty_rate, p->send_rate,
+            p->predicted_downtime_ms);
+
+    if ( p->throttle != throttle && throttle_domain(ctx, p->throttle) )
+    {
+        /* Carry on without, the policy then gives up on stalling. */
+        p->auto_converge = false;
+        p->throttle = throttle;
+    }
+
+    return decision;
+}
+
 /*
  * Send memory while guest is running.
  */
@@ -518,7 +881,12 @@ static int send_memory_live(struct xc_sr_context *ctx)
     };
     policy_stats = &ctx->save.stats;
 
-    if ( precopy_policy == NULL )
+    if ( precopy_policy == NULL && ctx->save.adaptive_precopy )
+    {
+        precopy_policy = adaptive_precopy_policy;
+        data = ctx;
+    }
+    else if ( precopy_policy == NULL )
         precopy_policy = simple_precopy_policy;
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
@@ -693,6 +1061,291 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Send a POSTCOPY_PFNS record for count dirty pfns, along with their types.
+ * Only the pages with data are left to send after the transition.
+ */
+static int send_postcopy_pfns(struct xc_sr_context *ctx, uint64_t *pfns,
+                              xen_pfn_t *types, unsigned int count)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns hdr = { .count = count };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = sizeof(hdr),
+        .data = &hdr,
+    };
+    unsigned int i;
+
+    for ( i = 0; i < count; ++i )
+        types[i] = ctx->save.ops.pfn_to_gfn(ctx, pfns[i]);
+
+    if ( xc_get_pfn_type_batch(xch, ctx->domid, count, types) )
+    {
+        PERROR("Failed to get types for postcopy pfns");
+        return -1;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !is_known_page_type(types[i]) )
+        {
+            ERROR("Unknown type %#"PRIpfn" for pfn %#"PRIx64,
+                  types[i], pfns[i]);
+            return -1;
+        }
+
+        if ( page_type_has_stream_data(types[i]) )
+        {
+            set_bit(pfns[i], ctx->save.postcopy_pfns);
+            ctx->save.nr_postcopy_pfns++;
+        }
+
+        pfns[i] |= (uint64_t)types[i] << 32;
+    }
+
+    return write_split_record(ctx, &rec, pfns, count * sizeof(*pfns));
+}
+
+/*
+ * Suspend the domain and send the pfns of its remaining dirty memory, whose
+ * data is sent after the transition.  This is the last iteration of a
+ * post-copy live migration.
+ */
+static int suspend_and_send_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_BEGIN };
+    uint64_t *pfns = NULL;
+    xen_pfn_t *types = NULL, p;
+    unsigned int count = 0;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        goto out;
+
+    if ( xc_logdirty_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        rc = -1;
+        goto out;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate memory for postcopy pfns");
+        rc = -1;
+        goto out;
+    }
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        goto out;
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( test_bit(p, dirty_bitmap) )
+            pfns[count++] = p;
+
+        if ( count == MAX_BATCH_SIZE ||
+             (count && p == ctx->save.p2m_size - 1) )
+        {
+            rc = send_postcopy_pfns(ctx, pfns, types, count);
+            if ( rc )
+                goto out;
+            count = 0;
+        }
+    }
+
+    DPRINTF("Postcopy: %lu pages left", ctx->save.nr_postcopy_pfns);
+
+ out:
+    free(types);
+    free(pfns);
+    return rc;
+}
+
+/*
+ * Send the pages requested in a POSTCOPY_FAULT record from the receiver.
+ */
+static int send_postcopy_faults(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    struct xc_sr_rec_postcopy_pfns *fault;
+    unsigned int i;
+    int rc;
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    fault = rec.data;
+
+    if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+    {
+        ERROR("Expected POSTCOPY_FAULT record, got %#x (%s)", rec.type,
+              rec_type_to_str(rec.type));
+        goto out;
+    }
+
+    if ( rec.length < sizeof(*fault) ||
+         rec.length != sizeof(*fault) + fault->count * sizeof(uint64_t) )
+    {
+        ERROR("POSTCOPY_FAULT record wrong size: length %u", rec.length);
+        goto out;
+    }
+
+    for ( i = 0; i < fault->count; ++i )
+    {
+        /* Pages already sent are still in flight. */
+        if ( fault->pfn[i] >= ctx->save.p2m_size ||
+             !test_and_clear_bit(fault->pfn[i], ctx->save.postcopy_pfns) )
+            continue;
+
+        ctx->save.nr_postcopy_pfns--;
+        ctx->save.nr_postcopy_faults++;
+
+        rc = add_to_batch(ctx, fault->pfn[i]);
+        if ( rc )
+            goto out;
+        rc = -1;
+    }
+
+    rc = flush_batch(ctx);
+
+ out:
+    free(rec.data);
+    return rc;
+}
+
+/*
+ * Transition to post-copy, and send the remaining pages.  Pages the receiver
+ * faults on are sent first, the others in pfn order.
+ */
+static int send_postcopy_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long total = ctx->save.nr_postcopy_pfns;
+    int rc;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    if ( ctx->save.callbacks->postcopy_transition &&
+         ctx->save.callbacks->postcopy_transition(
+             ctx->save.callbacks->data) != 1 )
+    {
+        ERROR("postcopy_transition() callback failed");
+        return -1;
+    }
+
+    xc_set_progress_prefix(xch, "Postcopy");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 && errno != EINTR )
+        {
+            PERROR("Failed to poll for postcopy faults");
+            goto out;
+        }
+
+        if ( rc > 0 )
+        {
+            rc = send_postcopy_faults(ctx);
+            if ( rc )
+                goto out;
+            continue;
+        }
+
+        while ( ctx->save.nr_batch_pfns < MAX_BATCH_SIZE &&
+                ctx->save.postcopy_cursor < ctx->save.p2m_size )
+        {
+            if ( test_and_clear_bit(ctx->save.postcopy_cursor,
+                                    ctx->save.postcopy_pfns) )
+            {
+                ctx->save.nr_postcopy_pfns--;
+                rc = add_to_batch(ctx, ctx->save.postcopy_cursor);
+                if ( rc )
+                    goto out;
+            }
+            ctx->save.postcopy_cursor++;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - ctx->save.nr_postcopy_pfns,
+                                total);
+    }
+
+    rc = drain_batches(ctx);
+    if ( rc )
+        goto out;
+
+    if ( ctx->save.nr_deferred_pages )
+    {
+        ERROR("%lu pages could not be sent after the postcopy transition",
+              ctx->save.nr_deferred_pages);
+        rc = -1;
+    }
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
+/*
+ * After the END record, wait for the receiver to confirm it has all pages,
+ * skipping faults which crossed with the pages in flight.  Following this,
+ * recv_fd may be used by the caller again.
+ */
+static int wait_postcopy_complete(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    int rc;
+
+    for ( ; ; )
+    {
+        rc = read_record(ctx, ctx->save.recv_fd, &rec);
+        if ( rc )
+            return rc;
+
+        free(rec.data);
+
+        if ( rec.type == REC_TYPE_POSTCOPY_COMPLETE )
+            return 0;
+
+        if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+        {
+            ERROR("Expected POSTCOPY_COMPLETE record, got %#x (%s)", rec.type,
+                  rec_type_to_str(rec.type));
+            return -1;
+        }
+    }
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -743,6 +1396,12 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
+    if ( ctx->save.postcopy )
+    {
+        rc = suspend_and_send_postcopy_pfns(ctx);
+        goto out;
+    }
+
     rc = suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
@@ -805,8 +1464,11 @@ static int setup(struct xc_sr_context *ctx)
     ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
                                   sizeof(*ctx->save.batch_pfns));
     ctx->save.deferred_pages = bitmap_alloc(ctx->save.p2m_size);
+    if ( ctx->save.postcopy )
+        ctx->save.postcopy_pfns = bitmap_alloc(ctx->save.p2m_size);
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages ||
+         (ctx->save.postcopy && !ctx->save.postcopy_pfns) )
     {
         ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
               " deferred pages");
@@ -815,6 +1477,21 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.nr_pipeline_threads )
+    {
+        rc = xc_sr_pipeline_init(&ctx->save.pipeline, ctx->fd,
+                                 2 * ctx->save.nr_pipeline_threads + 2,
+                                 ctx->save.nr_pipeline_threads - 1,
+                                 ctx->save.compress ? compress_batch : NULL,
+                                 NULL);
+        if ( rc )
+        {
+            PERROR("Unable to set up page data pipeline");
+            goto err;
+        }
+        ctx->save.use_pipeline = true;
+    }
+
     rc = 0;
 
  err:
@@ -831,11 +1508,41 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
 
+    if ( ctx->save.use_pipeline )
+    {
+        DPRINTF("Page data pipeline: %"PRIu64" batches, %"PRIu64" waits",
+                ctx->save.pipeline.nr_batches,
+                ctx->save.pipeline.nr_submit_waits);
+        xc_sr_pipeline_destroy(&ctx->save.pipeline);
+        ctx->save.use_pipeline = false;
+    }
+
+    if ( ctx->save.compress )
+        DPRINTF("Page data compression: %"PRIu64" zero, %"PRIu64" duplicate, "
+                "%"PRIu64" lz4, %"PRIu64" raw pages, %"PRIu64" -> %"PRIu64
+                " bytes", ctx->save.compress_stats.nr_zero,
+                ctx->save.compress_stats.nr_dup,
+                ctx->save.compress_stats.nr_lz4,
+                ctx->save.compress_stats.nr_raw,
+                ctx->save.compress_stats.bytes_in,
+                ctx->save.compress_stats.bytes_out);
+
+    unthrottle_domain(ctx);
+
+    if ( ctx->save.sparse )
+        DPRINTF("Sparse image: %"PRIu64" pages of zeroes left out",
+                ctx->save.nr_sparse_zero);
+
+    if ( ctx->save.postcopy )
+        DPRINTF("Postcopy: %"PRIu64" pages sent on faults, %lu not sent",
+                ctx->save.nr_postcopy_faults, ctx->save.nr_postcopy_pfns);
+
     if ( ctx->save.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.postcopy_pfns);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -903,6 +1610,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_postcopy_pages(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->stream_type != XC_STREAM_PLAIN )
         {
             /*
@@ -958,6 +1672,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    if ( ctx->save.postcopy )
+    {
+        rc = wait_postcopy_complete(ctx);
+        if ( rc )
+            goto err;
+    }
+
     xc_report_progress_single(xch, "Complete");
     goto done;
 
@@ -987,14 +1708,35 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
         .fd = io_fd,
         .stream_type = stream_type,
     };
+    unsigned int max_downtime_ms;
     bool hvm;
 
     /* GCC 4.4 (of CentOS 6.x vintage) can' t initialise anonymous unions. */
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.compress = !!(flags & XCFLAGS_COMPRESS);
+    ctx.save.sparse = !!(flags & XCFLAGS_SPARSE);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    ctx.save.nr_pipeline_threads =
+        (flags & XCFLAGS_PIPELINE_MASK) >> XCFLAGS_PIPELINE_SHIFT;
+
+    max_downtime_ms = (flags & XCFLAGS_DOWNTIME_MASK) >> XCFLAGS_DOWNTIME_SHIFT;
+    if ( !max_downtime_ms && (flags & XCFLAGS_AUTO_CONVERGE) )
+        max_downtime_ms = DEFAULT_MAX_DOWNTIME_MS;
+    ctx.save.adaptive_precopy = max_downtime_ms;
+    xc_sr_precopy_init(&ctx.save.precopy, max_downtime_ms,
+                       flags & XCFLAGS_AUTO_CONVERGE);
     ctx.save.recv_fd = recv_fd;
 
+    if ( ctx.save.sparse &&
+         (ctx.save.compress || stream_type != XC_STREAM_PLAIN) )
+    {
+        ERROR("Sparse images can't be compressed or checkpointed");
+        errno = EINVAL;
+        return -1;
+    }
+
     if ( xc_domain_getinfo_single(xch, dom, &ctx.dominfo) < 0 )
     {
         PERROR("Failed to get domain info");
@@ -1003,6 +1745,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     hvm = ctx.dominfo.flags & XEN_DOMINF_hvm_guest;
 
+    /* The receiver pages in the remaining memory using HVM guest paging. */
+    if ( ctx.save.postcopy &&
+         (!hvm || !ctx.save.live || ctx.save.sparse || recv_fd < 0 ||
+          stream_type != XC_STREAM_PLAIN) )
+    {
+        ERROR("Postcopy needs a live migration of an HVM guest with recv_fd");
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
     {
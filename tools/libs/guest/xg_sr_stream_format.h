@@ -28,6 +28,9 @@ struct xc_sr_ihdr
 #define IHDR_OPT_LITTLE_ENDIAN (0 << _IHDR_OPT_ENDIAN)
 #define IHDR_OPT_BIG_ENDIAN    (1 << _IHDR_OPT_ENDIAN)
 
+#define _IHDR_OPT_COMPRESSED 1
+#define IHDR_OPT_COMPRESSED    (1 << _IHDR_OPT_COMPRESSED)
+
 /*
  * Domain Header
  */
@@ -76,6 +79,13 @@ struct xc_sr_rhdr
 #define REC_TYPE_STATIC_DATA_END            0x00000010U
 #define REC_TYPE_X86_CPUID_POLICY           0x00000011U
 #define REC_TYPE_X86_MSR_POLICY             0x00000012U
+#define REC_TYPE_PAGE_DATA_COMPRESSED       0x00000013U
+#define REC_TYPE_PAGE_DATA_SPARSE           0x00000014U
+#define REC_TYPE_POSTCOPY_BEGIN             0x00000015U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000016U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000017U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000018U
+#define REC_TYPE_POSTCOPY_COMPLETE          0x00000019U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +100,50 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/*
+ * PAGE_DATA_COMPRESSED
+ *
+ * Same header and pfn array as PAGE_DATA, followed by one 32 bit encoding
+ * descriptor per page with data (padded to 8 octets), followed by the data.
+ */
+#define PAGE_DATA_ENC_SHIFT    28
+#define PAGE_DATA_ENC_MASK     0xf0000000U
+#define PAGE_DATA_ENC_ARG_MASK 0x0fffffffU
+
+/* Uncompressed page, page size octets of data. */
+#define PAGE_DATA_ENC_RAW      0x0U
+/* Page of zeroes, no data. */
+#define PAGE_DATA_ENC_ZERO     0x1U
+/* Same contents as the page with index arg in this record, no data. */
+#define PAGE_DATA_ENC_DUP      0x2U
+/* LZ4 block compressed page, arg octets of data. */
+#define PAGE_DATA_ENC_LZ4      0x3U
+
+/*
+ * PAGE_DATA_SPARSE
+ *
+ * Pfn array as PAGE_DATA, followed by pad octets of padding placing the
+ * page data at a page boundary of the image file, and the data of pages not
+ * marked as zero.
+ */
+struct xc_sr_rec_page_data_sparse_header
+{
+    uint32_t count;
+    uint32_t pad;
+    uint64_t pfn[0];
+};
+
+/* Page of zeroes, without data. */
+#define PAGE_DATA_SPARSE_ZERO 0x0800000000000000ULL
+
+/* POSTCOPY_PFNS and POSTCOPY_FAULT */
+struct xc_sr_rec_postcopy_pfns
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "xg_sr_common.h"
+
+static void *workqueue_worker(void *arg)
+{
+    struct xc_sr_workqueue *wq = arg;
+    struct xc_sr_work *work;
+    int rc, err;
+
+    pthread_mutex_lock(&wq->lock);
+
+    for ( ; ; )
+    {
+        while ( !wq->shutdown && !wq->head )
+            pthread_cond_wait(&wq->cond, &wq->lock);
+
+        if ( wq->shutdown )
+            break;
+
+        work = wq->head;
+        wq->head = work->next;
+        if ( !wq->head )
+            wq->tail = &wq->head;
+
+        /* After a failure items are only released, not run. */
+        rc = 0;
+        err = 0;
+        if ( !wq->error )
+        {
+            pthread_mutex_unlock(&wq->lock);
+            rc = work->fn(work);
+            err = errno;
+            work->release(work);
+            pthread_mutex_lock(&wq->lock);
+        }
+        else
+            work->release(work);
+
+        if ( rc && !wq->error )
+            wq->error = err ?: EIO;
+        wq->nr_active--;
+        pthread_cond_broadcast(&wq->cond);
+    }
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return NULL;
+}
+
+static void workqueue_stop(struct xc_sr_workqueue *wq)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&wq->lock);
+    wq->shutdown = true;
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+
+    for ( i = 0; i < wq->nr_threads; i++ )
+        pthread_join(wq->threads[i], NULL);
+    wq->nr_threads = 0;
+}
+
+int xc_sr_workqueue_init(struct xc_sr_workqueue *wq, unsigned int nr_threads,
+                         unsigned int depth)
+{
+    int rc;
+
+    *wq = (struct xc_sr_workqueue){
+        .tail = &wq->head,
+        .depth = depth ?: 1,
+    };
+
+    wq->threads = calloc(nr_threads ?: 1, sizeof(*wq->threads));
+    if ( !wq->threads )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+
+    while ( wq->nr_threads < (nr_threads ?: 1) )
+    {
+        rc = pthread_create(&wq->threads[wq->nr_threads], NULL,
+                            workqueue_worker, wq);
+        if ( rc )
+        {
+            workqueue_stop(wq);
+            pthread_cond_destroy(&wq->cond);
+            pthread_mutex_destroy(&wq->lock);
+            free(wq->threads);
+            wq->threads = NULL;
+            errno = rc;
+            return -1;
+        }
+        wq->nr_threads++;
+    }
+
+    return 0;
+}
+
+int xc_sr_workqueue_queue(struct xc_sr_workqueue *wq, struct xc_sr_work *work)
+{
+    int err;
+
+    pthread_mutex_lock(&wq->lock);
+
+    if ( !wq->error && wq->nr_active >= wq->depth )
+    {
+        wq->nr_queue_waits++;
+        while ( !wq->error && wq->nr_active >= wq->depth )
+            pthread_cond_wait(&wq->cond, &wq->lock);
+    }
+
+    if ( wq->error )
+    {
+        err = wq->error;
+        pthread_mutex_unlock(&wq->lock);
+        work->release(work);
+        errno = err;
+        return -1;
+    }
+
+    work->next = NULL;
+    *wq->tail = work;
+    wq->tail = &work->next;
+    wq->nr_active++;
+    wq->nr_work++;
+    pthread_cond_broadcast(&wq->cond);
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return 0;
+}
+
+int xc_sr_workqueue_flush(struct xc_sr_workqueue *wq)
+{
+    int err;
+
+    pthread_mutex_lock(&wq->lock);
+    while ( wq->nr_active )
+        pthread_cond_wait(&wq->cond, &wq->lock);
+    err = wq->error;
+    pthread_mutex_unlock(&wq->lock);
+
+    if ( err )
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+void xc_sr_workqueue_destroy(struct xc_sr_workqueue *wq)
+{
+    struct xc_sr_work *work;
+
+    if ( !wq->threads )
+        return;
+
+    workqueue_stop(wq);
+
+    while ( (work = wq->head) )
+    {
+        wq->head = work->next;
+        work->release(work);
+    }
+    wq->tail = &wq->head;
+
+    pthread_cond_destroy(&wq->cond);
+    pthread_mutex_destroy(&wq->lock);
+    free(wq->threads);
+    wq->threads = NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,91 @@
+#ifndef __SR_WORKQUEUE__H
+#define __SR_WORKQUEUE__H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Pool of worker threads for independent items of work of the migration
+ * stream, e.g. copying page data into the guest on restore.
+ *
+ * Items are run in no particular order.  At most 'depth' items are queued
+ * or running at any time, queueing blocks until one has completed.  After
+ * the first failure, remaining items are only released.
+ */
+
+struct xc_sr_work
+{
+    /*
+     * Called on a worker thread.
+     *
+     * @returns 0 for success, -1 for failure, with errno appropriately set.
+     */
+    int (*fn)(struct xc_sr_work *work);
+
+    /* Called once the item isn't needed any longer, including on error. */
+    void (*release)(struct xc_sr_work *work);
+
+    struct xc_sr_work *next;
+};
+
+struct xc_sr_workqueue
+{
+    pthread_mutex_t lock;
+    /* Signalled when work is queued or completed, and on shutdown. */
+    pthread_cond_t cond;
+
+    /* Queued items, not yet picked up by a worker. */
+    struct xc_sr_work *head, **tail;
+    /* Items queued or running. */
+    unsigned int nr_active, depth;
+
+    /* errno of the first failure, 0 if none. */
+    int error;
+    bool shutdown;
+
+    pthread_t *threads;
+    unsigned int nr_threads;
+
+    /* Statistics, protected by lock. */
+    uint64_t nr_work, nr_queue_waits;
+};
+
+/*
+ * Start nr_threads workers, allowing at most depth items in flight.
+ *
+ * @returns 0 for success, -1 for failure, with errno appropriately set.
+ */
+int xc_sr_workqueue_init(struct xc_sr_workqueue *wq, unsigned int nr_threads,
+                         unsigned int depth);
+
+/*
+ * Queue an item of work.  Ownership is passed to the workqueue in all
+ * cases, its release hook will be called.
+ *
+ * @returns 0 for success, -1 for failure of an earlier item, with errno
+ * appropriately set.
+ */
+int xc_sr_workqueue_queue(struct xc_sr_workqueue *wq, struct xc_sr_work *work);
+
+/*
+ * Wait for all queued items to complete.
+ *
+ * @returns 0 for success, -1 if any item failed, with errno appropriately
+ * set.
+ */
+int xc_sr_workqueue_flush(struct xc_sr_workqueue *wq);
+
+/* Stop all threads and release items not yet run. */
+void xc_sr_workqueue_destroy(struct xc_sr_workqueue *wq);
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
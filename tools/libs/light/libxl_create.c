@@ -1006,6 +1006,18 @@ static void libxl__colo_restore_setup_done(libxl__egc *egc,
 static void domcreate_stream_done(libxl__egc *egc,
                                   libxl__stream_read_state *srs,
                                   int ret);
+static void domcreate_postcopy_transition(void *user);
+static void domcreate_postcopy_transition_done(libxl__egc *egc,
+                                               libxl__stream_read_state *srs,
+                                               int rc);
+static void domcreate_postcopy_create_done(libxl__egc *egc,
+                                           libxl__domain_create_state *dcs,
+                                           int rc, uint32_t domid);
+static void domcreate_postcopy_stream_done(libxl__egc *egc,
+                                           libxl__stream_read_state *srs,
+                                           int rc);
+static void domcreate_postcopy_join(libxl__egc *egc,
+                                    libxl__domain_create_state *dcs);
 static void domcreate_rebuild_done(libxl__egc *egc,
                                    libxl__domain_create_state *dcs,
                                    int ret);
@@ -1458,6 +1470,10 @@ static void domcreate_bootloader_done(libxl__egc *egc,
     /* Restore */
     callbacks->static_data_done = libxl__srm_callout_callback_static_data_done;
     callbacks->restore_results = libxl__srm_callout_callback_restore_results;
+    if (checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_NONE) {
+        callbacks->postcopy_transition = domcreate_postcopy_transition;
+        dcs->srs.postcopy_callback = domcreate_postcopy_transition_done;
+    }
 
     /* COLO only supports HVM now because it does not work very
      * well with pv drivers:
@@ -1661,6 +1677,123 @@ out:
     domcreate_rebuild_done(egc, dcs, ret);
 }
 
+/*----- post-copy migration -----*/
+
+/*
+ * libxc has received the POSTCOPY_TRANSITION record: the records the
+ * domain needs for being resumed follow, up to POSTCOPY_TRANSITION_END.
+ */
+static void domcreate_postcopy_transition(void *user)
+{
+    libxl__save_helper_state *shs = user;
+    libxl__domain_create_state *dcs = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+
+    libxl__stream_read_start_postcopy(egc, &dcs->srs);
+}
+
+static void domcreate_postcopy_transition_done(libxl__egc *egc,
+                                               libxl__stream_read_state *srs,
+                                               int rc)
+{
+    libxl__domain_create_state *dcs = srs->dcs;
+    STATE_AO_GC(dcs->ao);
+
+    if (rc) {
+        LOGD(ERROR, dcs->guest_domid, "Failed to receive the device model "
+             "state at the post-copy transition");
+        libxl__xc_domain_saverestore_async_callback_done(egc, &srs->shs, 0);
+        return;
+    }
+
+    /*
+     * The domain can be set up, and resumed, while libxc receives the
+     * rest of its memory.  Complete the creation and the stream
+     * separately, and call our caller back once both are done, as COLO
+     * builds the secondary without closing the stream.
+     */
+    dcs->postcopy_saved_callback = dcs->callback;
+    dcs->callback = domcreate_postcopy_create_done;
+    srs->completion_callback = domcreate_postcopy_stream_done;
+    dcs->postcopy_stream_done = false;
+    dcs->postcopy_create_done = false;
+    dcs->postcopy_created = false;
+    dcs->postcopy_rc = 0;
+
+    libxl__xc_domain_saverestore_async_callback_done(egc, &srs->shs, 1);
+    domcreate_stream_done(egc, srs, 0);
+}
+
+static void domcreate_postcopy_create_done(libxl__egc *egc,
+                                           libxl__domain_create_state *dcs,
+                                           int rc, uint32_t domid)
+{
+    STATE_AO_GC(dcs->ao);
+
+    dcs->postcopy_created = !rc;
+
+    if (!rc && !dcs->postcopy_rc &&
+        libxl_defbool_val(dcs->restore_params.postcopy_resume)) {
+        rc = libxl__domain_unpause_deprecated(gc, domid);
+        if (rc)
+            LOGD(ERROR, domid, "Failed to resume domain after the "
+                 "post-copy transition");
+    }
+
+    if (rc && !dcs->postcopy_rc) {
+        dcs->postcopy_rc = rc;
+        /* Nothing will run the domain: stop receiving its memory. */
+        libxl__stream_read_abort(egc, &dcs->srs, rc);
+    }
+
+    /* Only now, as the abort may complete the stream on top of us. */
+    dcs->postcopy_create_done = true;
+    domcreate_postcopy_join(egc, dcs);
+}
+
+static void domcreate_postcopy_stream_done(libxl__egc *egc,
+                                           libxl__stream_read_state *srs,
+                                           int rc)
+{
+    libxl__domain_create_state *dcs = srs->dcs;
+    STATE_AO_GC(dcs->ao);
+
+    if (rc && !dcs->postcopy_rc) {
+        LOGD(ERROR, dcs->guest_domid, "Failed to receive the memory of the "
+             "domain after the post-copy transition");
+        dcs->postcopy_rc = rc;
+    }
+
+    dcs->postcopy_stream_done = true;
+    domcreate_postcopy_join(egc, dcs);
+}
+
+static void domcreate_postcopy_join(libxl__egc *egc,
+                                    libxl__domain_create_state *dcs)
+{
+    STATE_AO_GC(dcs->ao);
+
+    if (!dcs->postcopy_stream_done || !dcs->postcopy_create_done)
+        return;
+
+    dcs->callback = dcs->postcopy_saved_callback;
+
+    /*
+     * A domain missing some of its memory cannot be kept, whether it ran
+     * or not.  If its creation failed, domcreate_complete() has
+     * destroyed it already.
+     */
+    if (dcs->postcopy_rc && dcs->postcopy_created) {
+        dcs->dds.ao = ao;
+        dcs->dds.domid = dcs->guest_domid;
+        dcs->dds.callback = domcreate_destruction_cb;
+        libxl__domain_destroy(egc, &dcs->dds);
+        return;
+    }
+
+    dcs->callback(egc, dcs, dcs->postcopy_rc, dcs->guest_domid);
+}
+
 static void domcreate_rebuild_done(libxl__egc *egc,
                                    libxl__domain_create_state *dcs,
                                    int ret)
@@ -2132,6 +2265,8 @@ static int do_domain_create(libxl_ctx *ctx, libxl_domain_config *d_config,
     cdcs->dcs.send_back_fd = send_back_fd;
     if (restore_fd >= 0) {
         cdcs->dcs.restore_params = *params;
+        libxl_defbool_setdefault(&cdcs->dcs.restore_params.postcopy_resume,
+                                 false);
         rc = libxl__fd_flags_modify_save(gc, cdcs->dcs.restore_fd,
                                          ~(O_NONBLOCK|O_NDELAY), 0,
                                          &cdcs->dcs.restore_fdfl);
@@ -25,6 +25,10 @@ static void stream_done(libxl__egc *egc,
                         libxl__stream_write_state *sws, int rc);
 static void domain_save_done(libxl__egc *egc,
                              libxl__domain_save_state *dss, int rc);
+static void domain_save_postcopy_transition(void *data);
+static void postcopy_transition_written(libxl__egc *egc,
+                                        libxl__stream_write_state *sws,
+                                        int rc);
 
 /*----- complicated callback, called by xc_domain_save -----*/
 
@@ -409,7 +413,13 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     if (rc) goto out;
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
-          | (debug ? XCFLAGS_DEBUG : 0);
+          | (debug ? XCFLAGS_DEBUG : 0)
+          | (dss->auto_converge ? XCFLAGS_AUTO_CONVERGE : 0)
+          | (dss->compress ? XCFLAGS_COMPRESS : 0)
+          | (dss->sparse ? XCFLAGS_SPARSE : 0)
+          | (dss->postcopy ? XCFLAGS_POSTCOPY : 0)
+          | XCFLAGS_DOWNTIME(dss->max_downtime_ms)
+          | XCFLAGS_PIPELINE(dss->stream_threads);
 
     /* Disallow saving a guest with vNUMA configured because migration
      * stream does not preserve node information.
@@ -429,6 +439,12 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     if (dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_NONE)
         callbacks->suspend = libxl__domain_suspend_callback;
 
+    dss->postcopy_transitioned = false;
+    if (dss->postcopy) {
+        callbacks->postcopy_transition = domain_save_postcopy_transition;
+        dss->sws.postcopy_callback = postcopy_transition_written;
+    }
+
     callbacks->switch_qemu_logdirty = libxl__domain_suspend_common_switch_qemu_logdirty;
 
     dss->sws.ao  = dss->ao;
@@ -444,6 +460,36 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     domain_save_done(egc, dss, rc);
 }
 
+/*
+ * libxc has suspended the domain and written the POSTCOPY_TRANSITION
+ * record: send the emulator records, which the receiver needs to resume
+ * the domain, before libxc sends the rest of its memory.
+ */
+static void domain_save_postcopy_transition(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_save_state *dss = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+
+    libxl__stream_write_start_postcopy(egc, &dss->sws);
+}
+
+static void postcopy_transition_written(libxl__egc *egc,
+                                        libxl__stream_write_state *sws,
+                                        int rc)
+{
+    libxl__domain_save_state *dss = sws->dss;
+    STATE_AO_GC(dss->ao);
+
+    if (rc)
+        LOGD(ERROR, dss->domid, "Failed to send the device model state "
+             "at the post-copy transition");
+    else
+        dss->postcopy_transitioned = true;
+
+    libxl__xc_domain_saverestore_async_callback_done(egc, &sws->shs, !rc);
+}
+
 static void stream_done(libxl__egc *egc,
                         libxl__stream_write_state *sws, int rc)
 {
@@ -479,6 +525,16 @@ static void domain_save_done(libxl__egc *egc,
         return;
     }
 
+    if (rc && dss->postcopy_transitioned) {
+        /*
+         * The receiver may have resumed the domain already, and holds
+         * (part of) its memory: the domain must not be resumed here.
+         */
+        LOGD(ERROR, domid, "Post-copy migration failed after the "
+             "transition, the domain is lost");
+        rc = ERROR_POSTCOPY_FAILED;
+    }
+
     dss->callback(egc, dss, rc);
 }
 
@@ -504,16 +504,66 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
                          const libxl_asyncop_how *ao_how)
+{
+    libxl_domain_suspend_params params;
+    int rc;
+
+    libxl_domain_suspend_params_init(&params);
+    rc = libxl_domain_suspend_with_params(ctx, domid, fd, flags, &params,
+                                          ao_how);
+    libxl_domain_suspend_params_dispose(&params);
+
+    return rc;
+}
+
+int libxl_domain_suspend_with_params(libxl_ctx *ctx, uint32_t domid, int fd,
+                                     int flags,
+                                     const libxl_domain_suspend_params *params,
+                                     const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
+    libxl_defbool auto_converge = params->auto_converge;
+    libxl_defbool compress = params->compress;
+    libxl_defbool sparse = params->sparse;
+    libxl_defbool postcopy = params->postcopy;
     int rc;
 
+    /* Limits of the XCFLAGS_DOWNTIME() and XCFLAGS_PIPELINE() fields. */
+    if (params->max_downtime_ms > XCFLAGS_DOWNTIME_MAX ||
+        params->stream_threads > XCFLAGS_PIPELINE_MAX) {
+        LOGD(ERROR, domid, "Downtime budget %"PRIu32" ms or %"PRIu32
+             " stream threads out of range", params->max_downtime_ms,
+             params->stream_threads);
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
+    libxl_defbool_setdefault(&auto_converge, false);
+    libxl_defbool_setdefault(&compress, false);
+    libxl_defbool_setdefault(&sparse, false);
+    libxl_defbool_setdefault(&postcopy, false);
+
+    if (libxl_defbool_val(sparse) && libxl_defbool_val(compress)) {
+        LOGD(ERROR, domid, "Sparse save files cannot be compressed");
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
     libxl_domain_type type = libxl__domain_type(gc, domid);
     if (type == LIBXL_DOMAIN_TYPE_INVALID) {
         rc = ERROR_FAIL;
         goto out_err;
     }
 
+    if (libxl_defbool_val(postcopy) &&
+        (!(flags & LIBXL_SUSPEND_LIVE) || type != LIBXL_DOMAIN_TYPE_HVM ||
+         params->recv_fd < 0 || libxl_defbool_val(sparse))) {
+        LOGD(ERROR, domid, "Post-copy migration needs a live migration of an "
+             "HVM domain, with a channel back from the receiver");
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
     libxl__domain_save_state *dss;
     GCNEW(dss);
 
@@ -522,11 +572,19 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
 
     dss->domid = domid;
     dss->fd = fd;
+    dss->recv_fd = params->recv_fd;
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
+    dss->max_downtime_ms = params->max_downtime_ms;
+    dss->auto_converge = libxl_defbool_val(auto_converge);
+    dss->compress = libxl_defbool_val(compress);
+    dss->stream_threads = params->stream_threads;
+    dss->sparse = libxl_defbool_val(sparse);
+    dss->postcopy = libxl_defbool_val(postcopy);
+
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
                                      ~(O_NONBLOCK|O_NDELAY), 0,
                                      &dss->fdfl);
@@ -3466,12 +3466,16 @@ struct libxl__stream_read_state {
     void (*checkpoint_callback)(libxl__egc *egc,
                                 libxl__stream_read_state *srs,
                                 int rc);
+    void (*postcopy_callback)(libxl__egc *egc,
+                              libxl__stream_read_state *srs,
+                              int rc);
     /* Private */
     int rc;
     bool running;
     bool in_checkpoint;
     bool sync_teardown; /* Only used to coordinate shutdown on error path. */
     bool in_checkpoint_state;
+    bool in_postcopy_transition;
     libxl__save_helper_state shs;
     libxl__conversion_helper_state chs;
 
@@ -3501,6 +3505,8 @@ _hidden void libxl__stream_read_start_checkpoint(libxl__egc *egc,
                                                  libxl__stream_read_state *stream);
 _hidden void libxl__stream_read_checkpoint_state(libxl__egc *egc,
                                                  libxl__stream_read_state *stream);
+_hidden void libxl__stream_read_start_postcopy(libxl__egc *egc,
+                                               libxl__stream_read_state *stream);
 _hidden void libxl__stream_read_abort(libxl__egc *egc,
                                       libxl__stream_read_state *stream, int rc);
 static inline bool
@@ -3544,12 +3550,17 @@ struct libxl__stream_write_state {
     void (*checkpoint_callback)(libxl__egc *egc,
                                 libxl__stream_write_state *sws,
                                 int rc);
+    void (*postcopy_callback)(libxl__egc *egc,
+                              libxl__stream_write_state *sws,
+                              int rc);
     /* Private */
     int rc;
     bool running;
     bool in_checkpoint;
     bool sync_teardown;  /* Only used to coordinate shutdown on error path. */
     bool in_checkpoint_state;
+    bool in_postcopy_transition;
+    bool postcopy_transitioned; /* The emulator records have been sent. */
     libxl__save_helper_state shs;
 
     /* Main stream-writing data. */
@@ -3577,6 +3588,9 @@ _hidden void
 libxl__stream_write_checkpoint_state(libxl__egc *egc,
                                      libxl__stream_write_state *stream,
                                      libxl_sr_checkpoint_state *srcs);
+_hidden void
+libxl__stream_write_start_postcopy(libxl__egc *egc,
+                                   libxl__stream_write_state *stream);
 _hidden void libxl__stream_write_abort(libxl__egc *egc,
                                        libxl__stream_write_state *stream,
                                        int rc);
@@ -3651,9 +3665,17 @@ struct libxl__domain_save_state {
     int debug;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
+    /* live migration parameters, see libxl_domain_suspend_with_params */
+    uint32_t max_downtime_ms;
+    bool auto_converge;
+    bool compress;
+    uint32_t stream_threads;
+    bool sparse;
+    bool postcopy;
     /* private */
     int rc;
-    int xcflags;
+    uint32_t xcflags;
+    bool postcopy_transitioned; /* The receiver may have resumed the guest. */
     libxl__domain_suspend_state dsps;
     union {
         /* for Remus */
@@ -4234,6 +4256,11 @@ struct libxl__domain_create_state {
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
     libxl__xswait_state console_xswait;
+    /* After a post-copy transition, the creation of the domain and the
+     * receiving of its memory complete separately. */
+    libxl__domain_create_cb *postcopy_saved_callback;
+    bool postcopy_stream_done, postcopy_create_done, postcopy_created;
+    int postcopy_rc;
 };
 
 _hidden int libxl__device_nic_set_devids(libxl__gc *gc,
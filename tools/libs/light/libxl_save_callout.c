@@ -61,6 +61,7 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
         state->store_domid, state->console_port,
         state->console_domid,
         cbflags, dcs->restore_params.checkpointed_stream,
+        dcs->restore_params.copy_threads,
     };
 
     shs->ao = ao;
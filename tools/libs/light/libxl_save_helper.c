@@ -273,9 +273,11 @@ int main(int argc, char **argv)
         domid_t console_domid =             strtoul(NEXTARG,0,10);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_stream_type_t stream_type =      strtoul(NEXTARG,0,10);
+        unsigned nr_copy_threads =          strtoul(NEXTARG,0,10);
         assert(!*++argv);
 
         helper_setcallbacks_restore(&cb, cbflags);
+        cb.nr_copy_threads = nr_copy_threads;
 
         unsigned long store_mfn = 0;
         unsigned long console_mfn = 0;
@@ -27,6 +27,7 @@ our @msgs = (
     [ 'srcxA',  "postcopy", [] ],
     [ 'srcxA',  "checkpoint", [] ],
     [ 'srcxA',  "wait_checkpoint", [] ],
+    [ 'srcxA',  "postcopy_transition", [] ],
     [ 'scxA',   "switch_qemu_logdirty",  [qw(uint32_t domid
                                           unsigned enable)] ],
     [ 'rcxW',   "static_data_done",      [qw(unsigned missing)] ],
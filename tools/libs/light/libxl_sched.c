@@ -397,6 +397,79 @@ int libxl_sched_credit2_params_set(libxl_ctx *ctx, uint32_t poolid,
     return rc;
 }
 
+static const struct {
+    libxl_sched_rtds_runqueue libxl;
+    uint32_t xen;
+} rtds_runqueues[] = {
+    { LIBXL_SCHED_RTDS_RUNQUEUE_CPU,    XEN_SYSCTL_RTDS_RUNQUEUE_CPU },
+    { LIBXL_SCHED_RTDS_RUNQUEUE_CORE,   XEN_SYSCTL_RTDS_RUNQUEUE_CORE },
+    { LIBXL_SCHED_RTDS_RUNQUEUE_SOCKET, XEN_SYSCTL_RTDS_RUNQUEUE_SOCKET },
+    { LIBXL_SCHED_RTDS_RUNQUEUE_NODE,   XEN_SYSCTL_RTDS_RUNQUEUE_NODE },
+    { LIBXL_SCHED_RTDS_RUNQUEUE_ALL,    XEN_SYSCTL_RTDS_RUNQUEUE_ALL },
+};
+
+int libxl_sched_rtds_params_get(libxl_ctx *ctx, uint32_t poolid,
+                                libxl_sched_rtds_params *scinfo)
+{
+    struct xen_sysctl_rtds_schedule sparam;
+    unsigned int i;
+    int r, rc;
+    GC_INIT(ctx);
+
+    r = xc_sched_rtds_params_get(ctx->xch, poolid, &sparam);
+    if (r < 0) {
+        LOGE(ERROR, "getting RTDS scheduler parameters");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    scinfo->runqueue = LIBXL_SCHED_RTDS_RUNQUEUE_UNKNOWN;
+    for (i = 0; i < ARRAY_SIZE(rtds_runqueues); i++)
+        if (rtds_runqueues[i].xen == sparam.runqueue)
+            scinfo->runqueue = rtds_runqueues[i].libxl;
+
+    rc = 0;
+ out:
+    GC_FREE;
+    return rc;
+}
+
+int libxl_sched_rtds_params_set(libxl_ctx *ctx, uint32_t poolid,
+                                libxl_sched_rtds_params *scinfo)
+{
+    struct xen_sysctl_rtds_schedule sparam;
+    unsigned int i;
+    int r, rc;
+    GC_INIT(ctx);
+
+    for (i = 0; i < ARRAY_SIZE(rtds_runqueues); i++)
+        if (rtds_runqueues[i].libxl == scinfo->runqueue)
+            break;
+    if (i == ARRAY_SIZE(rtds_runqueues)) {
+        LOG(ERROR, "invalid RTDS runqueue arrangement %d", scinfo->runqueue);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    sparam.runqueue = rtds_runqueues[i].xen;
+
+    r = xc_sched_rtds_params_set(ctx->xch, poolid, &sparam);
+    if (r < 0) {
+        if (errno == EBUSY)
+            LOG(ERROR, "the runqueue arrangement of cpupool %u can only be "
+                "changed while it has no cpus", poolid);
+        else
+            LOGE(ERROR, "setting RTDS scheduler parameters");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = 0;
+ out:
+    GC_FREE;
+    return rc;
+}
+
 static int sched_credit2_domain_get(libxl__gc *gc, uint32_t domid,
                                     libxl_domain_sched_params *scinfo)
 {
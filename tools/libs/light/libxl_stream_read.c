@@ -71,6 +71,10 @@
  *  - libxl__stream_read_start_checkpoint()
  *     - Starts buffering records at a checkpoint.  Must be called on
  *       a running stream.
+ *  - libxl__stream_read_start_postcopy()
+ *     - Starts processing the records sent at a post-copy transition,
+ *       up to POSTCOPY_TRANSITION_END.  Must be called on a running
+ *       stream.
  *
  * There are several chains of event:
  *
@@ -100,6 +104,16 @@
  *    - stream_write_emulator()
  *    - stream_write_emulator_done()
  *    - stream_continue()
+ * 3d) LIBXC record of a post-copy migration:
+ *    - process_record()
+ *    - libxl__xc_domain_restore()
+ *    - libxl__stream_read_start_postcopy(), from libxc's
+ *      postcopy_transition callback
+ *    - stream_continue(), in PHASE_NORMAL, up to POSTCOPY_TRANSITION_END
+ *    - postcopy_transition_done()
+ *    ...
+ *    - libxl__xc_domain_restore_done(), once libxc has all the memory
+ *    - stream_continue()
  *
  * Depending on the contents of the stream, there are likely to be several
  * parallel tasks being managed.  check_all_finished() is used to join all
@@ -134,6 +148,9 @@ static void stream_complete(libxl__egc *egc,
                             libxl__stream_read_state *stream, int rc);
 static void checkpoint_done(libxl__egc *egc,
                             libxl__stream_read_state *stream, int rc);
+static void postcopy_transition_done(libxl__egc *egc,
+                                     libxl__stream_read_state *stream,
+                                     int rc);
 static void stream_done(libxl__egc *egc,
                         libxl__stream_read_state *stream, int rc);
 static void conversion_done(libxl__egc *egc,
@@ -212,6 +229,7 @@ void libxl__stream_read_init(libxl__stream_read_state *stream)
     stream->running = false;
     stream->in_checkpoint = false;
     stream->sync_teardown = false;
+    stream->in_postcopy_transition = false;
     FILLZERO(stream->dc);
     FILLZERO(stream->hdr);
     XEN_STAILQ_INIT(&stream->record_queue);
@@ -309,6 +327,23 @@ void libxl__stream_read_start_checkpoint(libxl__egc *egc,
     stream_continue(egc, stream);
 }
 
+void libxl__stream_read_start_postcopy(libxl__egc *egc,
+                                       libxl__stream_read_state *stream)
+{
+    assert(stream->running);
+    assert(!stream->in_checkpoint);
+    assert(!stream->in_postcopy_transition);
+    assert(stream->phase == SRS_PHASE_NORMAL);
+
+    stream->in_postcopy_transition = true;
+
+    /*
+     * Libxc has handed control of the fd to us, until the end of the
+     * records the domain needs to be resumed.
+     */
+    stream_continue(egc, stream);
+}
+
 void libxl__stream_read_abort(libxl__egc *egc,
                               libxl__stream_read_state *stream, int rc)
 {
@@ -642,6 +677,15 @@ static bool process_record(libxl__egc *egc,
         checkpoint_state_done(egc, stream, srcs->id);
         break;
 
+    case REC_TYPE_POSTCOPY_TRANSITION_END:
+        if (!stream->in_postcopy_transition) {
+            LOG(ERROR, "Unexpected POSTCOPY_TRANSITION_END record in stream");
+            rc = ERROR_FAIL;
+            goto err;
+        }
+        postcopy_transition_done(egc, stream, 0);
+        break;
+
     default:
         LOG(ERROR, "Unrecognised record 0x%08x", rec->hdr.type);
         rc = ERROR_FAIL;
@@ -768,6 +812,18 @@ static void stream_complete(libxl__egc *egc,
         return;
     }
 
+    if (stream->in_postcopy_transition) {
+        assert(rc);
+
+        /*
+         * Pass the error back to libxc, which gives up on the migration.
+         * The failure will come back around to us via
+         * libxl__xc_domain_restore_done()
+         */
+        postcopy_transition_done(egc, stream, rc);
+        return;
+    }
+
     stream_done(egc, stream, rc);
 }
 
@@ -791,6 +847,16 @@ static void checkpoint_done(libxl__egc *egc,
     stream->phase = SRS_PHASE_NORMAL;
 }
 
+static void postcopy_transition_done(libxl__egc *egc,
+                                     libxl__stream_read_state *stream,
+                                     int rc)
+{
+    assert(stream->in_postcopy_transition);
+
+    stream->in_postcopy_transition = false;
+    stream->postcopy_callback(egc, stream, rc);
+}
+
 static void stream_done(libxl__egc *egc,
                         libxl__stream_read_state *stream, int rc)
 {
@@ -799,6 +865,7 @@ static void stream_done(libxl__egc *egc,
     assert(stream->running);
     assert(!stream->in_checkpoint);
     assert(!stream->in_checkpoint_state);
+    assert(!stream->in_postcopy_transition);
     stream->running = false;
 
     if (stream->incoming_record)
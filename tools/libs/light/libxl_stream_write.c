@@ -24,6 +24,9 @@
  *     - Start writing a stream from the start.
  *  - libxl__stream_write_start_checkpoint()
  *     - Write the records which form a checkpoint into a stream.
+ *  - libxl__stream_write_start_postcopy()
+ *     - Write the records which the receiver needs for resuming the
+ *       domain, at the post-copy transition.
  *
  * In normal operation, there are two tasks running at once; this
  * stream processing, and the libxl-save-helper.  check_all_finished()
@@ -50,6 +53,16 @@
  *      - Emulator context record
  *  - Checkpoint end record
  *
+ * For a post-copy migration, libxc stops in the middle of the libxc
+ * record, once the domain is suspended, and triggers a third loop with
+ * its postcopy_transition callback.  It writes:
+ *  - (optional) Emulator xenstore record
+ *  - if (hvm)
+ *      - Emulator context record
+ *  - Postcopy transition end record
+ * after which libxc sends the rest of the memory, and the main loop only
+ * writes the end record, the emulator records having been sent already.
+ *
  * For back channel stream:
  * - libxl__stream_write_start()
  *    - Set up the stream to running state
@@ -68,6 +81,9 @@ static void stream_done(libxl__egc *egc,
 static void checkpoint_done(libxl__egc *egc,
                             libxl__stream_write_state *stream,
                             int rc);
+static void postcopy_transition_done(libxl__egc *egc,
+                                     libxl__stream_write_state *stream,
+                                     int rc);
 static void check_all_finished(libxl__egc *egc,
                                libxl__stream_write_state *stream, int rc);
 
@@ -98,6 +114,12 @@ static void write_checkpoint_end_record(libxl__egc *egc,
 static void checkpoint_end_record_done(libxl__egc *egc,
                                        libxl__stream_write_state *stream);
 
+/* Event chain unique to post-copy migration. */
+static void write_postcopy_transition_end_record(libxl__egc *egc,
+                                        libxl__stream_write_state *stream);
+static void postcopy_transition_end_record_done(libxl__egc *egc,
+                                        libxl__stream_write_state *stream);
+
 /* checkpoint state */
 static void write_checkpoint_state_done(libxl__egc *egc,
                                         libxl__stream_write_state *stream);
@@ -214,6 +236,8 @@ void libxl__stream_write_init(libxl__stream_write_state *stream)
     stream->running = false;
     stream->in_checkpoint = false;
     stream->sync_teardown = false;
+    stream->in_postcopy_transition = false;
+    stream->postcopy_transitioned = false;
     FILLZERO(stream->dc);
     stream->record_done_callback = NULL;
     FILLZERO(stream->emu_dc);
@@ -296,6 +320,18 @@ void libxl__stream_write_start_checkpoint(libxl__egc *egc,
     write_emulator_xenstore_record(egc, stream);
 }
 
+void libxl__stream_write_start_postcopy(libxl__egc *egc,
+                                        libxl__stream_write_state *stream)
+{
+    assert(stream->running);
+    assert(!stream->in_postcopy_transition);
+    assert(!stream->postcopy_transitioned);
+    assert(stream->dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_NONE);
+    stream->in_postcopy_transition = true;
+
+    write_emulator_xenstore_record(egc, stream);
+}
+
 void libxl__stream_write_abort(libxl__egc *egc,
                                libxl__stream_write_state *stream, int rc)
 {
@@ -375,6 +411,8 @@ void libxl__xc_domain_save_done(libxl__egc *egc, void *dss_void,
              * return value (Please refer to libxl__remus_teardown())
              */
             stream_complete(egc, stream, 0);
+        else if (stream->postcopy_transitioned)
+            write_end_record(egc, stream);
         else
             write_emulator_xenstore_record(egc, stream);
     }
@@ -429,6 +467,8 @@ static void emulator_xenstore_record_done(libxl__egc *egc,
     else {
         if (stream->in_checkpoint)
             write_checkpoint_end_record(egc, stream);
+        else if (stream->in_postcopy_transition)
+            write_postcopy_transition_end_record(egc, stream);
         else
             write_end_record(egc, stream);
     }
@@ -529,6 +569,8 @@ static void emulator_context_record_done(libxl__egc *egc,
 
     if (stream->in_checkpoint)
         write_checkpoint_end_record(egc, stream);
+    else if (stream->in_postcopy_transition)
+        write_postcopy_transition_end_record(egc, stream);
     else
         write_end_record(egc, stream);
 }
@@ -563,6 +605,25 @@ static void checkpoint_end_record_done(libxl__egc *egc,
     checkpoint_done(egc, stream, 0);
 }
 
+static void write_postcopy_transition_end_record(libxl__egc *egc,
+                                        libxl__stream_write_state *stream)
+{
+    struct libxl__sr_rec_hdr rec;
+
+    FILLZERO(rec);
+    rec.type = REC_TYPE_POSTCOPY_TRANSITION_END;
+
+    setup_write(egc, stream, "postcopy transition end record",
+                &rec, NULL, postcopy_transition_end_record_done);
+}
+
+static void postcopy_transition_end_record_done(libxl__egc *egc,
+                                        libxl__stream_write_state *stream)
+{
+    stream->postcopy_transitioned = true;
+    postcopy_transition_done(egc, stream, 0);
+}
+
 /*----- Success/error/cleanup handling. -----*/
 
 static void stream_success(libxl__egc *egc, libxl__stream_write_state *stream)
@@ -602,6 +663,18 @@ static void stream_complete(libxl__egc *egc,
         return;
     }
 
+    if (stream->in_postcopy_transition) {
+        assert(rc);
+
+        /*
+         * As for a checkpoint, pass the error back to libxc, which fails
+         * the migration, before sending any memory the receiver cannot
+         * do anything with.
+         */
+        postcopy_transition_done(egc, stream, rc);
+        return;
+    }
+
     stream_done(egc, stream, rc);
 }
 
@@ -610,6 +683,7 @@ static void stream_done(libxl__egc *egc,
 {
     assert(stream->running);
     assert(!stream->in_checkpoint_state);
+    assert(!stream->in_postcopy_transition);
     stream->running = false;
 
     if (stream->emu_carefd)
@@ -639,6 +713,16 @@ static void checkpoint_done(libxl__egc *egc,
     stream->checkpoint_callback(egc, stream, rc);
 }
 
+static void postcopy_transition_done(libxl__egc *egc,
+                                     libxl__stream_write_state *stream,
+                                     int rc)
+{
+    assert(stream->in_postcopy_transition);
+
+    stream->in_postcopy_transition = false;
+    stream->postcopy_callback(egc, stream, rc);
+}
+
 static void check_all_finished(libxl__egc *egc,
                                libxl__stream_write_state *stream,
                                int rc)
@@ -23,7 +23,10 @@ IHDR_OPT_BIT_ENDIAN = 0
 IHDR_OPT_LE = (0 << IHDR_OPT_BIT_ENDIAN)
 IHDR_OPT_BE = (1 << IHDR_OPT_BIT_ENDIAN)
 
-IHDR_OPT_RESZ_MASK = 0xfffe
+IHDR_OPT_BIT_COMPRESSED = 1
+IHDR_OPT_COMPRESSED = (1 << IHDR_OPT_BIT_COMPRESSED)
+
+IHDR_OPT_RESZ_MASK = 0xfffc
 
 # Domain Header
 DHDR_FORMAT = "IHHII"
@@ -58,6 +61,13 @@ REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
 REC_TYPE_static_data_end            = 0x00000010
 REC_TYPE_x86_cpuid_policy           = 0x00000011
 REC_TYPE_x86_msr_policy             = 0x00000012
+REC_TYPE_page_data_compressed       = 0x00000013
+REC_TYPE_page_data_sparse           = 0x00000014
+REC_TYPE_postcopy_begin             = 0x00000015
+REC_TYPE_postcopy_pfns              = 0x00000016
+REC_TYPE_postcopy_transition        = 0x00000017
+REC_TYPE_postcopy_fault             = 0x00000018
+REC_TYPE_postcopy_complete          = 0x00000019
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -79,6 +89,13 @@ rec_type_to_str = {
     REC_TYPE_static_data_end            : "Static data end",
     REC_TYPE_x86_cpuid_policy           : "x86 CPUID policy",
     REC_TYPE_x86_msr_policy             : "x86 MSR policy",
+    REC_TYPE_page_data_compressed       : "Page data compressed",
+    REC_TYPE_page_data_sparse           : "Page data sparse",
+    REC_TYPE_postcopy_begin             : "Postcopy begin",
+    REC_TYPE_postcopy_pfns              : "Postcopy pfns",
+    REC_TYPE_postcopy_transition        : "Postcopy transition",
+    REC_TYPE_postcopy_fault             : "Postcopy fault",
+    REC_TYPE_postcopy_complete          : "Postcopy complete",
 }
 
 # page_data
@@ -101,6 +118,21 @@ PAGE_DATA_TYPE_BROKEN        = (0xd << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (0xe << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (0xf << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# page_data_compressed
+PAGE_DATA_ENC_SHIFT          = 28
+PAGE_DATA_ENC_ARG_MASK       = (1 << PAGE_DATA_ENC_SHIFT) - 1
+
+PAGE_DATA_ENC_RAW            = 0x0 # Uncompressed page
+PAGE_DATA_ENC_ZERO           = 0x1 # Page of zeroes
+PAGE_DATA_ENC_DUP            = 0x2 # Copy of an earlier page in the record
+PAGE_DATA_ENC_LZ4            = 0x3 # LZ4 block compressed page
+
+# page_data_sparse
+PAGE_DATA_SPARSE_ZERO        = 1 << 59 # Page of zeroes, no data
+
+# postcopy_pfns
+POSTCOPY_PFNS_FORMAT         = "II"
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -129,6 +161,7 @@ class VerifyLibxc(VerifyBase):
         VerifyBase.__init__(self, info, read)
 
         self.version = 0
+        self.compressed = False
         self.squashed_pagedata_records = 0
 
 
@@ -161,6 +194,7 @@ class VerifyLibxc(VerifyBase):
                 (version, ))
 
         self.version = version
+        self.compressed = bool(options & IHDR_OPT_COMPRESSED)
 
         if options & IHDR_OPT_RESZ_MASK:
             raise StreamError("Reserved bits set in image options field: 0x%x" %
@@ -177,8 +211,9 @@ class VerifyLibxc(VerifyBase):
                 "Stream is not native endianess - unable to validate")
 
         endian = ["little", "big"][options & IHDR_OPT_LE]
-        self.info("Libxc Image Header: Version %d, %s endian" %
-                  (version, endian))
+        self.info("Libxc Image Header: Version %d, %s endian%s" %
+                  (version, endian,
+                   ", compressed" if self.compressed else ""))
 
 
     def verify_dhdr(self):
@@ -217,7 +252,8 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_page_data_compressed,
+                         REC_TYPE_page_data_sparse):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together" %
@@ -251,30 +287,39 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
-        """ Page Data record """
+    def verify_page_data_pfns(self, content, name, sparse = False):
+        """ Header and pfns of a Page Data record, returns the length of both
+        and the number of pages with data """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
         if len(content) <= minsz:
             raise RecordError(
-                "PAGE_DATA record must be at least %d bytes long" % (minsz, ))
+                "%s record must be at least %d bytes long" % (name, minsz))
 
         count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
 
-        if res1 != 0:
+        # The reserved field holds the padding of sparse records
+        if res1 != 0 and not sparse:
             raise StreamError(
-                "Reserved bits set in PAGE_DATA record 0x%04x" % (res1, ))
+                "Reserved bits set in %s record 0x%04x" % (name, res1))
 
         pfnsz = count * 8
         if (len(content) - minsz) < pfnsz:
             raise RecordError(
-                "PAGE_DATA record must contain a pfn record for each count")
+                "%s record must contain a pfn record for each count" % (name, ))
 
         pfns = list(unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz]))
 
         nr_pages = 0
         for idx, pfn in enumerate(pfns):
 
+            zero = sparse and pfn & PAGE_DATA_SPARSE_ZERO
+            if zero:
+                if (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) > PAGE_DATA_TYPE_L4TAB:
+                    raise RecordError("Page of zeroes without data in "
+                                      "pfn[%d]: 0x%016x" % (idx, pfn))
+                pfn &= ~PAGE_DATA_SPARSE_ZERO
+
             if pfn & PAGE_DATA_PFN_RESZ_MASK:
                 raise RecordError("Reserved bits set in pfn[%d]: 0x%016x" %
                                   (idx, pfn & PAGE_DATA_PFN_RESZ_MASK))
@@ -285,13 +330,81 @@ class VerifyLibxc(VerifyBase):
 
             # We expect page data for each normal page or pagetable
             if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
-                    <= PAGE_DATA_TYPE_L4TAB:
+                    <= PAGE_DATA_TYPE_L4TAB and not zero:
                 nr_pages += 1
 
+        return minsz + pfnsz, nr_pages
+
+
+    def verify_record_page_data(self, content):
+        """ Page Data record """
+
+        pfnsz, nr_pages = self.verify_page_data_pfns(content, "PAGE_DATA")
+
+        pagesz = nr_pages * 4096
+        if len(content) != pfnsz + pagesz:
+            raise RecordError("Expected %u + %u, got %u" %
+                              (pfnsz, pagesz, len(content)))
+
+
+    def verify_record_page_data_compressed(self, content):
+        """ Page Data Compressed record """
+
+        if not self.compressed:
+            raise RecordError("PAGE_DATA_COMPRESSED record in stream without "
+                              "compression")
+
+        pfnsz, nr_pages = self.verify_page_data_pfns(content,
+                                                     "PAGE_DATA_COMPRESSED")
+
+        encsz = (nr_pages * 4 + 7) & ~7
+        if len(content) < pfnsz + encsz:
+            raise RecordError("PAGE_DATA_COMPRESSED record must contain an "
+                              "encoding for each page of data")
+
+        encs = unpack("=%dI" % (nr_pages, ),
+                      content[pfnsz:pfnsz + nr_pages * 4])
+
+        datasz = 0
+        for idx, enc in enumerate(encs):
+
+            kind, arg = enc >> PAGE_DATA_ENC_SHIFT, enc & PAGE_DATA_ENC_ARG_MASK
+
+            if kind == PAGE_DATA_ENC_RAW and arg == 0:
+                datasz += 4096
+            elif kind == PAGE_DATA_ENC_ZERO and arg == 0:
+                pass
+            elif kind == PAGE_DATA_ENC_DUP and arg < idx:
+                pass
+            elif kind == PAGE_DATA_ENC_LZ4 and 0 < arg < 4096:
+                datasz += arg
+            else:
+                raise RecordError("Invalid encoding for page %d: 0x%08x" %
+                                  (idx, enc))
+
+        if len(content) != pfnsz + encsz + datasz:
+            raise RecordError("Expected %u + %u + %u, got %u" %
+                              (pfnsz, encsz, datasz, len(content)))
+
+
+    def verify_record_page_data_sparse(self, content):
+        """ Page Data Sparse record """
+
+        pfnsz, nr_pages = self.verify_page_data_pfns(content,
+                                                     "PAGE_DATA_SPARSE",
+                                                     sparse = True)
+
+        _, pad = unpack(PAGE_DATA_FORMAT, content[:calcsize(PAGE_DATA_FORMAT)])
+        if pad >= 4096:
+            raise RecordError("PAGE_DATA_SPARSE padding %u too large" % (pad, ))
+
+        if content[pfnsz:pfnsz + pad] != b"\x00" * pad:
+            raise StreamError("Padding containing non0 bytes found")
+
         pagesz = nr_pages * 4096
-        if len(content) != minsz + pfnsz + pagesz:
+        if len(content) != pfnsz + pad + pagesz:
             raise RecordError("Expected %u + %u + %u, got %u" %
-                              (minsz, pfnsz, pagesz, len(content)))
+                              (pfnsz, pad, pagesz, len(content)))
 
 
     def verify_record_x86_pv_info(self, content):
@@ -476,6 +589,48 @@ class VerifyLibxc(VerifyBase):
                               (contentsz, sz))
 
 
+    def verify_record_postcopy_begin(self, content):
+        """ postcopy begin record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy begin record with non-zero length")
+
+
+    def verify_record_postcopy_pfns(self, content):
+        """ postcopy pfns record """
+
+        minsz = calcsize(POSTCOPY_PFNS_FORMAT)
+        if len(content) < minsz:
+            raise RecordError("Length expected to be at least %d bytes, got %d"
+                              % (minsz, len(content)))
+
+        count, res1 = unpack(POSTCOPY_PFNS_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved field not zero (0x%08x)" % (res1, ))
+
+        if count == 0:
+            raise RecordError("Postcopy pfns record with no pfns")
+
+        if len(content) != minsz + count * 8:
+            raise RecordError("Expected %u + %u, got %u" %
+                              (minsz, count * 8, len(content)))
+
+        self.info("  %d pfns" % (count, ))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ postcopy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition record with non-zero length")
+
+
+    def verify_record_postcopy_back_channel(self, content):
+        """ postcopy fault or complete record """
+        raise RecordError("Found postcopy back channel record in stream")
+
+
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
@@ -525,4 +680,20 @@ record_verifiers = {
         VerifyLibxc.verify_record_x86_cpuid_policy,
     REC_TYPE_x86_msr_policy:
         VerifyLibxc.verify_record_x86_msr_policy,
+
+    REC_TYPE_page_data_compressed:
+        VerifyLibxc.verify_record_page_data_compressed,
+    REC_TYPE_page_data_sparse:
+        VerifyLibxc.verify_record_page_data_sparse,
+
+    REC_TYPE_postcopy_begin:
+        VerifyLibxc.verify_record_postcopy_begin,
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_back_channel,
+    REC_TYPE_postcopy_complete:
+        VerifyLibxc.verify_record_postcopy_back_channel,
     }
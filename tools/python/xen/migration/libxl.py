@@ -31,20 +31,22 @@ HDR_OPT_RESZ_MASK = 0xfffc
 # Records
 RH_FORMAT = "II"
 
-REC_TYPE_end                    = 0x00000000
-REC_TYPE_libxc_context          = 0x00000001
-REC_TYPE_emulator_xenstore_data = 0x00000002
-REC_TYPE_emulator_context       = 0x00000003
-REC_TYPE_checkpoint_end         = 0x00000004
-REC_TYPE_checkpoint_state       = 0x00000005
+REC_TYPE_end                     = 0x00000000
+REC_TYPE_libxc_context           = 0x00000001
+REC_TYPE_emulator_xenstore_data  = 0x00000002
+REC_TYPE_emulator_context        = 0x00000003
+REC_TYPE_checkpoint_end          = 0x00000004
+REC_TYPE_checkpoint_state        = 0x00000005
+REC_TYPE_postcopy_transition_end = 0x00000006
 
 rec_type_to_str = {
-    REC_TYPE_end                    : "End",
-    REC_TYPE_libxc_context          : "Libxc context",
-    REC_TYPE_emulator_xenstore_data : "Emulator xenstore data",
-    REC_TYPE_emulator_context       : "Emulator context",
-    REC_TYPE_checkpoint_end         : "Checkpoint end",
-    REC_TYPE_checkpoint_state       : "Checkpoint state",
+    REC_TYPE_end                     : "End",
+    REC_TYPE_libxc_context           : "Libxc context",
+    REC_TYPE_emulator_xenstore_data  : "Emulator xenstore data",
+    REC_TYPE_emulator_context        : "Emulator context",
+    REC_TYPE_checkpoint_end          : "Checkpoint end",
+    REC_TYPE_checkpoint_state        : "Checkpoint state",
+    REC_TYPE_postcopy_transition_end : "Postcopy transition end",
 }
 
 # emulator_* header
@@ -219,6 +221,13 @@ class VerifyLibxl(VerifyBase):
         if len(content) == 0:
             raise RecordError("Checkpoint state record with zero length")
 
+    def verify_record_postcopy_transition_end(self, content):
+        """ Postcopy transition end record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition end record with non-zero "
+                              "length")
+
 
 record_verifiers = {
     REC_TYPE_end:
@@ -233,4 +242,6 @@ record_verifiers = {
         VerifyLibxl.verify_record_checkpoint_end,
     REC_TYPE_checkpoint_state:
         VerifyLibxl.verify_record_checkpoint_state,
+    REC_TYPE_postcopy_transition_end:
+        VerifyLibxl.verify_record_postcopy_transition_end,
 }
@@ -0,0 +1,58 @@
+/*
+ * Emulation of the hypervisor environment needed by the credit2 runqueue
+ * code and lib/rbtree.c, for testing and benchmarking it in userspace.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_CREDIT2_RUNQ_
+#define _TEST_CREDIT2_RUNQ_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+#define smp_wmb()
+#define ASSERT(x) assert(x)
+#define prefetch(x) __builtin_prefetch(x)
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#include "list.h"
+#include "rbtree.h"
+
+/* The fields of the hypervisor's struct csched2_unit the runqueue uses. */
+struct csched2_unit {
+    int credit;
+    unsigned int id;
+    struct rb_node runq_elem;
+    struct list_head list_elem;        /* On the reference list runqueue */
+};
+
+#include "credit2-runq.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
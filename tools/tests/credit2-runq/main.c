@@ -0,0 +1,325 @@
+/*
+ * Unit tests and benchmark for credit2 runqueues.
+ *
+ * Random sequences of insertions, removals and credit resets are applied
+ * both to a runqueue and to a sorted list, as credit2 used to keep its
+ * runqueues, comparing the order of the two after every step.  The
+ * benchmark measures wakeups (insertions) and picks (removals of the head
+ * followed by reinsertion, as when the picked unit is descheduled again)
+ * for both, with increasing numbers of runnable units.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "emul.h"
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+#define NR_UNITS      1000
+#define CREDIT_INIT   10000000
+#define CARRYOVER_MAX 500
+
+static struct csched2_unit units[NR_UNITS];
+
+/* The reference: credit2's former runq_insert(), on a list. */
+static void list_insert(struct list_head *runq, struct csched2_unit *svc)
+{
+    struct list_head *iter;
+
+    list_for_each( iter, runq )
+    {
+        struct csched2_unit *iter_svc =
+            list_entry(iter, struct csched2_unit, list_elem);
+
+        if ( svc->credit > iter_svc->credit )
+            break;
+    }
+    list_add_tail(&svc->list_elem, iter);
+}
+
+static void init_units(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_UNITS; i++ )
+    {
+        units[i].id = i;
+        runq_elem_init(&units[i]);
+        INIT_LIST_HEAD(&units[i].list_elem);
+    }
+}
+
+/* Both runqueues must hold the same units, in the same order. */
+static void check(const struct csched2_runq *runq,
+                  const struct list_head *list)
+{
+    const struct csched2_unit *svc = runq_first(runq), *lsvc;
+
+    list_for_each_entry ( lsvc, list, list_elem )
+    {
+        EXPECT(svc == lsvc);
+        EXPECT(unit_on_runq(svc));
+        svc = runq_next(svc);
+    }
+    EXPECT(!svc);
+    EXPECT(runq_empty(runq) == list_empty(list));
+}
+
+/*
+ * Few distinct credit values, for units with the same credit to be frequent:
+ * they must be kept in the order they were inserted.
+ */
+static int random_credit(void)
+{
+    return CREDIT_INIT - (rand() % 64) * 1000;
+}
+
+static void test_random(unsigned int nr_ops)
+{
+    struct csched2_runq runq;
+    struct csched2_unit *svc;
+    LIST_HEAD(list);
+    unsigned int op, i;
+
+    runq_init(&runq);
+    init_units();
+
+    for ( op = 0; op < nr_ops; op++ )
+    {
+        svc = &units[rand() % NR_UNITS];
+
+        switch ( rand() % 8 )
+        {
+        case 0 ... 3: /* Wake up, or get preempted and go back. */
+            if ( unit_on_runq(svc) )
+                break;
+            svc->credit = random_credit();
+            runq_link(&runq, svc);
+            list_insert(&list, svc);
+            break;
+
+        case 4 ... 5: /* Go to sleep, or migrate away. */
+            if ( !unit_on_runq(svc) )
+                break;
+            runq_unlink(&runq, svc);
+            list_del_init(&svc->list_elem);
+            EXPECT(!unit_on_runq(svc));
+            break;
+
+        case 6: /* Get picked. */
+            svc = runq_first(&runq);
+            if ( !svc )
+                break;
+            EXPECT(svc == list_first_entry(&list, struct csched2_unit,
+                                           list_elem));
+            runq_unlink(&runq, svc);
+            list_del_init(&svc->list_elem);
+            break;
+
+        case 7: /* Reset credits, as reset_credit() does. */
+            for ( i = 0; i < NR_UNITS; i++ )
+                if ( unit_on_runq(&units[i]) )
+                    units[i].credit = min(units[i].credit + CREDIT_INIT,
+                                          CREDIT_INIT + CARRYOVER_MAX);
+            break;
+        }
+
+        check(&runq, &list);
+    }
+
+    /* Positions, as traced, must match the list's. */
+    i = 0;
+    for ( svc = runq_first(&runq); svc; svc = runq_next(svc) )
+        EXPECT(runq_pos(svc) == i++);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Per operation times of wakeups and picks, with n units on a runqueue.
+ * Wakeups are timed together with the removal of a unit going to sleep, to
+ * keep n constant.  Credits only go down between resets, so picked units are
+ * reinserted with a bit less credit than they had, and woken ones with
+ * random credit.
+ */
+static void bench_runq(unsigned int n, unsigned long nr, double *wake,
+                       double *pick)
+{
+    struct csched2_runq runq;
+    unsigned long j;
+    unsigned int i;
+    double t0, t1, t2;
+
+    runq_init(&runq);
+    init_units();
+    for ( i = 0; i < n; i++ )
+    {
+        units[i].credit = random_credit();
+        runq_link(&runq, &units[i]);
+    }
+
+    t0 = now();
+    for ( j = 0; j < nr; j++ )
+    {
+        struct csched2_unit *svc = &units[(j * 40503UL) % n];
+
+        runq_unlink(&runq, svc);
+        svc->credit = CREDIT_INIT - (j * 2654435761UL) % 64000;
+        runq_link(&runq, svc);
+    }
+    t1 = now();
+    for ( j = 0; j < nr; j++ )
+    {
+        struct csched2_unit *svc = runq_first(&runq);
+
+        runq_unlink(&runq, svc);
+        svc->credit -= 100;
+        runq_link(&runq, svc);
+    }
+    t2 = now();
+
+    *wake = (t1 - t0) / nr;
+    *pick = (t2 - t1) / nr;
+}
+
+static void bench_list(unsigned int n, unsigned long nr, double *wake,
+                       double *pick)
+{
+    LIST_HEAD(list);
+    unsigned long j;
+    unsigned int i;
+    double t0, t1, t2;
+
+    init_units();
+    for ( i = 0; i < n; i++ )
+    {
+        units[i].credit = random_credit();
+        list_insert(&list, &units[i]);
+    }
+
+    t0 = now();
+    for ( j = 0; j < nr; j++ )
+    {
+        struct csched2_unit *svc = &units[(j * 40503UL) % n];
+
+        list_del(&svc->list_elem);
+        svc->credit = CREDIT_INIT - (j * 2654435761UL) % 64000;
+        list_insert(&list, svc);
+    }
+    t1 = now();
+    for ( j = 0; j < nr; j++ )
+    {
+        struct csched2_unit *svc =
+            list_first_entry(&list, struct csched2_unit, list_elem);
+
+        list_del(&svc->list_elem);
+        svc->credit -= 100;
+        list_insert(&list, svc);
+    }
+    t2 = now();
+
+    *wake = (t1 - t0) / nr;
+    *pick = (t2 - t1) / nr;
+}
+
+static void bench(void)
+{
+    static const unsigned int sizes[] = { 10, 100, 1000 };
+    unsigned int i;
+
+    printf("%7s  %21s  %21s\n", "", "rbtree (ns per op)", "list (ns per op)");
+    printf("%7s  %10s %10s  %10s %10s\n",
+           "units", "wake", "pick", "wake", "pick");
+
+    for ( i = 0; i < ARRAY_SIZE(sizes); i++ )
+    {
+        unsigned long nr = 1UL << 20;
+        double rwake, rpick, lwake, lpick;
+
+        bench_runq(sizes[i], nr, &rwake, &rpick);
+        bench_list(sizes[i], nr, &lwake, &lpick);
+
+        printf("%7u  %10.1f %10.1f  %10.1f %10.1f\n",
+               sizes[i], rwake, rpick, lwake, lpick);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-b] [-n ops]\n"
+            "  -b  benchmark wakeups and picks\n"
+            "  -n  random operations to test (default 200000)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_ops = 200000;
+    bool benchmark = false;
+    int c;
+
+    while ( (c = getopt(argc, argv, "bn:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'b':
+            benchmark = true;
+            break;
+        case 'n':
+            nr_ops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    srand(1);
+
+    test_random(nr_ops);
+    printf("credit2-runq: ok\n");
+
+    if ( benchmark )
+        bench();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,60 @@
+/*
+ * Emulation of the hypervisor environment needed by credit2's spreading of
+ * busy units over SMT cores, for testing it in userspace.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_CREDIT2_SMT_
+#define _TEST_CREDIT2_SMT_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+typedef int64_t s_time_t;
+
+#define MICROSECS(us) ((s_time_t)(us) * 1000)
+#define MILLISECS(ms) ((s_time_t)(ms) * 1000000)
+
+typedef struct cpumask {
+    unsigned long bits;
+} cpumask_t;
+
+static inline bool cpumask_empty(const cpumask_t *mask)
+{
+    return !mask->bits;
+}
+
+/* The fields of the hypervisor's struct csched2_unit used here. */
+struct csched2_unit {
+    unsigned int id;
+    s_time_t start_time;
+    s_time_t switch_time;
+};
+
+#include "credit2-smt.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,207 @@
+/*
+ * Unit tests for credit2's spreading of busy units over SMT cores.
+ *
+ * Scheduling decisions are replayed, as csched2_schedule() takes them, on
+ * cores of two threads: credits are burnt, which moves start_time forward,
+ * and then a unit which would keep running is checked for whether it should
+ * rather leave a contended core for a fully idle one.  Units must stay put
+ * for the migration resistance after being switched in, and then move,
+ * whichever the frequency of scheduling decisions.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "emul.h"
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+#define NR_CORES 4
+#define NR_CPUS  (NR_CORES * 2)
+#define RESIST   MICROSECS(500)        /* Default migrate_resist */
+
+static struct csched2_unit units[NR_CPUS];
+static struct csched2_unit *curr[NR_CPUS];
+static unsigned int nr_spread;
+
+static unsigned int sibling(unsigned int cpu)
+{
+    return cpu ^ 1;
+}
+
+static unsigned int core_busy_threads(unsigned int cpu)
+{
+    return !!curr[cpu] + !!curr[sibling(cpu)];
+}
+
+/* As rqd->smt_idle: all threads of the cores with no busy thread. */
+static cpumask_t smt_idle(void)
+{
+    cpumask_t mask = { 0 };
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+        if ( !core_busy_threads(cpu) )
+            mask.bits |= 1UL << cpu;
+
+    return mask;
+}
+
+/* As burn_credits(), as far as times go. */
+static void burn_credits(struct csched2_unit *svc, s_time_t now)
+{
+    svc->start_time = now;
+}
+
+static void switch_in(unsigned int cpu, struct csched2_unit *svc, s_time_t now)
+{
+    curr[cpu] = svc;
+    unit_switch_in(svc, now);
+    svc->start_time = now;
+}
+
+/*
+ * A scheduling decision on cpu, whose unit keeps running unless it should
+ * spread.  If it does, it is picked by the first thread of an idle core, as
+ * runq_tickle() would.
+ */
+static void schedule(unsigned int cpu, s_time_t now)
+{
+    struct csched2_unit *svc = curr[cpu];
+    cpumask_t idle;
+
+    if ( !svc )
+        return;
+
+    burn_credits(svc, now);
+
+    idle = smt_idle();
+    if ( !smt_spread_wanted(svc, core_busy_threads(cpu), &idle, now,
+                            RESIST) )
+        return;
+
+    curr[cpu] = NULL;
+    switch_in(__builtin_ctzl(idle.bits), svc, now);
+    nr_spread++;
+}
+
+static void reset(void)
+{
+    unsigned int i;
+
+    memset(units, 0, sizeof(units));
+    memset(curr, 0, sizeof(curr));
+    for ( i = 0; i < NR_CPUS; i++ )
+        units[i].id = i;
+    nr_spread = 0;
+}
+
+/* Schedule all cpus every period, from now until end. */
+static void run(s_time_t now, s_time_t end, s_time_t period)
+{
+    unsigned int cpu;
+
+    for ( ; now < end; now += period )
+        for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+            schedule(cpu, now);
+}
+
+/*
+ * Two units on the same core, the others idle: one of them moves, once the
+ * resistance has passed, and only one, whatever the scheduling period.
+ */
+static void test_spread(s_time_t period)
+{
+    reset();
+    switch_in(0, &units[0], 0);
+    switch_in(1, &units[1], 0);
+
+    run(0, RESIST - 1, period);
+    EXPECT(nr_spread == 0);
+    EXPECT(curr[0] == &units[0] && curr[1] == &units[1]);
+
+    run(RESIST, RESIST + period, period);
+    EXPECT(nr_spread == 1);
+    EXPECT(core_busy_threads(0) == 1);
+
+    /* Nothing is contended any longer: no more moves. */
+    run(RESIST + period, MILLISECS(100), period);
+    EXPECT(nr_spread == 1);
+}
+
+/* A unit just switched in is left alone, however long its sibling ran. */
+static void test_resist(void)
+{
+    reset();
+    switch_in(0, &units[0], 0);
+    switch_in(1, &units[1], MILLISECS(10));
+
+    schedule(1, MILLISECS(10) + RESIST / 2);
+    EXPECT(nr_spread == 0);
+    schedule(0, MILLISECS(10) + RESIST / 2);
+    EXPECT(nr_spread == 1);
+    EXPECT(!curr[0] && curr[1] == &units[1]);
+}
+
+/* Without fully idle cores, or with a single busy thread, nothing moves. */
+static void test_no_spread(void)
+{
+    unsigned int cpu;
+
+    reset();
+    for ( cpu = 0; cpu < NR_CPUS - 1; cpu++ )
+        switch_in(cpu, &units[cpu], 0);
+    run(0, MILLISECS(100), MILLISECS(1));
+    EXPECT(nr_spread == 0);
+
+    reset();
+    for ( cpu = 0; cpu < NR_CPUS; cpu += 2 )
+        switch_in(cpu, &units[cpu], 0);
+    run(0, MILLISECS(100), MILLISECS(1));
+    EXPECT(nr_spread == 0);
+}
+
+int main(void)
+{
+    static const s_time_t periods[] = {
+        MICROSECS(10), MICROSECS(100), MILLISECS(1), MILLISECS(10),
+    };
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(periods); i++ )
+        test_spread(periods[i]);
+    test_resist();
+    test_no_spread();
+
+    printf("credit2-smt: ok\n");
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
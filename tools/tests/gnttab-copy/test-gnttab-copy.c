@@ -0,0 +1,271 @@
+/*
+ * Check and benchmark GNTTABOP_copy, in operations per second by batch size.
+ *
+ * Pages are granted to ourselves and copied between through their grant
+ * references, in a few access patterns: chunks of one page after another,
+ * as a backend filling pages with packet fragments does; chunks interleaved
+ * between a few pages; and whole pages, each from a different grant.
+ * After each run the destination pages are checked against the sources.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xencall.h>
+#include <xengnttab.h>
+#include <xen-tools/common-macros.h>
+
+#include <xen/xen.h>
+#include <xen/grant_table.h>
+
+#define PAGE_SIZE  4096
+#define NR_PAGES   64
+#define MAX_BATCH  256
+#define CHUNK      512
+
+static xencall_handle *xch;
+static xengntshr_handle *xgs;
+
+static uint32_t src_refs[NR_PAGES], dst_refs[NR_PAGES];
+static unsigned char *src, *dst;
+static struct gnttab_copy *ops;
+
+static uint32_t domid;
+static unsigned long nr_ops = 1UL << 20;
+static unsigned int nr_failures;
+
+/* Which page and chunk of it operation k copies, and how much. */
+struct pattern {
+    const char *name;
+    void (*op)(unsigned long k, unsigned int *page, unsigned int *offset,
+               unsigned int *len);
+};
+
+static void op_packed(unsigned long k, unsigned int *page,
+                      unsigned int *offset, unsigned int *len)
+{
+    *page = (k / (PAGE_SIZE / CHUNK)) % NR_PAGES;
+    *offset = (k % (PAGE_SIZE / CHUNK)) * CHUNK;
+    *len = CHUNK;
+}
+
+static void op_interleaved(unsigned long k, unsigned int *page,
+                           unsigned int *offset, unsigned int *len)
+{
+    unsigned int per_group = 4 * (PAGE_SIZE / CHUNK);
+
+    *page = (k % 4) + 4 * ((k / per_group) % (NR_PAGES / 4));
+    *offset = ((k / 4) % (PAGE_SIZE / CHUNK)) * CHUNK;
+    *len = CHUNK;
+}
+
+static void op_spread(unsigned long k, unsigned int *page,
+                      unsigned int *offset, unsigned int *len)
+{
+    *page = k % NR_PAGES;
+    *offset = 0;
+    *len = PAGE_SIZE;
+}
+
+static const struct pattern patterns[] = {
+    { "packed",      op_packed },
+    { "interleaved", op_interleaved },
+    { "spread",      op_spread },
+};
+
+static void fill_ops(const struct pattern *p, unsigned long first,
+                     unsigned int batch)
+{
+    unsigned int i, page, offset, len;
+
+    for ( i = 0; i < batch; i++ )
+    {
+        struct gnttab_copy *op = &ops[i];
+
+        p->op(first + i, &page, &offset, &len);
+
+        memset(op, 0, sizeof(*op));
+        op->source.u.ref = src_refs[page];
+        op->source.domid = domid;
+        op->source.offset = offset;
+        op->dest.u.ref = dst_refs[page];
+        op->dest.domid = domid;
+        op->dest.offset = offset;
+        op->len = len;
+        op->flags = GNTCOPY_source_gref | GNTCOPY_dest_gref;
+    }
+}
+
+static int do_copy(unsigned int batch)
+{
+    unsigned int i;
+    int rc = xencall3(xch, __HYPERVISOR_grant_table_op, GNTTABOP_copy,
+                      (unsigned long)ops, batch);
+
+    if ( rc )
+        return rc;
+
+    for ( i = 0; i < batch; i++ )
+        if ( ops[i].status != GNTST_okay )
+            return ops[i].status;
+
+    return 0;
+}
+
+/* Run nr_ops operations in batches, returning the time taken in ns. */
+static double run(const struct pattern *p, unsigned int batch)
+{
+    struct timespec start, end;
+    unsigned long k;
+    double ns = 0;
+    int rc;
+
+    for ( k = 0; k < nr_ops; k += batch )
+    {
+        /* Filling in the operations is part of a backend's work too. */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fill_ops(p, k, batch);
+        rc = do_copy(batch);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if ( rc )
+        {
+            nr_failures++;
+            printf("  %s, batch %u: copy failed: %d\n", p->name, batch, rc);
+            return -1;
+        }
+
+        ns += (end.tv_sec - start.tv_sec) * 1e9 +
+              (end.tv_nsec - start.tv_nsec);
+    }
+
+    return ns;
+}
+
+static void check(const struct pattern *p, unsigned int batch)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        if ( memcmp(src + i * PAGE_SIZE, dst + i * PAGE_SIZE,
+                    PAGE_SIZE) )
+        {
+            nr_failures++;
+            printf("  %s, batch %u: page %u differs\n", p->name, batch, i);
+            return;
+        }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d domid] [-n ops]\n"
+            "  -d  our own domain id (default 0)\n"
+            "  -n  operations per pattern and batch size (default %lu)\n",
+            prog, nr_ops);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i, batch;
+    int c;
+
+    while ( (c = getopt(argc, argv, "d:n:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_ops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* Each run must cover all pages, for them to be checked. */
+    nr_ops = (nr_ops + MAX_BATCH - 1) / MAX_BATCH * MAX_BATCH;
+    if ( nr_ops < NR_PAGES * (PAGE_SIZE / CHUNK) )
+        nr_ops = NR_PAGES * (PAGE_SIZE / CHUNK);
+
+    xch = xencall_open(NULL, 0);
+    if ( !xch )
+        err(1, "xencall_open");
+
+    xgs = xengntshr_open(NULL, 0);
+    if ( !xgs )
+        err(1, "xengntshr_open");
+
+    src = xengntshr_share_pages(xgs, domid, NR_PAGES, src_refs, 0);
+    dst = xengntshr_share_pages(xgs, domid, NR_PAGES, dst_refs, 1);
+    if ( !src || !dst )
+        err(1, "xengntshr_share_pages");
+
+    ops = xencall_alloc_buffer(xch, sizeof(*ops) * MAX_BATCH);
+    if ( !ops )
+        err(1, "xencall_alloc_buffer");
+
+    srand(time(NULL));
+    for ( i = 0; i < NR_PAGES * PAGE_SIZE; i++ )
+        src[i] = rand();
+
+    for ( i = 0; i < ARRAY_SIZE(patterns); i++ )
+    {
+        const struct pattern *p = &patterns[i];
+
+        printf("%s:\n", p->name);
+
+        for ( batch = 1; batch <= MAX_BATCH; batch *= 2 )
+        {
+            double ns;
+
+            memset(dst, 0, NR_PAGES * PAGE_SIZE);
+
+            ns = run(p, batch);
+            if ( ns < 0 )
+                break;
+
+            check(p, batch);
+
+            printf("  batch %3u: %7.1f ns per op, %6.3f Mop/s\n",
+                   batch, ns / nr_ops, nr_ops / ns * 1e3);
+        }
+    }
+
+    xencall_free_buffer(xch, ops);
+    xengntshr_unshare(xgs, src, NR_PAGES);
+    xengntshr_unshare(xgs, dst, NR_PAGES);
+    xengntshr_close(xgs);
+    xencall_close(xch);
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,82 @@
+/*
+ * Emulation of the hypervisor environment needed by common/rangeset.c and
+ * lib/rbtree.c, for testing and benchmarking rangesets in userspace.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_RANGESET_
+#define _TEST_RANGESET_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+#define smp_wmb()
+#define prefetch(x) __builtin_prefetch(x)
+#define ASSERT(x) assert(x)
+#define BUG_ON(x) assert(!(x))
+#define __must_check __attribute__((__warn_unused_result__))
+#define cf_check
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#include "list.h"
+#include "rbtree.h"
+#include "rangeset.h"
+
+typedef bool spinlock_t;
+typedef bool rwlock_t;
+#define spin_lock_init(l) (*(l) = false)
+#define spin_lock(l) (*(l) = true)
+#define spin_unlock(l) (*(l) = false)
+#define rwlock_init(l) (*(l) = false)
+#define read_lock(l) (*(l) = true)
+#define read_unlock(l) (*(l) = false)
+#define write_lock(l) (*(l) = true)
+#define write_unlock(l) (*(l) = false)
+
+typedef uint16_t domid_t;
+
+struct domain {
+    domid_t domain_id;
+    struct list_head rangesets;
+    spinlock_t rangesets_lock;
+};
+
+#define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xfree(p) free(p)
+
+#define safe_strcpy(d, s) snprintf(d, sizeof(d), "%s", s)
+
+extern bool test_verbose;
+#define printk(fmt, args...) \
+    ({ if ( test_verbose ) printf(fmt, ## args); })
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
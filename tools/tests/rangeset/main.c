@@ -0,0 +1,461 @@
+/*
+ * Unit tests and benchmark for rangesets.
+ *
+ * Random sequences of operations are applied both to rangesets and to a
+ * bitmap model of them, comparing the two after every step.  This is done
+ * at the bottom and at the top of the range of unsigned long, to catch
+ * wrap-arounds.  The benchmark measures lookups and insertions for
+ * increasing numbers of ranges.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "emul.h"
+
+bool test_verbose;
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+/*
+ * The model: a bitmap of MODEL_SIZE values starting at base.  Operations
+ * are done on the lower half, leaving room for claimed ranges, and reaching
+ * ~0UL when base is -MODEL_OPS.
+ */
+#define MODEL_SIZE 2048
+#define MODEL_OPS  (MODEL_SIZE / 2)
+
+struct model {
+    unsigned long base;
+    bool bit[MODEL_SIZE];
+};
+
+static void model_set(struct model *m, unsigned long s, unsigned long e,
+                      bool val)
+{
+    for ( ; ; s++ )
+    {
+        m->bit[s - m->base] = val;
+        if ( s == e )
+            break;
+    }
+}
+
+/* Compare the ranges reported with the maximal ranges of the model. */
+struct report {
+    const struct model *m;
+    unsigned long next;
+    unsigned int nr;
+};
+
+static int cf_check check_range(unsigned long s, unsigned long e, void *data)
+{
+    struct report *rep = data;
+    const struct model *m = rep->m;
+    unsigned long i;
+
+    EXPECT(s <= e);
+    EXPECT(s - m->base < MODEL_SIZE && e - m->base < MODEL_SIZE);
+    EXPECT(!rep->nr || s > rep->next);
+
+    /* The model must be clear up to s, set from s to e, and clear after. */
+    for ( i = rep->next; i < s - m->base; i++ )
+        EXPECT(!m->bit[i]);
+    for ( i = s - m->base; i <= e - m->base; i++ )
+        EXPECT(m->bit[i]);
+    EXPECT(e - m->base == MODEL_SIZE - 1 || !m->bit[e - m->base + 1]);
+
+    rep->next = e - m->base + 1;
+    rep->nr++;
+
+    return 0;
+}
+
+static unsigned int check(struct rangeset *r, const struct model *m)
+{
+    struct report rep = { .m = m };
+    unsigned long i, end = m->base + MODEL_SIZE - 1;
+
+    /* At the top the model is cut off at ~0UL. */
+    if ( end < m->base )
+        end = ~0UL;
+
+    EXPECT(!rangeset_report_ranges(r, m->base, end, check_range, &rep));
+    for ( i = rep.next; i < MODEL_SIZE; i++ )
+        EXPECT(!m->bit[i]);
+    EXPECT(rangeset_is_empty(r) == !rep.nr);
+
+    return rep.nr;
+}
+
+static bool model_contains(const struct model *m, unsigned long s,
+                           unsigned long e)
+{
+    for ( ; ; s++ )
+    {
+        if ( !m->bit[s - m->base] )
+            return false;
+        if ( s == e )
+            return true;
+    }
+}
+
+static bool model_overlaps(const struct model *m, unsigned long s,
+                           unsigned long e)
+{
+    for ( ; ; s++ )
+    {
+        if ( m->bit[s - m->base] )
+            return true;
+        if ( s == e )
+            return false;
+    }
+}
+
+static void random_range(const struct model *m, unsigned long *s,
+                         unsigned long *e)
+{
+    unsigned long a = rand() % MODEL_OPS;
+    unsigned long len = rand() % 8 ? rand() % 16 : rand() % 256;
+
+    *s = m->base + a;
+    *e = m->base + min(a + len, MODEL_OPS - 1UL);
+}
+
+/* Partial reports must be clipped to the range asked for. */
+struct clip {
+    unsigned long s, e, nr;
+};
+
+static int cf_check clip_range(unsigned long s, unsigned long e, void *data)
+{
+    struct clip *c = data;
+
+    EXPECT(c->s <= s && e <= c->e);
+    c->nr += e - s + 1;
+
+    return 0;
+}
+
+static void test_random(unsigned long base, unsigned int nr_ops, bool limit)
+{
+    static struct model m, m2;
+    struct domain d = { .domain_id = 0 };
+    struct rangeset *r, *r2;
+    unsigned int op, nr = 0;
+
+    rangeset_domain_initialise(&d);
+    r = rangeset_new(&d, "random", RANGESETF_prettyprint_hex);
+    r2 = rangeset_new(&d, "other", RANGESETF_no_print);
+    EXPECT(r && r2);
+    memset(&m, 0, sizeof(m));
+    memset(&m2, 0, sizeof(m2));
+    m.base = m2.base = base;
+
+    if ( limit )
+        rangeset_limit(r, 16);
+
+    for ( op = 0; op < nr_ops; op++ )
+    {
+        unsigned long s, e, size, start;
+        unsigned int i;
+        struct clip c;
+        int rc;
+
+        random_range(&m, &s, &e);
+
+        switch ( rand() % 16 )
+        {
+        case 0: case 1: case 2: case 3: case 4:
+            rc = rangeset_add_range(r, s, e);
+            EXPECT(!rc || (limit && rc == -ENOMEM));
+            if ( !rc )
+                model_set(&m, s, e, true);
+            break;
+
+        case 5: case 6: case 7: case 8:
+            rc = rangeset_remove_range(r, s, e);
+            EXPECT(!rc || (limit && rc == -ENOMEM));
+            if ( !rc )
+                model_set(&m, s, e, false);
+            break;
+
+        case 9:
+            rc = rangeset_add_singleton(r, s);
+            EXPECT(!rc || (limit && rc == -ENOMEM));
+            if ( !rc )
+                m.bit[s - base] = true;
+            break;
+
+        case 10:
+            rc = rangeset_remove_singleton(r, s);
+            EXPECT(!rc || (limit && rc == -ENOMEM));
+            if ( !rc )
+                m.bit[s - base] = false;
+            break;
+
+        case 11: /* Claiming searches from 0, so only at the bottom. */
+            if ( base || limit )
+                break;
+            size = 1 + rand() % 32;
+            EXPECT(rangeset_claim_range(r, size, &start) == 0);
+            for ( s = 0; model_overlaps(&m, s, s + size - 1); s++ )
+                continue;
+            EXPECT(start == s);
+            model_set(&m, start, start + size - 1, true);
+            /* Keep the claimed range within the operations half. */
+            if ( start + size > MODEL_OPS )
+            {
+                EXPECT(rangeset_remove_range(r, MODEL_OPS,
+                                             start + size - 1) == 0);
+                model_set(&m, max(start, (unsigned long)MODEL_OPS),
+                          start + size - 1, false);
+            }
+            break;
+
+        case 12: /* Merge another set in. */
+            if ( limit )
+                break;
+            rangeset_purge(r2);
+            memset(m2.bit, 0, sizeof(m2.bit));
+            for ( i = 0; i < 4; i++ )
+            {
+                random_range(&m2, &s, &e);
+                EXPECT(rangeset_add_range(r2, s, e) == 0);
+                model_set(&m2, s, e, true);
+            }
+            check(r2, &m2);
+            EXPECT(rangeset_merge(r, r2) == 0);
+            for ( i = 0; i < MODEL_SIZE; i++ )
+                m.bit[i] |= m2.bit[i];
+            break;
+
+        case 13: /* Swap twice, checking the other set in between. */
+            rangeset_swap(r, r2);
+            check(r2, &m);
+            rangeset_swap(r, r2);
+            break;
+
+        case 14: /* Reports are clipped to the range asked for. */
+            c = (struct clip){ .s = s, .e = e };
+            EXPECT(!rangeset_report_ranges(r, s, e, clip_range, &c));
+            for ( i = s - base; i <= e - base; i++ )
+                c.nr -= m.bit[i];
+            EXPECT(!c.nr);
+            break;
+
+        default:
+            break;
+        }
+
+        /* Random lookups against the model. */
+        for ( i = 0; i < 4; i++ )
+        {
+            random_range(&m, &s, &e);
+            EXPECT(rangeset_contains_range(r, s, e) ==
+                   model_contains(&m, s, e));
+            EXPECT(rangeset_overlaps_range(r, s, e) ==
+                   model_overlaps(&m, s, e));
+        }
+
+        nr = check(r, &m);
+        EXPECT(!limit || nr <= 16);
+    }
+
+    printk("%lx%s: %u ranges\n", base, limit ? " limited" : "", nr);
+    rangeset_domain_printk(&d);
+    rangeset_domain_destroy(&d);
+}
+
+/* Consume the set in chunks, restarting as preemption would. */
+struct consume {
+    const struct model *m;
+    unsigned long next, chunk;
+};
+
+static int cf_check consume_range(unsigned long s, unsigned long e,
+                                  void *data, unsigned long *c)
+{
+    struct consume *con = data;
+    unsigned long i;
+
+    EXPECT(s >= con->next);
+    for ( i = s; i <= e; i++ )
+        EXPECT(con->m->bit[i - con->m->base]);
+
+    *c = min(e - s + 1, con->chunk);
+    con->next = s + *c;
+
+    return *c <= e - s ? -ERESTART : 0;
+}
+
+static void test_consume(void)
+{
+    static struct model m = { .base = 0 };
+    struct rangeset *r = rangeset_new(NULL, "consume", 0);
+    struct consume con = { .m = &m, .chunk = 5 };
+    unsigned long s, e;
+    unsigned int i;
+    int rc;
+
+    EXPECT(r);
+    for ( i = 0; i < 64; i++ )
+    {
+        random_range(&m, &s, &e);
+        EXPECT(rangeset_add_range(r, s, e) == 0);
+        model_set(&m, s, e, true);
+    }
+
+    while ( (rc = rangeset_consume_ranges(r, consume_range, &con)) )
+        EXPECT(rc == -ERESTART);
+    EXPECT(rangeset_is_empty(r));
+
+    rangeset_destroy(r);
+}
+
+/* Rangesets of a domain are destroyed with it. */
+static void test_domain(void)
+{
+    struct domain d = { .domain_id = 1 };
+    struct rangeset *r;
+
+    rangeset_domain_initialise(&d);
+    r = rangeset_new(&d, "iomem", RANGESETF_prettyprint_hex);
+    EXPECT(r);
+    EXPECT(rangeset_add_range(r, 0xfee00, 0xfeeff) == 0);
+    EXPECT(rangeset_new(&d, NULL, RANGESETF_no_print));
+    EXPECT(rangeset_add_range(r, 0, ~0UL) == 0);
+    EXPECT(rangeset_contains_range(r, 0, ~0UL));
+    EXPECT(rangeset_remove_singleton(r, ~0UL) == 0);
+    EXPECT(!rangeset_contains_singleton(r, ~0UL));
+    EXPECT(rangeset_contains_singleton(r, ~0UL - 1));
+    rangeset_domain_printk(&d);
+    rangeset_domain_destroy(&d);
+    EXPECT(list_empty(&d.rangesets));
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Lookups in sets of disjoint ranges, as for iomem or ioreq server ranges. */
+static void bench(unsigned int max)
+{
+    unsigned int n, i;
+
+    for ( n = 16; n <= max; n *= 4 )
+    {
+        struct rangeset *r = rangeset_new(NULL, "bench", 0);
+        unsigned long nr_lookups = 1UL << 22, found = 0, j;
+        double t0, t1, t2;
+
+        EXPECT(r);
+
+        /* Insert in random order, to avoid favouring either end. */
+        t0 = now();
+        for ( i = 0; i < n; i++ )
+        {
+            unsigned long s = ((i * 2654435761UL) % n) * 16;
+
+            EXPECT(rangeset_add_range(r, s, s + 7) == 0);
+        }
+        t1 = now();
+
+        for ( j = 0; j < nr_lookups; j++ )
+            found += rangeset_contains_singleton(r, (j * 40503UL) % (n * 16));
+        t2 = now();
+
+        EXPECT(found);
+
+        printf("%7u ranges: %8.1f ns per insert, %8.1f ns per lookup\n",
+               n, (t1 - t0) / n, (t2 - t1) / nr_lookups);
+
+        rangeset_destroy(r);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-v] [-b] [-n ops]\n"
+            "  -v  verbose, print the sets\n"
+            "  -b  benchmark lookups and insertions\n"
+            "  -n  random operations per test (default 20000)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_ops = 20000;
+    bool benchmark = false;
+    int c;
+
+    while ( (c = getopt(argc, argv, "vbn:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'v':
+            test_verbose = true;
+            break;
+        case 'b':
+            benchmark = true;
+            break;
+        case 'n':
+            nr_ops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    srand(1);
+
+    test_random(0, nr_ops, false);
+    test_random(0, nr_ops, true);
+    test_random(-(unsigned long)MODEL_OPS, nr_ops, false);
+    test_random(-(unsigned long)MODEL_OPS, nr_ops, true);
+    test_consume();
+    test_domain();
+    printf("rangeset: ok\n");
+
+    if ( benchmark )
+        bench(1U << 16);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
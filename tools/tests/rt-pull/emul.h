@@ -0,0 +1,279 @@
+/*
+ * Emulation of the hypervisor environment needed by RTDS's pulling of units
+ * from other runqueues, for testing it in userspace.
+ *
+ * Locks only record whether they are held, for the tests to contend them,
+ * and raising the schedule softirq only marks it pending on the CPU.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_RT_PULL_
+#define _TEST_RT_PULL_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+#define smp_wmb()
+#define ASSERT(x) assert(x)
+#define prefetch(x) __builtin_prefetch(x)
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#include "list.h"
+
+typedef int64_t s_time_t;
+#define STIME_MAX INT64_MAX
+
+#define read_atomic(p) (*(p))
+#define write_atomic(p, v) (*(p) = (v))
+
+#define NR_CPUS 8
+
+typedef struct {
+    bool held;
+} spinlock_t;
+
+typedef struct {
+    unsigned int readers;
+    bool writer;
+} rwlock_t;
+
+static inline bool spin_trylock(spinlock_t *l)
+{
+    if ( l->held )
+        return false;
+    l->held = true;
+    return true;
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+    assert(l->held);
+    l->held = false;
+}
+
+static inline bool read_trylock(rwlock_t *l)
+{
+    if ( l->writer )
+        return false;
+    l->readers++;
+    return true;
+}
+
+static inline void read_unlock(rwlock_t *l)
+{
+    assert(l->readers);
+    l->readers--;
+}
+
+typedef struct cpumask {
+    unsigned long bits;
+} cpumask_t;
+
+static inline const cpumask_t *cpumask_of(unsigned int cpu)
+{
+    static cpumask_t masks[NR_CPUS];
+
+    masks[cpu].bits = 1UL << cpu;
+    return &masks[cpu];
+}
+
+#define SCHEDULE_SOFTIRQ 0
+
+static bool softirq_pending[NR_CPUS];
+
+static inline void cpu_raise_softirq(unsigned int cpu, unsigned int nr)
+{
+    softirq_pending[cpu] = true;
+}
+
+static struct {
+    unsigned int rtds_pull;
+    unsigned int rtds_pull_trylock_failed;
+} stats;
+
+#define SCHED_STAT_CRANK(x) (stats.x++)
+
+static const bool tb_init_done;
+#define TRC_RTDS_RUNQ_PULL 0
+#define trace_time(e, s, d) ((void)(d))
+
+struct domain {
+    uint16_t domain_id;
+};
+
+/* The fields of the hypervisor's structures used for pulling. */
+struct sched_unit {
+    unsigned int unit_id;
+    struct domain *domain;
+    unsigned long hard_affinity;       /* Bits of the cpus it may run on   */
+    unsigned int res;                  /* As sched_unit_master()           */
+    bool idle;
+    bool runnable;
+};
+
+struct rt_prio {
+    unsigned int level;
+    s_time_t deadline;
+};
+#define RTDS_PRIO_NONE UINT_MAX
+
+struct rt_unit {
+    struct list_head q_elem;
+    unsigned int priority_level;
+    s_time_t cur_deadline;
+    struct sched_unit *unit;
+};
+
+struct rt_runqueue_data {
+    spinlock_t lock;
+    struct list_head rql;
+    unsigned int id;
+    unsigned long cpus;
+    struct list_head runq;
+    struct rt_prio head;
+};
+
+struct rt_private {
+    rwlock_t lock;
+    struct list_head rql;
+    unsigned int nr_runqueues;
+};
+
+struct scheduler {
+    struct rt_private *priv;
+};
+
+static inline struct rt_private *rt_priv(const struct scheduler *ops)
+{
+    return ops->priv;
+}
+
+static inline bool is_idle_unit(const struct sched_unit *unit)
+{
+    return unit->idle;
+}
+
+static inline bool unit_runnable_state(const struct sched_unit *unit)
+{
+    return unit->runnable;
+}
+
+static inline unsigned int get_sched_res(unsigned int cpu)
+{
+    return cpu;
+}
+
+static inline void sched_set_res(struct sched_unit *unit, unsigned int res)
+{
+    unit->res = res;
+}
+
+/* As in rt.c. */
+static inline s_time_t
+compare_unit_priority(const struct rt_unit *v1, const struct rt_unit *v2)
+{
+    int prio = v2->priority_level - v1->priority_level;
+
+    if ( prio == 0 )
+        return v2->cur_deadline - v1->cur_deadline;
+
+    return prio;
+}
+
+static inline void set_prio(struct rt_prio *p, const struct rt_unit *svc)
+{
+    write_atomic(&p->level, svc ? svc->priority_level : RTDS_PRIO_NONE);
+    write_atomic(&p->deadline, svc ? svc->cur_deadline : STIME_MAX);
+}
+
+static inline s_time_t
+compare_prio(const struct rt_unit *v1, const struct rt_prio *p)
+{
+    unsigned int level = read_atomic(&p->level);
+
+    if ( level == v1->priority_level )
+        return read_atomic(&p->deadline) - v1->cur_deadline;
+
+    return (s_time_t)level - v1->priority_level;
+}
+
+static inline void runq_update_head(struct rt_runqueue_data *rqd)
+{
+    set_prio(&rqd->head,
+             list_empty(&rqd->runq) ? NULL
+                                    : list_first_entry(&rqd->runq,
+                                                       struct rt_unit,
+                                                       q_elem));
+}
+
+static inline void q_remove(struct rt_runqueue_data *rqd, struct rt_unit *svc)
+{
+    ASSERT(rqd->lock.held);
+    list_del_init(&svc->q_elem);
+    runq_update_head(rqd);
+}
+
+/* EDF order, as deadline_queue_insert(). */
+static inline void runq_insert(struct rt_runqueue_data *rqd,
+                               struct rt_unit *svc)
+{
+    struct list_head *iter;
+
+    ASSERT(rqd->lock.held);
+    list_for_each ( iter, &rqd->runq )
+        if ( compare_unit_priority(svc, list_entry(iter, struct rt_unit,
+                                                   q_elem)) > 0 )
+            break;
+    list_add_tail(&svc->q_elem, iter);
+    runq_update_head(rqd);
+}
+
+/* No replenishments in these tests. */
+#define replq_remove(rqd, svc) ((void)(svc))
+#define replq_insert(rqd, svc) ((void)(svc))
+
+static inline struct rt_unit *
+runq_pick(const struct rt_runqueue_data *rqd, const cpumask_t *mask,
+          unsigned int cpu)
+{
+    struct rt_unit *svc;
+
+    list_for_each_entry ( svc, &rqd->runq, q_elem )
+        if ( svc->unit->hard_affinity & mask->bits )
+            return svc;
+
+    return NULL;
+}
+
+#include "rt-pull.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
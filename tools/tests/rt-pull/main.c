@@ -0,0 +1,279 @@
+/*
+ * Unit tests for RTDS's pulling of units from other runqueues.
+ *
+ * Scheduling decisions are replayed, as rt_schedule() takes them, on two
+ * runqueues of two CPUs each.  A unit waits in a runqueue whose CPUs are all
+ * busy with higher priority units, while a CPU of the other runqueue is idle
+ * and should pull it.  The locks runq_pull() only trylocks are held, as by
+ * other CPUs, for the idle CPU to find them contended: it must then keep
+ * rescheduling until it gets them and pulls the unit, but not reschedule
+ * when there is nothing worth pulling in the first place.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "emul.h"
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+#define NR_RUNQS      2
+#define CPUS_PER_RUNQ 2
+#define NR_TEST_CPUS  (NR_RUNQS * CPUS_PER_RUNQ)
+#define NR_UNITS      4
+
+static struct rt_private prv;
+static const struct scheduler ops = { .priv = &prv };
+static struct rt_runqueue_data rqs[NR_RUNQS];
+static struct domain dom;
+
+static struct sched_unit units[NR_UNITS], idle_units[NR_TEST_CPUS];
+static struct rt_unit svcs[NR_UNITS], idle_svcs[NR_TEST_CPUS];
+static struct rt_unit *curr[NR_TEST_CPUS];
+
+static struct rt_runqueue_data *cpu_rqd(unsigned int cpu)
+{
+    return &rqs[cpu / CPUS_PER_RUNQ];
+}
+
+static void reset(void)
+{
+    unsigned int i;
+
+    memset(&prv, 0, sizeof(prv));
+    memset(&stats, 0, sizeof(stats));
+    memset(softirq_pending, 0, sizeof(softirq_pending));
+    INIT_LIST_HEAD(&prv.rql);
+
+    for ( i = 0; i < NR_RUNQS; i++ )
+    {
+        struct rt_runqueue_data *rqd = &rqs[i];
+
+        memset(rqd, 0, sizeof(*rqd));
+        rqd->id = i;
+        INIT_LIST_HEAD(&rqd->runq);
+        runq_update_head(rqd);
+        list_add_tail(&rqd->rql, &prv.rql);
+        prv.nr_runqueues++;
+    }
+
+    for ( i = 0; i < NR_TEST_CPUS; i++ )
+    {
+        idle_units[i] = (struct sched_unit){ .idle = true, .res = i };
+        idle_svcs[i] = (struct rt_unit){ .unit = &idle_units[i] };
+        curr[i] = &idle_svcs[i];
+    }
+
+    for ( i = 0; i < NR_UNITS; i++ )
+    {
+        units[i] = (struct sched_unit){
+            .unit_id = i, .domain = &dom, .hard_affinity = ~0UL,
+            .runnable = true,
+        };
+        svcs[i] = (struct rt_unit){ .unit = &units[i] };
+        INIT_LIST_HEAD(&svcs[i].q_elem);
+    }
+}
+
+static struct rt_unit *unit(unsigned int i, s_time_t deadline)
+{
+    svcs[i].cur_deadline = deadline;
+    return &svcs[i];
+}
+
+static void run_on(unsigned int cpu, struct rt_unit *svc)
+{
+    curr[cpu] = svc;
+    svc->unit->res = cpu;
+}
+
+static void wait_in(unsigned int rq, struct rt_unit *svc)
+{
+    struct rt_runqueue_data *rqd = &rqs[rq];
+
+    spin_trylock(&rqd->lock);
+    runq_insert(rqd, svc);
+    spin_unlock(&rqd->lock);
+    svc->unit->res = rq * CPUS_PER_RUNQ;
+}
+
+/* As rt_schedule(), with the lock of the cpu's runqueue held. */
+static void schedule(unsigned int cpu)
+{
+    struct rt_runqueue_data *rqd = cpu_rqd(cpu);
+    struct rt_unit *scurr = curr[cpu], *snext, *pulled;
+
+    EXPECT(spin_trylock(&rqd->lock));
+
+    snext = runq_pick(rqd, cpumask_of(cpu), cpu) ?: &idle_svcs[cpu];
+    if ( !is_idle_unit(scurr->unit) &&
+         (is_idle_unit(snext->unit) || compare_unit_priority(scurr, snext) > 0) )
+        snext = scurr;
+
+    pulled = runq_pull(&ops, rqd, snext, cpu);
+    if ( pulled )
+    {
+        EXPECT(pulled->unit->res == cpu);
+        snext = pulled;
+    }
+
+    if ( snext != scurr )
+    {
+        if ( !is_idle_unit(scurr->unit) )
+            runq_insert(rqd, scurr);
+        if ( !is_idle_unit(snext->unit) )
+            q_remove(rqd, snext);
+        run_on(cpu, snext);
+    }
+
+    spin_unlock(&rqd->lock);
+}
+
+/* Handle pending schedule softirqs once.  Return whether there were any. */
+static bool do_softirqs(void)
+{
+    bool any = false;
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < NR_TEST_CPUS; cpu++ )
+    {
+        if ( !softirq_pending[cpu] )
+            continue;
+
+        softirq_pending[cpu] = false;
+        schedule(cpu);
+        any = true;
+    }
+
+    return any;
+}
+
+/*
+ * cpu0 and cpu1 run units 0 and 1, with unit 2 waiting behind them, while
+ * cpu2 and cpu3 are idle.
+ */
+static void setup_waiting(void)
+{
+    reset();
+    run_on(0, unit(0, 10));
+    run_on(1, unit(1, 20));
+    wait_in(0, unit(2, 30));
+}
+
+static void test_pull(void)
+{
+    setup_waiting();
+
+    schedule(2);
+    EXPECT(curr[2] == &svcs[2]);
+    EXPECT(list_empty(&rqs[0].runq));
+    EXPECT(rqs[0].head.level == RTDS_PRIO_NONE);
+    EXPECT(stats.rtds_pull == 1);
+    EXPECT(!do_softirqs());
+}
+
+/*
+ * The lock of the runqueue the unit waits in, or the private scheduler
+ * lock, is held for a few rounds of rescheduling by cpu2, which must keep
+ * trying, and pull the unit once the lock is released.
+ */
+static void test_contended(bool prv_lock)
+{
+    unsigned int i;
+
+    setup_waiting();
+
+    if ( prv_lock )
+        prv.lock.writer = true;
+    else
+        rqs[0].lock.held = true;
+
+    schedule(2);
+    for ( i = 0; i < 3; i++ )
+    {
+        EXPECT(is_idle_unit(curr[2]->unit));
+        EXPECT(softirq_pending[2]);
+        EXPECT(do_softirqs());
+    }
+    EXPECT(stats.rtds_pull_trylock_failed == 4);
+    EXPECT(stats.rtds_pull == 0);
+
+    if ( prv_lock )
+        prv.lock.writer = false;
+    else
+        rqs[0].lock.held = false;
+
+    EXPECT(do_softirqs());
+    EXPECT(curr[2] == &svcs[2]);
+    EXPECT(stats.rtds_pull == 1);
+    EXPECT(!do_softirqs());
+    EXPECT(!prv.lock.readers);
+}
+
+/* cpu2 doesn't keep rescheduling for units it would not pull anyway. */
+static void test_no_retry(void)
+{
+    /* Nothing waiting. */
+    reset();
+    run_on(0, unit(0, 10));
+    rqs[0].lock.held = true;
+    schedule(2);
+    EXPECT(!softirq_pending[2]);
+
+    /* A unit with a lower priority than what cpu2 runs. */
+    setup_waiting();
+    run_on(2, unit(3, 5));
+    rqs[0].lock.held = true;
+    schedule(2);
+    EXPECT(curr[2] == &svcs[3]);
+    EXPECT(!softirq_pending[2]);
+    EXPECT(stats.rtds_pull_trylock_failed == 0);
+
+    /* A unit which can't run on cpu2: looked at once, but not retried. */
+    setup_waiting();
+    units[2].hard_affinity = 0x3;
+    schedule(2);
+    EXPECT(is_idle_unit(curr[2]->unit));
+    EXPECT(!do_softirqs());
+    EXPECT(!list_empty(&rqs[0].runq));
+}
+
+int main(void)
+{
+    test_pull();
+    test_contended(false);
+    test_contended(true);
+    test_no_retry();
+
+    printf("rt-pull: ok\n");
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
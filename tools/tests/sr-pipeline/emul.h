@@ -0,0 +1,68 @@
+/*
+ * Test harness for the migration stream page data helpers.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_SR_PIPELINE_
+#define _TEST_SR_PIPELINE_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define PAGE_SIZE 4096
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* From xenguest.h. */
+struct precopy_stats
+{
+    unsigned int iteration;
+    unsigned long total_written;
+    long dirty_count;
+};
+
+#define XGS_POLICY_CONTINUE_PRECOPY 0
+#define XGS_POLICY_STOP_AND_COPY    1
+
+#include "xg_sr_pipeline.h"
+#include "xg_sr_compress.h"
+#include "xg_sr_workqueue.h"
+#include "xg_sr_precopy.h"
+#include "xg_sr_stream_format.h"
+
+/* Built from the hypervisor sources, as in libxenguest. */
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+                                     unsigned char *dest, size_t *dest_len);
+
+/* Provided by libxenctrl in the real library. */
+int writev_exact(int fd, const struct iovec *iov, int iovcnt);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,765 @@
+/*
+ * Unit tests and benchmarks for the migration stream page data pipeline,
+ * page encoding, restore workqueue and adaptive precopy policy.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emul.h"
+
+/* Same as MAX_BATCH_SIZE of the migration code. */
+#define BATCH_PAGES    1024
+
+struct test_batch
+{
+    struct xc_sr_pipeline_batch pb;
+    uint64_t seq;
+    unsigned int nr_pages;
+    void *bounce;
+    struct iovec iov[BATCH_PAGES + 1];
+};
+
+static unsigned int nr_released, nr_written;
+static pthread_mutex_t release_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t fail_seq = ~0ULL;
+static char *image;
+
+/* Pool of bounce buffers for the benchmark, protected by release_lock. */
+#define NR_BOUNCE 64
+static void *bounce_pool[NR_BOUNCE];
+static unsigned int nr_bounce;
+
+int writev_exact(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec local[iovcnt];
+    int idx = 0;
+    ssize_t len;
+
+    memcpy(local, iov, sizeof(local));
+
+    while ( idx < iovcnt )
+    {
+        len = writev(fd, &local[idx], iovcnt - idx > IOV_MAX ? IOV_MAX
+                                                             : iovcnt - idx);
+        if ( len == -1 && errno == EINTR )
+            continue;
+        if ( len <= 0 )
+            return -1;
+
+        while ( idx < iovcnt && len >= local[idx].iov_len )
+            len -= local[idx++].iov_len;
+        if ( len )
+        {
+            local[idx].iov_base += len;
+            local[idx].iov_len -= len;
+        }
+    }
+
+    return 0;
+}
+
+static void release(struct xc_sr_pipeline_batch *pb)
+{
+    struct test_batch *b = (struct test_batch *)pb;
+
+    pthread_mutex_lock(&release_lock);
+    nr_released++;
+    if ( pb->written )
+        nr_written++;
+    if ( b->bounce && b->nr_pages == BATCH_PAGES && nr_bounce < NR_BOUNCE )
+    {
+        bounce_pool[nr_bounce++] = b->bounce;
+        b->bounce = NULL;
+    }
+    pthread_mutex_unlock(&release_lock);
+
+    free(b->bounce);
+    free(b);
+}
+
+static struct test_batch *new_batch(uint64_t seq, unsigned int nr_pages,
+                                    char *data)
+{
+    struct test_batch *b = calloc(1, sizeof(*b));
+    unsigned int i;
+
+    assert(b);
+    b->pb.iov = b->iov;
+    b->pb.release = release;
+    b->seq = seq;
+    b->nr_pages = nr_pages;
+    b->iov[0].iov_base = &b->seq;
+    b->iov[0].iov_len = sizeof(b->seq);
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        b->iov[i + 1].iov_base = data + i * PAGE_SIZE;
+        b->iov[i + 1].iov_len = PAGE_SIZE;
+    }
+    b->pb.iovcnt = nr_pages + 1;
+
+    return b;
+}
+
+/* Stamp each page with the sequence number, from a local copy. */
+static int transform_stamp(struct xc_sr_pipeline_batch *pb, void *arg)
+{
+    struct test_batch *b = (struct test_batch *)pb;
+    unsigned int i;
+
+    if ( b->seq == fail_seq )
+    {
+        errno = EILSEQ;
+        return -1;
+    }
+
+    b->bounce = malloc(b->nr_pages * PAGE_SIZE);
+    if ( !b->bounce )
+        return -1;
+
+    /* Vary the time spent, so workers complete out of order. */
+    if ( b->seq % 3 == 0 )
+        usleep(100);
+
+    for ( i = 0; i < b->nr_pages; i++ )
+    {
+        memset(b->bounce + i * PAGE_SIZE, (uint8_t)b->seq, PAGE_SIZE);
+        b->iov[i + 1].iov_base = b->bounce + i * PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/* Copy the pages to a local buffer, similar to normalising them. */
+static int transform_copy(struct xc_sr_pipeline_batch *pb, void *arg)
+{
+    struct test_batch *b = (struct test_batch *)pb;
+    unsigned int i;
+
+    pthread_mutex_lock(&release_lock);
+    if ( b->nr_pages == BATCH_PAGES && nr_bounce )
+        b->bounce = bounce_pool[--nr_bounce];
+    pthread_mutex_unlock(&release_lock);
+
+    if ( !b->bounce )
+        b->bounce = malloc(b->nr_pages * PAGE_SIZE);
+    if ( !b->bounce )
+        return -1;
+
+    for ( i = 0; i < b->nr_pages; i++ )
+    {
+        memcpy(b->bounce + i * PAGE_SIZE, b->iov[i + 1].iov_base, PAGE_SIZE);
+        b->iov[i + 1].iov_base = b->bounce + i * PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static void test_order(unsigned int nr_workers)
+{
+    struct xc_sr_pipeline p;
+    const unsigned int nr_batches = 200, nr_pages = 4;
+    static char page[PAGE_SIZE * 4];
+    char buf[PAGE_SIZE];
+    FILE *f = tmpfile();
+    uint64_t seq;
+    unsigned int i, j;
+
+    assert(f);
+    nr_released = nr_written = 0;
+
+    assert(!xc_sr_pipeline_init(&p, fileno(f), 8, nr_workers,
+                                transform_stamp, NULL));
+    for ( i = 0; i < nr_batches; i++ )
+        assert(!xc_sr_pipeline_submit(&p,
+                                      &new_batch(i, nr_pages, page)->pb));
+    assert(!xc_sr_pipeline_drain(&p));
+    xc_sr_pipeline_destroy(&p);
+    assert(nr_released == nr_batches && nr_written == nr_batches);
+
+    rewind(f);
+    for ( i = 0; i < nr_batches; i++ )
+    {
+        assert(fread(&seq, sizeof(seq), 1, f) == 1);
+        assert(seq == i);
+        for ( j = 0; j < nr_pages; j++ )
+        {
+            assert(fread(buf, PAGE_SIZE, 1, f) == 1);
+            assert(buf[0] == (char)i && buf[PAGE_SIZE - 1] == (char)i);
+        }
+    }
+    assert(fread(buf, 1, 1, f) == 0);
+
+    fclose(f);
+}
+
+static void test_error(unsigned int nr_workers)
+{
+    struct xc_sr_pipeline p;
+    static char page[PAGE_SIZE];
+    int fd = open("/dev/null", O_WRONLY);
+    unsigned int i, submitted = 0;
+    int rc = 0;
+
+    assert(fd >= 0);
+    nr_released = nr_written = 0;
+    fail_seq = 5;
+
+    assert(!xc_sr_pipeline_init(&p, fd, 4, nr_workers, transform_stamp,
+                                NULL));
+    for ( i = 0; i < 100 && !rc; i++ )
+    {
+        rc = xc_sr_pipeline_submit(&p, &new_batch(i, 1, page)->pb);
+        submitted++;
+    }
+    if ( !rc )
+        rc = xc_sr_pipeline_drain(&p);
+    assert(rc && errno == EILSEQ);
+    xc_sr_pipeline_destroy(&p);
+    assert(nr_released == submitted);
+    /* Only batches ahead of the failing one can have been written. */
+    assert(nr_written <= fail_seq);
+
+    fail_seq = ~0ULL;
+    close(fd);
+}
+
+/* Fill a page with data of the given kind, seeded by n. */
+static void fill_page(uint8_t *page, unsigned int kind, unsigned int n)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    unsigned int i;
+
+    switch ( kind )
+    {
+    case 0: /* Zeroes. */
+        memset(page, 0, PAGE_SIZE);
+        break;
+
+    case 1: /* Random, incompressible. */
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            page[i] = rand();
+        break;
+
+    case 2: /* Text. */
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            page[i] = text[(i + n) % (sizeof(text) - 1)];
+        break;
+
+    case 3: /* Short period pattern, overlapping matches. */
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            page[i] = (i % (1 + n % 7)) + n;
+        break;
+
+    case 4: /* Mostly zero with some random words. */
+        memset(page, 0, PAGE_SIZE);
+        for ( i = 0; i < 16; i++ )
+            page[rand() % PAGE_SIZE] = rand();
+        break;
+
+    default: /* Random runs of random bytes. */
+        for ( i = 0; i < PAGE_SIZE; )
+        {
+            unsigned int len = 1 + rand() % 300;
+            uint8_t c = rand();
+
+            for ( ; len && i < PAGE_SIZE; len--, i++ )
+                page[i] = (rand() % 4) ? c : rand();
+        }
+        break;
+    }
+}
+
+static void test_compress(void)
+{
+    const unsigned int nr_pages = BATCH_PAGES;
+    uint8_t *pages = malloc(nr_pages * PAGE_SIZE);
+    uint8_t *buf = malloc(nr_pages * PAGE_SIZE);
+    uint8_t *data = malloc(nr_pages * PAGE_SIZE);
+    uint8_t *out = malloc(nr_pages * PAGE_SIZE);
+    void *ptrs[BATCH_PAGES];
+    uint32_t enc[BATCH_PAGES];
+    struct iovec iov[BATCH_PAGES];
+    struct xc_sr_compress_stats stats = { 0 };
+    unsigned int i, iovcnt, round;
+    size_t len;
+
+    assert(pages && buf && data && out);
+    srand(1);
+
+    for ( round = 0; round < 20; round++ )
+    {
+        for ( i = 0; i < nr_pages; i++ )
+        {
+            ptrs[i] = pages + i * PAGE_SIZE;
+
+            /* Every eighth page duplicates an earlier one. */
+            if ( i && i % 8 == 7 )
+                memcpy(ptrs[i], ptrs[rand() % i], PAGE_SIZE);
+            else
+                fill_page(ptrs[i], (i + round) % 7, i);
+        }
+
+        iovcnt = xc_sr_compress_pages(ptrs, nr_pages, enc, iov, buf, &stats);
+        assert(iovcnt <= nr_pages);
+
+        for ( i = 0, len = 0; i < iovcnt; len += iov[i++].iov_len )
+            memcpy(data + len, iov[i].iov_base, iov[i].iov_len);
+        assert(xc_sr_compressed_length(enc, nr_pages) == len);
+
+        memset(out, 0xaa, nr_pages * PAGE_SIZE);
+        assert(xc_sr_decompress_pages(enc, nr_pages, data, out) == 0);
+        assert(!memcmp(out, pages, nr_pages * PAGE_SIZE));
+    }
+
+    assert(stats.nr_zero && stats.nr_dup && stats.nr_lz4 && stats.nr_raw);
+    assert(stats.bytes_out < stats.bytes_in);
+
+    /* Invalid encodings. */
+    enc[0] = (PAGE_DATA_ENC_DUP << PAGE_DATA_ENC_SHIFT) | 0;
+    assert(xc_sr_compressed_length(enc, 1) == -1);
+    enc[0] = (PAGE_DATA_ENC_LZ4 << PAGE_DATA_ENC_SHIFT) | PAGE_SIZE;
+    assert(xc_sr_compressed_length(enc, 1) == -1);
+    enc[0] = 0xf << PAGE_DATA_ENC_SHIFT;
+    assert(xc_sr_compressed_length(enc, 1) == -1);
+
+    /* Truncated LZ4 data fails to decode. */
+    fill_page(pages, 2, 0);
+    ptrs[0] = pages;
+    assert(xc_sr_compress_pages(ptrs, 1, enc, iov, buf, NULL) == 1);
+    assert((enc[0] >> PAGE_DATA_ENC_SHIFT) == PAGE_DATA_ENC_LZ4);
+    enc[0]--;
+    assert(xc_sr_decompress_pages(enc, 1, buf, out) == 1);
+
+    printf("Compression: %llu zero, %llu dup, %llu lz4, %llu raw, "
+           "%llu -> %llu bytes\n",
+           (unsigned long long)stats.nr_zero, (unsigned long long)stats.nr_dup,
+           (unsigned long long)stats.nr_lz4, (unsigned long long)stats.nr_raw,
+           (unsigned long long)stats.bytes_in,
+           (unsigned long long)stats.bytes_out);
+
+    free(out);
+    free(data);
+    free(buf);
+    free(pages);
+}
+
+struct test_work
+{
+    struct xc_sr_work work;
+    unsigned int seq;
+    void *dst, *src;
+};
+
+static unsigned int nr_run;
+
+static int work_count(struct xc_sr_work *work)
+{
+    struct test_work *w = (struct test_work *)work;
+
+    if ( w->seq == fail_seq )
+    {
+        errno = EILSEQ;
+        return -1;
+    }
+
+    if ( w->seq % 5 == 0 )
+        usleep(50);
+
+    pthread_mutex_lock(&release_lock);
+    nr_run++;
+    pthread_mutex_unlock(&release_lock);
+
+    return 0;
+}
+
+static void work_release(struct xc_sr_work *work)
+{
+    struct test_work *w = (struct test_work *)work;
+
+    pthread_mutex_lock(&release_lock);
+    nr_released++;
+    pthread_mutex_unlock(&release_lock);
+
+    free(w->src);
+    free(w);
+}
+
+static struct xc_sr_work *new_work(unsigned int seq)
+{
+    struct test_work *w = calloc(1, sizeof(*w));
+
+    assert(w);
+    w->work.fn = work_count;
+    w->work.release = work_release;
+    w->seq = seq;
+
+    return &w->work;
+}
+
+static void test_workqueue(unsigned int nr_threads)
+{
+    struct xc_sr_workqueue wq;
+    unsigned int i, queued = 0;
+    int rc = 0;
+
+    nr_run = nr_released = 0;
+    assert(!xc_sr_workqueue_init(&wq, nr_threads, 2 * nr_threads));
+    for ( i = 0; i < 500; i++ )
+        assert(!xc_sr_workqueue_queue(&wq, new_work(i)));
+    assert(!xc_sr_workqueue_flush(&wq));
+    assert(nr_run == 500 && nr_released == 500);
+
+    /* Flushing an idle queue doesn't block. */
+    assert(!xc_sr_workqueue_flush(&wq));
+    xc_sr_workqueue_destroy(&wq);
+
+    /* After a failure remaining items are released without running. */
+    nr_run = nr_released = 0;
+    fail_seq = 5;
+    assert(!xc_sr_workqueue_init(&wq, nr_threads, 2));
+    for ( i = 0; i < 100 && !rc; i++ )
+    {
+        rc = xc_sr_workqueue_queue(&wq, new_work(i));
+        queued++;
+    }
+    if ( !rc )
+        rc = xc_sr_workqueue_flush(&wq);
+    assert(rc && errno == EILSEQ);
+    xc_sr_workqueue_destroy(&wq);
+    assert(nr_released == queued && nr_run < queued);
+    fail_seq = ~0ULL;
+}
+
+static int work_copy(struct xc_sr_work *work)
+{
+    struct test_work *w = (struct test_work *)work;
+
+    memcpy(w->dst, w->src, w->seq * PAGE_SIZE);
+
+    return 0;
+}
+
+static int read_exact(int fd, void *data, size_t size)
+{
+    ssize_t len;
+
+    while ( size )
+    {
+        len = read(fd, data, size);
+        if ( len == -1 && errno == EINTR )
+            continue;
+        if ( len <= 0 )
+            return -1;
+        data += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Restore a stream of page batches from fd into the guest memory image,
+ * copying on the reading thread or with a workqueue of the given number of
+ * threads, as xc_domain_restore() does.
+ */
+static double run_restore_bench(int fd, unsigned long nr_pages,
+                                unsigned int threads)
+{
+    struct xc_sr_workqueue wq;
+    struct timespec t1, t2;
+    struct test_work *w;
+    unsigned long pfn;
+    unsigned int n;
+
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if ( threads )
+        assert(!xc_sr_workqueue_init(&wq, threads, 2 * threads));
+
+    for ( pfn = 0; pfn < nr_pages; pfn += n )
+    {
+        n = nr_pages - pfn < BATCH_PAGES ? nr_pages - pfn : BATCH_PAGES;
+
+        w = calloc(1, sizeof(*w));
+        assert(w);
+        w->work.fn = work_copy;
+        w->work.release = work_release;
+        w->seq = n;
+        w->dst = image + pfn * PAGE_SIZE;
+        w->src = malloc(n * PAGE_SIZE);
+        assert(w->src);
+        assert(!read_exact(fd, w->src, n * PAGE_SIZE));
+
+        if ( threads )
+            assert(!xc_sr_workqueue_queue(&wq, &w->work));
+        else
+        {
+            assert(!work_copy(&w->work));
+            work_release(&w->work);
+        }
+    }
+
+    if ( threads )
+    {
+        assert(!xc_sr_workqueue_flush(&wq));
+        xc_sr_workqueue_destroy(&wq);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    return (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+}
+
+static void restore_benchmark(unsigned long size_mb)
+{
+    static const unsigned int threads[] = { 0, 1, 2, 4, 8 };
+    unsigned long nr_pages = size_mb << (20 - 12), pfn;
+    unsigned int i;
+    double secs;
+    FILE *f = tmpfile();
+    char *page = malloc(PAGE_SIZE);
+
+    assert(f && page);
+    image = malloc(nr_pages * PAGE_SIZE);
+    assert(image);
+    /* Touch the guest image, as populating it isn't part of the copy. */
+    memset(image, 0, nr_pages * PAGE_SIZE);
+
+    for ( pfn = 0; pfn < nr_pages; pfn++ )
+    {
+        memset(page, (uint8_t)pfn, PAGE_SIZE);
+        assert(fwrite(page, PAGE_SIZE, 1, f) == 1);
+    }
+    assert(!fflush(f));
+
+    printf("Restoring %lu MiB synthetic image from a file:\n", size_mb);
+    for ( i = 0; i < sizeof(threads) / sizeof(threads[0]); i++ )
+    {
+        secs = run_restore_bench(fileno(f), nr_pages, threads[i]);
+        assert(image[(nr_pages - 1) * PAGE_SIZE] == (char)(nr_pages - 1));
+        printf("  threads %u: %.3f s, %.2f GiB/s\n", threads[i], secs,
+               size_mb / 1024.0 / secs);
+    }
+
+    free(image);
+    free(page);
+    fclose(f);
+}
+
+/*
+ * Simulate live migration of a guest with nr_pages of memory over a link
+ * sending link_rate pages/s.  The guest dirties dirty_rate pages/s, less the
+ * throttle, out of a working set of wss pages.
+ *
+ * @returns the number of pages left for the stop-and-copy phase.
+ */
+static unsigned long simulate_precopy(struct xc_sr_precopy *p,
+                                      unsigned long nr_pages,
+                                      unsigned long link_rate,
+                                      unsigned long dirty_rate,
+                                      unsigned long wss,
+                                      unsigned int *nr_rounds)
+{
+    struct precopy_stats stats = { .dirty_count = nr_pages };
+    uint64_t now = 1000000000ULL, ns;
+    unsigned long dirty;
+
+    for ( ; ; )
+    {
+        if ( xc_sr_precopy_decide(p, stats, now) != XGS_POLICY_CONTINUE_PRECOPY )
+            break;
+
+        ns = stats.dirty_count * 1000000000ULL / link_rate;
+        now += ns;
+
+        stats.iteration++;
+        stats.total_written += stats.dirty_count;
+        stats.dirty_count = -1;
+        if ( xc_sr_precopy_decide(p, stats, now) != XGS_POLICY_CONTINUE_PRECOPY )
+        {
+            stats.dirty_count = 0;
+            break;
+        }
+
+        dirty = (uint64_t)dirty_rate * (100 - p->throttle) / 100 * ns /
+                1000000000ULL;
+        stats.dirty_count = MIN(dirty, wss);
+    }
+
+    *nr_rounds = stats.iteration;
+
+    return stats.dirty_count;
+}
+
+static void test_precopy(void)
+{
+    struct xc_sr_precopy p;
+    unsigned long left;
+    unsigned int rounds;
+
+    /* 1 GiB guest, 100k pages/s link. */
+
+    /* Idle guest: converges after a few rounds, without throttling. */
+    xc_sr_precopy_init(&p, 300, false);
+    left = simulate_precopy(&p, 262144, 100000, 1000, 262144, &rounds);
+    assert(left * 1000 / 100000 <= 300 && !p.throttle);
+    printf("Precopy idle guest: %u rounds, %lu pages left\n", rounds, left);
+
+    /* Small working set: fits the budget once the working set is reached. */
+    xc_sr_precopy_init(&p, 300, false);
+    left = simulate_precopy(&p, 262144, 100000, 500000, 20000, &rounds);
+    assert(left == 20000 && rounds < 5 && !p.throttle);
+
+    /* Dirtying faster than the link: gives up after a couple of rounds. */
+    xc_sr_precopy_init(&p, 300, false);
+    left = simulate_precopy(&p, 262144, 100000, 200000, 262144, &rounds);
+    assert(left * 1000 / 100000 > 300 && rounds <= 4 && !p.throttle);
+    printf("Precopy busy guest: %u rounds, %lu pages left\n", rounds, left);
+
+    /* Same with auto-convergence: throttled until within budget. */
+    xc_sr_precopy_init(&p, 300, true);
+    left = simulate_precopy(&p, 262144, 100000, 200000, 262144, &rounds);
+    assert(left * 1000 / 100000 <= 300 && p.throttle);
+    printf("Precopy busy guest, auto-converge: %u rounds, %lu pages left, "
+           "throttle %u%%\n", rounds, left, p.throttle);
+
+    /* Unreachable budget: gives up at the maximum throttle. */
+    xc_sr_precopy_init(&p, 0, true);
+    left = simulate_precopy(&p, 262144, 100000, 20000000, 262144, &rounds);
+    assert(left > 50 && p.throttle == 95 && rounds < 30);
+}
+
+/*
+ * Threads as for XCFLAGS_PIPELINE(): 0 writes synchronously, otherwise a
+ * writer thread and threads - 1 workers are used.  Without workers the
+ * pages are copied on the submitting thread.
+ */
+static double run_bench(int fd, unsigned long nr_pages, unsigned int threads)
+{
+    struct xc_sr_pipeline p;
+    struct timespec t1, t2;
+    struct test_batch *b;
+    unsigned long pfn;
+    unsigned int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if ( threads )
+        assert(!xc_sr_pipeline_init(&p, fd, 2 * threads + 2, threads - 1,
+                                    threads > 1 ? transform_copy : NULL,
+                                    NULL));
+
+    for ( pfn = 0; pfn < nr_pages; pfn += n )
+    {
+        n = nr_pages - pfn < BATCH_PAGES ? nr_pages - pfn : BATCH_PAGES;
+        b = new_batch(pfn, n, image + pfn * PAGE_SIZE);
+
+        if ( threads <= 1 )
+            assert(!transform_copy(&b->pb, NULL));
+
+        if ( threads )
+            assert(!xc_sr_pipeline_submit(&p, &b->pb));
+        else
+        {
+            assert(!writev_exact(fd, b->iov, b->pb.iovcnt));
+            release(&b->pb);
+        }
+    }
+
+    if ( threads )
+    {
+        assert(!xc_sr_pipeline_drain(&p));
+        xc_sr_pipeline_destroy(&p);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    return (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+}
+
+static void benchmark(unsigned long size_mb)
+{
+    static const unsigned int threads[] = { 0, 1, 2, 4, 8 };
+    unsigned long nr_pages = size_mb << (20 - 12);
+    unsigned int i;
+    double secs;
+    int fd = open("/dev/null", O_WRONLY);
+
+    assert(fd >= 0);
+    image = malloc(nr_pages * PAGE_SIZE);
+    assert(image);
+    memset(image, 0x5a, nr_pages * PAGE_SIZE);
+
+    printf("Saving %lu MiB synthetic image to /dev/null:\n", size_mb);
+    for ( i = 0; i < sizeof(threads) / sizeof(threads[0]); i++ )
+    {
+        secs = run_bench(fd, nr_pages, threads[i]);
+        printf("  threads %u: %.2f GiB/s\n", threads[i],
+               size_mb / 1024.0 / secs);
+    }
+
+    while ( nr_bounce )
+        free(bounce_pool[--nr_bounce]);
+    free(image);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int w;
+
+    for ( w = 1; w <= 4; w++ )
+    {
+        test_order(w);
+        test_error(w);
+    }
+    printf("Pipeline tests passed\n");
+
+    test_compress();
+    printf("Compression tests passed\n");
+
+    for ( w = 1; w <= 4; w++ )
+        test_workqueue(w);
+    printf("Workqueue tests passed\n");
+
+    test_precopy();
+    printf("Precopy policy tests passed\n");
+
+    if ( argc > 1 && !strcmp(argv[1], "-b") )
+        benchmark(argc > 2 ? strtoul(argv[2], NULL, 0) : 1024);
+
+    if ( argc > 1 && !strcmp(argv[1], "-r") )
+        restore_benchmark(argc > 2 ? strtoul(argv[2], NULL, 0) : 1024);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,72 @@
+/*
+ * Emulation of the hypervisor environment needed by the timer wheel code,
+ * for testing and benchmarking it in userspace.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_TIMER_WHEEL_
+#define _TEST_TIMER_WHEEL_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+#define smp_wmb()
+#define ASSERT(x) assert(x)
+#define prefetch(x) __builtin_prefetch(x)
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+typedef int64_t s_time_t;
+#define STIME_MAX INT64_MAX
+
+static inline unsigned int ffs64(uint64_t x)
+{
+    return __builtin_ffsll(x);
+}
+
+#include "list.h"
+
+/* The fields of the hypervisor's struct timer the wheel and heap use. */
+struct timer {
+    s_time_t expires;
+    union {
+        unsigned int heap_offset;
+        struct list_head wheel_elem;
+    };
+#define TIMER_STATUS_inactive 1
+#define TIMER_STATUS_in_heap  3
+#define TIMER_STATUS_in_wheel 5
+    uint8_t status;
+    uint8_t wheel_level;
+};
+
+#include "timer-wheel.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,425 @@
+/*
+ * Unit tests and benchmark for the timer wheel.
+ *
+ * Timers are set, stopped and run at random times on a CPU's timers, kept as
+ * timer.c does on the wheel and on a heap, checking after every step that no
+ * timer runs early, none is left behind once due, and the deadline the timer
+ * hardware would be programmed with comes no later than any pending timer.
+ * The benchmark measures setting timers which are already pending, as when a
+ * periodic timer gets reprogrammed or a timeout pushed back, and running
+ * periodic timers, with and without the wheel, for increasing numbers of
+ * pending timers.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "emul.h"
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+#define NR_TIMERS     10000
+#define NR_TEST       1000
+#define MILLISECS(ms) ((s_time_t)(ms) * 1000000)
+
+static struct timer timers[NR_TIMERS];
+static s_time_t periods[NR_TIMERS];
+
+/* A CPU's timers, as timer.c keeps them, but for the overflow list. */
+static struct timers {
+    struct timer *heap[NR_TIMERS + 1];
+    unsigned int size;
+    struct timer_wheel wheel;
+    bool use_wheel;
+    s_time_t now;
+} ts;
+
+/* The reference: timer.c's heap. */
+static void down_heap(unsigned int pos)
+{
+    struct timer **heap = ts.heap, *t = heap[pos];
+    unsigned int sz = ts.size, nxt;
+
+    while ( (nxt = (pos << 1)) <= sz )
+    {
+        if ( ((nxt+1) <= sz) && (heap[nxt+1]->expires < heap[nxt]->expires) )
+            nxt++;
+        if ( heap[nxt]->expires > t->expires )
+            break;
+        heap[pos] = heap[nxt];
+        heap[pos]->heap_offset = pos;
+        pos = nxt;
+    }
+
+    heap[pos] = t;
+    t->heap_offset = pos;
+}
+
+static void up_heap(unsigned int pos)
+{
+    struct timer **heap = ts.heap, *t = heap[pos];
+
+    while ( (pos > 1) && (t->expires < heap[pos>>1]->expires) )
+    {
+        heap[pos] = heap[pos>>1];
+        heap[pos]->heap_offset = pos;
+        pos >>= 1;
+    }
+
+    heap[pos] = t;
+    t->heap_offset = pos;
+}
+
+static void remove_from_heap(struct timer *t)
+{
+    unsigned int pos = t->heap_offset;
+
+    if ( pos == ts.size )
+    {
+        ts.size--;
+        return;
+    }
+
+    ts.heap[pos] = ts.heap[ts.size--];
+    ts.heap[pos]->heap_offset = pos;
+
+    if ( (pos > 1) && (ts.heap[pos]->expires < ts.heap[pos>>1]->expires) )
+        up_heap(pos);
+    else
+        down_heap(pos);
+}
+
+static bool add_to_heap(struct timer *t)
+{
+    ts.heap[++ts.size] = t;
+    up_heap(ts.size);
+
+    return t->heap_offset == 1;
+}
+
+/* As add_entry() and remove_entry() in timer.c. */
+static bool add_entry(struct timer *t)
+{
+    if ( ts.use_wheel )
+    {
+        int lvl;
+
+        if ( timer_wheel_empty(&ts.wheel) )
+            ts.wheel.clk = max(ts.wheel.clk, ts.now);
+
+        lvl = timer_wheel_level(&ts.wheel, t->expires);
+        if ( lvl >= 0 )
+        {
+            t->status = TIMER_STATUS_in_wheel;
+            return timer_wheel_add(&ts.wheel, t, lvl);
+        }
+    }
+
+    t->status = TIMER_STATUS_in_heap;
+    return add_to_heap(t);
+}
+
+static void remove_entry(struct timer *t)
+{
+    if ( t->status == TIMER_STATUS_in_wheel )
+        timer_wheel_del(&ts.wheel, t);
+    else
+        remove_from_heap(t);
+
+    t->status = TIMER_STATUS_inactive;
+}
+
+/* Return TRUE if the timer softirq needs raising. */
+static bool set_timer(struct timer *t, s_time_t expires)
+{
+    if ( t->status != TIMER_STATUS_inactive )
+        remove_entry(t);
+    t->expires = expires;
+
+    return add_entry(t);
+}
+
+static void init_timers(bool use_wheel)
+{
+    unsigned int i;
+
+    memset(&ts, 0, sizeof(ts));
+    timer_wheel_init(&ts.wheel);
+    ts.use_wheel = use_wheel;
+    ts.now = MILLISECS(1000);
+
+    for ( i = 0; i < NR_TIMERS; i++ )
+        timers[i].status = TIMER_STATUS_inactive;
+}
+
+/*
+ * Run the timers due at @now, as timer_softirq_action() does, calling @fn
+ * for each.  Return the deadline the timer hardware would be programmed with.
+ */
+static s_time_t run_timers(s_time_t now, void (*fn)(struct timer *t))
+{
+    LIST_HEAD(cascade);
+    struct timer *t;
+    s_time_t deadline;
+
+    ts.now = now;
+
+    timer_wheel_collect(&ts.wheel, now, &cascade);
+    while ( !list_empty(&cascade) )
+    {
+        t = list_first_entry(&cascade, struct timer, wheel_elem);
+        list_del(&t->wheel_elem);
+        add_entry(t);
+    }
+
+    while ( ts.size && (t = ts.heap[1])->expires < now )
+    {
+        remove_from_heap(t);
+        t->status = TIMER_STATUS_inactive;
+        fn(t);
+    }
+
+    deadline = timer_wheel_next(&ts.wheel);
+    if ( ts.size && ts.heap[1]->expires < deadline )
+        deadline = ts.heap[1]->expires;
+
+    return deadline;
+}
+
+static void check_run(struct timer *t)
+{
+    EXPECT(t->expires < ts.now);
+}
+
+/* No timer may be overdue, nor expire before the deadline. */
+static void check(s_time_t deadline)
+{
+    unsigned int i, nr = 0;
+
+    for ( i = 0; i < NR_TEST; i++ )
+    {
+        const struct timer *t = &timers[i];
+
+        if ( t->status == TIMER_STATUS_inactive )
+            continue;
+
+        nr++;
+        EXPECT(t->expires >= ts.now);
+        EXPECT(t->expires >= deadline);
+        if ( t->status == TIMER_STATUS_in_heap )
+            EXPECT(ts.heap[t->heap_offset] == t);
+        else
+            EXPECT(!list_empty(&timer_wheel_bucket(&ts.wheel, t)->timers));
+    }
+
+    EXPECT(nr >= ts.size);
+    EXPECT(!timer_wheel_empty(&ts.wheel) == (nr > ts.size));
+}
+
+static s_time_t random_time(s_time_t max)
+{
+    return (((s_time_t)rand() << 31) | rand()) % max;
+}
+
+/* Expiry times from the past to well beyond the wheel. */
+static s_time_t random_expiry(void)
+{
+    switch ( rand() % 5 )
+    {
+    case 0:  return ts.now - random_time(MILLISECS(1));
+    case 1:  return ts.now + random_time(MILLISECS(1));
+    case 2:  return ts.now + random_time(MILLISECS(20));
+    case 3:  return ts.now + random_time(MILLISECS(1000));
+    default: return ts.now + random_time(MILLISECS(6000));
+    }
+}
+
+static void test_random(unsigned int nr_ops)
+{
+    s_time_t deadline = STIME_MAX, now;
+    struct timer *t;
+    unsigned int op;
+
+    init_timers(true);
+
+    for ( op = 0; op < nr_ops; op++ )
+    {
+        t = &timers[rand() % NR_TEST];
+
+        switch ( rand() % 8 )
+        {
+        case 0 ... 3: /* Set, or set again. */
+            if ( set_timer(t, random_expiry()) )
+                deadline = run_timers(ts.now, check_run);
+            break;
+
+        case 4: /* Stop. */
+            if ( t->status != TIMER_STATUS_inactive )
+                remove_entry(t);
+            break;
+
+        case 5 ... 6: /* The timer interrupt, at the deadline or a bit later. */
+            if ( deadline == STIME_MAX )
+                break;
+            now = max(deadline, ts.now) + 1 + rand() % 1000;
+            deadline = run_timers(now, check_run);
+            break;
+
+        case 7: /* Something else, e.g. a softirq, sometimes much later. */
+            now = ts.now + (rand() % 64 ? random_time(MILLISECS(1))
+                                        : random_time(MILLISECS(10000)));
+            deadline = run_timers(now, check_run);
+            break;
+        }
+
+        check(deadline);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Periods of 1 to 10ms, as of vLAPIC, vPT and scheduler timers. */
+static s_time_t period(unsigned long i)
+{
+    return MILLISECS(1) + (i * 2654435761UL) % MILLISECS(9);
+}
+
+static unsigned long nr_run;
+
+static void run_periodic(struct timer *t)
+{
+    t->expires += periods[t - timers];
+    add_entry(t);
+    nr_run++;
+}
+
+/*
+ * Per operation times of setting pending timers again, and of running
+ * periodic timers, with n timers pending.
+ */
+static void bench_timers(bool use_wheel, unsigned int n, unsigned long nr,
+                         double *set, double *run)
+{
+    unsigned long j;
+    unsigned int i;
+    double t0, t1, t2;
+
+    init_timers(use_wheel);
+    for ( i = 0; i < n; i++ )
+    {
+        periods[i] = period(i);
+        set_timer(&timers[i], ts.now + periods[i]);
+    }
+
+    t0 = now();
+    for ( j = 0; j < nr; j++ )
+        set_timer(&timers[(j * 40503UL) % n], ts.now + period(j));
+    t1 = now();
+    for ( nr_run = 0; nr_run < nr; )
+        ts.now = run_timers(ts.now, run_periodic) + 1;
+    t2 = now();
+
+    *set = (t1 - t0) / nr;
+    *run = (t2 - t1) / nr_run;
+}
+
+static void bench(void)
+{
+    static const unsigned int sizes[] = { 100, 1000, 10000 };
+    unsigned int i;
+
+    printf("%7s  %21s  %21s\n", "", "wheel (ns per op)", "heap (ns per op)");
+    printf("%7s  %10s %10s  %10s %10s\n",
+           "timers", "set", "run", "set", "run");
+
+    for ( i = 0; i < ARRAY_SIZE(sizes); i++ )
+    {
+        unsigned long nr = 1UL << 20;
+        double wset, wrun, hset, hrun;
+
+        bench_timers(true, sizes[i], nr, &wset, &wrun);
+        bench_timers(false, sizes[i], nr, &hset, &hrun);
+
+        printf("%7u  %10.1f %10.1f  %10.1f %10.1f\n",
+               sizes[i], wset, wrun, hset, hrun);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-b] [-n ops]\n"
+            "  -b  benchmark setting and running timers\n"
+            "  -n  random operations to test (default 200000)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_ops = 200000;
+    bool benchmark = false;
+    int c;
+
+    while ( (c = getopt(argc, argv, "bn:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'b':
+            benchmark = true;
+            break;
+        case 'n':
+            nr_ops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    srand(1);
+
+    test_random(nr_ops);
+    printf("timer-wheel: ok\n");
+
+    if ( benchmark )
+        bench();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
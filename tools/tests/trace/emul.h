@@ -0,0 +1,242 @@
+/*
+ * Emulation of the hypervisor environment needed by common/trace.c, for
+ * testing and benchmarking the trace buffer writer in userspace.
+ *
+ * All cpus are online and share a single thread.  The current cpu is
+ * selected with test_cpu, interrupts are emulated by test_interrupt_hook,
+ * which is called from get_cycles().
+ */
+
+#ifndef _TEST_TRACE_
+#define _TEST_TRACE_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xen-tools/common-macros.h>
+
+#include <xen/xen.h>
+#include <xen/sysctl.h>
+#include <xen/trace.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define __init
+#define __read_mostly
+#define __packed __attribute__((__packed__))
+#define cf_check
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define ASSERT(x) assert(x)
+#define BUG_ON(x) assert(!(x))
+#define WARN_ON(x) ((void)(x))
+#ifndef BUILD_BUG_ON
+#define BUILD_BUG_ON(x) _Static_assert(!(x), #x)
+#endif
+
+#define XENLOG_WARNING
+#define XENLOG_INFO
+
+extern bool test_verbose;
+#define printk(fmt, args...) \
+    ({ if ( test_verbose ) printf(fmt, ## args); })
+#define printk_once(fmt, args...) printk(fmt, ## args)
+
+#define integer_param(name, var)
+
+/* cpus */
+#define NR_CPUS 64
+
+typedef struct { uint64_t bits; } cpumask_t;
+typedef cpumask_t *cpumask_var_t;
+
+extern unsigned int test_cpu, nr_cpu_ids;
+extern cpumask_t cpu_online_map;
+
+#define smp_processor_id() test_cpu
+#define num_online_cpus() nr_cpu_ids
+#define for_each_online_cpu(cpu) for ( (cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++ )
+
+#define cpumask_setall(m) ((m)->bits = ~0ULL)
+#define cpumask_copy(d, s) (*(d) = *(s))
+#define cpumask_test_cpu(c, m) (((m)->bits >> (c)) & 1)
+#define free_cpumask_var(m) free(m)
+
+static inline int xenctl_bitmap_to_cpumask(cpumask_var_t *mask,
+                                           const struct xenctl_bitmap *bitmap)
+{
+    unsigned int i;
+
+    *mask = calloc(1, sizeof(**mask));
+    if ( !*mask )
+        return -ENOMEM;
+
+    for ( i = 0; i < bitmap->nr_bits && i < NR_CPUS; i++ )
+        if ( (bitmap->bitmap.p[i / 8] >> (i % 8)) & 1 )
+            (*mask)->bits |= 1ULL << i;
+
+    return 0;
+}
+
+/* IPIs run the function on the current cpu only, as there is no other. */
+#define on_selected_cpus(mask, fn, data, wait) ((void)(mask), (fn)(data))
+
+/* Per-cpu data */
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__##name[NR_CPUS]
+#define DEFINE_PER_CPU_READ_MOSTLY(type, name) DEFINE_PER_CPU(type, name)
+#define per_cpu(name, cpu) (per_cpu__##name[cpu])
+#define this_cpu(name) per_cpu(name, smp_processor_id())
+
+/* Memory, emulated with an arena of page frames, starting at mfn 1. */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define PFN_UP(x) (((x) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+
+#define TEST_ARENA_PAGES 4096
+
+struct page_info {
+    unsigned long count_info;
+};
+
+extern unsigned char *test_arena;
+extern unsigned int test_arena_used;
+extern struct page_info test_frame_table[];
+
+#define mfn_to_virt(mfn) ((void *)(test_arena + ((mfn) - 1) * PAGE_SIZE))
+#define virt_to_mfn(va) \
+    ((unsigned long)(((unsigned char *)(va) - test_arena) >> PAGE_SHIFT) + 1)
+#define virt_to_page(va) (&test_frame_table[virt_to_mfn(va)])
+
+#define MEMF_bits(n) 0
+
+enum XENSHARE_flags {
+    SHARE_rw,
+    SHARE_ro,
+};
+
+#define share_xen_page_with_privileged_guests(pg, flags) \
+    ((pg)->count_info = (flags) + 1)
+
+static inline unsigned int get_order_from_pages(unsigned long nr_pages)
+{
+    unsigned int order = 0;
+
+    while ( (1UL << order) < nr_pages )
+        order++;
+
+    return order;
+}
+
+static inline void *alloc_xenheap_pages(unsigned int order,
+                                        unsigned int memflags)
+{
+    void *p;
+
+    if ( test_arena_used + (1U << order) > TEST_ARENA_PAGES )
+        return NULL;
+
+    p = test_arena + (unsigned long)test_arena_used * PAGE_SIZE;
+    test_arena_used += 1U << order;
+
+    return p;
+}
+
+#define xmalloc_array(type, nr) ((type *)malloc(sizeof(type) * (nr)))
+#define xzalloc_array(type, nr) ((type *)calloc(nr, sizeof(type)))
+#define xfree(p) free(p)
+
+/* Barriers and atomics */
+#define barrier() __asm__ __volatile__ ( "" ::: "memory" )
+#define smp_mb() __sync_synchronize()
+#define smp_rmb() barrier()
+#define smp_wmb() barrier()
+#define cpu_relax() ((void)0)
+
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define read_atomic(p) ACCESS_ONCE(*(p))
+#define write_atomic(p, x) (ACCESS_ONCE(*(p)) = (x))
+#define cmpxchg(p, o, n) __sync_val_compare_and_swap(p, o, n)
+#define xchg(p, x) __atomic_exchange_n(p, x, __ATOMIC_SEQ_CST)
+#define arch_fetch_and_add(p, x) __sync_fetch_and_add(p, x)
+
+typedef bool spinlock_t;
+#define DEFINE_SPINLOCK(l) spinlock_t l
+#define spin_lock(l) (*(l) = true)
+#define spin_unlock(l) (*(l) = false)
+
+/* Context */
+struct domain {
+    domid_t domain_id;
+};
+
+struct vcpu {
+    unsigned int vcpu_id;
+    struct domain *domain;
+};
+
+extern struct vcpu *current;
+extern bool test_in_nmi;
+#define in_nmi_handler() test_in_nmi
+
+/* Called on every timestamp, to emulate interrupts at that point. */
+extern void (*test_interrupt_hook)(void);
+
+static inline uint64_t test_rdtsc(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t get_cycles(void)
+{
+    if ( unlikely(test_interrupt_hook) )
+        test_interrupt_hook();
+
+    return test_rdtsc();
+}
+
+/* Notification */
+struct tasklet {
+    void (*fn)(void *data);
+    void *data;
+};
+
+#define DECLARE_SOFTIRQ_TASKLET(name, func, arg) \
+    struct tasklet name = { .fn = func, .data = arg }
+
+extern unsigned int test_nr_notifications;
+#define tasklet_schedule(t) ((t)->fn((t)->data))
+#define send_global_virq(virq) ((void)(virq), test_nr_notifications++)
+
+#define CONFIG_TRACEBUFFER
+#include "xen-trace.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
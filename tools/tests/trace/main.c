@@ -0,0 +1,430 @@
+/*
+ * Unit tests and benchmark for the lock-free trace buffer writer.
+ *
+ * Records are written with trace() and read back through t_info the way
+ * xentrace does, checking that none are lost or corrupted without being
+ * accounted for in a lost records record, also when writers interrupt each
+ * other and with buffers of different sizes.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emul.h"
+
+bool test_verbose;
+unsigned int test_cpu, nr_cpu_ids = 4;
+cpumask_t cpu_online_map = { 0xf };
+unsigned char *test_arena;
+unsigned int test_arena_used;
+struct page_info test_frame_table[TEST_ARENA_PAGES + 1];
+bool test_in_nmi;
+void (*test_interrupt_hook)(void);
+unsigned int test_nr_notifications;
+
+static struct domain test_domain = { .domain_id = DOMID_IDLE };
+static struct vcpu test_vcpu = { .domain = &test_domain };
+struct vcpu *current = &test_vcpu;
+
+#define TEST_EVENT (TRC_GEN + 0x100)
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+/* Sequence numbers of the next record written and read, per cpu. */
+static uint32_t next_seq[NR_CPUS], expected_seq[NR_CPUS];
+
+static int tbuf_op(uint32_t cmd, uint32_t size, uint64_t cpus)
+{
+    struct xen_sysctl_tbuf_op op = { .cmd = cmd, .size = size };
+    uint8_t bitmap[sizeof(cpus)];
+    unsigned int i;
+
+    for ( i = 0; i < sizeof(bitmap); i++ )
+        bitmap[i] = cpus >> (i * 8);
+    set_xen_guest_handle(op.cpu_mask.bitmap, bitmap);
+    op.cpu_mask.nr_bits = sizeof(cpus) * 8;
+
+    return tb_control(&op);
+}
+
+static struct t_info *get_t_info(void)
+{
+    struct xen_sysctl_tbuf_op op = { .cmd = XEN_SYSCTL_TBUFOP_get_info };
+
+    EXPECT(!tb_control(&op));
+    EXPECT(op.buffer_mfn);
+
+    return mfn_to_virt(op.buffer_mfn);
+}
+
+/* Size of the buffer of a cpu, in pages, as published in t_info. */
+static unsigned int buf_pages(unsigned int cpu)
+{
+    struct t_info *ti = get_t_info();
+
+    if ( !ti->mfn_offset[cpu] )
+        return 0;
+
+    return ((uint32_t *)ti)[ti->mfn_offset[cpu] - 1];
+}
+
+/* Copy len octets at offset off of the data of a buffer, as consumers do. */
+static void read_data(unsigned int cpu, uint32_t off, void *dst, size_t len)
+{
+    struct t_info *ti = get_t_info();
+    const uint32_t *mfns = (uint32_t *)ti + ti->mfn_offset[cpu];
+    unsigned char *p = dst;
+
+    off += sizeof(struct t_buf);
+    while ( len )
+    {
+        size_t chunk = min(len, PAGE_SIZE - (off & ~PAGE_MASK));
+
+        memcpy(p, (unsigned char *)mfn_to_virt(mfns[off >> PAGE_SHIFT]) +
+               (off & ~PAGE_MASK), chunk);
+        p += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * Consume all records of a cpu, checking them.
+ *
+ * @returns the number of test records read.
+ */
+static unsigned int consume(unsigned int cpu)
+{
+    struct t_info *ti = get_t_info();
+    struct t_buf *buf = mfn_to_virt(((uint32_t *)ti)[ti->mfn_offset[cpu]]);
+    uint32_t data_size = buf_pages(cpu) * PAGE_SIZE - sizeof(*buf);
+    uint32_t cons = buf->cons, prod = buf->prod;
+    unsigned int nr = 0, i;
+
+    EXPECT(prod < 2 * data_size && cons < 2 * data_size);
+
+    while ( cons != prod )
+    {
+        uint32_t off = cons >= data_size ? cons - data_size : cons;
+        struct t_rec rec;
+        unsigned int size;
+        const uint32_t *extra;
+
+        read_data(cpu, off, &rec, sizeof(uint32_t));
+        size = sizeof(uint32_t) + (rec.cycles_included ? 8 : 0) +
+               rec.extra_u32 * sizeof(uint32_t);
+        EXPECT(off + size <= data_size);
+        read_data(cpu, off, &rec, size);
+        extra = rec.cycles_included ? rec.u.cycles.extra_u32
+                                    : rec.u.nocycles.extra_u32;
+
+        switch ( rec.event )
+        {
+        case TRC_TRACE_WRAP_BUFFER:
+            EXPECT(off + size == data_size);
+            break;
+
+        case TRC_LOST_RECORDS:
+            EXPECT(rec.cycles_included && rec.extra_u32 == 4);
+            EXPECT(extra[0]);
+            expected_seq[cpu] += extra[0];
+            break;
+
+        case TEST_EVENT:
+            EXPECT(rec.extra_u32);
+            EXPECT(extra[0] == expected_seq[cpu]);
+            for ( i = 1; i < rec.extra_u32; i++ )
+                EXPECT(extra[i] == (extra[0] ^ (i << 24) ^ cpu));
+            expected_seq[cpu]++;
+            nr++;
+            break;
+
+        default:
+            EXPECT(!"unexpected event");
+        }
+
+        cons += size;
+        if ( cons >= 2 * data_size )
+            cons -= 2 * data_size;
+    }
+
+    buf->cons = cons;
+
+    return nr;
+}
+
+/* Write a test record with n extra words on the current cpu. */
+static void write_rec(unsigned int n, bool cycles)
+{
+    uint32_t d[TRACE_EXTRA_MAX];
+    unsigned int i;
+
+    d[0] = next_seq[test_cpu]++;
+    for ( i = 1; i < n; i++ )
+        d[i] = d[0] ^ (i << 24) ^ test_cpu;
+
+    trace(TEST_EVENT | (cycles ? TRC_HD_CYCLE_FLAG : 0),
+          n * sizeof(uint32_t), d);
+}
+
+static void reset_seqs(void)
+{
+    memset(next_seq, 0, sizeof(next_seq));
+    memset(expected_seq, 0, sizeof(expected_seq));
+}
+
+static void test_records(void)
+{
+    unsigned int cpu, i, nr;
+
+    reset_seqs();
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        test_cpu = cpu;
+        nr = 0;
+        for ( i = 0; i < 20000; i++ )
+        {
+            write_rec(1 + i % TRACE_EXTRA_MAX, i & 1);
+            if ( i % 97 == 0 )
+                nr += consume(cpu);
+        }
+        nr += consume(cpu);
+        EXPECT(nr == 20000);
+        EXPECT(expected_seq[cpu] == next_seq[cpu]);
+    }
+
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+}
+
+static void test_lost(void)
+{
+    unsigned int i, nr, notifications = test_nr_notifications;
+
+    reset_seqs();
+    test_cpu = 1;
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+
+    /* Overflow the buffer, then write again after it has been drained. */
+    for ( i = 0; i < 10000; i++ )
+        write_rec(1 + i % TRACE_EXTRA_MAX, true);
+    EXPECT(test_nr_notifications == notifications + 1);
+
+    nr = consume(test_cpu);
+    EXPECT(nr < 10000);
+    EXPECT(expected_seq[test_cpu] == nr);
+
+    write_rec(2, false);
+    nr += consume(test_cpu);
+    EXPECT(expected_seq[test_cpu] == next_seq[test_cpu]);
+    EXPECT(nr < next_seq[test_cpu]);
+
+    /* No notifications from NMI context. */
+    test_in_nmi = true;
+    notifications = test_nr_notifications;
+    for ( i = 0; i < 10000; i++ )
+        write_rec(7, true);
+    EXPECT(test_nr_notifications == notifications);
+    test_in_nmi = false;
+    consume(test_cpu);
+
+    /* Disabling discards the lost records. */
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+    next_seq[test_cpu] = expected_seq[test_cpu];
+    write_rec(1, false);
+    EXPECT(consume(test_cpu) == 1);
+
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+}
+
+/*
+ * Write a record from every timestamp taken by a writer, as an interrupt
+ * handler would, nesting up to depth deep.
+ */
+static unsigned int nest_depth, nest_max, nr_nested;
+
+static void nest_hook(void)
+{
+    if ( nest_depth >= nest_max )
+        return;
+
+    nest_depth++;
+    nr_nested++;
+    write_rec(1 + nr_nested % TRACE_EXTRA_MAX, nr_nested & 1);
+    nest_depth--;
+}
+
+static void test_nested(void)
+{
+    unsigned int i, nr = 0;
+
+    reset_seqs();
+    test_cpu = 2;
+    nr_nested = 0;
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+
+    test_interrupt_hook = nest_hook;
+    for ( nest_max = 1; nest_max <= 3; nest_max++ )
+        for ( i = 0; i < 2000; i++ )
+        {
+            write_rec(1 + i % TRACE_EXTRA_MAX, true);
+            if ( i % 13 == 0 )
+                nr += consume(test_cpu);
+        }
+
+    /* Interrupting writers which run out of space. */
+    for ( i = 0; i < 2000; i++ )
+        write_rec(1 + i % TRACE_EXTRA_MAX, true);
+    test_interrupt_hook = NULL;
+
+    nr += consume(test_cpu);
+    write_rec(1, false);
+    nr += consume(test_cpu);
+
+    EXPECT(nr_nested);
+    EXPECT(expected_seq[test_cpu] == next_seq[test_cpu]);
+    EXPECT(nr <= next_seq[test_cpu]);
+
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+}
+
+static void test_resize(void)
+{
+    struct t_info *ti = get_t_info();
+    unsigned int cpu, nr;
+
+    /* Buffers can't be resized while tracing. */
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+    EXPECT(tbuf_op(XEN_SYSCTL_TBUFOP_set_cpu_size, 5, 1 << 1) == -EBUSY);
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_size, ti->tbuf_size, 0));
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_cpu_size, 5, 1 << 1));
+    ti = get_t_info();
+    EXPECT(ti->tbuf_size == 0);
+    EXPECT(buf_pages(0) == 2 && buf_pages(1) == 5);
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_cpu_size, 5, 1 << 1));
+
+    /* Enough cpus with large buffers need a second t_info page. */
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_cpu_size, 600, 0xc));
+    ti = get_t_info();
+    EXPECT(buf_pages(2) == 600 && buf_pages(3) == 600);
+    EXPECT(tbuf_op(XEN_SYSCTL_TBUFOP_set_cpu_size, 600, 0) == 0);
+
+    reset_seqs();
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        unsigned int i;
+
+        test_cpu = cpu;
+        for ( nr = i = 0; i < 100000; i++ )
+        {
+            write_rec(1 + i % TRACE_EXTRA_MAX, i & 1);
+            if ( i % 1000 == 0 )
+                nr += consume(cpu);
+        }
+        nr += consume(cpu);
+        write_rec(1, false);
+        nr += consume(cpu);
+        EXPECT(expected_seq[cpu] == next_seq[cpu]);
+        /* Only the small buffers may run out of space. */
+        if ( cpu >= 2 )
+            EXPECT(nr == next_seq[cpu]);
+    }
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+
+    /* Back to a common size. */
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_size, 3, 0));
+    ti = get_t_info();
+    EXPECT(ti->tbuf_size == 3);
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        EXPECT(buf_pages(cpu) == 3);
+}
+
+static void bench(unsigned int words, bool cycles)
+{
+    struct t_info *ti = get_t_info();
+    struct t_buf *buf = mfn_to_virt(((uint32_t *)ti)[ti->mfn_offset[0]]);
+    uint32_t d[TRACE_EXTRA_MAX] = { 0 };
+    uint32_t event = TEST_EVENT | (cycles ? TRC_HD_CYCLE_FLAG : 0);
+    unsigned int i, j;
+    uint64_t start, total = 0, nr = 0;
+
+    test_cpu = 0;
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0));
+
+    for ( i = 0; i < 200; i++ )
+    {
+        start = test_rdtsc();
+        for ( j = 0; j < 1000; j++ )
+            trace(event, words * sizeof(uint32_t), d);
+        total += test_rdtsc() - start;
+        nr += j;
+
+        /* Discard the records, the consumer isn't part of the benchmark. */
+        buf->cons = buf->prod;
+    }
+
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_disable, 0, 0));
+
+    printf("  %u extra words, %s cycles: %.1f cycles per record\n", words,
+           cycles ? "with" : "without", (double)total / nr);
+}
+
+int main(int argc, char **argv)
+{
+    test_arena = aligned_alloc(PAGE_SIZE, TEST_ARENA_PAGES * PAGE_SIZE);
+    EXPECT(test_arena);
+
+    init_trace_bufs();
+    EXPECT(tbuf_op(XEN_SYSCTL_TBUFOP_enable, 0, 0) == -EINVAL);
+    EXPECT(tbuf_op(XEN_SYSCTL_TBUFOP_set_cpu_size, 2, 1) == -EINVAL);
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_size, 2, 0));
+    EXPECT(get_t_info()->tbuf_size == 2);
+
+    test_records();
+    test_lost();
+    test_nested();
+    test_resize();
+
+    /* Buffers large enough not to wrap during a round. */
+    EXPECT(!tbuf_op(XEN_SYSCTL_TBUFOP_set_size, 16, 0));
+    printf("Trace record write cost:\n");
+    bench(1, false);
+    bench(1, true);
+    bench(3, true);
+    bench(7, true);
+
+    printf("All tests passed\n");
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -23,6 +23,7 @@
 #include <err.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,6 +49,7 @@ struct test {
 };
 
 static struct xs_handle *xsh;
+static struct xs_handle *xsh_watch;
 static char *path;
 static char *paths[WRITE_BUFFERS_N];
 static char write_buffers[WRITE_BUFFERS_N][WRITE_BUFFERS_SIZE];
@@ -405,6 +407,88 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+/*
+ * Consume nr watch events of xsh_watch, so they don't pile up in xenstored
+ * and distort the following measurements.
+ */
+static int drain_watch_events(unsigned int nr)
+{
+    struct pollfd pfd = { .fd = xs_fileno(xsh_watch), .events = POLLIN };
+    char **vec;
+    int rc;
+
+    if ( pfd.fd < 0 )
+        return errno;
+
+    while ( nr )
+    {
+        vec = xs_check_watch(xsh_watch);
+        if ( vec )
+        {
+            free(vec);
+            nr--;
+            continue;
+        }
+        if ( errno != EAGAIN )
+            return errno;
+
+        rc = poll(&pfd, 1, 5000);
+        if ( rc < 0 )
+            return errno;
+        if ( !rc )
+            return ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/*
+ * Register par watches on unrelated nodes plus one on the written node, in
+ * order to measure the write latency depending on the number of watches.
+ * Each watch fires once when registered, and the written node's once more
+ * for the write.
+ */
+static int test_watch_init(uintptr_t par)
+{
+    char *wpath;
+    unsigned int i;
+    bool ok;
+
+    xsh_watch = xs_open(0);
+    if ( !xsh_watch )
+        return errno;
+
+    for ( i = 0; i < par; i++ )
+    {
+        if ( asprintf(&wpath, "%s/w%u", path, i) < 0 )
+            return ENOMEM;
+        ok = xs_watch(xsh_watch, wpath, "unrelated");
+        free(wpath);
+        if ( !ok )
+            return errno;
+    }
+
+    if ( !xs_watch(xsh_watch, paths[0], "node") )
+        return errno;
+
+    return drain_watch_events(par + 1);
+}
+
+static int test_watch(uintptr_t par)
+{
+    return xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) ? 0 : errno;
+}
+
+static int test_watch_deinit(uintptr_t par)
+{
+    int ret = drain_watch_events(1);
+
+    xs_close(xsh_watch);
+    xsh_watch = NULL;
+
+    return ret ?: verify_node(paths[0], write_buffers[0], 1);
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -419,6 +503,9 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("watch 0", test_watch, 0, "Write node with 1 watch"),
+TEST("watch 100", test_watch, 100, "Write node with 100 other watches"),
+TEST("watch 1000", test_watch, 1000, "Write node with 1000 other watches"),
 };
 
 static void cleanup(void)
@@ -0,0 +1,215 @@
+/*
+ * Emulation of the hypervisor environment needed by common/xmalloc_tlsf.c,
+ * for testing and benchmarking the allocator in userspace.
+ *
+ * Every thread is a cpu, selected by setting test_cpu.  Xenheap pages come
+ * from an arena with a frame table, so that whole page allocations work.
+ */
+
+#ifndef _TEST_XMALLOC_
+#define _TEST_XMALLOC_
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <xen-tools/common-macros.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+
+#define __init
+#define __read_mostly
+#define cf_check
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define ASSERT(x) assert(x)
+#define BUG_ON(x) assert(!(x))
+#define BUG() abort()
+#define ASSERT_ALLOC_CONTEXT() ((void)0)
+
+/* No Kconfig options are enabled, in particular not XMEM_POOL_POISON. */
+#define IS_ENABLED(option) 0
+
+#define XENLOG_ERR
+
+extern bool test_verbose;
+#define printk(fmt, args...) \
+    ({ if ( test_verbose ) printf(fmt, ## args); })
+
+#define strlcpy(d, s, n) snprintf(d, n, "%s", s)
+
+static inline void *memchr_inv(const void *s, int c, size_t n)
+{
+    const unsigned char *p = s;
+
+    for ( ; n; p++, n-- )
+        if ( *p != (unsigned char)c )
+            return (void *)p;
+
+    return NULL;
+}
+
+static inline int flsl(unsigned long x)
+{
+    return x ? sizeof(x) * 8 - __builtin_clzl(x) : 0;
+}
+
+/* Only used with the pool lock held, so needn't be atomic. */
+#define set_bit(nr, addr) ((void)(*(addr) |= 1U << (nr)))
+#define clear_bit(nr, addr) ((void)(*(addr) &= ~(1U << (nr))))
+
+/* Hooks into the test for parameters and init functions */
+#define boolean_param(name, var) bool *const test_##var = &(var)
+#define presmp_initcall(fn) int (*const test_presmp_initcall)(void) = (fn)
+#define register_keyhandler(key, fn, desc, diag) \
+    ((void)(key), test_keyhandler = (fn))
+
+extern void (*test_keyhandler)(unsigned char key);
+
+/* cpus */
+#define NR_CPUS 64
+
+extern __thread unsigned int test_cpu;
+extern unsigned int nr_cpu_ids;
+
+#define smp_processor_id() test_cpu
+#define for_each_online_cpu(cpu) for ( (cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++ )
+
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__##name[NR_CPUS]
+#define per_cpu(name, cpu) (per_cpu__##name[cpu])
+#define this_cpu(name) per_cpu(name, smp_processor_id())
+
+#define NOTIFY_DONE 0
+#define CPU_UP_PREPARE  0x0002
+#define CPU_UP_CANCELED 0x0003
+#define CPU_DEAD        0x0008
+
+struct notifier_block {
+    int (*notifier_call)(struct notifier_block *nfb, unsigned long action,
+                         void *hcpu);
+    int priority;
+};
+
+extern struct notifier_block *test_cpu_nfb;
+#define register_cpu_notifier(nfb) ((void)(test_cpu_nfb = (nfb)))
+
+/* Locks */
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__ ( "" ::: "memory" )
+#endif
+
+typedef struct {
+    volatile bool locked;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(l) spinlock_t l = { false }
+#define spin_lock_init(l) ((l)->locked = false)
+
+static inline void spin_lock(spinlock_t *l)
+{
+    while ( __atomic_test_and_set(&l->locked, __ATOMIC_ACQUIRE) )
+        while ( l->locked )
+            cpu_relax();
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+    __atomic_clear(&l->locked, __ATOMIC_RELEASE);
+}
+
+/* Lists */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    new->next = head;
+    new->prev = head->prev;
+    head->prev->next = new;
+    head->prev = new;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry->prev = entry;
+}
+
+/* Memory */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & PAGE_MASK)
+#define PFN_UP(x) (((x) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+
+#define TEST_ARENA_PAGES (64UL << 10)
+
+struct page_info {
+    unsigned int order;
+};
+
+#define PFN_ORDER(pg) ((pg)->order)
+
+extern unsigned char *test_arena;
+extern struct page_info *test_frame_table;
+extern unsigned long test_pages_used;
+
+#define virt_to_page(va) \
+    (&test_frame_table[((unsigned char *)(va) - test_arena) >> PAGE_SHIFT])
+
+static inline unsigned int get_order_from_pages(unsigned long nr_pages)
+{
+    unsigned int order = 0;
+
+    while ( (1UL << order) < nr_pages )
+        order++;
+
+    return order;
+}
+
+#define get_order_from_bytes(b) get_order_from_pages(PFN_UP(b))
+
+void *alloc_xenheap_pages(unsigned int order, unsigned int memflags);
+void free_xenheap_pages(void *v, unsigned int order);
+#define alloc_xenheap_page() alloc_xenheap_pages(0, 0)
+#define free_xenheap_page(v) free_xenheap_pages(v, 0)
+
+/* xen/xmalloc.h */
+#define ZERO_BLOCK_PTR ((void *)-1L)
+
+#define xzalloc(_type) ((_type *)_xzalloc(sizeof(_type), __alignof__(_type)))
+
+struct xmem_pool;
+typedef void *(xmem_pool_get_memory)(unsigned long bytes);
+typedef void (xmem_pool_put_memory)(void *ptr);
+
+void *_xmalloc(unsigned long size, unsigned long align);
+void *_xzalloc(unsigned long size, unsigned long align);
+void *_xrealloc(void *ptr, unsigned long size, unsigned long align);
+void xfree(void *p);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,403 @@
+/*
+ * Unit tests and benchmark for xmalloc and its per-cpu caches.
+ *
+ * Threads, each being a cpu, allocate, check and free blocks of random
+ * sizes and alignments, handing some of them to other cpus to be freed
+ * there.  After all cpus have gone down all pages must have been returned.
+ * The cost of an allocation and free is measured with and without the
+ * per-cpu caches, for increasing numbers of cpus.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <getopt.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emul.h"
+
+bool test_verbose;
+__thread unsigned int test_cpu;
+unsigned int nr_cpu_ids = 1;
+struct notifier_block *test_cpu_nfb;
+void (*test_keyhandler)(unsigned char key);
+
+unsigned char *test_arena;
+struct page_info *test_frame_table;
+unsigned long test_pages_used;
+
+extern bool *const test_opt_xmalloc_cache;
+extern int (*const test_presmp_initcall)(void);
+
+#define EXPECT(x)                                                       \
+    do {                                                                \
+        if ( !(x) )                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #x);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+
+/* Xenheap: free lists per order, carved from the arena on demand. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#define HEAP_ORDERS 8
+static void *heap_free[HEAP_ORDERS];
+static unsigned long heap_top;
+
+void *alloc_xenheap_pages(unsigned int order, unsigned int memflags)
+{
+    void *p;
+
+    EXPECT(order < ARRAY_SIZE(heap_free));
+
+    pthread_mutex_lock(&heap_lock);
+    if ( (p = heap_free[order]) != NULL )
+        heap_free[order] = *(void **)p;
+    else
+    {
+        heap_top = (heap_top + (1UL << order) - 1) & ~((1UL << order) - 1);
+        if ( heap_top + (1UL << order) <= TEST_ARENA_PAGES )
+        {
+            p = test_arena + heap_top * PAGE_SIZE;
+            heap_top += 1UL << order;
+        }
+    }
+    if ( p )
+        test_pages_used += 1UL << order;
+    pthread_mutex_unlock(&heap_lock);
+
+    return p;
+}
+
+void free_xenheap_pages(void *v, unsigned int order)
+{
+    if ( v == NULL )
+        return;
+
+    EXPECT(!(((unsigned char *)v - test_arena) & ((PAGE_SIZE << order) - 1)));
+
+    pthread_mutex_lock(&heap_lock);
+    *(void **)v = heap_free[order];
+    heap_free[order] = v;
+    test_pages_used -= 1UL << order;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void cpu_notify(unsigned int cpu, unsigned long action)
+{
+    test_cpu_nfb->notifier_call(test_cpu_nfb, action,
+                                (void *)(unsigned long)cpu);
+}
+
+/* Blocks are filled with a pattern based on a tag, checked before freeing. */
+struct block {
+    unsigned char *p;
+    unsigned long size, align;
+    unsigned int tag;
+};
+
+static void fill(struct block *b)
+{
+    unsigned long i;
+
+    for ( i = 0; i < b->size; i++ )
+        b->p[i] = b->tag + i;
+}
+
+static void check(const struct block *b)
+{
+    unsigned long i;
+
+    for ( i = 0; i < b->size; i++ )
+        EXPECT(b->p[i] == (unsigned char)(b->tag + i));
+}
+
+static unsigned long random_size(unsigned int *seed)
+{
+    unsigned int r = rand_r(seed);
+
+    /* Mostly small blocks, some larger than the cached ones and pages. */
+    switch ( r % 16 )
+    {
+    case 0:
+        return 1 + r % 6000;
+    case 1: case 2:
+        return 1 + r % 2048;
+    default:
+        return 1 + r % 256;
+    }
+}
+
+static void random_alloc(struct block *b, unsigned int *seed)
+{
+    static const unsigned long align[] = { 0, 8, 64, 256 };
+    unsigned int r = rand_r(seed);
+
+    b->align = r % 8 ? sizeof(void *) : align[(r >> 3) % 4];
+    b->tag = r >> 5;
+    b->size = random_size(seed);
+    b->p = _xmalloc(b->size, b->align);
+    EXPECT(b->p != NULL && b->p != ZERO_BLOCK_PTR);
+    EXPECT(!b->align || !((unsigned long)b->p & (b->align - 1)));
+}
+
+/* Blocks handed between cpus */
+#define NR_EXCHANGE 64
+static struct block exchange[NR_EXCHANGE];
+static pthread_mutex_t exchange_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define NR_SLOTS 256
+
+static unsigned long nr_ops = 200000;
+static pthread_barrier_t barrier;
+
+static void *stress_cpu(void *arg)
+{
+    struct block slot[NR_SLOTS] = { { NULL } };
+    unsigned int seed = (unsigned long)arg + 1, i;
+    unsigned long op;
+
+    test_cpu = (unsigned long)arg;
+    pthread_barrier_wait(&barrier);
+
+    for ( op = 0; op < nr_ops; op++ )
+    {
+        struct block *b = &slot[rand_r(&seed) % NR_SLOTS];
+        unsigned int r = rand_r(&seed);
+
+        if ( !b->p )
+        {
+            random_alloc(b, &seed);
+            fill(b);
+            continue;
+        }
+
+        check(b);
+
+        switch ( r % 8 )
+        {
+        case 0: /* Free on another cpu, and free one from another cpu. */
+        {
+            struct block x;
+
+            pthread_mutex_lock(&exchange_lock);
+            x = exchange[r % NR_EXCHANGE];
+            exchange[r % NR_EXCHANGE] = *b;
+            pthread_mutex_unlock(&exchange_lock);
+
+            if ( x.p )
+            {
+                check(&x);
+                xfree(x.p);
+            }
+            break;
+        }
+
+        case 1: /* Resize, keeping the alignment as xrealloc() requires. */
+        {
+            unsigned long size = random_size(&seed);
+
+            b->p = _xrealloc(b->p, size, b->align);
+            EXPECT(b->p != NULL);
+            b->size = min(b->size, size);
+            check(b);
+            b->size = size;
+            fill(b);
+            continue;
+        }
+
+        default:
+            xfree(b->p);
+            break;
+        }
+
+        b->p = NULL;
+    }
+
+    for ( i = 0; i < NR_SLOTS; i++ )
+        if ( slot[i].p )
+        {
+            check(&slot[i]);
+            xfree(slot[i].p);
+        }
+
+    return NULL;
+}
+
+/* Allocate and free bursts of small blocks, as hypercalls tend to do. */
+static void *bench_cpu(void *arg)
+{
+    static const unsigned short sizes[] = { 24, 40, 64, 96, 128, 200, 512 };
+    void *p[16];
+    unsigned long op;
+    unsigned int i;
+
+    test_cpu = (unsigned long)arg;
+    pthread_barrier_wait(&barrier);
+
+    for ( op = 0; op < nr_ops; op += ARRAY_SIZE(p) )
+    {
+        for ( i = 0; i < ARRAY_SIZE(p); i++ )
+            p[i] = _xmalloc(sizes[(op / ARRAY_SIZE(p) + i) % ARRAY_SIZE(sizes)],
+                            sizeof(void *));
+        for ( i = 0; i < ARRAY_SIZE(p); i++ )
+            xfree(p[i]);
+    }
+
+    return NULL;
+}
+
+static double run_cpus(void *(*fn)(void *), unsigned int nr)
+{
+    pthread_t thread[NR_CPUS];
+    struct timespec start, end;
+    unsigned long cpu;
+
+    EXPECT(pthread_barrier_init(&barrier, NULL, nr + 1) == 0);
+    for ( cpu = 0; cpu < nr; cpu++ )
+        EXPECT(pthread_create(&thread[cpu], NULL, fn, (void *)cpu) == 0);
+
+    pthread_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( cpu = 0; cpu < nr; cpu++ )
+        pthread_join(thread[cpu], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&barrier);
+
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static void bench(const char *name, unsigned int nr)
+{
+    unsigned int n;
+
+    for ( n = 1; n <= nr; n *= 2 )
+    {
+        double ns = run_cpus(bench_cpu, n);
+
+        /* Each op is an allocation and a free, each thread doing nr_ops. */
+        printf("%-8s %2u cpus: %7.1f ns per op, %7.2f Mop/s total\n",
+               name, n, ns / nr_ops, n * nr_ops / ns * 1e3);
+    }
+}
+
+static void stress(unsigned int nr)
+{
+    unsigned int i;
+
+    run_cpus(stress_cpu, nr);
+
+    for ( i = 0; i < NR_EXCHANGE; i++ )
+        if ( exchange[i].p )
+        {
+            check(&exchange[i]);
+            xfree(exchange[i].p);
+            exchange[i].p = NULL;
+        }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-v] [-b] [-c cpus] [-n ops]\n"
+            "  -v  verbose, dump the caches\n"
+            "  -b  benchmark, with and without caches\n"
+            "  -c  number of cpus (default: online cpus, at most %u)\n"
+            "  -n  operations per cpu (default %lu)\n",
+            prog, NR_CPUS, nr_ops);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long base;
+    unsigned int cpu;
+    bool benchmark = false;
+    long nr = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+
+    while ( (c = getopt(argc, argv, "vbc:n:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'v':
+            test_verbose = true;
+            break;
+        case 'b':
+            benchmark = true;
+            break;
+        case 'c':
+            nr = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_ops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    nr_cpu_ids = nr < 2 ? 2 : nr > NR_CPUS ? NR_CPUS : nr;
+
+    /* Page allocations are naturally aligned, also in virtual address. */
+    test_arena = mmap(NULL, (TEST_ARENA_PAGES + (1UL << HEAP_ORDERS)) * PAGE_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    EXPECT(test_arena != MAP_FAILED);
+    test_arena += -(unsigned long)test_arena & ((PAGE_SIZE << HEAP_ORDERS) - 1);
+    test_frame_table = calloc(TEST_ARENA_PAGES, sizeof(*test_frame_table));
+    EXPECT(test_frame_table);
+
+    /* Create the pool, leaving only its own pages. */
+    xfree(_xmalloc(1, 0));
+    base = test_pages_used;
+
+    /* The pool alone, as before the per-cpu caches are set up. */
+    stress(nr_cpu_ids);
+    EXPECT(test_pages_used == base);
+    printf("pool: ok\n");
+
+    if ( benchmark )
+        bench("pool", nr_cpu_ids);
+
+    EXPECT(*test_opt_xmalloc_cache);
+    test_presmp_initcall();
+    for ( cpu = 1; cpu < nr_cpu_ids; cpu++ )
+        cpu_notify(cpu, CPU_UP_PREPARE);
+
+    stress(nr_cpu_ids);
+    if ( test_verbose )
+        test_keyhandler('X');
+
+    if ( benchmark )
+        bench("cache", nr_cpu_ids);
+
+    /* Taking cpus down returns their caches, and all pages with them. */
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        cpu_notify(cpu, CPU_DEAD);
+    EXPECT(test_pages_used == base);
+    printf("cache: ok\n");
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -2286,7 +2286,7 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static unsigned int hash_from_key_fn(const void *k)
+unsigned int hash_from_key_fn(const void *k)
 {
 	const char *str = k;
 	unsigned int hash = 5381;
@@ -2298,7 +2298,7 @@ static unsigned int hash_from_key_fn(const void *k)
 	return hash;
 }
 
-static int keys_equal_fn(const void *key1, const void *key2)
+int keys_equal_fn(const void *key1, const void *key2)
 {
 	return 0 == strcmp(key1, key2);
 }
@@ -163,6 +163,10 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* Cached watch permission check result of current fire_watches(). */
+	unsigned int watch_fire_gen;
+	bool watch_permitted;
+
 	/* Methods for communicating over this connection. */
 	const struct interface_funcs *funcs;
 
@@ -413,6 +417,9 @@ void finish_daemonize(void);
 
 extern xengnttab_handle **xgt_handle;
 
+/* Hash and compare functions for hashtables keyed by strings. */
+unsigned int hash_from_key_fn(const void *k);
+int keys_equal_fn(const void *key1, const void *key2);
 int remember_string(struct hashtable *hash, const char *str);
 
 /* Data base access functions. */
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -36,6 +37,15 @@ struct watch
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path (all connections), see watch_index. */
+	struct list_head index_list;
+
+	/* Connection owning the watch. */
+	struct connection *conn;
+
+	/* Global creation sequence number, used for ordering events. */
+	uint64_t seq;
+
 	/* Offset into path for skipping prefix (used for relative paths). */
 	unsigned int prefix_len;
 
@@ -43,23 +53,24 @@ struct watch
 	char *node;
 };
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+/*
+ * All watches are indexed by their (absolute) path, so firing watches for a
+ * node needs to look at the node and its ancestors only instead of scanning
+ * all watches of all connections.
+ */
+struct watch_path
 {
-	unsigned int len = strlen(parent);
+	/* Watches registered for this path. */
+	struct list_head watches;
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+	char *path;
+};
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+static struct hashtable *watch_index;
+static uint64_t watch_seq;
 
-	return child[len] == '/' || child[len] == '\0';
-}
+/* Generation count of fire_watches() calls for caching permission checks. */
+static unsigned int watch_fire_gen;
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
 {
@@ -111,6 +122,125 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 	return perm & XS_PERM_READ;
 }
 
+static int watch_index_add(struct watch *watch)
+{
+	struct watch_path *wp;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(NULL, "watches", hash_from_key_fn,
+					       keys_equal_fn, 0);
+		if (!watch_index)
+			return ENOMEM;
+	}
+
+	wp = hashtable_search(watch_index, watch->node);
+	if (!wp) {
+		wp = talloc(watch_index, struct watch_path);
+		if (!wp)
+			return ENOMEM;
+		wp->path = talloc_strdup(wp, watch->node);
+		if (!wp->path || hashtable_add(watch_index, wp->path, wp)) {
+			talloc_free(wp);
+			return ENOMEM;
+		}
+		INIT_LIST_HEAD(&wp->watches);
+	}
+
+	watch->seq = watch_seq++;
+	list_add_tail(&watch->index_list, &wp->watches);
+
+	return 0;
+}
+
+static void watch_index_del(struct watch *watch)
+{
+	struct watch_path *wp;
+
+	if (list_empty(&watch->index_list))
+		return;
+
+	list_del(&watch->index_list);
+	INIT_LIST_HEAD(&watch->index_list);
+
+	wp = hashtable_search(watch_index, watch->node);
+	if (wp && list_empty(&wp->watches)) {
+		hashtable_remove(watch_index, wp->path);
+		talloc_free(wp);
+	}
+}
+
+/*
+ * Call func for all watches on the path or (if !exact) on any of its
+ * ancestors. "/" is regarded to be the parent of any node, so watches on "/"
+ * are matching special "@..." nodes, too.
+ */
+static void watch_index_iterate(const void *ctx, const char *name, bool exact,
+				void (*func)(struct watch *, void *), void *arg)
+{
+	struct watch_path *wp;
+	struct watch *watch;
+	char *path, *slash;
+
+	if (!watch_index)
+		return;
+
+	wp = hashtable_search(watch_index, name);
+	if (wp)
+		list_for_each_entry(watch, &wp->watches, index_list)
+			func(watch, arg);
+
+	if (exact || streq(name, "/"))
+		return;
+
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return;
+
+	while ((slash = strrchr(path, '/')) && slash != path) {
+		*slash = 0;
+		wp = hashtable_search(watch_index, path);
+		if (wp)
+			list_for_each_entry(watch, &wp->watches, index_list)
+				func(watch, arg);
+	}
+
+	talloc_free(path);
+
+	wp = hashtable_search(watch_index, "/");
+	if (wp)
+		list_for_each_entry(watch, &wp->watches, index_list)
+			func(watch, arg);
+}
+
+struct watch_matches {
+	struct watch **watches;
+	unsigned int num;
+	unsigned int max;
+};
+
+static void watch_count(struct watch *watch, void *arg)
+{
+	struct watch_matches *m = arg;
+
+	m->num++;
+}
+
+static void watch_collect(struct watch *watch, void *arg)
+{
+	struct watch_matches *m = arg;
+
+	if (m->num < m->max)
+		m->watches[m->num++] = watch;
+}
+
+static int watch_seq_cmp(const void *a, const void *b)
+{
+	const struct watch *w1 = *(const struct watch * const *)a;
+	const struct watch *w2 = *(const struct watch * const *)b;
+
+	return (w1->seq > w2->seq) - (w1->seq < w2->seq);
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -124,6 +254,8 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 	struct connection *i;
 	struct buffered_data *req;
 	struct watch *watch;
+	struct watch_matches m = { };
+	unsigned int w;
 
 	/* During transactions, don't fire watches, but queue them. */
 	if (conn && conn->transaction) {
@@ -133,29 +265,47 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 
 	req = domain_is_unprivileged(conn) ? conn->in : NULL;
 
+	watch_index_iterate(ctx, name, exact, watch_count, &m);
+	if (!m.num)
+		return;
+
+	/*
+	 * Events must be sent in the order the watches have been registered,
+	 * so sort the matching watches by their sequence number.
+	 */
+	m.max = m.num;
+	m.watches = talloc_array(ctx, struct watch *, m.max);
+	if (!m.watches)
+		return;
+	m.num = 0;
+	watch_index_iterate(ctx, name, exact, watch_collect, &m);
+	qsort(m.watches, m.num, sizeof(*m.watches), watch_seq_cmp);
+
+	/* Check permissions only once per connection. */
+	watch_fire_gen++;
+
 	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		if (!watch_permitted(i, ctx, name, node, perms))
+	for (w = 0; w < m.num; w++) {
+		watch = m.watches[w];
+		i = watch->conn;
+
+		if (i->watch_fire_gen != watch_fire_gen) {
+			i->watch_fire_gen = watch_fire_gen;
+			i->watch_permitted = watch_permitted(i, ctx, name,
+							     node, perms);
+		}
+		if (!i->watch_permitted)
 			continue;
 
-		list_for_each_entry(watch, &i->watches, list) {
-			if (exact) {
-				if (streq(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			} else {
-				if (is_child(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			}
-		}
+		send_event(req, i, get_watch_path(watch, name), watch->token);
 	}
+
+	talloc_free(m.watches);
 }
 
 static int destroy_watch(void *_watch)
 {
+	watch_index_del(_watch);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -178,6 +328,8 @@ static struct watch *add_watch(struct connection *conn, const char *path,
 	watch = talloc(conn, struct watch);
 	if (!watch)
 		goto nomem;
+	INIT_LIST_HEAD(&watch->index_list);
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, path);
 	watch->token = talloc_strdup(watch, token);
 	if (!watch->node || !watch->token)
@@ -188,6 +340,12 @@ static struct watch *add_watch(struct connection *conn, const char *path,
 
 	watch->prefix_len = relative ? strlen(get_implicit_path(conn)) + 1 : 0;
 
+	if (watch_index_add(watch)) {
+		domain_memory_add_nochk(conn, conn->id,
+					-strlen(path) - strlen(token));
+		goto nomem;
+	}
+
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
 	talloc_set_destructor(watch, destroy_watch);
@@ -0,0 +1,78 @@
+#ifndef __COMPACT_H
+# define __COMPACT_H
+
+/*
+ * Compact trace format, written by xentrace --compact and read by xenalyze.
+ *
+ * The file starts with a compact_header.  It is followed by the windows of
+ * the usual format, each a cpu_change record and the records of one pcpu,
+ * except that:
+ *  - the tsc of a record is replaced by the difference to the tsc of the
+ *    previous record in the window, zigzag and LEB128 encoded.  The first
+ *    tsc of a window is relative to 0, so windows can be dropped (as with
+ *    xentrace -M) without losing the time of the following ones;
+ *  - the window size of a cpu_change record is the size of the encoded
+ *    records following it.
+ * Everything else is copied unchanged, so the 8 bytes of tsc of a record
+ * typically shrink to 2-4 bytes.
+ */
+
+#include <stdint.h>
+
+#define COMPACT_MAGIC   0x7a637478 /* "xtcz" */
+#define COMPACT_VERSION 1
+
+struct compact_header {
+    uint32_t magic, version;
+};
+
+/* Longest encoding of a 64-bit tsc difference */
+#define COMPACT_TSC_MAX 10
+
+static inline unsigned int compact_put_tsc(uint8_t *p, uint64_t tsc,
+                                           uint64_t prev)
+{
+    int64_t delta = tsc - prev;
+    uint64_t v = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+    unsigned int n = 0;
+
+    while ( v >= 0x80 )
+    {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+
+    return n;
+}
+
+/* Returns the bytes used, or 0 if the encoding runs past end. */
+static inline unsigned int compact_get_tsc(const uint8_t *p,
+                                           const uint8_t *end,
+                                           uint64_t *tsc)
+{
+    uint64_t v = 0;
+    unsigned int n = 0, shift = 0;
+
+    do {
+        if ( p + n >= end || shift > 63 )
+            return 0;
+        v |= (uint64_t)(p[n] & 0x7f) << shift;
+        shift += 7;
+    } while ( p[n++] & 0x80 );
+
+    *tsc += (int64_t)((v >> 1) ^ -(v & 1));
+
+    return n;
+}
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
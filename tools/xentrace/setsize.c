@@ -23,12 +23,52 @@ int main(int argc, char * argv[])
 
     size = atol(argv[1]);
 
-    if ( xc_tbuf_set_size(xc_handle, size) != 0 )
+    if ( argc > 2 )
     {
-        perror("set_size Hypercall failure");
-        exit(1);
+        /* Resize the buffers of a list of cpus, e.g. "0-3,8". */
+        xc_cpumap_t map = xc_cpumap_alloc(xc_handle);
+        char *s = argv[2], *end;
+        unsigned long first, last;
+
+        if ( !map )
+        {
+            perror("Failure to allocate cpumap");
+            exit(1);
+        }
+
+        while ( *s )
+        {
+            first = last = strtoul(s, &end, 0);
+            if ( *end == '-' )
+                last = strtoul(end + 1, &end, 0);
+            if ( end == s || (*end && *end != ',') || last < first ||
+                 last >= xc_get_max_cpus(xc_handle) )
+            {
+                fprintf(stderr, "Invalid cpu list %s\n", argv[2]);
+                exit(1);
+            }
+            for ( ; first <= last; first++ )
+                xc_cpumap_setcpu(first, map);
+            s = *end ? end + 1 : end;
+        }
+
+        if ( xc_tbuf_set_cpu_size(xc_handle, map, size) != 0 )
+        {
+            perror("set_cpu_size Hypercall failure");
+            exit(1);
+        }
+        free(map);
+        printf("set_cpu_size succeeded.\n");
+    }
+    else
+    {
+        if ( xc_tbuf_set_size(xc_handle, size) != 0 )
+        {
+            perror("set_size Hypercall failure");
+            exit(1);
+        }
+        printf("set_size succeeded.\n");
     }
-    printf("set_size succeeded.\n");
   
     if (xc_tbuf_get_size(xc_handle, &size) != 0)
         perror("Failure to get tbuf info from Xen."
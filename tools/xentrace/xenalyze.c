@@ -34,6 +34,7 @@
 #include "analyze.h"
 #include "mread.h"
 #include "pv.h"
+#include "compact.h"
 #include <errno.h>
 #include <strings.h>
 #include <string.h>
@@ -71,6 +72,7 @@ struct {
     struct symbol_struct * symbols;
     char * symbol_file;
     char * trace_file;
+    char * index_file;
     int output_defined;
     off_t file_size;
     struct {
@@ -84,6 +86,7 @@ struct {
     .symbols = NULL,
     .symbol_file = NULL,
     .trace_file = NULL,
+    .index_file = NULL,
     .output_defined = 0,
     .file_size = 0,
     .progress = { .update_offset = 0 },
@@ -180,6 +183,7 @@ struct {
         svm_mode:1,
         summary:1,
         report_pcpu:1,
+        report_smt:1,
         tsc_loop_fatal:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
@@ -191,6 +195,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size, sample_max;
+    int jobs;
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -253,6 +258,7 @@ struct {
     .svm_mode = 0,
     .summary = 0,
     .report_pcpu = 0,
+    .report_smt = 0,
     .tsc_loop_fatal = 0,
     .cpu_hz = DEFAULT_CPU_HZ,
     /* Pre-calculate a multiplier that makes the rest of the
@@ -261,6 +267,7 @@ struct {
     .default_guest_paging_levels = 2,
     .sample_size = DEFAULT_SAMPLE_SIZE,
     .sample_max = DEFAULT_SAMPLE_MAX,
+    .jobs = 1,
     .tolerance = ERR_SANITY,
     .interval = { .msec = DEFAULT_INTERVAL_LENGTH },
 };
@@ -1664,6 +1671,7 @@ struct vcpu_data {
     struct cycle_framework f;
     struct cycle_summary runstates[RUNSTATE_MAX];
     struct cycle_summary runnable_states[RUNNABLE_STATE_MAX];
+    unsigned long long wake_latency_max; /* Longest wake -> running */
     struct cycle_summary cpu_affinity_all,
         cpu_affinity_pcpu[MAX_CPUS];
     enum {
@@ -1825,6 +1833,7 @@ struct pcpu_info {
     tsc_t first_tsc, last_tsc, order_tsc;
     off_t file_offset;
     off_t next_cpu_change_offset;
+    unsigned long window, last_window; /* Indexed: range of windows to process */
     struct record_info ri;
     int last_cpu_change_pid;
     int power_state;
@@ -1902,6 +1911,45 @@ struct {
     } interval;
 } P = { 0 };
 
+/* -- Trace index --
+ *
+ * A trace file is a sequence of windows, each a cpu_change record followed
+ * by window_size bytes of records of one pcpu.  The index lists the windows
+ * with the tsc of their first record, so that a pcpu can skip straight to
+ * its next window rather than reading every other pcpu's cpu_change record,
+ * and so that the trace can be split into time shards for parallel
+ * processing.
+ */
+#define TRACE_INDEX_MAGIC   0x78696478 /* "xidx" */
+#define TRACE_INDEX_VERSION 1
+
+struct trace_index_header {
+    uint32_t magic, version;
+    uint64_t trace_size, trace_mtime;
+    uint64_t nr_windows;
+};
+
+struct trace_index_window {
+    uint64_t offset;    /* Offset of the cpu_change record */
+    uint64_t first_tsc; /* tsc of the first record with one, 0 if none */
+    uint32_t size;      /* Size of the records following the cpu_change */
+    uint32_t cpu;
+};
+
+struct {
+    int active;
+    struct trace_index_window *windows;
+    unsigned long nr_windows;
+    /* Smallest tsc in the trace, to keep time consistent between shards */
+    tsc_t first_tsc;
+    /* Sort key of each window: its first_tsc, made monotonic per pcpu */
+    tsc_t *tsc;
+    /* Windows of each pcpu, in file order */
+    struct {
+        unsigned long *window, count;
+    } pcpu[MAX_CPUS];
+} I = { 0 };
+
 /* Function prototypes */
 char * pcpu_string(int pcpu);
 void pcpu_string_draw(struct pcpu_info *p);
@@ -5009,6 +5057,13 @@ static inline void runstate_update(struct vcpu_data *v, int new_runstate,
         if(v->runstate.state == RUNSTATE_RUNNABLE)
             update_cycles(v->runnable_states + v->runstate.runnable_state, tsc - v->runstate.tsc);
 
+        /* Real-time schedulers care about the worst case, not the average. */
+        if(v->runstate.state == RUNSTATE_RUNNABLE
+           && v->runstate.runnable_state == RUNNABLE_STATE_WAKE
+           && new_runstate == RUNSTATE_RUNNING
+           && tsc - v->runstate.tsc > v->wake_latency_max)
+            v->wake_latency_max = tsc - v->runstate.tsc;
+
         /* How much did dom0 run this buffer? */
         if(v->d->did == 0) {
             int i;
@@ -7456,17 +7511,24 @@ void runstate_summary(tsc_t * runstate_cycles)
         }
 }
 
-void sched_summary_vcpu(struct vcpu_data *v)
+/* Account the time v has been on its pcpu up to the end of the trace */
+void sched_finish_vcpu(struct vcpu_data *v)
 {
-    int i;
-    char desc[30];
-
     /* FIXME: Update all records like this */
     if ( v->pcpu_tsc )
     {
         update_cycles(&v->cpu_affinity_all, P.f.last_tsc - v->pcpu_tsc);
         update_cycles(&v->cpu_affinity_pcpu[v->p->pid], P.f.last_tsc - v->pcpu_tsc);
+        v->pcpu_tsc = 0;
     }
+}
+
+void sched_summary_vcpu(struct vcpu_data *v)
+{
+    int i;
+    char desc[30];
+
+    sched_finish_vcpu(v);
 
     printf(" Runstates:\n");
     for(i=0; i<RUNSTATE_MAX; i++) {
@@ -7481,6 +7543,14 @@ void sched_summary_vcpu(struct vcpu_data *v)
                 snprintf(desc,30, "    %8s", runnable_state_name[j]);
                 print_cycle_summary(v->runnable_states+j, desc);
             }
+            if ( v->wake_latency_max )
+            {
+                struct time_struct t;
+
+                cycles_to_time(v->wake_latency_max, &t);
+                printf("    %8s: %lld (%u.%09u s)\n", "wake max",
+                       v->wake_latency_max, t.s, t.ns);
+            }
         }
     }
     print_cpu_affinity(&v->cpu_affinity_all, " cpu affinity");
@@ -7503,6 +7573,119 @@ void sched_summary_domain(struct domain_data *d)
     }
 }
 
+/*
+ * SMT sibling contention, from the csched2:core_busy records: how long
+ * cores had more than one busy thread, and how much of that time other
+ * cores were fully idle, i.e., the contention could have been avoided.
+ */
+#define MAX_CORES MAX_CPUS
+struct smt_core {
+    int socket, core, threads, busy;
+    tsc_t tsc;
+    unsigned long long busy_cycles, contended_cycles;
+};
+
+struct {
+    int nr_cores, nr_contended, nr_idle;
+    struct smt_core cores[MAX_CORES];
+    tsc_t tsc;
+    unsigned long long total_cycles, contended_cycles, avoidable_cycles;
+} smt_info;
+
+void smt_core_busy_process(tsc_t tsc, int socket, int core, int busy,
+                           int threads)
+{
+    struct smt_core *c;
+    int i;
+
+    for ( i = 0; i < smt_info.nr_cores; i++ )
+        if ( smt_info.cores[i].socket == socket &&
+             smt_info.cores[i].core == core )
+            break;
+
+    if ( i == smt_info.nr_cores )
+    {
+        if ( i == MAX_CORES )
+        {
+            fprintf(warn, "%s: too many cores, ignoring socket %d core %d\n",
+                    __func__, socket, core);
+            return;
+        }
+        c = smt_info.cores + smt_info.nr_cores++;
+        c->socket = socket;
+        c->core = core;
+        c->busy = 0;
+        c->tsc = tsc;
+        smt_info.nr_idle++;
+    }
+    else
+        c = smt_info.cores + i;
+
+    /* Account the time since the last change, of any core. */
+    if ( smt_info.tsc && tsc > smt_info.tsc )
+    {
+        tsc_t delta = tsc - smt_info.tsc;
+
+        smt_info.total_cycles += delta;
+        if ( smt_info.nr_contended )
+        {
+            smt_info.contended_cycles += delta;
+            if ( smt_info.nr_idle )
+                smt_info.avoidable_cycles += delta;
+        }
+    }
+    smt_info.tsc = tsc;
+
+    /* And the time since the last change of this core. */
+    if ( tsc > c->tsc )
+    {
+        if ( c->busy )
+            c->busy_cycles += tsc - c->tsc;
+        if ( c->busy > 1 )
+            c->contended_cycles += tsc - c->tsc;
+    }
+    c->tsc = tsc;
+
+    smt_info.nr_contended += (busy > 1) - (c->busy > 1);
+    smt_info.nr_idle += !busy - !c->busy;
+    c->busy = busy;
+    c->threads = threads;
+}
+
+void report_smt(void)
+{
+    int i;
+
+    printf("SMT sibling contention:\n");
+    if ( !smt_info.total_cycles )
+    {
+        printf(" No csched2:core_busy records found\n");
+        return;
+    }
+
+    printf(" Cores with more than one busy thread: %5.2lfs (%5.2lf%%)\n",
+           ((double)smt_info.contended_cycles) / opt.cpu_hz,
+           smt_info.contended_cycles * 100.0 / smt_info.total_cycles);
+    printf("  ... while other cores were fully idle: %5.2lfs (%5.2lf%%)\n",
+           ((double)smt_info.avoidable_cycles) / opt.cpu_hz,
+           smt_info.avoidable_cycles * 100.0 / smt_info.total_cycles);
+
+    for ( i = 0; i < smt_info.nr_cores; i++ )
+    {
+        struct smt_core *c = smt_info.cores + i;
+
+        printf(" socket %d core %d (%d threads): busy %5.2lfs, "
+               "contended %5.2lfs",
+               c->socket, c->core, c->threads,
+               ((double)c->busy_cycles) / opt.cpu_hz,
+               ((double)c->contended_cycles) / opt.cpu_hz);
+        if ( c->busy_cycles )
+            printf(" (%5.2lf%% of busy)",
+                   c->contended_cycles * 100.0 / c->busy_cycles);
+        printf("\n");
+    }
+}
+
 void dump_sched_vcpu_action(struct record_info *ri, const char *action)
 {
     struct {
@@ -7641,6 +7824,27 @@ void sched_process(struct pcpu_info *p)
                 printf("\n");
             }
             break;
+        case TRC_SCHED_WAKE_QUEUED:
+            if(opt.dump_all) {
+                struct {
+                    unsigned int domid, vcpuid, cpu;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s vcpu_wake_queued d%uv%u, to cpu %u\n",
+                       ri->dump_header, r->domid, r->vcpuid, r->cpu);
+            }
+            break;
+        case TRC_SCHED_LOCK_WAIT:
+            if(opt.dump_all) {
+                struct {
+                    unsigned int cpu, wait;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s sched_lock_wait cpu %u, waited %u.%uus\n",
+                       ri->dump_header, r->cpu,
+                       r->wait / 1000, r->wait % 1000);
+            }
+            break;
         case TRC_SCHED_CTL:
         case TRC_SCHED_S_TIMER_FN:
         case TRC_SCHED_T_TIMER_FN:
@@ -7999,6 +8203,22 @@ void sched_process(struct pcpu_info *p)
                        ri->dump_header, r->domid, r->vcpuid);
             }
             break;
+        case TRC_SCHED_CLASS_EVT(CSCHED2, 24): /* CORE_BUSY        */
+        {
+            struct {
+                uint16_t cpu, core, socket;
+                uint8_t busy, threads;
+            } *r = (typeof(r))ri->d;
+
+            if (opt.dump_all)
+                printf(" %s csched2:core_busy cpu %u, socket %u core %u, "
+                       "%u/%u threads busy\n", ri->dump_header, r->cpu,
+                       r->socket, r->core, r->busy, r->threads);
+
+            smt_core_busy_process(ri->tsc, r->socket, r->core, r->busy,
+                                  r->threads);
+            break;
+        }
         /* RTDS (TRC_RTDS_xxx) */
         case TRC_SCHED_CLASS_EVT(RTDS, 1): /* TICKLE           */
             if(opt.dump_all) {
@@ -8064,6 +8284,17 @@ void sched_process(struct pcpu_info *p)
                        r->tickled ? ", tickled" : ", not tickled");
             }
             break;
+        case TRC_SCHED_CLASS_EVT(RTDS, 7): /* RUNQ_PULL        */
+            if (opt.dump_all) {
+                struct {
+                    uint16_t vcpuid, domid;
+                    uint16_t cpu, runq;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s rtds:runq_pull d%uv%u to cpu %u from runq %u\n",
+                       ri->dump_header, r->domid, r->vcpuid, r->cpu, r->runq);
+            }
+            break;
         case TRC_SCHED_CLASS_EVT(SNULL, 1): /* PICKED_CPU */
             if (opt.dump_all) {
                 struct {
@@ -9081,6 +9312,30 @@ void activate_early_eof(void) {
     }
 }
 
+/* Start processing pcpu p at the cpu_change record rec, found at offset */
+void activate_pcpu(struct pcpu_info *p, struct trace_record *rec, ssize_t r,
+                   off_t offset)
+{
+    fprintf(warn, "%s: Activating pcpu %d at offset %lld\n",
+            __func__, p->pid, (unsigned long long)offset);
+
+    p->active = 1;
+    /* Process this cpu_change record first */
+    p->ri.rec = *rec;
+    p->ri.size = r;
+    __fill_in_record_info(p);
+
+    p->file_offset = offset;
+    p->next_cpu_change_offset = offset;
+
+    record_order_insert(p);
+
+    sched_default_vcpu_activate(p);
+
+    if ( p->pid > P.max_active_pcpu )
+        P.max_active_pcpu = p->pid;
+}
+
 off_t scan_for_new_pcpu(off_t offset) {
     ssize_t r;
     struct trace_record rec;
@@ -9110,30 +9365,9 @@ off_t scan_for_new_pcpu(off_t offset) {
     }
 
     if(cd->cpu > P.max_active_pcpu || !P.pcpu[cd->cpu].active) {
-        struct pcpu_info *p = P.pcpu + cd->cpu;
-
-        fprintf(warn, "%s: Activating pcpu %d at offset %lld\n",
-                __func__, cd->cpu, (unsigned long long)offset);
-
-        p->active = 1;
-        /* Process this cpu_change record first */
-        p->ri.rec = rec;
-        p->ri.size = r;
-        __fill_in_record_info(p);
-
-        p->file_offset = offset;
-        p->next_cpu_change_offset = offset;
-
-        record_order_insert(p);
-
-        offset += r + cd->window_size;
+        activate_pcpu(P.pcpu + cd->cpu, &rec, r, offset);
 
-        sched_default_vcpu_activate(p);
-
-        if ( cd->cpu > P.max_active_pcpu )
-            P.max_active_pcpu = cd->cpu;
-
-        return offset;
+        return offset + r + cd->window_size;
     } else {
         return 0;
     }
@@ -9429,9 +9663,10 @@ void process_cpu_change(struct pcpu_info *p) {
         p->file_offset += ri->size;
         p->next_cpu_change_offset = p->file_offset + r->window_size;
 
+        /* With an index all pcpus are activated up front. */
         if(p->next_cpu_change_offset > G.file_size)
             activate_early_eof();
-        else if(p->pid == P.max_active_pcpu)
+        else if(!I.active && p->pid == P.max_active_pcpu)
             scan_for_new_pcpu(p->next_cpu_change_offset);
 
     }
@@ -9744,141 +9979,603 @@ void __fill_in_record_info(struct pcpu_info *p)
     ri->cpu = p->pid;
 }
 
-ssize_t read_record(struct pcpu_info * p) {
-    off_t * offset;
-    struct record_info *ri;
+/* -- Compact traces -- */
 
-    offset = &p->file_offset;
-    ri = &p->ri;
+/* Expand the records of a compact window into out, returning the size. */
+static size_t compact_decode_window(uint8_t *out, const uint8_t *p,
+                                    const uint8_t *end, off_t offset)
+{
+    uint8_t *o = out;
+    uint64_t tsc = 0;
 
-    ri->size = __read_record(&ri->rec, *offset);
-    if(ri->size)
-    {
-        __fill_in_record_info(p);
-    }
-    else
+    while ( p < end )
     {
-        fprintf(warn, "%s: read returned zero, deactivating pcpu %d\n",
-                __func__, p->pid);
-        deactivate_pcpu(p);
+        uint32_t hdr;
+        unsigned int extra, n;
+
+        if ( p + sizeof(hdr) > end )
+            goto bad;
+        memcpy(&hdr, p, sizeof(hdr));
+        memcpy(o, &hdr, sizeof(hdr));
+        p += sizeof(hdr);
+        o += sizeof(hdr);
+
+        if ( TRC_HD_INCLUDES_CYCLE_COUNT(hdr) )
+        {
+            if ( !(n = compact_get_tsc(p, end, &tsc)) )
+                goto bad;
+            memcpy(o, &tsc, sizeof(tsc));
+            p += n;
+            o += sizeof(tsc);
+        }
+
+        extra = TRC_HD_EXTRA(hdr) * sizeof(uint32_t);
+        if ( p + extra > end )
+            goto bad;
+        memcpy(o, p, extra);
+        p += extra;
+        o += extra;
     }
 
-    return ri->size;
+    return o - out;
+
+bad:
+    fprintf(stderr, "%s: Corrupt record in window at offset %llx\n",
+            __func__, (unsigned long long)offset);
+    error(ERR_FILE, NULL);
+    return 0;
 }
 
 /*
- * This function gets called for every record when doing dump.  Try to
- * make it efficient by changing the minimum amount from the last
- * call.  Do this by:
- * - Keeping track of the last pcpu called, so we can just set that to -
- * - Keeping track of how many pcpus we've "drawn", and only "drawing" new ones
- * - Updating the current one
- *
- * FIXME: Need to deal with pcpu states changing...
- *
- * WARNING not thread-safe
+ * If the trace was written by xentrace --compact, expand it into a
+ * temporary file in the usual format and use that instead.
  */
-
-char __pcpu_string[MAX_CPUS+1] = { 0 };
-void pcpu_string_draw(struct pcpu_info *p)
+static void compact_open(void)
 {
-    char *s = __pcpu_string;
-    int i=p->pid;
+    struct compact_header hdr;
+    struct {
+        uint32_t header;
+        struct cpu_change_data data;
+    } cc;
+    uint8_t *in = NULL, *out = NULL;
+    size_t in_size = 0;
+    off_t offset = sizeof(hdr);
+    FILE *f;
+
+    if ( pread(G.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+         || hdr.magic != COMPACT_MAGIC )
+        return;
 
-    if(p->lost_record.active)
-        s[i]='l';
-    else if (!p->current)
-        s[i]=' ';
-    else if (p->current->d->did == DEFAULT_DOMAIN)
-        s[i]='.';
-    else if (p->current->d->did == IDLE_DOMAIN)
+    if ( hdr.version != COMPACT_VERSION )
     {
-        if ( opt.dump_show_power_states )
-            s[i]=p->power_state+'0';
-        else
-            s[i]='-';
+        fprintf(stderr, "%s: Unknown compact trace version %u\n",
+                __func__, hdr.version);
+        error(ERR_FILE, NULL);
     }
-    else
-        s[i]='|';
-}
-
-char * pcpu_string(int pcpu)
-{
-    char *s = __pcpu_string;
-    static int max_active_pcpu=-1, last_pcpu=-1;
-
-    assert(P.max_active_pcpu < MAX_CPUS);
-    assert(pcpu <= P.max_active_pcpu);
 
-    if(last_pcpu >= 0)
-        pcpu_string_draw(P.pcpu+last_pcpu);
+    fprintf(warn, "%s: Expanding compact trace %s\n", __func__, G.trace_file);
 
-    if(P.max_active_pcpu > max_active_pcpu)
+    if ( !(f = tmpfile()) )
     {
-        int i;
-        for(i=max_active_pcpu + 1; i<= P.max_active_pcpu; i++)
-            pcpu_string_draw(P.pcpu+i);
-        max_active_pcpu=P.max_active_pcpu;
+        perror("tmpfile");
+        error(ERR_SYSTEM, NULL);
     }
 
-    s[pcpu]='x';
-    last_pcpu = pcpu;
+    while ( pread(G.fd, &cc, sizeof(cc), offset) == sizeof(cc) )
+    {
+        size_t size;
 
-    return s;
-}
+        if ( TRC_HD_TO_EVENT(cc.header) != TRC_TRACE_CPU_CHANGE )
+        {
+            fprintf(stderr, "%s: Unexpected record event %x at offset %llx!\n",
+                    __func__, TRC_HD_TO_EVENT(cc.header),
+                    (unsigned long long)offset);
+            error(ERR_FILE, NULL);
+        }
 
-/* Null terminated */
-struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
+        if ( cc.data.window_size > in_size )
+        {
+            in_size = cc.data.window_size;
+            free(in);
+            free(out);
+            in = malloc(in_size);
+            /* A record grows by at most 7 bytes, from 5 to 12. */
+            out = malloc(in_size * 12 / 5 + 1);
+            if ( !in || !out )
+            {
+                fprintf(stderr, "%s: malloc failed!\n", __func__);
+                error(ERR_SYSTEM, NULL);
+            }
+        }
 
-/* In the case of identical tsc values, the old algorithm would favor the
- * pcpu with the lowest number.  By default the new algorithm favors the
- * pcpu which has been processed most recently.
- *
- * I think the second way is better; but it's good to be able to use the
- * old ordering, at very lest to verify that there are no (other) ordering
- * differences.  Enabling the below flag will cause the insertion / bubble
- * routines to order by pcpu id as well as tsc, preserving the old order. */
-//#define PRESERVE_PCPU_ORDERING
+        if ( pread(G.fd, in, cc.data.window_size, offset + sizeof(cc))
+             != cc.data.window_size )
+        {
+            fprintf(warn, "%s: Window at offset %llx truncated, ignoring rest of file\n",
+                    __func__, (unsigned long long)offset);
+            break;
+        }
 
-/* Steady state:
- * + Entire list is in order, except (potentially) for the first entry
- * + last is pointing to the first entry.
- */
-void record_order_bubble(struct pcpu_info *last)
-{
-    int i;
+        size = compact_decode_window(out, in, in + cc.data.window_size,
+                                     offset);
+        offset += sizeof(cc) + cc.data.window_size;
 
-    /* Find the pcpu to "bubble".  This is usually the
-     * first one, but if other pcpus have been activated, it may
-     * not be. */
-    for(i=0; record_order[i] && record_order[i]!=last; i++);
+        cc.data.window_size = size;
+        if ( fwrite(&cc, sizeof(cc), 1, f) != 1
+             || fwrite(out, 1, size, f) != size )
+        {
+            perror("fwrite");
+            error(ERR_SYSTEM, NULL);
+        }
+    }
 
-    assert(record_order[i]);
+    free(in);
+    free(out);
 
-    /* Now bubble it down */
-    for( ;
-        record_order[i+1]
-             && ( record_order[i+1]->order_tsc < last->order_tsc
-#ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i+1]->order_tsc == last->order_tsc
-                       && record_order[i+1]->pid < last->pid )
-#endif
-                 ) ;
-        i++)
-        record_order[i]=record_order[i+1];
-    record_order[i]=last;
+    if ( fflush(f) )
+    {
+        perror("fflush");
+        error(ERR_SYSTEM, NULL);
+    }
+
+    close(G.fd);
+    G.fd = fileno(f);
+    G.file_size = ftello(f);
 }
 
-void record_order_insert(struct pcpu_info *new)
+/* -- Trace index -- */
+
+/* Read the cpu_change record at offset, returning its size, or 0 if there
+ * isn't a complete one there. */
+static ssize_t index_read_cpu_change(struct trace_record *rec, off_t offset)
 {
-    int i;
-    struct pcpu_info *p=NULL, *t=NULL;
+    ssize_t r;
 
-    /* Sanity check: Make sure it's not already in there */
-    for(i=0; record_order[i]; i++)
-        assert(record_order[i]!=new);
+    r = __read_record(rec, offset);
 
-    /* Find where to insert it */
+    if ( r == 0 )
+        return 0;
+
+    if ( rec->event != TRC_TRACE_CPU_CHANGE || rec->cycle_flag )
+    {
+        fprintf(stderr, "%s: Unexpected record event %x at offset %llx!\n",
+                __func__, rec->event, (unsigned long long)offset);
+        error(ERR_ASSERT, NULL); /* Actually file, but can't recover */
+    }
+
+    return r;
+}
+
+static void index_build(void)
+{
+    unsigned long max_windows = 0;
+    off_t offset = 0;
+    ssize_t r, rsize;
+    struct trace_record rec;
+
+    fprintf(warn, "%s: Indexing %s\n", __func__, G.trace_file);
+
+    I.nr_windows = 0;
+
+    while ( (r = index_read_cpu_change(&rec, offset)) )
+    {
+        struct cpu_change_data *cd = (typeof(cd))rec.u.notsc.data;
+        struct trace_index_window *w;
+        off_t o, end;
+
+        if ( cd->cpu >= MAX_CPUS )
+        {
+            fprintf(stderr, "%s: cpu %d exceeds MAX_CPU %d!\n",
+                    __func__, cd->cpu, MAX_CPUS);
+            error(ERR_ASSERT, NULL);
+        }
+
+        end = offset + r + cd->window_size;
+
+        /* Leave out a window truncated by the end of the file. */
+        if ( end > G.file_size )
+        {
+            fprintf(warn, "%s: Window at offset %llx truncated, ignoring rest of file\n",
+                    __func__, (unsigned long long)offset);
+            break;
+        }
+
+        if ( I.nr_windows == max_windows )
+        {
+            void *n;
+
+            max_windows = max_windows ? max_windows << 1 : 1024;
+            n = realloc(I.windows, max_windows * sizeof(*I.windows));
+            if ( !n )
+            {
+                fprintf(stderr, "%s: realloc failed!\n", __func__);
+                error(ERR_SYSTEM, NULL);
+            }
+            I.windows = n;
+        }
+
+        w = I.windows + I.nr_windows++;
+        w->offset = offset;
+        w->size = cd->window_size;
+        w->cpu = cd->cpu;
+        w->first_tsc = 0;
+
+        /* Only the first few records may lack a tsc. */
+        for ( o = offset + r; o < end; o += rsize )
+        {
+            struct trace_record trec;
+
+            if ( !(rsize = __read_record(&trec, o)) )
+                break;
+
+            if ( trec.cycle_flag )
+            {
+                w->first_tsc = (((tsc_t)trec.u.tsc.tsc_hi) << 32)
+                    | trec.u.tsc.tsc_lo;
+                break;
+            }
+        }
+
+        offset = end;
+    }
+
+    fprintf(warn, "%s: %lu windows\n", __func__, I.nr_windows);
+}
+
+static int index_load(const char *fn, const struct stat *s)
+{
+    struct trace_index_header h;
+    FILE *f;
+    int ret = -1;
+
+    if ( (f = fopen(fn, "rb")) == NULL )
+        return -1;
+
+    if ( fread(&h, sizeof(h), 1, f) != 1
+         || h.magic != TRACE_INDEX_MAGIC
+         || h.version != TRACE_INDEX_VERSION
+         || h.trace_size != s->st_size
+         || h.trace_mtime != s->st_mtime )
+    {
+        fprintf(warn, "%s: %s doesn't match %s, rebuilding\n",
+                __func__, fn, G.trace_file);
+        goto out;
+    }
+
+    I.windows = malloc(h.nr_windows * sizeof(*I.windows) + 1);
+    if ( !I.windows )
+    {
+        fprintf(stderr, "%s: malloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    if ( fread(I.windows, sizeof(*I.windows), h.nr_windows, f)
+         != h.nr_windows )
+    {
+        fprintf(warn, "%s: short read from %s, rebuilding\n", __func__, fn);
+        free(I.windows);
+        I.windows = NULL;
+        goto out;
+    }
+
+    I.nr_windows = h.nr_windows;
+    ret = 0;
+
+ out:
+    fclose(f);
+    return ret;
+}
+
+static void index_save(const char *fn, const struct stat *s)
+{
+    struct trace_index_header h = {
+        .magic = TRACE_INDEX_MAGIC,
+        .version = TRACE_INDEX_VERSION,
+        .trace_size = s->st_size,
+        .trace_mtime = s->st_mtime,
+        .nr_windows = I.nr_windows,
+    };
+    FILE *f;
+
+    if ( (f = fopen(fn, "wb")) == NULL )
+    {
+        fprintf(stderr, "%s: Could not create index file %s: %s\n",
+                __func__, fn, strerror(errno));
+        return;
+    }
+
+    if ( fwrite(&h, sizeof(h), 1, f) != 1
+         || fwrite(I.windows, sizeof(*I.windows), I.nr_windows, f)
+            != I.nr_windows
+         || fclose(f) )
+    {
+        fprintf(stderr, "%s: Could not write index file %s: %s\n",
+                __func__, fn, strerror(errno));
+        unlink(fn);
+    }
+}
+
+void index_set_shard(tsc_t start, tsc_t end);
+
+/* Load the index from G.index_file, or build it (and save it there, if
+ * given), and set up the per-pcpu window lists. */
+void index_init(void)
+{
+    struct stat s;
+    unsigned long i;
+    int cpu;
+
+    /* The trace file as given, rather than an expanded compact trace */
+    if ( stat(G.trace_file, &s) )
+    {
+        perror("stat");
+        error(ERR_SYSTEM, NULL);
+    }
+
+    if ( !G.index_file || index_load(G.index_file, &s) )
+    {
+        index_build();
+        if ( G.index_file )
+            index_save(G.index_file, &s);
+    }
+
+    I.tsc = malloc(I.nr_windows * sizeof(*I.tsc) + 1);
+    if ( !I.tsc )
+    {
+        fprintf(stderr, "%s: malloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    for ( i = 0; i < I.nr_windows; i++ )
+    {
+        struct trace_index_window *w = I.windows + i;
+
+        if ( w->cpu >= MAX_CPUS )
+        {
+            fprintf(stderr, "%s: Corrupt index, cpu %u at offset %llx\n",
+                    __func__, w->cpu, (unsigned long long)w->offset);
+            error(ERR_ASSERT, NULL);
+        }
+
+        if ( w->first_tsc && (!I.first_tsc || w->first_tsc < I.first_tsc) )
+            I.first_tsc = w->first_tsc;
+
+        I.pcpu[w->cpu].count++;
+    }
+
+    for ( cpu = 0; cpu < MAX_CPUS; cpu++ )
+    {
+        if ( !I.pcpu[cpu].count )
+            continue;
+
+        I.pcpu[cpu].window = malloc(I.pcpu[cpu].count
+                                    * sizeof(*I.pcpu[cpu].window));
+        if ( !I.pcpu[cpu].window )
+        {
+            fprintf(stderr, "%s: malloc failed!\n", __func__);
+            error(ERR_SYSTEM, NULL);
+        }
+        I.pcpu[cpu].count = 0;
+    }
+
+    for ( i = 0; i < I.nr_windows; i++ )
+    {
+        struct trace_index_window *w = I.windows + i;
+        unsigned long n = I.pcpu[w->cpu].count++;
+        tsc_t prev = n ? I.tsc[I.pcpu[w->cpu].window[n - 1]] : 0;
+
+        /* Windows without a tsc, or going backwards, sort with the
+         * window before them. */
+        I.tsc[i] = w->first_tsc > prev ? w->first_tsc : prev;
+        I.pcpu[w->cpu].window[n] = i;
+    }
+
+    I.active = 1;
+    index_set_shard(0, ~0ULL);
+}
+
+/* Restrict processing to the windows starting in [start, end). */
+void index_set_shard(tsc_t start, tsc_t end)
+{
+    int cpu;
+
+    for ( cpu = 0; cpu < MAX_CPUS; cpu++ )
+    {
+        struct pcpu_info *p = P.pcpu + cpu;
+        unsigned long *w = I.pcpu[cpu].window;
+        unsigned long n = I.pcpu[cpu].count;
+
+        for ( p->window = 0; p->window < n && I.tsc[w[p->window]] < start;
+              p->window++ )
+            ;
+        for ( p->last_window = p->window;
+              p->last_window < n && I.tsc[w[p->last_window]] < end;
+              p->last_window++ )
+            ;
+    }
+}
+
+/* Activate each pcpu at its first window, instead of discovering pcpus
+ * while scanning. */
+void index_activate_pcpus(void)
+{
+    int cpu;
+
+    for ( cpu = 0; cpu < MAX_CPUS; cpu++ )
+    {
+        struct pcpu_info *p = P.pcpu + cpu;
+        struct trace_record rec;
+        off_t offset;
+        ssize_t r;
+
+        if ( p->window >= p->last_window )
+            continue;
+
+        offset = I.windows[I.pcpu[cpu].window[p->window]].offset;
+        r = index_read_cpu_change(&rec, offset);
+        if ( !r )
+        {
+            fprintf(stderr, "%s: Index doesn't match trace at offset %llx\n",
+                    __func__, (unsigned long long)offset);
+            error(ERR_ASSERT, NULL);
+        }
+
+        activate_pcpu(p, &rec, r, offset);
+    }
+}
+
+/* Move p to the start of its next window; -1 if it has none left. */
+int index_next_window(struct pcpu_info *p)
+{
+    if ( ++p->window >= p->last_window )
+        return -1;
+
+    p->file_offset = I.windows[I.pcpu[p->pid].window[p->window]].offset;
+    p->next_cpu_change_offset = p->file_offset;
+
+    return 0;
+}
+
+ssize_t read_record(struct pcpu_info * p) {
+    off_t * offset;
+    struct record_info *ri;
+
+    offset = &p->file_offset;
+    ri = &p->ri;
+
+    /* At the end of a window, use the index to go to the next one. */
+    if ( I.active && *offset == p->next_cpu_change_offset
+         && index_next_window(p) < 0 )
+        ri->size = 0;
+    else
+        ri->size = __read_record(&ri->rec, *offset);
+    if(ri->size)
+    {
+        __fill_in_record_info(p);
+    }
+    else
+    {
+        fprintf(warn, "%s: read returned zero, deactivating pcpu %d\n",
+                __func__, p->pid);
+        deactivate_pcpu(p);
+    }
+
+    return ri->size;
+}
+
+/*
+ * This function gets called for every record when doing dump.  Try to
+ * make it efficient by changing the minimum amount from the last
+ * call.  Do this by:
+ * - Keeping track of the last pcpu called, so we can just set that to -
+ * - Keeping track of how many pcpus we've "drawn", and only "drawing" new ones
+ * - Updating the current one
+ *
+ * FIXME: Need to deal with pcpu states changing...
+ *
+ * WARNING not thread-safe
+ */
+
+char __pcpu_string[MAX_CPUS+1] = { 0 };
+void pcpu_string_draw(struct pcpu_info *p)
+{
+    char *s = __pcpu_string;
+    int i=p->pid;
+
+    if(p->lost_record.active)
+        s[i]='l';
+    else if (!p->current)
+        s[i]=' ';
+    else if (p->current->d->did == DEFAULT_DOMAIN)
+        s[i]='.';
+    else if (p->current->d->did == IDLE_DOMAIN)
+    {
+        if ( opt.dump_show_power_states )
+            s[i]=p->power_state+'0';
+        else
+            s[i]='-';
+    }
+    else
+        s[i]='|';
+}
+
+char * pcpu_string(int pcpu)
+{
+    char *s = __pcpu_string;
+    static int max_active_pcpu=-1, last_pcpu=-1;
+
+    assert(P.max_active_pcpu < MAX_CPUS);
+    assert(pcpu <= P.max_active_pcpu);
+
+    if(last_pcpu >= 0)
+        pcpu_string_draw(P.pcpu+last_pcpu);
+
+    if(P.max_active_pcpu > max_active_pcpu)
+    {
+        int i;
+        for(i=max_active_pcpu + 1; i<= P.max_active_pcpu; i++)
+            pcpu_string_draw(P.pcpu+i);
+        max_active_pcpu=P.max_active_pcpu;
+    }
+
+    s[pcpu]='x';
+    last_pcpu = pcpu;
+
+    return s;
+}
+
+/* Null terminated */
+struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
+
+/* In the case of identical tsc values, the old algorithm would favor the
+ * pcpu with the lowest number.  By default the new algorithm favors the
+ * pcpu which has been processed most recently.
+ *
+ * I think the second way is better; but it's good to be able to use the
+ * old ordering, at very lest to verify that there are no (other) ordering
+ * differences.  Enabling the below flag will cause the insertion / bubble
+ * routines to order by pcpu id as well as tsc, preserving the old order. */
+//#define PRESERVE_PCPU_ORDERING
+
+/* Steady state:
+ * + Entire list is in order, except (potentially) for the first entry
+ * + last is pointing to the first entry.
+ */
+void record_order_bubble(struct pcpu_info *last)
+{
+    int i;
+
+    /* Find the pcpu to "bubble".  This is usually the
+     * first one, but if other pcpus have been activated, it may
+     * not be. */
+    for(i=0; record_order[i] && record_order[i]!=last; i++);
+
+    assert(record_order[i]);
+
+    /* Now bubble it down */
+    for( ;
+        record_order[i+1]
+             && ( record_order[i+1]->order_tsc < last->order_tsc
+#ifdef PRESERVE_PCPU_ORDERING
+                  || ( record_order[i+1]->order_tsc == last->order_tsc
+                       && record_order[i+1]->pid < last->pid )
+#endif
+                 ) ;
+        i++)
+        record_order[i]=record_order[i+1];
+    record_order[i]=last;
+}
+
+void record_order_insert(struct pcpu_info *new)
+{
+    int i;
+    struct pcpu_info *p=NULL, *t=NULL;
+
+    /* Sanity check: Make sure it's not already in there */
+    for(i=0; record_order[i]; i++)
+        assert(record_order[i]!=new);
+
+    /* Find where to insert it */
     for(i=0;
         record_order[i]
              && ( record_order[i]->order_tsc < new->order_tsc
@@ -9890,201 +10587,934 @@ void record_order_insert(struct pcpu_info *new)
         i++)
         ;
 
-    /* And insert it */
-    for( p=new; p ; i++)
+    /* And insert it */
+    for( p=new; p ; i++)
+    {
+        t=record_order[i];
+        record_order[i]=p;
+        p=t;
+    }
+}
+
+void record_order_remove(struct pcpu_info *rem)
+{
+    int i;
+
+    /* Find where the record is */
+    for(i=0; record_order[i] && record_order[i]!=rem; i++)
+        ;
+
+    /* Sanity check: Make sure it's actually there! */
+    assert(record_order[i]);
+
+    /* And move everyone forward */
+    for(; (record_order[i]=record_order[i+1]); i++)
+        ;
+}
+
+struct pcpu_info * choose_next_record(void)
+{
+    struct pcpu_info *min_p=NULL;
+
+    min_p=record_order[0];
+
+    if(opt.progress && min_p && min_p->file_offset >= G.progress.update_offset)
+        progress_update(min_p->file_offset);
+
+    /* If there are active pcpus, make sure we chose one */
+    assert(min_p || (P.max_active_pcpu==-1));
+
+    return min_p;
+}
+
+void process_records(void) {
+    while(1) {
+        struct pcpu_info *p = NULL;
+
+        if(!(p=choose_next_record()))
+            return;
+
+        process_record(p);
+
+        /* Lost records gets processed twice. */
+        if(p->ri.event == TRC_LOST_RECORDS) {
+            p->ri.event = TRC_LOST_RECORDS_END;
+            if(p->ri.tsc > p->order_tsc)
+                p->order_tsc = p->ri.tsc;
+            else {
+                fprintf(warn, "Strange, lost_record ri->tsc %lld !> p->order_tsc %lld!\n",
+                        p->ri.tsc, p->order_tsc);
+                error(ERR_FILE, NULL);
+            }
+        }
+        else
+            read_record(p);
+
+        /* Update this pcpu in the processing order */
+        if ( p->active )
+            record_order_bubble(p);
+    }
+}
+
+void vcpu_summary(struct vcpu_data *v)
+{
+    printf("-- v%d --\n", v->vid);
+    sched_summary_vcpu(v);
+    switch(v->data_type) {
+    case VCPU_DATA_HVM:
+        hvm_summary(&v->hvm);
+        break;
+    case VCPU_DATA_PV:
+        pv_summary(&v->pv);
+        break;
+    default:
+        break;
+    }
+}
+
+void domain_summary(void)
+{
+    struct domain_data * d;
+    int i;
+
+    if(opt.show_default_domain_summary) {
+        d = &default_domain;
+        printf("|-- Default domain --|\n");
+
+        for( i = 0; i < MAX_CPUS ; i++ )
+        {
+            if(d->vcpu[i])
+                vcpu_summary(d->vcpu[i]);
+        }
+    }
+
+    for ( d = domain_list ; d ; d=d->next )
+    {
+        int i;
+        printf("|-- Domain %d --|\n", d->did);
+
+        sched_summary_domain(d);
+
+        mem_summary_domain(d);
+
+        for( i = 0; i < MAX_CPUS ; i++ )
+        {
+            if(d->vcpu[i])
+                vcpu_summary(d->vcpu[i]);
+        }
+
+        printf("Emulate eip list\n");
+        dump_eip(d->emulate_eip_list);
+
+        if ( opt.with_interrupt_eip_enumeration )
+        {
+            printf("Interrupt eip list (vector %d)\n",
+                   opt.interrupt_eip_enumeration_vector);
+            dump_eip(d->interrupt_eip_list);
+        }
+
+        cr3_dump_list(d->cr3_value_head);
+    }
+}
+
+char * stringify_cpu_hz(long long cpu_hz);
+
+void summary(void) {
+    int i;
+    printf("Total time: %.2lf seconds (using cpu speed %s)\n",
+           ((double)(P.f.total_cycles))/opt.cpu_hz,
+           stringify_cpu_hz(opt.cpu_hz));
+    printf("--- Log volume summary ---\n");
+    for(i=0; i<MAX_CPUS; i++)
     {
-        t=record_order[i];
-        record_order[i]=p;
-        p=t;
+        struct pcpu_info *p = P.pcpu+i;
+        if(!p->summary)
+            continue;
+        printf(" - cpu %d -\n", i);
+        volume_summary(&p->volume.total);
+    }
+    domain_summary();
+}
+
+void report_pcpu(void) {
+    int i, active=0;
+
+    for(i=0; i<MAX_CPUS; i++)
+    {
+        struct pcpu_info *p = P.pcpu+i;
+        if(!p->summary)
+            continue;
+        printf("pcpu %d\n", i);
+
+        print_cycle_summary(&p->time.running, " running");
+        print_cycle_summary(&p->time.idle,    "    idle");
+        print_cycle_summary(&p->time.lost,    "    lost");
+
+        if ( p->time.running.count )
+            active++;
+    }
+    printf("Total active cpus: %d\n", active);
+
+}
+
+void init_pcpus(void) {
+    int i=0;
+    off_t offset = 0;
+
+    for(i=0; i<MAX_CPUS; i++)
+    {
+        P.pcpu[i].pid=i;
+        P.pcpu[i].lost_record.seen_valid_schedule=1;
+        P.pcpu[i].power_state=CSTATE_INVALID;
+    }
+
+    P.max_active_pcpu = -1;
+
+    sched_default_domain_init();
+
+    if ( I.active )
+    {
+        index_activate_pcpus();
+        return;
+    }
+
+    /* Scan through the cpu_change recs until we see a duplicate */
+    do {
+        offset = scan_for_new_pcpu(offset);
+
+        if(!offset) {
+            fprintf(warn, "%s: through first trace write, done for now.\n",
+                   __func__);
+        }
+    } while(offset);
+
+}
+
+/* -- Parallel processing --
+ *
+ * With --jobs, the indexed trace is split into time shards holding roughly
+ * the same amount of records, each processed by a forked worker.  A
+ * worker's output goes to a temporary file, copied to stdout in shard order
+ * once all workers are done; its summary data goes to another one, and is
+ * merged into the parent's structures, which are then reported as usual.
+ *
+ * Each shard starts without knowing the state of the vcpus, just as the
+ * start of a trace does, so time in flight at a shard boundary (e.g. the
+ * runstate a vcpu is in) isn't accounted.
+ */
+struct shard {
+    pid_t pid;
+    FILE *out, *state;
+};
+
+enum {
+    SHARD_STATE_END,
+    SHARD_STATE_PCPU,
+    SHARD_STATE_DOMAIN,
+    SHARD_STATE_VCPU,
+};
+
+typedef void (*cycle_summary_fn_t)(struct cycle_summary *s, void *arg);
+
+#define for_each_cycle_summary(_a, _fn, _arg)                   \
+    do {                                                        \
+        int _i;                                                 \
+        for ( _i = 0; _i < ARRAY_SIZE(_a); _i++ )               \
+            (_fn)((_a) + _i, (_arg));                           \
+    } while ( 0 )
+
+static void pcpu_cycle_summaries(struct pcpu_info *p,
+                                 cycle_summary_fn_t fn, void *arg)
+{
+    fn(&p->time.idle, arg);
+    fn(&p->time.running, arg);
+    fn(&p->time.lost, arg);
+}
+
+static void domain_cycle_summaries(struct domain_data *d,
+                                   cycle_summary_fn_t fn, void *arg)
+{
+    fn(&d->total_time, arg);
+    for_each_cycle_summary(d->runstates, fn, arg);
+    for_each_cycle_summary(d->hvm_short.s, fn, arg);
+}
+
+static void vcpu_cycle_summaries(struct vcpu_data *v,
+                                 cycle_summary_fn_t fn, void *arg)
+{
+    struct hvm_data *h = &v->hvm;
+    int i;
+
+    for_each_cycle_summary(v->runstates, fn, arg);
+    for_each_cycle_summary(v->runnable_states, fn, arg);
+    fn(&v->cpu_affinity_all, arg);
+    for_each_cycle_summary(v->cpu_affinity_pcpu, fn, arg);
+
+    if ( v->data_type != VCPU_DATA_HVM )
+        return;
+
+    for_each_cycle_summary(h->summary.exit_reason, fn, arg);
+    for_each_cycle_summary(h->summary.trap, fn, arg);
+    for_each_cycle_summary(h->summary.pf_xen, fn, arg);
+    for_each_cycle_summary(h->summary.pf_xen_emul, fn, arg);
+    for_each_cycle_summary(h->summary.pf_xen_emul_early_unshadow, fn, arg);
+    for_each_cycle_summary(h->summary.pf_xen_non_emul, fn, arg);
+    for_each_cycle_summary(h->summary.pf_xen_fixup, fn, arg);
+    for_each_cycle_summary(h->summary.pf_xen_fixup_unsync_resync, fn, arg);
+    for_each_cycle_summary(h->summary.cr_write, fn, arg);
+    for_each_cycle_summary(h->summary.cr3_write_resyncs, fn, arg);
+    for_each_cycle_summary(h->summary.vmcall, fn, arg);
+    for_each_cycle_summary(h->summary.generic, fn, arg);
+    for_each_cycle_summary(h->summary.mmio, fn, arg);
+    for ( i = 0; i < ARRAY_SIZE(h->summary.guest_interrupt); i++ )
+        for_each_cycle_summary(h->summary.guest_interrupt[i].runtime, fn, arg);
+    fn(&h->summary.ipi_latency, arg);
+}
+
+static void state_write(FILE *f, const void *p, size_t size)
+{
+    if ( size && fwrite(p, size, 1, f) != 1 )
+    {
+        fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(errno));
+        error(ERR_SYSTEM, NULL);
+    }
+}
+
+static void state_read(FILE *f, void *p, size_t size)
+{
+    if ( size && fread(p, size, 1, f) != 1 )
+    {
+        fprintf(stderr, "%s: short read\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
+}
+
+static void *state_read_alloc(FILE *f, size_t size)
+{
+    void *p = malloc(size);
+
+    if ( !p )
+    {
+        fprintf(stderr, "%s: malloc %zd failed!\n", __func__, size);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    state_read(f, p, size);
+
+    return p;
+}
+
+static int cycle_summary_samples(const struct cycle_summary *s)
+{
+    if ( !s->sample )
+        return 0;
+
+    return s->count < s->sample_size ? s->count : s->sample_size;
+}
+
+/* The raw structures are written first, followed by the samples of each of
+ * their cycle summaries. */
+static void cycle_summary_write(struct cycle_summary *s, void *f)
+{
+    state_write(f, s->sample, cycle_summary_samples(s) * sizeof(*s->sample));
+}
+
+static void cycle_summary_read(struct cycle_summary *s, void *f)
+{
+    int n = cycle_summary_samples(s);
+
+    s->sample = n ? state_read_alloc(f, n * sizeof(*s->sample)) : NULL;
+}
+
+/* Pick k of the n samples in src, evenly spread */
+static void sample_pick(long long *dst, const long long *src, int n, int k)
+{
+    int i;
+
+    for ( i = 0; i < k; i++ )
+        dst[i] = src[(long long)i * n / k];
+}
+
+static void cycle_summary_merge(struct cycle_summary *d,
+                                struct cycle_summary *s)
+{
+    int dn = cycle_summary_samples(d), sn = cycle_summary_samples(s);
+
+    d->event_count += s->event_count;
+
+    if ( sn )
+    {
+        int n = dn + sn, dk, sk;
+        long long *sample;
+
+        if ( opt.sample_max && n > opt.sample_max )
+            n = opt.sample_max;
+
+        /* Keep samples in proportion to the number of events they
+         * stand for. */
+        dk = (long long)n * d->count / (d->count + s->count);
+        if ( dk > dn )
+            dk = dn;
+        sk = n - dk;
+        if ( sk > sn )
+        {
+            sk = sn;
+            dk = n - sk;
+        }
+
+        sample = malloc(n * sizeof(*sample));
+        if ( !sample )
+        {
+            fprintf(stderr, "%s: malloc failed!\n", __func__);
+            error(ERR_SYSTEM, NULL);
+        }
+
+        sample_pick(sample, d->sample, dn, dk);
+        sample_pick(sample + dk, s->sample, sn, sk);
+
+        free(d->sample);
+        d->sample = sample;
+        d->sample_size = n;
+    }
+
+    d->count += s->count;
+    d->cycles += s->cycles;
+}
+
+/* Merge the cycle summaries of a structure read from a worker into the
+ * same structure of the parent, at the same offset. */
+struct cycle_summary_merge_args {
+    char *dst;
+    const char *src;
+};
+
+static void cycle_summary_merge_fn(struct cycle_summary *s, void *arg)
+{
+    struct cycle_summary_merge_args *a = arg;
+
+    cycle_summary_merge((void *)(a->dst + ((char *)s - a->src)), s);
+    free(s->sample);
+}
+
+#define merge_summaries(_fn, _dst, _src)                                \
+    do {                                                                \
+        struct cycle_summary_merge_args _a = {                          \
+            .dst = (char *)(_dst), .src = (const char *)(_src) };       \
+        _fn(_src, cycle_summary_merge_fn, &_a);                         \
+    } while ( 0 )
+
+static void merge_counts(int *d, const int *s, size_t n)
+{
+    size_t i;
+
+    for ( i = 0; i < n; i++ )
+        d[i] += s[i];
+}
+
+#define merge_count_array(_d, _s) \
+    merge_counts((int *)(_d), (const int *)(_s), sizeof(_d) / sizeof(int))
+
+static void volume_merge(struct trace_volume *d, const struct trace_volume *s)
+{
+    int i;
+
+    for ( i = 0; i < TOPLEVEL_MAX; i++ )
+        d->toplevel[i] += s->toplevel[i];
+    d->sched_verbose += s->sched_verbose;
+    for ( i = 0; i < HVM_VOL_MAX; i++ )
+        d->hvm[i] += s->hvm[i];
+}
+
+static void eip_list_write(FILE *f, struct eip_list_struct *head)
+{
+    struct eip_list_struct *p;
+    int n = 0;
+
+    for ( p = head; p; p = p->next )
+        n++;
+
+    state_write(f, &n, sizeof(n));
+
+    for ( p = head; p; p = p->next )
+    {
+        state_write(f, p, sizeof(*p));
+        cycle_summary_write(&p->summary, f);
+    }
+}
+
+static void eip_list_merge(FILE *f, struct eip_list_struct **head)
+{
+    int n;
+
+    state_read(f, &n, sizeof(n));
+
+    while ( n-- )
+    {
+        struct eip_list_struct *s, *p, **last = head;
+
+        s = state_read_alloc(f, sizeof(*s));
+        cycle_summary_read(&s->summary, f);
+
+        for ( p = *head; p; last = &p->next, p = p->next )
+            if ( p->eip >= s->eip )
+                break;
+
+        if ( !p || p->eip != s->eip )
+        {
+            s->next = p;
+            *last = s;
+            continue;
+        }
+
+        cycle_summary_merge(&p->summary, &s->summary);
+        free(s->summary.sample);
+        free(s);
+    }
+}
+
+static void io_address_write(FILE *f, struct io_address *list)
+{
+    struct io_address *p;
+    int n = 0;
+
+    for ( p = list; p; p = p->next )
+        n++;
+
+    state_write(f, &n, sizeof(n));
+
+    for ( p = list; p; p = p->next )
+    {
+        state_write(f, p, sizeof(*p));
+        for_each_cycle_summary(p->summary, cycle_summary_write, f);
+    }
+}
+
+static void io_address_merge(FILE *f, struct io_address **list)
+{
+    int n, i;
+
+    state_read(f, &n, sizeof(n));
+
+    while ( n-- )
+    {
+        struct io_address *s, *p, **last = list;
+
+        s = state_read_alloc(f, sizeof(*s));
+        for_each_cycle_summary(s->summary, cycle_summary_read, f);
+
+        for ( p = *list; p && p->pa < s->pa; last = &p->next, p = p->next )
+            ;
+
+        if ( !p || p->pa != s->pa )
+        {
+            s->next = p;
+            *last = s;
+            continue;
+        }
+
+        for ( i = 0; i < ARRAY_SIZE(s->summary); i++ )
+        {
+            cycle_summary_merge(p->summary + i, s->summary + i);
+            free(s->summary[i].sample);
+        }
+        free(s);
+    }
+}
+
+/* Handlers and their data are the same in all workers, as they are forked
+ * from the same process. */
+static void hvm_summary_handlers_write(FILE *f, struct hvm_data *h)
+{
+    int i;
+
+    for ( i = 0; i < HVM_EXIT_REASON_MAX; i++ )
+    {
+        struct hvm_summary_handler_node *p;
+        int n = 0;
+
+        for ( p = h->exit_reason_summary_handler_list[i]; p; p = p->next )
+            n++;
+
+        state_write(f, &n, sizeof(n));
+
+        for ( p = h->exit_reason_summary_handler_list[i]; p; p = p->next )
+        {
+            state_write(f, &p->handler, sizeof(p->handler));
+            state_write(f, &p->data, sizeof(p->data));
+        }
     }
 }
 
-void record_order_remove(struct pcpu_info *rem)
+static void hvm_summary_handlers_merge(FILE *f, struct hvm_data *h)
 {
     int i;
 
-    /* Find where the record is */
-    for(i=0; record_order[i] && record_order[i]!=rem; i++)
-        ;
+    for ( i = 0; i < HVM_EXIT_REASON_MAX; i++ )
+    {
+        int n;
 
-    /* Sanity check: Make sure it's actually there! */
-    assert(record_order[i]);
+        state_read(f, &n, sizeof(n));
 
-    /* And move everyone forward */
-    for(; (record_order[i]=record_order[i+1]); i++)
-        ;
+        while ( n-- )
+        {
+            struct hvm_summary_handler_node s, *p, **q;
+
+            state_read(f, &s.handler, sizeof(s.handler));
+            state_read(f, &s.data, sizeof(s.data));
+
+            for ( q = &h->exit_reason_summary_handler_list[i]; (p = *q);
+                  q = &p->next )
+                if ( p->handler == s.handler && p->data == s.data )
+                    break;
+
+            if ( p )
+                continue;
+
+            p = malloc(sizeof(*p));
+            if ( !p )
+            {
+                fprintf(stderr, "%s: Malloc failed!\n", __func__);
+                error(ERR_SYSTEM, NULL);
+            }
+            p->handler = s.handler;
+            p->data = s.data;
+            p->next = NULL;
+            *q = p;
+        }
+    }
 }
 
-struct pcpu_info * choose_next_record(void)
+static void shard_write_vcpu(FILE *f, struct vcpu_data *v)
 {
-    struct pcpu_info *min_p=NULL;
+    int tag = SHARD_STATE_VCPU;
 
-    min_p=record_order[0];
+    sched_finish_vcpu(v);
 
-    if(opt.progress && min_p && min_p->file_offset >= G.progress.update_offset)
-        progress_update(min_p->file_offset);
+    state_write(f, &tag, sizeof(tag));
+    state_write(f, v, sizeof(*v));
+    vcpu_cycle_summaries(v, cycle_summary_write, f);
 
-    /* If there are active pcpus, make sure we chose one */
-    assert(min_p || (P.max_active_pcpu==-1));
+    if ( v->data_type == VCPU_DATA_HVM )
+    {
+        hvm_summary_handlers_write(f, &v->hvm);
+        io_address_write(f, v->hvm.summary.io.pio);
+        io_address_write(f, v->hvm.summary.io.mmio);
+    }
+}
 
-    return min_p;
+static void shard_write_domain(FILE *f, struct domain_data *d)
+{
+    int tag = SHARD_STATE_DOMAIN, i;
+
+    state_write(f, &tag, sizeof(tag));
+    state_write(f, d, sizeof(*d));
+    domain_cycle_summaries(d, cycle_summary_write, f);
+    eip_list_write(f, d->emulate_eip_list);
+    eip_list_write(f, d->interrupt_eip_list);
+
+    for ( i = 0; i < MAX_CPUS; i++ )
+        if ( d->vcpu[i] )
+            shard_write_vcpu(f, d->vcpu[i]);
 }
 
-void process_records(void) {
-    while(1) {
-        struct pcpu_info *p = NULL;
+/* Called by a worker once it has processed its shard */
+static void shard_write_state(FILE *f)
+{
+    struct domain_data *d;
+    int tag, i;
 
-        if(!(p=choose_next_record()))
-            return;
+    state_write(f, &P.f, sizeof(P.f));
 
-        process_record(p);
+    for ( i = 0; i < MAX_CPUS; i++ )
+    {
+        struct pcpu_info *p = P.pcpu + i;
 
-        /* Lost records gets processed twice. */
-        if(p->ri.event == TRC_LOST_RECORDS) {
-            p->ri.event = TRC_LOST_RECORDS_END;
-            if(p->ri.tsc > p->order_tsc)
-                p->order_tsc = p->ri.tsc;
-            else {
-                fprintf(warn, "Strange, lost_record ri->tsc %lld !> p->order_tsc %lld!\n",
-                        p->ri.tsc, p->order_tsc);
-                error(ERR_FILE, NULL);
-            }
-        }
-        else
-            read_record(p);
+        if ( !p->summary )
+            continue;
 
-        /* Update this pcpu in the processing order */
-        if ( p->active )
-            record_order_bubble(p);
+        tag = SHARD_STATE_PCPU;
+        state_write(f, &tag, sizeof(tag));
+        state_write(f, p, sizeof(*p));
+        pcpu_cycle_summaries(p, cycle_summary_write, f);
+    }
+
+    shard_write_domain(f, &default_domain);
+    for ( d = domain_list; d; d = d->next )
+        shard_write_domain(f, d);
+
+    tag = SHARD_STATE_END;
+    state_write(f, &tag, sizeof(tag));
+
+    if ( fflush(f) )
+    {
+        fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(errno));
+        error(ERR_SYSTEM, NULL);
     }
 }
 
-void vcpu_summary(struct vcpu_data *v)
+static void shard_merge_vcpu(FILE *f, struct domain_data *d)
 {
-    printf("-- v%d --\n", v->vid);
-    sched_summary_vcpu(v);
-    switch(v->data_type) {
+    struct vcpu_data *s, *v;
+
+    s = state_read_alloc(f, sizeof(*s));
+    vcpu_cycle_summaries(s, cycle_summary_read, f);
+
+    if ( !(v = d->vcpu[s->vid]) )
+        v = vcpu_create(d, s->vid);
+
+    if ( s->data_type != VCPU_DATA_NONE )
+        vcpu_set_data_type(v, s->data_type);
+
+    merge_summaries(vcpu_cycle_summaries, v, s);
+
+    switch ( s->data_type )
+    {
     case VCPU_DATA_HVM:
-        hvm_summary(&v->hvm);
+    {
+        struct hvm_data *h = &v->hvm;
+        int i;
+
+        h->summary_info |= s->hvm.summary_info;
+        if ( !h->exit_reason_name )
+        {
+            h->exit_reason_name = s->hvm.exit_reason_name;
+            h->exit_reason_max = s->hvm.exit_reason_max;
+        }
+
+        merge_count_array(h->summary.extint, s->hvm.summary.extint);
+        for ( i = 0; i < ARRAY_SIZE(h->summary.guest_interrupt); i++ )
+            h->summary.guest_interrupt[i].count +=
+                s->hvm.summary.guest_interrupt[i].count;
+        merge_count_array(h->summary.ipi_count, s->hvm.summary.ipi_count);
+
+        hvm_summary_handlers_merge(f, h);
+        io_address_merge(f, &h->summary.io.pio);
+        io_address_merge(f, &h->summary.io.mmio);
         break;
+    }
     case VCPU_DATA_PV:
-        pv_summary(&v->pv);
+        v->pv.summary_info |= s->pv.summary_info;
+        merge_count_array(v->pv.count, s->pv.count);
+        merge_count_array(v->pv.hypercall_count, s->pv.hypercall_count);
+        merge_count_array(v->pv.trap_count, s->pv.trap_count);
         break;
     default:
         break;
     }
+
+    free(s);
 }
 
-void domain_summary(void)
+static struct domain_data *shard_merge_domain(FILE *f)
 {
-    struct domain_data * d;
-    int i;
+    struct domain_data *s, *d;
 
-    if(opt.show_default_domain_summary) {
-        d = &default_domain;
-        printf("|-- Default domain --|\n");
+    s = state_read_alloc(f, sizeof(*s));
+    domain_cycle_summaries(s, cycle_summary_read, f);
 
-        for( i = 0; i < MAX_CPUS ; i++ )
-        {
-            if(d->vcpu[i])
-                vcpu_summary(d->vcpu[i]);
-        }
-    }
+    d = (s->did == DEFAULT_DOMAIN) ? &default_domain : domain_find(s->did);
 
-    for ( d = domain_list ; d ; d=d->next )
-    {
-        int i;
-        printf("|-- Domain %d --|\n", d->did);
+    merge_summaries(domain_cycle_summaries, d, s);
+    merge_count_array(d->guest_interrupt, s->guest_interrupt);
+    merge_count_array(d->memops.done, s->memops.done);
+    merge_count_array(d->memops.done_for, s->memops.done_for);
+    merge_count_array(d->pod.reclaim_order, s->pod.reclaim_order);
+    merge_count_array(d->pod.reclaim_context, s->pod.reclaim_context);
+    merge_count_array(d->pod.reclaim_context_order,
+                      s->pod.reclaim_context_order);
+    merge_count_array(d->pod.populate_order, s->pod.populate_order);
 
-        sched_summary_domain(d);
+    eip_list_merge(f, &d->emulate_eip_list);
+    eip_list_merge(f, &d->interrupt_eip_list);
 
-        mem_summary_domain(d);
+    free(s);
 
-        for( i = 0; i < MAX_CPUS ; i++ )
+    return d;
+}
+
+static void shard_merge_state(FILE *f)
+{
+    struct cycle_framework cf;
+    struct domain_data *d = NULL;
+    int tag;
+
+    state_read(f, &cf, sizeof(cf));
+
+    if ( cf.first_tsc && (!P.f.first_tsc || cf.first_tsc < P.f.first_tsc) )
+        P.f.first_tsc = cf.first_tsc;
+    if ( cf.last_tsc > P.f.last_tsc )
+        P.f.last_tsc = cf.last_tsc;
+    P.f.total_cycles = P.f.last_tsc - P.f.first_tsc;
+
+    for ( ; ; )
+    {
+        state_read(f, &tag, sizeof(tag));
+
+        switch ( tag )
         {
-            if(d->vcpu[i])
-                vcpu_summary(d->vcpu[i]);
+        case SHARD_STATE_END:
+            return;
+        case SHARD_STATE_PCPU:
+        {
+            struct pcpu_info *s, *p;
+
+            s = state_read_alloc(f, sizeof(*s));
+            pcpu_cycle_summaries(s, cycle_summary_read, f);
+
+            p = P.pcpu + s->pid;
+            p->summary = 1;
+            volume_merge(&p->volume.total, &s->volume.total);
+            merge_summaries(pcpu_cycle_summaries, p, s);
+
+            free(s);
+            break;
+        }
+        case SHARD_STATE_DOMAIN:
+            d = shard_merge_domain(f);
+            break;
+        case SHARD_STATE_VCPU:
+            assert(d);
+            shard_merge_vcpu(f, d);
+            break;
+        default:
+            fprintf(stderr, "%s: Unexpected tag %d\n", __func__, tag);
+            error(ERR_ASSERT, NULL);
         }
+    }
+}
 
-        printf("Emulate eip list\n");
-        dump_eip(d->emulate_eip_list);
+static void shard_copy_output(FILE *f)
+{
+    char buf[1 << 16];
+    size_t n;
 
-        if ( opt.with_interrupt_eip_enumeration )
+    rewind(f);
+    while ( (n = fread(buf, 1, sizeof(buf), f)) > 0 )
+        if ( fwrite(buf, 1, n, stdout) != n )
         {
-            printf("Interrupt eip list (vector %d)\n",
-                   opt.interrupt_eip_enumeration_vector);
-            dump_eip(d->interrupt_eip_list);
+            perror("fwrite");
+            error(ERR_SYSTEM, NULL);
         }
-
-        cr3_dump_list(d->cr3_value_head);
-    }
 }
 
-char * stringify_cpu_hz(long long cpu_hz);
+static FILE *shard_tmpfile(void)
+{
+    FILE *f = tmpfile();
 
-void summary(void) {
-    int i;
-    printf("Total time: %.2lf seconds (using cpu speed %s)\n",
-           ((double)(P.f.total_cycles))/opt.cpu_hz,
-           stringify_cpu_hz(opt.cpu_hz));
-    printf("--- Log volume summary ---\n");
-    for(i=0; i<MAX_CPUS; i++)
+    if ( !f )
     {
-        struct pcpu_info *p = P.pcpu+i;
-        if(!p->summary)
-            continue;
-        printf(" - cpu %d -\n", i);
-        volume_summary(&p->volume.total);
+        fprintf(stderr, "%s: tmpfile failed: %s\n", __func__, strerror(errno));
+        error(ERR_SYSTEM, NULL);
     }
-    domain_summary();
+
+    return f;
 }
 
-void report_pcpu(void) {
-    int i, active=0;
+void parallel_process_records(void)
+{
+    struct shard *shards;
+    tsc_t *start;
+    unsigned long long total = 0, done = 0;
+    unsigned long i;
+    int k, failed = 0;
 
-    for(i=0; i<MAX_CPUS; i++)
+    shards = calloc(opt.jobs, sizeof(*shards));
+    start = calloc(opt.jobs + 1, sizeof(*start));
+    if ( !shards || !start )
     {
-        struct pcpu_info *p = P.pcpu+i;
-        if(!p->summary)
-            continue;
-        printf("pcpu %d\n", i);
+        fprintf(stderr, "%s: calloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
 
-        print_cycle_summary(&p->time.running, " running");
-        print_cycle_summary(&p->time.idle,    "    idle");
-        print_cycle_summary(&p->time.lost,    "    lost");
+    /* Split the trace into shards of about the same size. */
+    for ( i = 0; i < I.nr_windows; i++ )
+        total += I.windows[i].size;
 
-        if ( p->time.running.count )
-            active++;
+    for ( i = 0, k = 1; i < I.nr_windows && k < opt.jobs; i++ )
+    {
+        if ( done * opt.jobs >= total * k )
+        {
+            start[k] = I.tsc[i] > start[k - 1] ? I.tsc[i] : start[k - 1];
+            k++;
+        }
+        done += I.windows[i].size;
     }
-    printf("Total active cpus: %d\n", active);
+    for ( ; k <= opt.jobs; k++ )
+        start[k] = ~0ULL;
 
-}
-
-void init_pcpus(void) {
-    int i=0;
-    off_t offset = 0;
+    fflush(NULL);
 
-    for(i=0; i<MAX_CPUS; i++)
+    for ( k = 0; k < opt.jobs; k++ )
     {
-        P.pcpu[i].pid=i;
-        P.pcpu[i].lost_record.seen_valid_schedule=1;
-        P.pcpu[i].power_state=CSTATE_INVALID;
-    }
+        shards[k].out = shard_tmpfile();
+        shards[k].state = shard_tmpfile();
 
-    P.max_active_pcpu = -1;
+        shards[k].pid = fork();
+        if ( shards[k].pid < 0 )
+        {
+            fprintf(stderr, "%s: could not fork: %s\n",
+                    __func__, strerror(errno));
+            error(ERR_SYSTEM, NULL);
+        }
 
-    sched_default_domain_init();
+        if ( shards[k].pid == 0 )
+        {
+            if ( dup2(fileno(shards[k].out), STDOUT_FILENO) < 0 )
+            {
+                perror("dup2");
+                error(ERR_SYSTEM, NULL);
+            }
 
-    /* Scan through the cpu_change recs until we see a duplicate */
-    do {
-        offset = scan_for_new_pcpu(offset);
+            fprintf(warn, "%s: shard %d from tsc %llu\n",
+                    __func__, k, start[k]);
 
-        if(!offset) {
-            fprintf(warn, "%s: through first trace write, done for now.\n",
-                   __func__);
+            index_set_shard(start[k], start[k + 1]);
+            /* Report times relative to the start of the whole trace. */
+            P.f.first_tsc = I.first_tsc;
+
+            init_pcpus();
+            process_records();
+
+            shard_write_state(shards[k].state);
+            exit(0);
         }
-    } while(offset);
+    }
+
+    /* The parent doesn't process any windows itself. */
+    index_set_shard(0, 0);
+    init_pcpus();
+
+    for ( k = 0; k < opt.jobs; k++ )
+    {
+        int status;
+
+        if ( waitpid(shards[k].pid, &status, 0) < 0
+             || !WIFEXITED(status) || WEXITSTATUS(status) )
+        {
+            fprintf(stderr, "%s: shard %d failed\n", __func__, k);
+            failed = 1;
+        }
+    }
+
+    for ( k = 0; k < opt.jobs; k++ )
+    {
+        shard_copy_output(shards[k].out);
+        fclose(shards[k].out);
+    }
+    fflush(stdout);
+
+    if ( failed )
+        error(ERR_SYSTEM, NULL);
+
+    for ( k = 0; k < opt.jobs; k++ )
+    {
+        rewind(shards[k].state);
+        shard_merge_state(shards[k].state);
+        fclose(shards[k].state);
+    }
 
+    free(start);
+    free(shards);
 }
 
 enum {
@@ -10130,6 +11560,7 @@ enum {
     OPT_SAMPLE_SIZE,
     OPT_SAMPLE_MAX,
     OPT_REPORT_PCPU,
+    OPT_REPORT_SMT,
     /* Guest info */
     OPT_DEFAULT_GUEST_PAGING_LEVELS,
     OPT_SYMBOL_FILE,
@@ -10140,9 +11571,11 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_INDEX_FILE,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
+    OPT_JOBS='j',
     OPT_SUMMARY='s',
 };
 
@@ -10569,6 +12002,10 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         //opt.summary_info = 1;
         G.output_defined = 1;
         break;
+    case OPT_REPORT_SMT:
+        opt.report_smt = 1;
+        G.output_defined = 1;
+        break;
         /* Guest info group */
     case OPT_DEFAULT_GUEST_PAGING_LEVELS:
     {
@@ -10620,6 +12057,21 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_INDEX_FILE:
+        G.index_file = arg;
+        break;
+
+    case OPT_JOBS:
+    {
+        char * inval;
+
+        opt.jobs = (int)strtol(arg, &inval, 0);
+
+        if( inval == arg || opt.jobs < 1 )
+            argp_usage(state);
+    }
+    break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10636,6 +12088,21 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
             interval_header();
         }
 
+        if ( opt.jobs > 1
+             && (opt.interval_mode || opt.with_cr3_enumeration
+                 || opt.histogram_interrupt_eip) )
+        {
+            fprintf(stderr, "Interval, cr3 and histogram reports can't be "
+                    "merged between jobs, processing in one job.\n");
+            opt.jobs = 1;
+        }
+
+        if ( opt.jobs > 1 && opt.progress )
+        {
+            fprintf(stderr, "No progress dialog with more than one job.\n");
+            opt.progress = 0;
+        }
+
         if(!G.output_defined)
         {
             fprintf(stderr, "No output defined, using summary.\n");
@@ -10876,6 +12343,11 @@ const struct argp_option cmd_opts[] =  {
       .group = OPT_GROUP_SUMMARY,
       .doc = "Report utilization for pcpus", },
 
+    { .name = "report-smt",
+      .key = OPT_REPORT_SMT,
+      .group = OPT_GROUP_SUMMARY,
+      .doc = "Report contention between SMT siblings (credit2 only)", },
+
     /* Guest info */
     { .name = "default-guest-paging-levels",
       .key = OPT_DEFAULT_GUEST_PAGING_LEVELS,
@@ -10904,6 +12376,20 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "index-file",
+      .key = OPT_INDEX_FILE,
+      .arg = "filename",
+      .doc = "Use an index of the trace's pcpu windows kept in [filename], "\
+      "building it first if missing or out of date.  Lets each pcpu skip "\
+      "straight to its next window.", },
+
+    { .name = "jobs",
+      .key = OPT_JOBS,
+      .arg = "N",
+      .doc = "Split the trace into N time shards processed in parallel, and "\
+      "merge the results.  Summaries are approximate at shard boundaries.  "\
+      "Default 1.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10938,6 +12424,8 @@ int main(int argc, char *argv[]) {
         G.file_size = s.st_size;
     }
 
+    compact_open();
+
     if ( (G.mh = mread_init(G.fd)) == NULL )
         perror("mread");
 
@@ -10947,12 +12435,20 @@ int main(int argc, char *argv[]) {
     if(opt.dump_all)
         warn = stdout;
 
-    init_pcpus();
+    if ( opt.jobs > 1 || G.index_file )
+        index_init();
 
-    if(opt.progress)
-        progress_init();
+    if ( opt.jobs > 1 )
+        parallel_process_records();
+    else
+    {
+        init_pcpus();
+
+        if(opt.progress)
+            progress_init();
 
-    process_records();
+        process_records();
+    }
 
     if(opt.interval_mode)
         interval_tail();
@@ -10963,6 +12459,9 @@ int main(int argc, char *argv[]) {
     if(opt.report_pcpu)
         report_pcpu();
 
+    if(opt.report_smt)
+        report_smt();
+
     if(opt.progress)
         progress_finish();
 
@@ -25,7 +25,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <poll.h>
+#include <limits.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -34,6 +36,8 @@
 #include <xenevtchn.h>
 #include <xenctrl.h>
 
+#include "compact.h"
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -60,15 +64,18 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    char *memory_buffer_file;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        compact:1;
 } settings_t;
 
 struct t_struct {
     const struct t_info *t_info; /* Structure with information about individual buffers */
     struct t_buf **meta;    /* Pointers to trace buffer metadata */
     unsigned char **data;   /* Pointers to trace buffer data areas */
+    unsigned long *data_size; /* Sizes of trace buffer data areas */
 };
 
 settings_t opts;
@@ -85,10 +92,31 @@ static void close_handler(int signal)
     interrupted = 1;
 }
 
+/*
+ * Header of a memory buffer placed in a file with --memory-buffer-file,
+ * followed by the buffer at offset MEMBUF_SHARED_DATA.  prod and cons are
+ * byte counts which never wrap; the data at counter c is at c % size.
+ * Data between cons and prod is complete windows as written to a trace
+ * file.  cons is advanced before the space is reused, so a reader can
+ * copy data and then check whether cons has moved past it meanwhile.
+ */
+struct membuf_shared {
+    uint32_t magic, version;
+    uint32_t flags, pad;
+#define MEMBUF_SHARED_COMPACT (1U << 0) /* windows in compact format */
+    uint64_t size;
+    volatile uint64_t prod, cons;
+};
+
+#define MEMBUF_SHARED_MAGIC   0x78746d62 /* "xtmb" */
+#define MEMBUF_SHARED_VERSION 1
+#define MEMBUF_SHARED_DATA    4096
+
 static struct {
     char * buf;
     unsigned long prod, cons, size;
     unsigned long pending_size, pending_prod;
+    struct membuf_shared *shared;
 } membuf = { 0 };
 
 #define MEMBUF_INDEX_RESET_THRESHOLD (1<<29)
@@ -98,6 +126,8 @@ static struct {
 #define MEMBUF_CONS_INCREMENT(_n)               \
     do {                                        \
         membuf.cons += (_n);                    \
+        if ( membuf.shared )                    \
+            membuf.shared->cons += (_n);        \
     } while(0)
 #define MEMBUF_PROD_SET(_x)                                             \
     do {                                                                \
@@ -106,6 +136,11 @@ static struct {
                     __func__, membuf.prod, (unsigned long)(_x));        \
             exit(1);                                                    \
         }                                                               \
+        if ( membuf.shared )                                            \
+        {                                                               \
+            xen_wmb(); /* write data, then update prod. */              \
+            membuf.shared->prod += (_x) - membuf.prod;                  \
+        }                                                               \
         membuf.prod = (_x);                                             \
         if ( (_x) > MEMBUF_INDEX_RESET_THRESHOLD )                      \
         {                                                               \
@@ -131,7 +166,39 @@ struct cpu_change_record {
 
 void membuf_alloc(unsigned long size)
 {
-    membuf.buf = malloc(size);
+    if ( opts.memory_buffer_file )
+    {
+        void *p;
+        int fd = open(opts.memory_buffer_file, O_RDWR | O_CREAT | O_TRUNC,
+                      0644);
+
+        if ( fd < 0 || ftruncate(fd, MEMBUF_SHARED_DATA + size) )
+        {
+            PERROR("Could not create memory buffer file %s",
+                   opts.memory_buffer_file);
+            exit(EXIT_FAILURE);
+        }
+
+        p = mmap(NULL, MEMBUF_SHARED_DATA + size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+        if ( p == MAP_FAILED )
+        {
+            PERROR("Could not map memory buffer file %s",
+                   opts.memory_buffer_file);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+
+        membuf.shared = p;
+        membuf.shared->size = size;
+        membuf.shared->version = MEMBUF_SHARED_VERSION;
+        membuf.shared->flags = opts.compact ? MEMBUF_SHARED_COMPACT : 0;
+        xen_wmb();
+        membuf.shared->magic = MEMBUF_SHARED_MAGIC;
+        membuf.buf = (char *)p + MEMBUF_SHARED_DATA;
+    }
+    else
+        membuf.buf = malloc(size);
 
     if(!membuf.buf)
     {
@@ -218,6 +285,9 @@ void membuf_reserve_window(unsigned cpu, unsigned long window_size)
     }
 
 start_window:
+    if ( membuf.shared )
+        xen_mb(); /* publish cons, then overwrite data. */
+
     /*
      * Start writing "pending" data.  Update prod once all this data is
      * written.
@@ -332,50 +402,118 @@ fail:
     return;
 }
 
-/**
- * write_buffer - write a section of the trace buffer
- * @cpu      - source buffer CPU ID
- * @start
- * @size     - size of write (may be less than total window size)
- * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
- *
- * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* _XOPEN_IOV_MAX */
+#endif
+#define OUTQ_MAX (IOV_MAX < 1024 ? IOV_MAX : 1024)
+
+/*
+ * Trace data is written to the output file straight from the mapped trace
+ * buffers.  The windows found in one pass over the buffers are queued here
+ * and written with a single writev(); the buffers are handed back to Xen
+ * once the queue has been flushed.
  */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static struct {
+    struct iovec iov[OUTQ_MAX];
+    unsigned int nr;
+    unsigned long bytes;
+} outq;
+
+/* cpu_change records queued for each cpu, referenced by outq. */
+static struct cpu_change_record *cpu_change_recs;
+
+static void check_disk_space(unsigned long size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+    unsigned long long freespace;
+
+    if ( opts.disk_rsvd == 0 )
+        return;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (outfd, &stat) )
     {
-        unsigned long long freespace;
+        PERROR("Statfs failed!");
+        exit(EXIT_FAILURE);
+    }
 
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
 
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+    freespace >>= 20; /* Convert to MB */
 
-        freespace >>= 20; /* Convert to MB */
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
+static void outq_flush(void)
+{
+    struct iovec *iov = outq.iov;
+    unsigned int nr = outq.nr;
+    ssize_t written;
 
-        if ( freespace <= opts.disk_rsvd )
+    if ( nr == 0 )
+        return;
+
+    check_disk_space(outq.bytes);
+
+    while ( nr )
+    {
+        written = writev(outfd, iov, nr);
+        if ( written < 0 && errno == EINTR )
+            continue;
+        if ( written <= 0 )
+        {
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Short write: skip what has been written, and retry the rest. */
+        while ( nr && (size_t)written >= iov->iov_len )
         {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
+            written -= iov->iov_len;
+            iov++;
+            nr--;
+        }
+        if ( nr )
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
         }
     }
 
+    outq.nr = 0;
+    outq.bytes = 0;
+}
+
+static void outq_add(void *start, unsigned long size)
+{
+    if ( outq.nr == OUTQ_MAX )
+        outq_flush();
+
+    outq.iov[outq.nr].iov_base = start;
+    outq.iov[outq.nr].iov_len = size;
+    outq.nr++;
+    outq.bytes += size;
+}
+
+/**
+ * write_buffer - write a section of the trace buffer
+ * @cpu      - source buffer CPU ID
+ * @start
+ * @size     - size of write (may be less than total window size)
+ * @total_size - total size of the window (0 on 2nd write of wrapped windows)
+ *
+ * Queues the trace buffer for output, prepending the CPU and size of the
+ * buffer write.  The data must stay in place until outq_flush().
+ */
+static void write_buffer(unsigned int cpu, unsigned char *start, int size,
+                         int total_size)
+{
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
      * first write. */
@@ -387,42 +525,72 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
         }
         else
         {
-            struct cpu_change_record rec;
+            struct cpu_change_record *rec = &cpu_change_recs[cpu];
 
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
+            rec->header = CPU_CHANGE_HEADER;
+            rec->data.cpu = cpu;
+            rec->data.window_size = total_size;
 
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
+            outq_add(rec, sizeof(*rec));
         }
     }
 
     if ( opts.memory_buffer )
-    {
         membuf_write(start, size);
-    }
     else
+        outq_add(start, size);
+}
+
+/*
+ * Append the records at src to dst in the format described in compact.h,
+ * returning the bytes written.  Windows only contain whole records, as Xen
+ * pads the end of a buffer with a TRC_TRACE_WRAP_BUFFER record rather than
+ * splitting a record.  *tsc is the tsc of the previous record in the window.
+ */
+static unsigned long compact_encode(unsigned int cpu, unsigned char *dst,
+                                    const unsigned char *src,
+                                    unsigned long size, uint64_t *tsc)
+{
+    unsigned char *p = dst;
+    const unsigned char *end = src + size;
+
+    while ( src < end )
     {
-        written = write(outfd, start, size);
-        if ( written != size )
+        uint32_t hdr;
+        uint64_t cur;
+        unsigned int extra, cycles;
+
+        if ( src + sizeof(hdr) > end )
+            goto bad;
+        memcpy(&hdr, src, sizeof(hdr));
+        cycles = TRC_HD_INCLUDES_CYCLE_COUNT(hdr) ? sizeof(cur) : 0;
+        extra = TRC_HD_EXTRA(hdr) * sizeof(uint32_t);
+        if ( src + sizeof(hdr) + cycles + extra > end )
+            goto bad;
+
+        memcpy(p, &hdr, sizeof(hdr));
+        p += sizeof(hdr);
+        src += sizeof(hdr);
+
+        if ( cycles )
         {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
-            goto fail;
+            memcpy(&cur, src, sizeof(cur));
+            p += compact_put_tsc(p, cur, *tsc);
+            *tsc = cur;
+            src += sizeof(cur);
         }
+
+        memcpy(p, src, extra);
+        p += extra;
+        src += extra;
     }
 
-    return;
+    return p - dst;
 
-fail:
-    PERROR("Failed to write trace data");
-    exit(EXIT_FAILURE);
+bad:
+    fprintf(stderr, "%s: cpu %u: partial record at end of window, dropped\n",
+            __func__, cpu);
+    return p - dst;
 }
 
 static void disable_tbufs(void)
@@ -483,12 +651,6 @@ static struct t_struct *map_tbufs(unsigned long tbufs_mfn, unsigned int num,
         exit(EXIT_FAILURE);
     }
 
-    if ( tbufs.t_info->tbuf_size == 0 )
-    {
-        fprintf(stderr, "%s: tbuf_size 0!\n", __func__);
-        exit(EXIT_FAILURE);
-    }
-
     /* 
      * Map per-cpu buffers.  NB that if a cpu is offline, it may have
      * no trace buffers.  In this case, the respective mfn_offset will
@@ -496,7 +658,8 @@ static struct t_struct *map_tbufs(unsigned long tbufs_mfn, unsigned int num,
      */
     tbufs.meta = (struct t_buf **)calloc(num, sizeof(struct t_buf *));
     tbufs.data = (unsigned char **)calloc(num, sizeof(unsigned char *));
-    if ( tbufs.meta == NULL || tbufs.data == NULL )
+    tbufs.data_size = calloc(num, sizeof(*tbufs.data_size));
+    if ( tbufs.meta == NULL || tbufs.data == NULL || tbufs.data_size == NULL )
     {
         PERROR( "Failed to allocate memory for buffer pointers\n");
         exit(EXIT_FAILURE);
@@ -505,26 +668,37 @@ static struct t_struct *map_tbufs(unsigned long tbufs_mfn, unsigned int num,
     for(i=0; i<num; i++)
     {
         const uint32_t *mfn_list;
-        int j;
-        xen_pfn_t pfn_list[tbufs.t_info->tbuf_size];
+        unsigned int j, pages;
 
         if ( !tbufs.t_info->mfn_offset[i] )
             continue;
 
+        /* The size of each buffer precedes its list of mfns. */
         mfn_list = (const uint32_t *)tbufs.t_info + tbufs.t_info->mfn_offset[i];
-        for ( j=0; j<tbufs.t_info->tbuf_size; j++)
-            pfn_list[j] = (xen_pfn_t)mfn_list[j];
+        pages = tbufs.t_info->tbuf_size ?: mfn_list[-1];
+        if ( pages == 0 )
+        {
+            fprintf(stderr, "%s: tbuf_size 0 for cpu %d!\n", __func__, i);
+            exit(EXIT_FAILURE);
+        }
+
+        {
+            xen_pfn_t pfn_list[pages];
+
+            for ( j = 0; j < pages; j++ )
+                pfn_list[j] = (xen_pfn_t)mfn_list[j];
 
-        tbufs.meta[i] = xc_map_foreign_pages(xc_handle, DOMID_XEN,
-                                             PROT_READ | PROT_WRITE,
-                                             pfn_list,
-                                             tbufs.t_info->tbuf_size);
+            tbufs.meta[i] = xc_map_foreign_pages(xc_handle, DOMID_XEN,
+                                                 PROT_READ | PROT_WRITE,
+                                                 pfn_list, pages);
+        }
         if ( tbufs.meta[i] == NULL )
         {
             PERROR("Failed to map cpu buffer!");
             exit(EXIT_FAILURE);
         }
         tbufs.data[i] = (unsigned char *)(tbufs.meta[i]+1);
+        tbufs.data_size[i] = pages * XC_PAGE_SIZE - sizeof(struct t_buf);
     }
 
     return &tbufs;
@@ -679,9 +853,8 @@ static void monitor_tbufs(void)
     unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
     unsigned int  num;           /* number of trace buffers / logical CPUS   */
     unsigned long tinfo_size;    /* size of t_info metadata map */
-    unsigned long size;          /* size of a single trace buffer            */
-
-    unsigned long data_size;
+    unsigned long *new_cons;     /* cons to hand back after writing */
+    unsigned char **compact_buf = NULL; /* windows in compact format */
 
     int last_read = 1;
 
@@ -699,13 +872,33 @@ static void monitor_tbufs(void)
     
     tbufs = map_tbufs(tbufs_mfn, num, tinfo_size);
 
-    size = tbufs->t_info->tbuf_size * XC_PAGE_SIZE;
-
-    data_size = size - sizeof(struct t_buf);
-
     meta = tbufs->meta;
     data = tbufs->data;
 
+    new_cons = calloc(num, sizeof(*new_cons));
+    cpu_change_recs = calloc(num, sizeof(*cpu_change_recs));
+    if ( opts.compact )
+        compact_buf = calloc(num, sizeof(*compact_buf));
+    if ( !new_cons || !cpu_change_recs || (opts.compact && !compact_buf) )
+    {
+        PERROR("Failed to allocate memory for buffer state");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < num; i++ )
+    {
+        new_cons[i] = ~0UL;
+
+        /* A record of 12 bytes grows to at most 4 + COMPACT_TSC_MAX. */
+        if ( opts.compact && meta[i] &&
+             !(compact_buf[i] = malloc(tbufs->data_size[i] +
+                                       tbufs->data_size[i] / 4)) )
+        {
+            PERROR("Failed to allocate compact buffer for cpu %d", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if ( opts.discard )
         for ( i = 0; i < num; i++ )
             if ( meta[i] )
@@ -717,6 +910,7 @@ static void monitor_tbufs(void)
         for ( i = 0; i < num; i++ )
         {
             unsigned long start_offset, end_offset, window_size, cons, prod;
+            unsigned long data_size = tbufs->data_size[i];
 
             if ( !meta[i] )
                 continue;
@@ -744,7 +938,28 @@ static void monitor_tbufs(void)
             start_offset = cons % data_size;
             end_offset = prod % data_size;
 
-            if ( end_offset > start_offset )
+            if ( opts.compact )
+            {
+                uint64_t tsc = 0;
+                unsigned long size;
+
+                if ( end_offset > start_offset )
+                    size = compact_encode(i, compact_buf[i],
+                                          data[i] + start_offset,
+                                          window_size, &tsc);
+                else
+                {
+                    size = compact_encode(i, compact_buf[i],
+                                          data[i] + start_offset,
+                                          data_size - start_offset, &tsc);
+                    size += compact_encode(i, compact_buf[i] + size,
+                                           data[i], end_offset, &tsc);
+                }
+
+                if ( size )
+                    write_buffer(i, compact_buf[i], size, size);
+            }
+            else if ( end_offset > start_offset )
             {
                 /* If window does not wrap, write in one big chunk */
                 write_buffer(i, data[i]+start_offset,
@@ -765,9 +980,18 @@ static void monitor_tbufs(void)
                              0);
             }
 
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
+            new_cons[i] = prod;
+        }
 
+        /* Write the windows, then hand the buffers back to Xen. */
+        outq_flush();
+        xen_mb(); /* read buffer, then update cons. */
+        for ( i = 0; i < num; i++ )
+        {
+            if ( new_cons[i] == ~0UL )
+                continue;
+            meta[i]->cons = new_cons[i];
+            new_cons[i] = ~0UL;
         }
 
         if ( interrupted )
@@ -791,8 +1015,15 @@ static void monitor_tbufs(void)
         membuf_dump();
 
     /* cleanup */
+    if ( compact_buf )
+        for ( i = 0; i < num; i++ )
+            free(compact_buf[i]);
+    free(compact_buf);
+    free(cpu_change_recs);
+    free(new_cons);
     free(meta);
     free(data);
+    free(tbufs->data_size);
     /* don't need to munmap - cleanup is automatic */
 }
 
@@ -839,6 +1070,13 @@ static void usage(int status)
 "  -V, --version           Print program version\n" \
 "  -M, --memory-buffer=b   Copy trace records to a circular memory buffer.\n" \
 "                          Dump to file on exit.\n" \
+"      --memory-buffer-file=f\n" \
+"                          Place the memory buffer in file f, so that other\n" \
+"                          processes can map it and read records while\n" \
+"                          xentrace is running.\n" \
+"      --compact           Write records in a compact format, replacing the\n" \
+"                          tsc of each record by a variable length encoded\n" \
+"                          difference to the previous one.\n" \
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
@@ -1075,6 +1313,11 @@ static int parse_cpu_mask(void)
 }
 
 /* parse command line arguments */
+enum {
+    OPT_MEMORY_BUFFER_FILE = 256,
+    OPT_COMPACT,
+};
+
 static void parse_args(int argc, char **argv)
 {
     int option;
@@ -1087,6 +1330,8 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "memory-buffer-file", required_argument, 0, OPT_MEMORY_BUFFER_FILE },
+        { "compact",        no_argument,       0, OPT_COMPACT },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -1144,6 +1389,14 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case OPT_MEMORY_BUFFER_FILE:
+            opts.memory_buffer_file = optarg;
+            break;
+
+        case OPT_COMPACT:
+            opts.compact = 1;
+            break;
+
         case 'h':
             usage(EXIT_SUCCESS);
             break;
@@ -1156,6 +1409,12 @@ static void parse_args(int argc, char **argv)
     /* get outfile (optional last argument) */
     if (argc > optind)
         opts.outfile = argv[optind];
+
+    if ( opts.memory_buffer_file && !opts.memory_buffer )
+    {
+        fprintf(stderr, "--memory-buffer-file requires --memory-buffer.\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 /* *BSD has no O_LARGEFILE */
@@ -1214,6 +1473,20 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if ( opts.compact )
+    {
+        struct compact_header hdr = {
+            .magic = COMPACT_MAGIC,
+            .version = COMPACT_VERSION,
+        };
+
+        if ( write(outfd, &hdr, sizeof(hdr)) != sizeof(hdr) )
+        {
+            PERROR("Failed to write compact header");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if ( opts.memory_buffer > 0 )
         membuf_alloc(opts.memory_buffer);
 
@@ -45,6 +45,8 @@ struct domain_create {
     const char *restore_file;
     char *colo_proxy_script;
     bool userspace_colo_proxy;
+    unsigned int copy_threads;
+    bool postcopy_resume;
     int migrate_fd; /* -1 means none */
     int send_back_fd; /* -1 means none */
     char **migration_domname_r; /* from malloc */
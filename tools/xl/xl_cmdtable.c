@@ -160,7 +160,9 @@ const struct cmd_spec cmd_table[] = {
       "-h  Print this help.\n"
       "-c  Leave domain running after creating the snapshot.\n"
       "-p  Leave domain paused after creating the snapshot.\n"
-      "-D  Store the domain id in the configuration."
+      "-D  Store the domain id in the configuration.\n"
+      "--sparse  Leave out pages of zeroes, and align memory in the file\n"
+      "          for faster restore."
     },
     { "migrate",
       &main_migrate, 0, 1,
@@ -175,7 +177,17 @@ const struct cmd_spec cmd_table[] = {
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
       "-p              Do not unpause domain after migrating it.\n"
-      "-D              Preserve the domain id"
+      "-D              Preserve the domain id\n"
+      "--max-downtime <ms>\n"
+      "                Keep copying memory until the rest is predicted to be\n"
+      "                sent within <ms> while the domain is suspended.\n"
+      "--auto-converge Throttle the domain's vCPUs if it dirties memory faster\n"
+      "                than it can be sent (credit2 only).\n"
+      "--compress      Compress memory in the migration stream.\n"
+      "--threads <n>   Use <n> threads to send and receive memory.\n"
+      "--postcopy      Resume the domain at <host> before all of its memory\n"
+      "                is sent, which is then sent as the domain touches it\n"
+      "                (HVM only).  A failure after that loses the domain."
     },
     { "restore",
       &main_restore, 0, 1,
@@ -186,7 +198,8 @@ const struct cmd_spec cmd_table[] = {
       "-e                       Do not wait in the background for the death of the domain.\n"
       "-d                       Enable debug messages.\n"
       "-V, --vncviewer          Connect to the VNC display after the domain is created.\n"
-      "-A, --vncviewer-autopass Pass VNC password to viewer via stdin."
+      "-A, --vncviewer-autopass Pass VNC password to viewer via stdin.\n"
+      "--threads <n>            Use <n> threads to copy memory into the domain."
     },
     { "migrate-receive",
       &main_migrate_receive, 0, 1,
@@ -285,13 +298,18 @@ const struct cmd_spec cmd_table[] = {
     { "sched-rtds",
       &main_sched_rtds, 0, 1,
       "Get/set rtds scheduler parameters",
-      "[-d <Domain> [-v[=VCPUID/all]] [-p[=PERIOD]] [-b[=BUDGET]] [-e[=Extratime]]]",
+      "[-d <Domain> [-v[=VCPUID/all]] [-p[=PERIOD]] [-b[=BUDGET]] [-e[=Extratime]]] [-c <CPUPool>] [-s [-r[=RUNQUEUE]]]",
       "-d DOMAIN, --domain=DOMAIN     Domain to modify\n"
       "-v VCPUID/all, --vcpuid=VCPUID/all    VCPU to modify or output;\n"
       "               Using '-v all' to modify/output all vcpus\n"
       "-p PERIOD, --period=PERIOD     Period (us)\n"
       "-b BUDGET, --budget=BUDGET     Budget (us)\n"
       "-e Extratime, --extratime=Extratime Extratime (1=yes, 0=no)\n"
+      "-c CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL, or the\n"
+      "               CPUPOOL of the scheduler parameters\n"
+      "-s         --schedparam        Query / modify scheduler parameters\n"
+      "-r RUNQUEUE, --runqueue=RUNQUEUE  One runqueue per cpu|core|socket|node,\n"
+      "               or all; only for a cpupool without CPUs\n"
     },
     { "domid",
       &main_domid, 0, 0,
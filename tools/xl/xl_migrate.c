@@ -178,7 +178,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 
 static void migrate_domain(uint32_t domid, int preserve_domid,
                            const char *rune, int debug,
-                           const char *override_config_file)
+                           const char *override_config_file,
+                           libxl_domain_suspend_params *params)
 {
     pid_t child = -1;
     int rc;
@@ -187,6 +188,7 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     char rc_buf;
     uint8_t *config_data;
     int config_len, flags = LIBXL_SUSPEND_LIVE;
+    bool postcopy = libxl_defbool_val(params->postcopy);
 
     save_domain_core_begin(domid, preserve_domid, override_config_file,
                            &config_data, &config_len);
@@ -199,6 +201,10 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
 
     child = create_migration_child(rune, &send_fd, &recv_fd);
 
+    /* Faults of a post-copy migration come back from the receiver. */
+    if (postcopy)
+        params->recv_fd = recv_fd;
+
     migrate_do_preamble(send_fd, recv_fd, child, config_data, config_len,
                         rune);
 
@@ -206,12 +212,15 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    rc = libxl_domain_suspend_with_params(ctx, domid, send_fd, flags, params,
+                                          NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
         if (rc == ERROR_GUEST_TIMEDOUT)
             goto failed_suspend;
+        else if (rc == ERROR_POSTCOPY_FAILED)
+            goto failed_postcopy;
         else
             goto failed_resume;
     }
@@ -223,7 +232,7 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     rc = migrate_read_fixedmessage(recv_fd, migrate_receiver_ready,
                                    sizeof(migrate_receiver_ready),
                                    "ready message", rune);
-    if (rc) goto failed_resume;
+    if (rc) goto failed_after_transfer;
 
     xtl_stdiostream_adjust_flags(logger, 0, XTL_STDIOSTREAM_HIDE_PROGRESS);
 
@@ -236,7 +245,7 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     if (common_domname) {
         xasprintf(&away_domname, "%s--migratedaway", common_domname);
         rc = libxl_domain_rename(ctx, domid, common_domname, away_domname);
-        if (rc) goto failed_resume;
+        if (rc) goto failed_after_transfer;
     }
 
     /* point of no return - as soon as we have tried to say
@@ -295,6 +304,15 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     fprintf(stderr, "Migration failed, failed to suspend at sender.\n");
     exit(EXIT_FAILURE);
 
+ failed_after_transfer:
+    /*
+     * After a post-copy migration, the receiver may be running the
+     * domain already: it must not be resumed here, unless the receiver
+     * gives it back.
+     */
+    if (postcopy)
+        goto failed_badly;
+
  failed_resume:
     close(send_fd);
     migration_child_report(recv_fd);
@@ -302,6 +320,15 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     libxl_domain_resume(ctx, domid, 1, 0);
     exit(EXIT_FAILURE);
 
+ failed_postcopy:
+    close(send_fd);
+    migration_child_report(recv_fd);
+    fprintf(stderr,
+ "** Post-copy migration failed after the transition **\n"
+ "The domain may have been running at the target, which now lacks some of\n"
+ " its memory, and cannot be resumed at the sender: it is lost.\n");
+    exit(EXIT_FAILURE);
+
  failed_badly:
     fprintf(stderr,
  "** Migration failed during final handshake **\n"
@@ -321,13 +348,16 @@ static void migrate_receive(int debug, int daemonize, int monitor,
                             int send_fd, int recv_fd,
                             libxl_checkpointed_stream checkpointed,
                             char *colo_proxy_script,
-                            bool userspace_colo_proxy)
+                            bool userspace_colo_proxy,
+                            unsigned int copy_threads, bool postcopy)
 {
     uint32_t domid;
     int rc, rc2;
     char rc_buf;
     char *migration_domname;
     struct domain_create dom_info;
+    /* After a post-copy transition, libxl resumes the domain itself. */
+    bool resumed = postcopy && !pause_after_migration;
 
     signal(SIGPIPE, SIG_IGN);
     /* if we get SIGPIPE we'd rather just have it as an error */
@@ -350,6 +380,8 @@ static void migrate_receive(int debug, int daemonize, int monitor,
     dom_info.checkpointed_stream = checkpointed;
     dom_info.colo_proxy_script = colo_proxy_script;
     dom_info.userspace_colo_proxy = userspace_colo_proxy;
+    dom_info.copy_threads = copy_threads;
+    dom_info.postcopy_resume = resumed;
 
     rc = create_domain(&dom_info);
     if (rc < 0) {
@@ -429,7 +461,7 @@ static void migrate_receive(int debug, int daemonize, int monitor,
         if (rc) goto perhaps_destroy_notify_rc;
     }
 
-    if (!pause_after_migration) {
+    if (!pause_after_migration && !resumed) {
         rc = libxl_domain_unpause(ctx, domid, NULL);
         if (rc) goto perhaps_destroy_notify_rc;
     }
@@ -451,6 +483,13 @@ static void migrate_receive(int debug, int daemonize, int monitor,
                               "success/failure code");
     if (rc2) exit(EXIT_FAILURE);
 
+    if (rc && resumed) {
+        /* Our copy has run: the one at the sender is stale. */
+        fprintf(stderr, "migration target: Failure, but domain %u is "
+                "running here already, keeping it.\n", domid);
+        exit(EXIT_FAILURE);
+    }
+
     if (rc) {
         fprintf(stderr, "migration target: Failure, destroying our copy.\n");
 
@@ -483,11 +522,15 @@ int main_migrate_receive(int argc, char **argv)
     int opt;
     bool userspace_colo_proxy = false;
     char *script = NULL;
+    unsigned int copy_threads = 0;
+    bool postcopy = false;
     static struct option opts[] = {
         {"colo", 0, 0, 0x100},
         /* It is a shame that the management code for disk is not here. */
         {"coloft-script", 1, 0, 0x200},
         {"userspace-colo-proxy", 0, 0, 0x300},
+        {"threads", 1, 0, 0x400},
+        {"postcopy", 0, 0, 0x500},
         COMMON_LONG_OPTS
     };
 
@@ -514,6 +557,12 @@ int main_migrate_receive(int argc, char **argv)
     case 0x300:
         userspace_colo_proxy = true;
         break;
+    case 0x400:
+        copy_threads = parse_ulong_option("--threads", optarg, 255);
+        break;
+    case 0x500:
+        postcopy = true;
+        break;
     case 'p':
         pause_after_migration = 1;
         break;
@@ -525,7 +574,8 @@ int main_migrate_receive(int argc, char **argv)
     }
     migrate_receive(debug, daemonize, monitor, pause_after_migration,
                     STDOUT_FILENO, STDIN_FILENO,
-                    checkpointed, script, userspace_colo_proxy);
+                    checkpointed, script, userspace_colo_proxy,
+                    copy_threads, postcopy);
 
     return EXIT_SUCCESS;
 }
@@ -539,12 +589,20 @@ int main_migrate(int argc, char **argv)
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
     int preserve_domid = 0;
+    libxl_domain_suspend_params params;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"max-downtime", 1, 0, 0x300},
+        {"auto-converge", 0, 0, 0x400},
+        {"compress", 0, 0, 0x500},
+        {"threads", 1, 0, 0x600},
+        {"postcopy", 0, 0, 0x700},
         COMMON_LONG_OPTS
     };
 
+    libxl_domain_suspend_params_init(&params);
+
     SWITCH_FOREACH_OPT(opt, "FC:s:epD", opts, "migrate", 2) {
     case 'C':
         config_filename = optarg;
@@ -571,7 +629,24 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --max-downtime */
+        params.max_downtime_ms = parse_ulong_option("--max-downtime", optarg,
+                                                    65535);
+        break;
+    case 0x400: /* --auto-converge */
+        libxl_defbool_set(&params.auto_converge, true);
+        break;
+    case 0x500: /* --compress */
+        libxl_defbool_set(&params.compress, true);
+        break;
+    case 0x600: /* --threads */
+        params.stream_threads = parse_ulong_option("--threads", optarg, 255);
+        break;
+    case 0x700: /* --postcopy */
+        libxl_defbool_set(&params.postcopy, true);
+        break;
     }
+    libxl_defbool_setdefault(&params.postcopy, false);
 
     domid = find_domain(argv[optind]);
     host = argv[optind + 1];
@@ -582,6 +657,7 @@ int main_migrate(int argc, char **argv)
         rune= host;
     } else {
         char verbose_buf[minmsglevel_default+3];
+        char threads_buf[32] = "";
         int verbose_len;
         verbose_buf[0] = ' ';
         verbose_buf[1] = '-';
@@ -592,17 +668,24 @@ int main_migrate(int argc, char **argv)
         } else {
             verbose_len = (minmsglevel_default - minmsglevel) + 2;
         }
-        xasprintf(&rune, "exec %s %s xl%s%s%.*s migrate-receive%s%s%s",
+        if (params.stream_threads)
+            snprintf(threads_buf, sizeof(threads_buf), " --threads %u",
+                     params.stream_threads);
+        xasprintf(&rune, "exec %s %s xl%s%s%.*s migrate-receive%s%s%s%s%s",
                   ssh_command, host,
                   pass_tty_arg ? " -t" : "",
                   timestamps ? " -T" : "",
                   verbose_len, verbose_buf,
                   daemonize ? "" : " -e",
                   debug ? " -d" : "",
-                  pause_after_migration ? " -p" : "");
+                  pause_after_migration ? " -p" : "",
+                  threads_buf,
+                  libxl_defbool_val(params.postcopy) ? " --postcopy" : "");
     }
 
-    migrate_domain(domid, preserve_domid, rune, debug, config_filename);
+    migrate_domain(domid, preserve_domid, rune, debug, config_filename,
+                   &params);
+    libxl_domain_suspend_params_dispose(&params);
     return EXIT_SUCCESS;
 }
 
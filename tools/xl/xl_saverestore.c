@@ -125,7 +125,8 @@ void save_domain_core_writeconfig(int fd, const char *source,
 
 static int save_domain(uint32_t domid, int preserve_domid,
                        const char *filename, int checkpoint,
-                       int leavepaused, const char *override_config_file)
+                       int leavepaused, const char *override_config_file,
+                       const libxl_domain_suspend_params *params)
 {
     int fd;
     uint8_t *config_data;
@@ -146,7 +147,7 @@ static int save_domain(uint32_t domid, int preserve_domid,
 
     save_domain_core_writeconfig(fd, filename, config_data, config_len);
 
-    int rc = libxl_domain_suspend(ctx, domid, fd, 0, NULL);
+    int rc = libxl_domain_suspend_with_params(ctx, domid, fd, 0, params, NULL);
     close(fd);
 
     if (rc < 0) {
@@ -171,10 +172,12 @@ int main_restore(int argc, char **argv)
     struct domain_create dom_info;
     int paused = 0, debug = 0, daemonize = 1, monitor = 1,
         console_autoconnect = 0, vnc = 0, vncautopass = 0;
+    unsigned int copy_threads = 0;
     int opt, rc;
     static struct option opts[] = {
         {"vncviewer", 0, 0, 'V'},
         {"vncviewer-autopass", 0, 0, 'A'},
+        {"threads", 1, 0, 0x100},
         COMMON_LONG_OPTS
     };
 
@@ -201,6 +204,9 @@ int main_restore(int argc, char **argv)
     case 'A':
         vnc = vncautopass = 1;
         break;
+    case 0x100: /* --threads */
+        copy_threads = parse_ulong_option("--threads", optarg, 255);
+        break;
     }
 
     if (argc-optind == 1) {
@@ -225,6 +231,7 @@ int main_restore(int argc, char **argv)
     dom_info.vnc = vnc;
     dom_info.vncautopass = vncautopass;
     dom_info.console_autoconnect = console_autoconnect;
+    dom_info.copy_threads = copy_threads;
 
     rc = create_domain(&dom_info);
     if (rc < 0)
@@ -242,8 +249,15 @@ int main_save(int argc, char **argv)
     int leavepaused = 0;
     int preserve_domid = 0;
     int opt;
+    libxl_domain_suspend_params params;
+    static struct option opts[] = {
+        {"sparse", 0, 0, 0x100},
+        COMMON_LONG_OPTS
+    };
+
+    libxl_domain_suspend_params_init(&params);
 
-    SWITCH_FOREACH_OPT(opt, "cpD", NULL, "save", 2) {
+    SWITCH_FOREACH_OPT(opt, "cpD", opts, "save", 2) {
     case 'c':
         checkpoint = 1;
         break;
@@ -253,6 +267,9 @@ int main_save(int argc, char **argv)
     case 'D':
         preserve_domid = 1;
         break;
+    case 0x100: /* --sparse */
+        libxl_defbool_set(&params.sparse, true);
+        break;
     }
 
     if (argc-optind > 3) {
@@ -266,7 +283,8 @@ int main_save(int argc, char **argv)
         config_filename = argv[optind + 2];
 
     save_domain(domid, preserve_domid, filename, checkpoint, leavepaused,
-                config_filename);
+                config_filename, &params);
+    libxl_domain_suspend_params_dispose(&params);
     return EXIT_SUCCESS;
 }
 
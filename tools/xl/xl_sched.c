@@ -339,10 +339,17 @@ static int sched_rtds_vcpu_output_all(int domid,
 
 static int sched_rtds_pool_output(uint32_t poolid)
 {
+    libxl_sched_rtds_params scparam;
     char *poolname;
 
     poolname = libxl_cpupoolid_to_name(ctx, poolid);
-    printf("Cpupool %s: sched=RTDS\n", poolname);
+    libxl_sched_rtds_params_init(&scparam);
+    if (libxl_sched_rtds_params_get(ctx, poolid, &scparam))
+        printf("Cpupool %s: sched=RTDS [sched params unavailable]\n",
+               poolname);
+    else
+        printf("Cpupool %s: sched=RTDS runqueue=%s\n", poolname,
+               libxl_sched_rtds_runqueue_to_string(scparam.runqueue));
 
     free(poolname);
     return 0;
@@ -715,6 +722,8 @@ int main_sched_credit2(int argc, char **argv)
  * -d [domid] -v [vcpuid 1] [params] -v [vcpuid 2] [params] ...  :
  * Set per-VCPU params for domain
  * -d [domid] -v all [params]  : Set all per-VCPU params for domain
+ * -s [-c cpupool]  : List sched params of a cpupool
+ * -s [-c cpupool] -r [runqueue]  : Set sched params of a cpupool
  */
 int main_sched_rtds(int argc, char **argv)
 {
@@ -737,6 +746,8 @@ int main_sched_rtds(int argc, char **argv)
     bool opt_e = false;
     bool opt_v = false;
     bool opt_all = false; /* output per-dom parameters */
+    bool opt_s = false;
+    libxl_sched_rtds_runqueue runqueue = LIBXL_SCHED_RTDS_RUNQUEUE_UNKNOWN;
     int opt, i, rc, r;
     static struct option opts[] = {
         {"domain", 1, 0, 'd'},
@@ -745,10 +756,12 @@ int main_sched_rtds(int argc, char **argv)
         {"extratime", 1, 0, 'e'},
         {"vcpuid",1, 0, 'v'},
         {"cpupool", 1, 0, 'c'},
+        {"schedparam", 0, 0, 's'},
+        {"runqueue", 1, 0, 'r'},
         COMMON_LONG_OPTS
     };
 
-    SWITCH_FOREACH_OPT(opt, "d:p:b:e:v:c", opts, "sched-rtds", 0) {
+    SWITCH_FOREACH_OPT(opt, "d:p:b:e:v:c:sr:", opts, "sched-rtds", 0) {
     case 'd':
         dom = optarg;
         break;
@@ -801,8 +814,31 @@ int main_sched_rtds(int argc, char **argv)
     case 'c':
         cpupool = optarg;
         break;
+    case 's':
+        opt_s = true;
+        break;
+    case 'r':
+        if (libxl_sched_rtds_runqueue_from_string(optarg, &runqueue) ||
+            runqueue == LIBXL_SCHED_RTDS_RUNQUEUE_UNKNOWN) {
+            fprintf(stderr, "Invalid runqueue arrangement \"%s\": expected "
+                    "cpu, core, socket, node or all.\n", optarg);
+            r = EXIT_FAILURE;
+            goto out;
+        }
+        break;
     }
 
+    if (runqueue != LIBXL_SCHED_RTDS_RUNQUEUE_UNKNOWN && !opt_s) {
+        fprintf(stderr, "Setting the runqueue arrangement needs -s.\n");
+        r = EXIT_FAILURE;
+        goto out;
+    }
+    if (opt_s && (dom || opt_p || opt_b || opt_e || opt_v || opt_all)) {
+        fprintf(stderr, "Specifying scheduler parameters is not allowed with "
+                "domain options.\n");
+        r = EXIT_FAILURE;
+        goto out;
+    }
     if (cpupool && (dom || opt_p || opt_b || opt_e || opt_v || opt_all)) {
         fprintf(stderr, "Specifying a cpupool is not allowed with "
                 "other options.\n");
@@ -832,7 +868,35 @@ int main_sched_rtds(int argc, char **argv)
         goto out;
     }
 
-    if ((!dom) && opt_all) {
+    if (opt_s) {
+        libxl_sched_rtds_params scparam;
+        uint32_t poolid = 0;
+
+        if (cpupool) {
+            if (libxl_cpupool_qualifier_to_cpupoolid(ctx, cpupool,
+                                                     &poolid, NULL) ||
+                !libxl_cpupoolid_is_valid(ctx, poolid)) {
+                fprintf(stderr, "unknown cpupool \'%s\'\n", cpupool);
+                r = EXIT_FAILURE;
+                goto out;
+            }
+        }
+
+        if (runqueue == LIBXL_SCHED_RTDS_RUNQUEUE_UNKNOWN) {
+            /* Output scheduling parameters */
+            sched_rtds_pool_output(poolid);
+        } else {
+            /* Set scheduling parameters (so far, just the runqueues) */
+            libxl_sched_rtds_params_init(&scparam);
+            scparam.runqueue = runqueue;
+            rc = libxl_sched_rtds_params_set(ctx, poolid, &scparam);
+            if (rc) {
+                fprintf(stderr, "libxl_sched_rtds_params_set failed.\n");
+                r = EXIT_FAILURE;
+                goto out;
+            }
+        }
+    } else if ((!dom) && opt_all) {
         /* get all domain's per-vcpu rtds scheduler parameters */
         rc = -sched_vcpu_output(LIBXL_SCHEDULER_RTDS,
                                 sched_rtds_vcpu_output_all,
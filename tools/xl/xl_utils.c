@@ -14,9 +14,11 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -144,6 +146,27 @@ uint32_t find_domain(const char *p)
     return domid;
 }
 
+/*
+ * Parse arg, the argument of option opt, as a decimal number of at most
+ * max, or exit.
+ */
+unsigned long parse_ulong_option(const char *opt, const char *arg,
+                                 unsigned long max)
+{
+    unsigned long val;
+    char *endptr;
+
+    errno = 0;
+    val = strtoul(arg, &endptr, 10);
+    if (arg == endptr || *endptr || errno || strchr(arg, '-') || val > max) {
+        fprintf(stderr, "Invalid %s \"%s\": expected a number up to %lu\n",
+                opt, arg, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
+}
+
 /*
  * Callers should use SWITCH_FOREACH_OPT in preference to calling this
  * directly.
@@ -140,6 +140,8 @@ void string_realloc_append(char **accumulate, const char *more);
 
 void flush_stream(FILE *fh);
 uint32_t find_domain(const char *p) __attribute__((warn_unused_result));
+unsigned long parse_ulong_option(const char *opt, const char *arg,
+                                 unsigned long max);
 
 void print_bitmap(uint8_t *map, int maplen, FILE *stream);
 
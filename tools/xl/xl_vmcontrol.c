@@ -925,6 +925,8 @@ start:
         params.colo_proxy_script = dom_info->colo_proxy_script;
         libxl_defbool_set(&params.userspace_colo_proxy,
                           dom_info->userspace_colo_proxy);
+        params.copy_threads = dom_info->copy_threads;
+        libxl_defbool_set(&params.postcopy_resume, dom_info->postcopy_resume);
 
         ret = libxl_domain_create_restore(ctx, &d_config,
                                           &domid, restore_fd,
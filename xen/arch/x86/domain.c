@@ -36,6 +36,8 @@
 #include <xen/wait.h>
 #include <xen/guest_access.h>
 #include <xen/livepatch.h>
+#include <xen/param.h>
+#include <xen/tasklet.h>
 #include <public/arch-x86/cpuid.h>
 #include <public/sysctl.h>
 #include <public/hvm/hvm_vcpu.h>
@@ -132,6 +134,8 @@ void play_dead(void)
         dead_idle();
 }
 
+static bool relinquish_pages_idle(void);
+
 static void noreturn cf_check idle_loop(void)
 {
     unsigned int cpu = smp_processor_id();
@@ -157,12 +161,13 @@ static void noreturn cf_check idle_loop(void)
             check_for_livepatch_work();
         }
         /*
-         * Test softirqs twice --- first to see if should even try scrubbing
-         * and then, after it is done, whether softirqs became pending
-         * while we were scrubbing.
+         * Test softirqs twice --- first to see if should even try helping
+         * to free a dying domain's memory or scrubbing and then, after it
+         * is done, whether softirqs became pending while we were at it.
          */
-        else if ( !softirq_pending(cpu) && !scrub_free_pages() &&
-                  !softirq_pending(cpu) )
+        else if ( !softirq_pending(cpu) &&
+                  (guest || !relinquish_pages_idle()) &&
+                  !scrub_free_pages() && !softirq_pending(cpu) )
         {
             if ( guest )
                 sched_guest_idle(pm_idle, cpu);
@@ -788,6 +793,7 @@ int arch_domain_create(struct domain *d,
     int rc;
 
     INIT_PAGE_LIST_HEAD(&d->arch.relmem_list);
+    INIT_LIST_HEAD(&d->arch.relmem_elem);
 
     spin_lock_init(&d->arch.e820_lock);
 
@@ -2345,6 +2351,207 @@ static int relinquish_memory(
     return ret;
 }
 
+/*
+ * Most pages of a dying domain merely need their allocation reference
+ * dropped to be freed.  For large domains this takes long enough to be worth
+ * spreading over idle CPUs of the nodes holding its memory, in addition to
+ * the one issuing the destroy hypercall.  As with scrubbing, they do so from
+ * their idle loop, and stop as soon as they have anything else to do.  Pages
+ * still in use, like page tables of PV domains, are then left for
+ * relinquish_memory() to deal with.
+ */
+static unsigned int __read_mostly opt_relinquish_cpus = 8;
+integer_param("relinquish-cpus", opt_relinquish_cpus);
+
+#define RELMEM_BATCH 64
+
+/* Dying domains with pages for idle CPUs to help freeing. */
+static LIST_HEAD(relmem_domains);
+static DEFINE_SPINLOCK(relmem_lock);
+
+/* Idle CPUs which found nothing to free, to be kicked when that changes. */
+static cpumask_t relmem_idle_cpus;
+
+/* Drop the allocation references of a batch of pages. */
+static bool relinquish_pages(struct domain *d)
+{
+    struct page_info *page, *batch[RELMEM_BATCH];
+    unsigned int i, nr = 0;
+    bool more;
+
+    rspin_lock(&d->page_alloc_lock);
+
+    while ( nr < ARRAY_SIZE(batch) &&
+            (page = page_list_remove_head(&d->page_list)) )
+    {
+        /* Put the page on the list and /then/ potentially free it. */
+        page_list_add_tail(page, &d->arch.relmem_list);
+
+        /* Couldn't get a reference -- someone is freeing this page. */
+        if ( unlikely(!get_page(page, d)) )
+            continue;
+
+        put_page_alloc_ref(page);
+        batch[nr++] = page;
+    }
+
+    d->arch.relmem_freed += nr;
+    more = !page_list_empty(&d->page_list);
+
+    rspin_unlock(&d->page_alloc_lock);
+
+    /* Free the pages outside of the lock, for other CPUs to get at it. */
+    for ( i = 0; i < nr; i++ )
+        put_page(batch[i]);
+
+    return more;
+}
+
+/*
+ * A domain for @cpu to help with, preferably one with memory on its node,
+ * with a helper reference taken.
+ */
+static struct domain *relmem_get_domain(unsigned int cpu)
+{
+    struct domain *d, *found = NULL;
+
+    if ( list_empty(&relmem_domains) )
+        return NULL;
+
+    spin_lock(&relmem_lock);
+
+    list_for_each_entry ( d, &relmem_domains, arch.relmem_elem )
+    {
+        if ( page_list_empty(&d->page_list) ||
+             atomic_read(&d->arch.relmem_busy) >= opt_relinquish_cpus )
+            continue;
+
+        found = d;
+        if ( nodemask_test(cpu_to_node(cpu), &d->node_affinity) )
+            break;
+    }
+
+    if ( found )
+        atomic_inc(&found->arch.relmem_busy);
+
+    spin_unlock(&relmem_lock);
+
+    return found;
+}
+
+/*
+ * Help freeing the memory of a dying domain, from the idle loop, until there
+ * is nothing left or something else to do.  Return whether there was any.
+ */
+static bool relinquish_pages_idle(void)
+{
+    unsigned int cpu = smp_processor_id();
+    struct domain *d = relmem_get_domain(cpu);
+
+    if ( !d )
+    {
+        if ( cpumask_test_cpu(cpu, &relmem_idle_cpus) )
+            return false;
+
+        /*
+         * A domain queued after the lookup above, but before this CPU shows
+         * up in relmem_idle_cpus, would not get it woken: check once more
+         * once in the mask (pairs with the barrier in
+         * relinquish_pages_start()).
+         */
+        cpumask_set_cpu(cpu, &relmem_idle_cpus);
+        smp_mb();
+        d = relmem_get_domain(cpu);
+        if ( !d )
+            return false;
+    }
+
+    if ( cpumask_test_cpu(cpu, &relmem_idle_cpus) )
+        cpumask_clear_cpu(cpu, &relmem_idle_cpus);
+
+    while ( relinquish_pages(d) && !softirq_pending(cpu) )
+        continue;
+
+    atomic_dec(&d->arch.relmem_busy);
+
+    return true;
+}
+
+/* Make @d's pages available to idle CPUs, and wake some up for them. */
+static void relinquish_pages_start(struct domain *d)
+{
+    unsigned int cpu, nr = 0;
+    nodeid_t node;
+
+    if ( !opt_relinquish_cpus || page_list_empty(&d->page_list) )
+        return;
+
+    spin_lock(&relmem_lock);
+    list_add_tail(&d->arch.relmem_elem, &relmem_domains);
+    spin_unlock(&relmem_lock);
+
+    /* Pairs with the barrier in relinquish_pages_idle(). */
+    smp_mb();
+
+    for_each_node_mask ( node, d->node_affinity )
+        for_each_cpu ( cpu, &node_to_cpumask(node) )
+        {
+            if ( nr == opt_relinquish_cpus )
+                return;
+
+            if ( cpumask_test_cpu(cpu, &relmem_idle_cpus) &&
+                 cpumask_test_and_clear_cpu(cpu, &relmem_idle_cpus) &&
+                 cpu_online(cpu) )
+            {
+                smp_send_event_check_cpu(cpu);
+                nr++;
+            }
+        }
+}
+
+static int relinquish_pages_parallel(struct domain *d)
+{
+    if ( d->arch.relmem_state == XEN_DOMCTL_RELINQUISH_none )
+    {
+        d->arch.relmem_state = XEN_DOMCTL_RELINQUISH_pages;
+        relinquish_pages_start(d);
+    }
+
+    while ( relinquish_pages(d) )
+        if ( hypercall_preempt_check() )
+            return -ERESTART;
+
+    /* No new helpers, and wait for the last ones to finish their batches. */
+    if ( !list_empty(&d->arch.relmem_elem) )
+    {
+        spin_lock(&relmem_lock);
+        list_del_init(&d->arch.relmem_elem);
+        spin_unlock(&relmem_lock);
+    }
+
+    if ( atomic_read(&d->arch.relmem_busy) )
+        return -ERESTART;
+
+    d->arch.relmem_state = XEN_DOMCTL_RELINQUISH_in_use;
+
+    /* Hand what is left to relinquish_memory(). */
+    rspin_lock(&d->page_alloc_lock);
+    page_list_move(&d->page_list, &d->arch.relmem_list);
+    rspin_unlock(&d->page_alloc_lock);
+
+    return 0;
+}
+
+void relinquish_progress(const struct domain *d,
+                         struct xen_domctl_relinquish_progress *p)
+{
+    p->state = d->is_dying == DOMDYING_dead ? XEN_DOMCTL_RELINQUISH_done
+                                            : d->arch.relmem_state;
+    p->pages_left = domain_tot_pages(d);
+    p->pages_freed = d->arch.relmem_freed;
+    p->nr_helpers = atomic_read(&d->arch.relmem_busy);
+}
+
 int domain_relinquish_resources(struct domain *d)
 {
     int ret;
@@ -2379,6 +2586,7 @@ int domain_relinquish_resources(struct domain *d)
             PROG_paging,
             PROG_vcpu_pagetables,
             PROG_xen,
+            PROG_pages,
             PROG_l4,
             PROG_l3,
             PROG_l2,
@@ -2482,6 +2690,12 @@ int domain_relinquish_resources(struct domain *d)
         if ( ret )
             return ret;
 
+    PROGRESS(pages):
+
+        ret = relinquish_pages_parallel(d);
+        if ( ret )
+            return ret;
+
     PROGRESS(l4):
 
         ret = relinquish_memory(d, &d->page_list, PGT_l4_page_table);
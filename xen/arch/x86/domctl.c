@@ -1325,6 +1325,11 @@ long arch_do_domctl(
         copyback = true;
         break;
 
+    case XEN_DOMCTL_get_relinquish_progress:
+        relinquish_progress(d, &domctl->u.relinquish_progress);
+        copyback = true;
+        break;
+
     case XEN_DOMCTL_set_cpu_policy:
         if ( d == currd ) /* No domain_pause() */
         {
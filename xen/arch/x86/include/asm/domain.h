@@ -339,6 +339,11 @@ struct arch_domain
     /* Continuable domain_relinquish_resources(). */
     unsigned int rel_priv;
     struct page_list_head relmem_list;
+    /* Idle CPUs helping with relinquish_pages(). */
+    struct list_head relmem_elem;
+    atomic_t relmem_busy;
+    unsigned long relmem_freed;
+    uint8_t relmem_state;              /* XEN_DOMCTL_RELINQUISH_* */
 
     const struct arch_csw {
         void (*from)(struct vcpu *v);
@@ -683,6 +688,10 @@ void update_guest_memory_policy(struct vcpu *v,
 
 void domain_cpu_policy_changed(struct domain *d);
 
+struct xen_domctl_relinquish_progress;
+void relinquish_progress(const struct domain *d,
+                         struct xen_domctl_relinquish_progress *p);
+
 bool update_secondary_system_time(struct vcpu *v,
                                   struct vcpu_time_info *u);
 void force_update_secondary_system_time(struct vcpu *v,
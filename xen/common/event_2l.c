@@ -16,7 +16,7 @@
 
 #include <asm/guest_atomics.h>
 
-static void cf_check evtchn_2l_set_pending(
+static bool cf_check evtchn_2l_set_pending(
     struct vcpu *v, struct evtchn *evtchn)
 {
     struct domain *d = v->domain;
@@ -30,7 +30,7 @@ static void cf_check evtchn_2l_set_pending(
      */
 
     if ( guest_test_and_set_bit(d, port, &shared_info(d, evtchn_pending)) )
-        return;
+        return false;
 
     if ( !guest_test_bit(d, port, &shared_info(d, evtchn_mask)) &&
          !guest_test_and_set_bit(d, port / BITS_PER_EVTCHN_WORD(d),
@@ -40,6 +40,8 @@ static void cf_check evtchn_2l_set_pending(
     }
 
     evtchn_check_pollers(d, port);
+
+    return true;
 }
 
 static void cf_check evtchn_2l_clear_pending(
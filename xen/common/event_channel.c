@@ -814,7 +814,9 @@ int evtchn_send(struct domain *ld, unsigned int lport)
 {
     struct evtchn *lchn = _evtchn_from_port(ld, lport), *rchn;
     struct domain *rd;
+    struct vcpu   *curr = current;
     int            rport, ret = 0;
+    bool           raised;
 
     if ( !lchn )
         return -EINVAL;
@@ -850,7 +852,14 @@ int evtchn_send(struct domain *ld, unsigned int lport)
             rcu_unlock_domain(rd);
             return 0;
         }
-        evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+        raised = evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+        /* Not accounted when sending on behalf of another domain. */
+        if ( likely(curr->domain == ld) )
+        {
+            curr->evtchn_sends++;
+            if ( !raised )
+                curr->evtchn_sends_coalesced++;
+        }
         break;
     case ECS_IPI:
         evtchn_port_set_pending(ld, lchn->notify_vcpu_id, lchn);
@@ -1640,10 +1649,20 @@ static void domain_dump_evtchn_info(struct domain *d)
 {
     unsigned int port;
     int irq;
+    const struct vcpu *v;
+    unsigned long sends = 0, coalesced = 0;
+
+    for_each_vcpu ( d, v )
+    {
+        sends += v->evtchn_sends;
+        coalesced += v->evtchn_sends_coalesced;
+    }
 
     printk("Event channel information for domain %d:\n"
            "Polling vCPUs: {%*pbl}\n"
-           "    port [p/m/s]\n", d->domain_id, d->max_vcpus, d->poll_mask);
+           "Interdomain sends: %lu (%lu coalesced)\n"
+           "    port [p/m/s]\n", d->domain_id, d->max_vcpus, d->poll_mask,
+           sends, coalesced);
 
     read_lock(&d->event_lock);
 
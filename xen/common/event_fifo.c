@@ -158,7 +158,7 @@ static bool evtchn_fifo_set_link(struct domain *d, event_word_t *word,
     return 1;
 }
 
-static void cf_check evtchn_fifo_set_pending(
+static bool cf_check evtchn_fifo_set_pending(
     struct vcpu *v, struct evtchn *evtchn)
 {
     struct domain *d = v->domain;
@@ -179,10 +179,24 @@ static void cf_check evtchn_fifo_set_pending(
      */
     if ( unlikely(!word) )
     {
+        check_pollers = !evtchn->pending;
         evtchn->pending = true;
-        return;
+        return check_pollers;
     }
 
+    /*
+     * An event which is already pending, and which is either linked or
+     * masked, needs nothing doing: neither bit would change below, and
+     * pollers were woken when it became pending.  Check for this without
+     * the queue locks, so that repeated notifications of a busy port don't
+     * contend on them.  Should the guest unlink or unmask the event
+     * meanwhile, it will still find it pending and deal with it.
+     */
+    if ( guest_test_bit(d, EVTCHN_FIFO_PENDING, word) &&
+         (guest_test_bit(d, EVTCHN_FIFO_LINKED, word) ||
+          guest_test_bit(d, EVTCHN_FIFO_MASKED, word)) )
+        return false;
+
     /*
      * Lock all queues related to the event channel (in case of a queue change
      * this might be two).
@@ -316,6 +330,8 @@ static void cf_check evtchn_fifo_set_pending(
 
     if ( check_pollers )
         evtchn_check_pollers(d, port);
+
+    return check_pollers;
 }
 
 static void cf_check evtchn_fifo_clear_pending(
@@ -41,6 +41,7 @@
 #include <xen/radix-tree.h>
 #include <xen/xvmalloc.h>
 #include <xen/nospec.h>
+#include <xen/prefetch.h>
 #include <xsm/xsm.h>
 #include <asm/flushtlb.h>
 #include <asm/guest_atomics.h>
@@ -530,34 +531,27 @@ static int get_paged_frame(unsigned long gfn, mfn_t *mfn,
 
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
+/* Maptrack frames allocated, and handles stolen from other vCPUs. */
+static unsigned long maptrack_frames, maptrack_steals;
+
 static inline grant_handle_t
 _get_maptrack_handle(struct grant_table *t, struct vcpu *v)
 {
-    unsigned int head, next;
+    unsigned int head;
 
     spin_lock(&v->maptrack_freelist_lock);
 
-    /* No maptrack pages allocated for this VCPU yet? */
+    /* Once the free list is used up, take all entries freed meanwhile. */
     head = v->maptrack_head;
-    if ( unlikely(head == MAPTRACK_TAIL) )
-    {
-        spin_unlock(&v->maptrack_freelist_lock);
-        return INVALID_MAPTRACK_HANDLE;
-    }
+    if ( head == MAPTRACK_TAIL )
+        head = xchg(&v->maptrack_freed, MAPTRACK_TAIL);
 
-    /*
-     * Always keep one entry in the free list to make it easier to
-     * add free entries to the tail.
-     */
-    next = maptrack_entry(t, head).ref;
-    if ( unlikely(next == MAPTRACK_TAIL) )
-        head = INVALID_MAPTRACK_HANDLE;
-    else
-        v->maptrack_head = next;
+    if ( head != MAPTRACK_TAIL )
+        v->maptrack_head = maptrack_entry(t, head).ref;
 
     spin_unlock(&v->maptrack_freelist_lock);
 
-    return head;
+    return head == MAPTRACK_TAIL ? INVALID_MAPTRACK_HANDLE : head;
 }
 
 /*
@@ -588,6 +582,7 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
             if ( handle != INVALID_MAPTRACK_HANDLE )
             {
                 maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+                arch_fetch_and_add(&maptrack_steals, 1);
                 return handle;
             }
         }
@@ -606,24 +601,19 @@ put_maptrack_handle(
     struct grant_table *t, grant_handle_t handle)
 {
     struct domain *currd = current->domain;
-    struct vcpu *v;
-    unsigned int tail;
-
-    /* 1. Set entry to be a tail. */
-    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
-
-    /* 2. Add entry to the tail of the list on the original VCPU. */
-    v = currd->vcpu[maptrack_entry(t, handle).vcpu];
+    struct vcpu *v = currd->vcpu[maptrack_entry(t, handle).vcpu];
+    unsigned int head = ACCESS_ONCE(v->maptrack_freed), prev;
 
-    spin_lock(&v->maptrack_freelist_lock);
-
-    tail = v->maptrack_tail;
-    v->maptrack_tail = handle;
-
-    /* 3. Update the old tail entry to point to the new entry. */
-    maptrack_entry(t, tail).ref = handle;
-
-    spin_unlock(&v->maptrack_freelist_lock);
+    /*
+     * Push the entry onto the freed list of the vCPU owning it, without
+     * taking its lock: handles are often unmapped on other vCPUs than they
+     * were mapped on.  The list is only ever taken off as a whole, so there
+     * is no ABA problem.
+     */
+    do {
+        maptrack_entry(t, handle).ref = head;
+        prev = head;
+    } while ( (head = cmpxchg(&v->maptrack_freed, prev, handle)) != prev );
 }
 
 static inline grant_handle_t
@@ -653,23 +643,6 @@ get_maptrack_handle(
     if ( !new_mt )
     {
         spin_unlock(&lgt->maptrack_lock);
-
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                curr->maptrack_head = handle;
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
         return steal_maptrack_handle(lgt, curr);
     }
 
@@ -688,16 +661,14 @@ get_maptrack_handle(
         new_mt[i].vcpu = curr->vcpu_id;
     }
 
-    /* Set tail directly if this is the first page for the local vCPU. */
-    if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
-
     lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
     smp_wmb();
     lgt->maptrack_limit += MAPTRACK_PER_PAGE;
 
     spin_unlock(&lgt->maptrack_lock);
 
+    arch_fetch_and_add(&maptrack_frames, 1);
+
     spin_lock(&curr->maptrack_freelist_lock);
     new_mt[i - 1].ref = curr->maptrack_head;
     curr->maptrack_head = handle + 1;
@@ -991,9 +962,13 @@ union maptrack_node {
     unsigned long raw;
 };
 
+/*
+ * *@rdp caches the RCU locked domain of the previous operation, if any, and
+ * is updated to the domain referenced by @op.  The caller unlocks it.
+ */
 static void
 map_grant_ref(
-    struct gnttab_map_grant_ref *op)
+    struct gnttab_map_grant_ref *op, struct domain **rdp)
 {
     struct domain *ld, *rd, *owner = NULL;
     struct grant_table *lgt, *rgt;
@@ -1034,7 +1009,19 @@ map_grant_ref(
         return;
     }
 
-    if ( unlikely((rd = rcu_lock_domain_by_id(op->dom)) == NULL) )
+    /*
+     * Backends map many grants of the same frontend at a time: look the
+     * domain up only when it changes.
+     */
+    rd = *rdp;
+    if ( !rd || rd->domain_id != op->dom )
+    {
+        if ( rd )
+            rcu_unlock_domain(rd);
+        *rdp = rd = rcu_lock_domain_by_id(op->dom);
+    }
+
+    if ( unlikely(!rd) )
     {
         gdprintk(XENLOG_INFO, "Could not find domain %d\n", op->dom);
         op->status = GNTST_bad_domain;
@@ -1044,7 +1031,6 @@ map_grant_ref(
     rc = xsm_grant_mapref(XSM_HOOK, ld, rd, op->flags);
     if ( rc )
     {
-        rcu_unlock_domain(rd);
         op->status = GNTST_permission_denied;
         return;
     }
@@ -1053,7 +1039,6 @@ map_grant_ref(
     handle = get_maptrack_handle(lgt);
     if ( unlikely(handle == INVALID_MAPTRACK_HANDLE) )
     {
-        rcu_unlock_domain(rd);
         gdprintk(XENLOG_INFO, "Failed to obtain maptrack handle\n");
         op->status = GNTST_no_space;
         return;
@@ -1323,7 +1308,6 @@ map_grant_ref(
     op->handle       = handle;
     op->status       = GNTST_okay;
 
-    rcu_unlock_domain(rd);
     return;
 
  undo_out:
@@ -1354,7 +1338,6 @@ map_grant_ref(
     grant_read_unlock(rgt);
     op->status = rc;
     put_maptrack_handle(lgt, handle);
-    rcu_unlock_domain(rd);
 }
 
 static long
@@ -1363,22 +1346,36 @@ gnttab_map_grant_ref(
 {
     int i;
     struct gnttab_map_grant_ref op;
+    struct domain *rd = NULL;
+    long rc = 0;
 
     for ( i = 0; i < count; i++ )
     {
         if ( i && hypercall_preempt_check() )
-            return i;
+        {
+            rc = i;
+            break;
+        }
 
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
 
-        map_grant_ref(&op);
+        map_grant_ref(&op, &rd);
 
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
     }
 
-    return 0;
+    if ( rd )
+        rcu_unlock_domain(rd);
+
+    return rc;
 }
 
 static void
@@ -2864,25 +2861,40 @@ struct gnttab_copy_buf {
     bool have_type;
 };
 
+/*
+ * Backends tend to copy from or to the same few grants in a batch, e.g. a
+ * packet's fragments into one page of the frontend, interleaved with others.
+ * So a few grants per side are kept acquired and mapped until the end of the
+ * batch, or until another domain is referenced.
+ */
+#define GNTTAB_COPY_BUFS 4
+
+struct gnttab_copy_side {
+    struct domain *domain;
+    domid_t domid;
+    unsigned int next;   /* Buffer to be reused next. */
+    struct gnttab_copy_buf buf[GNTTAB_COPY_BUFS];
+};
+
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
+                                   struct gnttab_copy_side *side)
 {
     /* Only DOMID_SELF may reference via frame. */
     if ( domid != DOMID_SELF && !is_gref )
         return GNTST_permission_denied;
 
-    buf->domain = rcu_lock_domain_by_any_id(domid);
+    side->domain = rcu_lock_domain_by_any_id(domid);
 
-    if ( !buf->domain )
+    if ( !side->domain )
         return GNTST_bad_domain;
 
-    buf->ptr.domid = domid;
+    side->domid = domid;
 
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_side *src,
+                                       struct gnttab_copy_side *dest)
 {
     if ( src->domain )
     {
@@ -2897,8 +2909,8 @@ static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
 }
 
 static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+                                    struct gnttab_copy_side *src,
+                                    struct gnttab_copy_side *dest)
 {
     int rc;
 
@@ -2948,6 +2960,14 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+static void gnttab_copy_release_side(struct gnttab_copy_side *side)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(side->buf); i++ )
+        gnttab_copy_release_buf(&side->buf[i]);
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -3015,7 +3035,59 @@ static bool gnttab_copy_buf_valid(
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/* Find the buffer for @ptr, or acquire and map it in place of an old one. */
+static struct gnttab_copy_buf *gnttab_copy_get_buf(
+    const struct gnttab_copy *op, const struct gnttab_copy_ptr *ptr,
+    struct gnttab_copy_side *side, unsigned int gref_flag, int *rc)
+{
+    struct gnttab_copy_buf *buf;
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(side->buf); i++ )
+        if ( gnttab_copy_buf_valid(ptr, &side->buf[i], op->flags & gref_flag) )
+            return &side->buf[i];
+
+    buf = &side->buf[side->next];
+    side->next = (side->next + 1) % ARRAY_SIZE(side->buf);
+
+    gnttab_copy_release_buf(buf);
+    buf->domain = side->domain;
+    *rc = gnttab_copy_claim_buf(op, ptr, buf, gref_flag);
+
+    return *rc ? NULL : buf;
+}
+
+/*
+ * Pull the grant entries the next operation will use into the cache, while
+ * the current one is being dealt with.  This is done without holding the
+ * grant table lock, so anything looked at may be stale, but only addresses
+ * within the table are ever touched.
+ */
+static void gnttab_copy_prefetch(const struct gnttab_copy_ptr *ptr,
+                                 const struct gnttab_copy_side *side,
+                                 bool has_gref)
+{
+    struct grant_table *gt;
+    unsigned int nr;
+    grant_ref_t ref;
+
+    if ( !has_gref || !side->domain || ptr->domid != side->domid )
+        return;
+
+    gt = side->domain->grant_table;
+    if ( ACCESS_ONCE(gt->gt_version) != 1 )
+        return;
+
+    nr = ACCESS_ONCE(gt->nr_grant_frames) * SHGNT_PER_PAGE_V1;
+    if ( ptr->u.ref >= nr )
+        return;
+
+    ref = array_index_nospec(ptr->u.ref, nr);
+    prefetch(&shared_entry_v1(gt, ref));
+    prefetch(&_active_entry(gt, ref));
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
@@ -3057,19 +3129,20 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_side *dest,
+                           struct gnttab_copy_side *src)
 {
+    struct gnttab_copy_buf *sbuf, *dbuf;
     int rc;
 
     if ( unlikely(!op->len) )
         return GNTST_okay;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    if ( !src->domain || op->source.domid != src->domid ||
+         !dest->domain || op->dest.domid != dest->domid )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
+        gnttab_copy_release_side(src);
+        gnttab_copy_release_side(dest);
         gnttab_copy_unlock_domains(src, dest);
 
         rc = gnttab_copy_lock_domains(op, src, dest);
@@ -3077,27 +3150,15 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
-    {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
-    }
+    sbuf = gnttab_copy_get_buf(op, &op->source, src, GNTCOPY_source_gref, &rc);
+    if ( !sbuf )
+        goto out;
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
-    {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
-    }
+    dbuf = gnttab_copy_get_buf(op, &op->dest, dest, GNTCOPY_dest_gref, &rc);
+    if ( !dbuf )
+        goto out;
 
-    rc = gnttab_copy_buf(op, dest, src);
+    rc = gnttab_copy_buf(op, dbuf, sbuf);
  out:
     return rc;
 }
@@ -3113,13 +3174,13 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
 static long gnttab_copy(
     XEN_GUEST_HANDLE_PARAM(gnttab_copy_t) uop, unsigned int count)
 {
-    unsigned int i;
-    struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    unsigned int i, j = 0, nr = 0;
+    struct gnttab_copy op[8];
+    struct gnttab_copy_side src = {};
+    struct gnttab_copy_side dest = {};
     long rc = 0;
 
-    for ( i = 0; i < count; i++ )
+    for ( i = 0; i < count; i++, j++ )
     {
         if ( i && hypercall_preempt_check() )
         {
@@ -3127,13 +3188,35 @@ static long gnttab_copy(
             break;
         }
 
-        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+        /*
+         * Read a few operations at a time.  Should some of them not be
+         * accessible, fall back to one, so that faults are reported for the
+         * operation they belong to.
+         */
+        if ( j == nr )
         {
-            rc = -EFAULT;
-            break;
+            j = 0;
+            nr = min_t(unsigned int, count - i, ARRAY_SIZE(op));
+            if ( unlikely(__copy_from_guest(op, uop, nr)) )
+            {
+                nr = 1;
+                if ( unlikely(__copy_from_guest(op, uop, 1)) )
+                {
+                    rc = -EFAULT;
+                    break;
+                }
+            }
+        }
+
+        if ( j + 1 < nr )
+        {
+            gnttab_copy_prefetch(&op[j + 1].source, &src,
+                                 op[j + 1].flags & GNTCOPY_source_gref);
+            gnttab_copy_prefetch(&op[j + 1].dest, &dest,
+                                 op[j + 1].flags & GNTCOPY_dest_gref);
         }
 
-        rc = gnttab_copy_one(&op, &dest, &src);
+        rc = gnttab_copy_one(&op[j], &dest, &src);
         if ( rc > 0 )
         {
             rc = count - i;
@@ -3141,13 +3224,13 @@ static long gnttab_copy(
         }
         if ( rc != GNTST_okay )
         {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
+            gnttab_copy_release_side(&src);
+            gnttab_copy_release_side(&dest);
         }
 
-        op.status = rc;
+        op[j].status = rc;
         rc = 0;
-        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+        if ( unlikely(__copy_field_to_guest(uop, &op[j], status)) )
         {
             rc = -EFAULT;
             break;
@@ -3155,8 +3238,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
+    gnttab_copy_release_side(&src);
+    gnttab_copy_release_side(&dest);
     gnttab_copy_unlock_domains(&src, &dest);
 
     return rc;
@@ -3849,6 +3932,7 @@ int gnttab_release_mappings(struct domain *d)
              */
             gt->maptrack_limit = handle;
             FREE_XENHEAP_PAGE(gt->maptrack[nr_maptrack_frames(gt)]);
+            arch_fetch_and_add(&maptrack_frames, -1L);
 
             if ( hypercall_preempt_check() )
                 return -ERESTART;
@@ -3949,6 +4033,8 @@ int gnttab_release_mappings(struct domain *d)
     }
 
     gt->maptrack_limit = 0;
+    if ( gt->maptrack[0] )
+        arch_fetch_and_add(&maptrack_frames, -1L);
     FREE_XENHEAP_PAGE(gt->maptrack[0]);
 
     radix_tree_destroy(&gt->maptrack_tree, NULL);
@@ -4035,7 +4121,7 @@ void grant_table_init_vcpu(struct vcpu *v)
 {
     spin_lock_init(&v->maptrack_freelist_lock);
     v->maptrack_head = MAPTRACK_TAIL;
-    v->maptrack_tail = MAPTRACK_TAIL;
+    v->maptrack_freed = MAPTRACK_TAIL;
 }
 
 #ifdef CONFIG_MEM_SHARING
@@ -4370,6 +4456,24 @@ static int __init cf_check gnttab_usage_init(void)
 }
 __initcall(gnttab_usage_init);
 
+#ifdef CONFIG_HYPFS
+static HYPFS_DIR_INIT(gnttab_dir, "gnttab");
+static HYPFS_UINT_INIT(gnttab_maptrack_frames, "maptrack-frames",
+                       maptrack_frames);
+static HYPFS_UINT_INIT(gnttab_maptrack_steals, "maptrack-steals",
+                       maptrack_steals);
+
+static int __init cf_check gnttab_hypfs_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &gnttab_dir, true);
+    hypfs_add_leaf(&gnttab_dir, &gnttab_maptrack_frames, true);
+    hypfs_add_leaf(&gnttab_dir, &gnttab_maptrack_steals, true);
+
+    return 0;
+}
+__initcall(gnttab_hypfs_init);
+#endif
+
 /*
  * Local variables:
  * mode: C
@@ -24,7 +24,10 @@
 #include <xen/irq.h>
 #include <xen/lib.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
+#include <xen/rcupdate.h>
 #include <xen/sched.h>
+#include <xen/sort.h>
 #include <xen/trace.h>
 
 #include <asm/guest_atomics.h>
@@ -258,9 +261,9 @@ bool vcpu_ioreq_handle_completion(struct vcpu *v)
     return res;
 }
 
-static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
+static int ioreq_server_alloc_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page;
 
     if ( iorp->page )
@@ -306,9 +309,9 @@ static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
     return -ENOMEM;
 }
 
-static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
+static void ioreq_server_free_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page = iorp->page;
 
     if ( !page )
@@ -325,7 +328,7 @@ static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
 
 bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 {
-    const struct ioreq_server *s;
+    struct ioreq_server *s;
     unsigned int id;
     bool found = false;
 
@@ -333,11 +336,28 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
+        const struct ioreq_vcpu *sv;
+
         if ( (s->ioreq.page == page) || (s->bufioreq.page == page) )
         {
             found = true;
             break;
         }
+
+        if ( !HANDLE_POSTED(s) )
+            continue;
+
+        spin_lock(&s->lock);
+        list_for_each_entry ( sv, &s->ioreq_vcpu_list, list_entry )
+            if ( sv->ring.page == page )
+            {
+                found = true;
+                break;
+            }
+        spin_unlock(&s->lock);
+
+        if ( found )
+            break;
     }
 
     rspin_unlock(&d->ioreq_server.lock);
@@ -370,6 +390,15 @@ static int ioreq_server_add_vcpu(struct ioreq_server *s,
     if ( !sv )
         goto fail1;
 
+    sv->ring.gfn = INVALID_GFN;
+
+    if ( HANDLE_POSTED(s) )
+    {
+        rc = ioreq_server_alloc_mfn(s, &sv->ring);
+        if ( rc )
+            goto fail_ring;
+    }
+
     spin_lock(&s->lock);
 
     rc = alloc_unbound_xen_event_channel(v->domain, v->vcpu_id,
@@ -404,6 +433,9 @@ static int ioreq_server_add_vcpu(struct ioreq_server *s,
 
  fail2:
     spin_unlock(&s->lock);
+    ioreq_server_free_mfn(s, &sv->ring);
+
+ fail_ring:
     xfree(sv);
 
  fail1:
@@ -431,6 +463,7 @@ static void ioreq_server_remove_vcpu(struct ioreq_server *s,
 
         free_xen_event_channel(v->domain, sv->ioreq_evtchn);
 
+        ioreq_server_free_mfn(s, &sv->ring);
         xfree(sv);
         break;
     }
@@ -458,6 +491,7 @@ static void ioreq_server_remove_all_vcpus(struct ioreq_server *s)
 
         free_xen_event_channel(v->domain, sv->ioreq_evtchn);
 
+        ioreq_server_free_mfn(s, &sv->ring);
         xfree(sv);
     }
 
@@ -468,21 +502,21 @@ static int ioreq_server_alloc_pages(struct ioreq_server *s)
 {
     int rc;
 
-    rc = ioreq_server_alloc_mfn(s, false);
+    rc = ioreq_server_alloc_mfn(s, &s->ioreq);
 
     if ( !rc && (s->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF) )
-        rc = ioreq_server_alloc_mfn(s, true);
+        rc = ioreq_server_alloc_mfn(s, &s->bufioreq);
 
     if ( rc )
-        ioreq_server_free_mfn(s, false);
+        ioreq_server_free_mfn(s, &s->ioreq);
 
     return rc;
 }
 
 static void ioreq_server_free_pages(struct ioreq_server *s)
 {
-    ioreq_server_free_mfn(s, true);
-    ioreq_server_free_mfn(s, false);
+    ioreq_server_free_mfn(s, &s->bufioreq);
+    ioreq_server_free_mfn(s, &s->ioreq);
 }
 
 static void ioreq_server_free_rangesets(struct ioreq_server *s)
@@ -490,7 +524,10 @@ static void ioreq_server_free_rangesets(struct ioreq_server *s)
     unsigned int i;
 
     for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
+    {
         rangeset_destroy(s->range[i]);
+        rangeset_destroy(s->posted[i]);
+    }
 }
 
 static int ioreq_server_alloc_rangesets(struct ioreq_server *s,
@@ -526,6 +563,24 @@ static int ioreq_server_alloc_rangesets(struct ioreq_server *s,
             goto fail;
 
         rangeset_limit(s->range[i], MAX_NR_IO_RANGES);
+
+        if ( !HANDLE_POSTED(s) )
+            continue;
+
+        rc = xasprintf(&name, "ioreq_server %d posted%s", id, type);
+        if ( rc )
+            goto fail;
+
+        s->posted[i] = rangeset_new(s->target, name,
+                                    RANGESETF_prettyprint_hex);
+
+        xfree(name);
+
+        rc = -ENOMEM;
+        if ( !s->posted[i] )
+            goto fail;
+
+        rangeset_limit(s->posted[i], MAX_NR_IO_RANGES);
     }
 
     return 0;
@@ -536,6 +591,186 @@ static int ioreq_server_alloc_rangesets(struct ioreq_server *s,
     return rc;
 }
 
+/*
+ * The selection index splits the ranges of all enabled servers into
+ * disjoint segments, each owned by the server ioreq_server_select() picks
+ * for an access within it.  It is rebuilt whenever ranges are mapped or
+ * unmapped and servers are enabled, disabled or destroyed, and replaced
+ * under RCU, so that selection needs neither locks nor a scan of all
+ * servers.
+ */
+struct ioreq_segment {
+    unsigned long start, end;
+    unsigned int id;
+};
+
+struct ioreq_index {
+    struct rcu_head rcu;
+    unsigned long gen;
+    unsigned int nr[NR_IO_RANGE_TYPES];
+    struct ioreq_segment *seg[NR_IO_RANGE_TYPES];
+};
+
+static DEFINE_RCU_READ_LOCK(ioreq_index_rcu_lock);
+
+static void cf_check ioreq_index_free(struct rcu_head *rcu)
+{
+    struct ioreq_index *idx = container_of(rcu, struct ioreq_index, rcu);
+    unsigned int i;
+
+    for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
+        xfree(idx->seg[i]);
+
+    xfree(idx);
+}
+
+struct ioreq_bounds {
+    unsigned long *bound;
+    unsigned int nr;
+};
+
+static int cf_check ioreq_count_range(unsigned long s, unsigned long e,
+                                      void *arg)
+{
+    ((struct ioreq_bounds *)arg)->nr += 2;
+
+    return 0;
+}
+
+/* Collect the first address of each range and the one following it. */
+static int cf_check ioreq_add_bounds(unsigned long s, unsigned long e,
+                                     void *arg)
+{
+    struct ioreq_bounds *b = arg;
+
+    b->bound[b->nr++] = s;
+    if ( e != ~0UL )
+        b->bound[b->nr++] = e + 1;
+
+    return 0;
+}
+
+static int cf_check cmp_bound(const void *a, const void *b)
+{
+    const unsigned long *l = a, *r = b;
+
+    return *l < *r ? -1 : *l > *r;
+}
+
+static void cf_check swap_bound(void *a, void *b, size_t size)
+{
+    unsigned long *l = a, *r = b, t = *l;
+
+    *l = *r;
+    *r = t;
+}
+
+static int ioreq_index_build_type(struct domain *d, struct ioreq_index *idx,
+                                  unsigned int type)
+{
+    struct ioreq_bounds b = {};
+    struct ioreq_segment *seg;
+    struct ioreq_server *s;
+    unsigned int id, i, nr = 0;
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+        if ( s->enabled )
+            rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                   ioreq_count_range, &b);
+
+    if ( !b.nr )
+        return 0;
+
+    b.bound = xmalloc_array(unsigned long, b.nr);
+    seg = xmalloc_array(struct ioreq_segment, b.nr);
+    if ( !b.bound || !seg )
+    {
+        xfree(b.bound);
+        xfree(seg);
+        return -ENOMEM;
+    }
+
+    b.nr = 0;
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+        if ( s->enabled )
+            rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                   ioreq_add_bounds, &b);
+
+    sort(b.bound, b.nr, sizeof(*b.bound), cmp_bound, swap_bound);
+    for ( i = 1, nr = 1; i < b.nr; i++ )
+        if ( b.bound[i] != b.bound[nr - 1] )
+            b.bound[nr++] = b.bound[i];
+    b.nr = nr;
+    nr = 0;
+
+    /*
+     * Between two bounds the set of servers covering an address doesn't
+     * change, so the owner is the most favoured server covering the lower
+     * one.  Adjacent segments of the same owner are merged: as its ranges
+     * are maximal, the merged segment still lies within one of them.
+     */
+    for ( i = 0; i < b.nr; i++ )
+    {
+        unsigned long start = b.bound[i];
+        unsigned long end = i + 1 < b.nr ? b.bound[i + 1] - 1 : ~0UL;
+
+        FOR_EACH_IOREQ_SERVER(d, id, s)
+        {
+            if ( !s->enabled ||
+                 !rangeset_contains_singleton(s->range[type], start) )
+                continue;
+
+            if ( nr && seg[nr - 1].id == id && seg[nr - 1].end + 1 == start )
+                seg[nr - 1].end = end;
+            else
+                seg[nr++] = (struct ioreq_segment){ start, end, id };
+            break;
+        }
+    }
+
+    xfree(b.bound);
+
+    idx->nr[type] = nr;
+    idx->seg[type] = seg;
+
+    return 0;
+}
+
+/*
+ * Replace the selection index of d.  If it can't be built, selection falls
+ * back to scanning all servers.
+ */
+static void ioreq_index_update(struct domain *d)
+{
+    struct ioreq_index *idx, *old = d->ioreq_server.index;
+    unsigned int i;
+
+    ASSERT(rspin_is_locked(&d->ioreq_server.lock));
+
+    perfc_incr(ioreq_index_update);
+
+    idx = xzalloc(struct ioreq_index);
+    for ( i = 0; idx && i < NR_IO_RANGE_TYPES; i++ )
+    {
+        if ( ioreq_index_build_type(d, idx, i) )
+        {
+            ioreq_index_free(&idx->rcu);
+            idx = NULL;
+        }
+    }
+
+    if ( idx )
+        idx->gen = ++d->ioreq_server.index_gen;
+    else
+        gprintk(XENLOG_WARNING,
+                "%pd: no memory for ioreq server index\n", d);
+
+    rcu_assign_pointer(d->ioreq_server.index, idx);
+
+    if ( old )
+        call_rcu(&old->rcu, ioreq_index_free);
+}
+
 static void ioreq_server_enable(struct ioreq_server *s)
 {
     struct ioreq_vcpu *sv;
@@ -575,7 +810,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
 
 static int ioreq_server_init(struct ioreq_server *s,
                              struct domain *d, int bufioreq_handling,
-                             ioservid_t id)
+                             bool posted_ring, ioservid_t id)
 {
     struct domain *currd = current->domain;
     struct vcpu *v;
@@ -592,6 +827,7 @@ static int ioreq_server_init(struct ioreq_server *s,
 
     s->ioreq.gfn = INVALID_GFN;
     s->bufioreq.gfn = INVALID_GFN;
+    s->posted_ring = posted_ring;
 
     rc = ioreq_server_alloc_rangesets(s, id);
     if ( rc )
@@ -641,7 +877,7 @@ static void ioreq_server_deinit(struct ioreq_server *s)
 }
 
 static int ioreq_server_create(struct domain *d, int bufioreq_handling,
-                               ioservid_t *id)
+                               bool posted_ring, ioservid_t *id)
 {
     struct ioreq_server *s;
     unsigned int i;
@@ -676,7 +912,7 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
      */
     set_ioreq_server(d, i, s);
 
-    rc = ioreq_server_init(s, d, bufioreq_handling, i);
+    rc = ioreq_server_init(s, d, bufioreq_handling, posted_ring, i);
     if ( rc )
     {
         set_ioreq_server(d, i, NULL);
@@ -729,6 +965,8 @@ static int ioreq_server_destroy(struct domain *d, ioservid_t id)
     ioreq_server_deinit(s);
     set_ioreq_server(d, id, NULL);
 
+    ioreq_index_update(d);
+
     domain_unpause(d);
 
     xfree(s);
@@ -788,6 +1026,30 @@ static int ioreq_server_get_info(struct domain *d, ioservid_t id,
     return rc;
 }
 
+/*
+ * Number of frames of server id's resource, as laid out by
+ * ioreq_server_get_frame(), or 0 if there is no such server.
+ */
+unsigned int ioreq_server_max_frames(struct domain *d, ioservid_t id)
+{
+    const struct ioreq_server *s;
+    unsigned int nr = 0;
+
+    ASSERT(is_hvm_domain(d));
+
+    rspin_lock(&d->ioreq_server.lock);
+
+    s = get_ioreq_server(d, id);
+    if ( s )
+        nr = HANDLE_POSTED(s)
+             ? XENMEM_resource_ioreq_server_frame_ring(d->max_vcpus)
+             : XENMEM_resource_ioreq_server_frame_ioreq(1);
+
+    rspin_unlock(&d->ioreq_server.lock);
+
+    return nr;
+}
+
 int ioreq_server_get_frame(struct domain *d, ioservid_t id,
                            unsigned int idx, mfn_t *mfn)
 {
@@ -829,9 +1091,31 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
         break;
 
     default:
+    {
+        const struct ioreq_vcpu *sv;
+
         rc = -EINVAL;
+        if ( idx < XENMEM_resource_ioreq_server_frame_ring(0) ||
+             idx >= XENMEM_resource_ioreq_server_frame_ring(d->max_vcpus) )
+            break;
+
+        rc = -ENOENT;
+        if ( !HANDLE_POSTED(s) )
+            break;
+
+        spin_lock(&s->lock);
+        list_for_each_entry ( sv, &s->ioreq_vcpu_list, list_entry )
+            if ( idx == XENMEM_resource_ioreq_server_frame_ring(
+                           sv->vcpu->vcpu_id) )
+            {
+                *mfn = page_to_mfn(sv->ring.page);
+                rc = 0;
+                break;
+            }
+        spin_unlock(&s->lock);
         break;
     }
+    }
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -841,7 +1125,7 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
 
 static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
                                      uint32_t type, uint64_t start,
-                                     uint64_t end)
+                                     uint64_t end, bool posted)
 {
     struct ioreq_server *s;
     struct rangeset *r;
@@ -879,11 +1163,30 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
     if ( !r )
         goto out;
 
+    rc = -EINVAL;
+    if ( posted && !HANDLE_POSTED(s) )
+        goto out;
+
     rc = -EEXIST;
     if ( rangeset_overlaps_range(r, start, end) )
         goto out;
 
     rc = rangeset_add_range(r, start, end);
+    if ( !rc && posted )
+    {
+        /*
+         * The range was free, so removing it leaves no more ranges than
+         * there were, and can only fail for lack of memory.  Should that
+         * happen, the range stays mapped without its writes being posted.
+         */
+        rc = rangeset_add_range(s->posted[type], start, end);
+        if ( rc && rangeset_remove_range(r, start, end) )
+            gprintk(XENLOG_WARNING,
+                    "%pd: ioreq server %u range %#"PRIx64"-%#"PRIx64
+                    " left mapped without posting\n", d, id, start, end);
+    }
+    if ( !rc && s->enabled )
+        ioreq_index_update(d);
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -935,7 +1238,17 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
     if ( !rangeset_contains_range(r, start, end) )
         goto out;
 
+    /* Stop posting first, so that a failure leaves the range as it was. */
+    if ( HANDLE_POSTED(s) )
+    {
+        rc = rangeset_remove_range(s->posted[type], start, end);
+        if ( rc )
+            goto out;
+    }
+
     rc = rangeset_remove_range(r, start, end);
+    if ( !rc && s->enabled )
+        ioreq_index_update(d);
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -1011,6 +1324,8 @@ static int ioreq_server_set_state(struct domain *d, ioservid_t id,
     else
         ioreq_server_disable(s);
 
+    ioreq_index_update(d);
+
     domain_unpause(d);
 
     rc = 0;
@@ -1094,63 +1409,143 @@ void ioreq_server_destroy_all(struct domain *d)
         xfree(s);
     }
 
+    if ( d->ioreq_server.index )
+    {
+        call_rcu(&d->ioreq_server.index->rcu, ioreq_index_free);
+        d->ioreq_server.index = NULL;
+    }
+
     rspin_unlock(&d->ioreq_server.lock);
 }
 
+/* Find the segment containing start, or NULL if no server covers start. */
+static const struct ioreq_segment *ioreq_index_find(
+    const struct ioreq_index *idx, unsigned int type, unsigned long start)
+{
+    const struct ioreq_segment *seg = idx->seg[type];
+    unsigned int lo = 0, hi = idx->nr[type];
+
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ( seg[mid].end < start )
+            lo = mid + 1;
+        else if ( seg[mid].start > start )
+            hi = mid;
+        else
+            return &seg[mid];
+    }
+
+    return NULL;
+}
+
 struct ioreq_server *ioreq_server_select(struct domain *d,
                                          ioreq_t *p)
 {
+    struct vcpu_io *vio = &current->io;
+    const struct ioreq_index *idx;
     struct ioreq_server *s;
     uint8_t type;
     uint64_t addr;
+    unsigned long start, end;
     unsigned int id;
 
     if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
         return NULL;
 
-    FOR_EACH_IOREQ_SERVER(d, id, s)
+    switch ( type )
     {
-        struct rangeset *r;
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-        if ( !s->enabled )
-            continue;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
 
-        r = s->range[type];
+    case XEN_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
 
-        switch ( type )
-        {
-            unsigned long start, end;
+    default:
+        return NULL;
+    }
 
-        case XEN_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    perfc_incr(ioreq_select);
 
-            break;
+    rcu_read_lock(&ioreq_index_rcu_lock);
 
-        case XEN_DMOP_IO_RANGE_MEMORY:
-            start = ioreq_mmio_first_byte(p);
-            end = ioreq_mmio_last_byte(p);
+    idx = rcu_dereference(d->ioreq_server.index);
+    if ( idx )
+    {
+        const struct ioreq_segment *seg;
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+        /* Accesses of a vCPU tend to go to the same device. */
+        if ( d == current->domain && vio->last.gen == idx->gen &&
+             vio->last.type == type &&
+             vio->last.start <= start && end <= vio->last.end )
+        {
+            perfc_incr(ioreq_select_last);
+            s = GET_IOREQ_SERVER(d, vio->last.id);
+            goto found;
+        }
 
-            break;
+        seg = ioreq_index_find(idx, type, start);
+        if ( !seg )
+        {
+            perfc_incr(ioreq_select_none);
+            rcu_read_unlock(&ioreq_index_rcu_lock);
+            return NULL;
+        }
 
-        case XEN_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
+        /* Accesses crossing segments need the servers' ranges checked. */
+        if ( end <= seg->end )
+        {
+            perfc_incr(ioreq_select_index);
+            if ( d == current->domain )
             {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
+                vio->last.gen = idx->gen;
+                vio->last.type = type;
+                vio->last.start = seg->start;
+                vio->last.end = seg->end;
+                vio->last.id = seg->id;
             }
-
-            break;
+            s = GET_IOREQ_SERVER(d, seg->id);
+            goto found;
         }
     }
 
+    rcu_read_unlock(&ioreq_index_rcu_lock);
+
+ scan:
+    perfc_incr(ioreq_select_scan);
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( s->enabled && rangeset_contains_range(s->range[type], start, end) )
+            goto selected;
+    }
+
     return NULL;
+
+ found:
+    rcu_read_unlock(&ioreq_index_rcu_lock);
+
+    /* The index may lag behind a server being disabled. */
+    if ( !s || !s->enabled )
+        goto scan;
+
+ selected:
+    if ( type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
+    }
+
+    return s;
 }
 
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
@@ -1246,6 +1641,94 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
     return IOREQ_STATUS_HANDLED;
 }
 
+/* Can the write be passed without waiting for its emulation? */
+static bool ioreq_posted(const struct ioreq_server *s, const ioreq_t *p)
+{
+    unsigned long start, end;
+    unsigned int type;
+
+    if ( !HANDLE_POSTED(s) || p->dir != IOREQ_WRITE || p->data_is_ptr )
+        return false;
+
+    switch ( p->type )
+    {
+    case IOREQ_TYPE_PIO:
+        type = XEN_DMOP_IO_RANGE_PORT;
+        start = p->addr;
+        end = start + p->size - 1;
+        break;
+
+    case IOREQ_TYPE_COPY:
+        type = XEN_DMOP_IO_RANGE_MEMORY;
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
+
+    case IOREQ_TYPE_PCI_CONFIG:
+        type = XEN_DMOP_IO_RANGE_PCI;
+        start = end = p->addr >> 32;
+        break;
+
+    default:
+        return false;
+    }
+
+    return rangeset_contains_range(s->posted[type], start, end);
+}
+
+/*
+ * Post a write to the vCPU's ring.  Returns IOREQ_STATUS_UNHANDLED if the
+ * ring is full, in which case the write has to be passed synchronously:
+ * as the emulator consumes the rings first, its completion then also
+ * retires all the writes posted before.
+ */
+static int ioreq_send_posted(struct ioreq_server *s, struct ioreq_vcpu *sv,
+                             const ioreq_t *p)
+{
+    ioreq_ring_t *ring = sv->ring.va;
+    unsigned int prod = sv->ring_prod, next, cons;
+
+    BUILD_BUG_ON(sizeof(ioreq_ring_t) > PAGE_SIZE);
+
+    next = prod + 1 < IOREQ_RING_SLOT_NUM ? prod + 1 : 0;
+    cons = ACCESS_ONCE(ring->cons);
+
+    if ( unlikely(cons >= IOREQ_RING_SLOT_NUM) )
+    {
+        gprintk(XENLOG_ERR, "device model set bad ring index %u\n", cons);
+        return IOREQ_STATUS_UNHANDLED;
+    }
+
+    if ( next == cons )
+    {
+        perfc_incr(ioreq_posted_full);
+        return IOREQ_STATUS_UNHANDLED;
+    }
+
+    ring->ring[prod] = *p;
+    ring->ring[prod].state = STATE_IOREQ_READY;
+    ring->ring[prod].vp_eport = sv->ioreq_evtchn;
+
+    /* Make the ioreq_t visible /before/ prod. */
+    smp_wmb();
+    ACCESS_ONCE(ring->prod) = sv->ring_prod = next;
+
+    perfc_incr(ioreq_posted);
+
+    /*
+     * Notify only if the emulator may have gone idle on an empty ring: it
+     * otherwise finds the write when re-checking prod after updating cons.
+     */
+    smp_mb();
+    if ( ACCESS_ONCE(ring->cons) == prod )
+    {
+        perfc_incr(ioreq_posted_notify);
+        notify_via_xen_event_channel(s->target, sv->ioreq_evtchn);
+    }
+
+    return IOREQ_STATUS_HANDLED;
+}
+
 int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
                bool buffered)
 {
@@ -1274,6 +1757,14 @@ int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
             evtchn_port_t port = sv->ioreq_evtchn;
             ioreq_t *p = get_ioreq(s, curr);
 
+            if ( ioreq_posted(s, proto_p) &&
+                 ioreq_send_posted(s, sv, proto_p) == IOREQ_STATUS_HANDLED )
+            {
+                /* There is no completion to wait for. */
+                vcpu_end_shutdown_deferral(curr);
+                return IOREQ_STATUS_HANDLED;
+            }
+
             if ( unlikely(p->state != STATE_IOREQ_NONE) )
             {
                 gprintk(XENLOG_ERR, "device model set bad IO state %d\n",
@@ -1346,14 +1837,16 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
     {
         struct xen_dm_op_create_ioreq_server *data =
             &op->u.create_ioreq_server;
+        const uint8_t valid_flags = XEN_DMOP_posted_ring;
 
         *const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( (data->flags & ~valid_flags) || data->pad[0] || data->pad[1] )
             break;
 
         rc = ioreq_server_create(d, data->handle_bufioreq,
+                                 data->flags & XEN_DMOP_posted_ring,
                                  &data->id);
         break;
     }
@@ -1383,13 +1876,15 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
     {
         const struct xen_dm_op_ioreq_server_range *data =
             &op->u.map_io_range_to_ioreq_server;
+        const uint16_t valid_flags = XEN_DMOP_IO_RANGE_posted;
 
         rc = -EINVAL;
-        if ( data->pad )
+        if ( data->flags & ~valid_flags )
             break;
 
         rc = ioreq_server_map_io_range(d, data->id, data->type,
-                                       data->start, data->end);
+                                       data->start, data->end,
+                                       data->flags & XEN_DMOP_IO_RANGE_posted);
         break;
     }
 
@@ -1399,7 +1894,7 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
             &op->u.unmap_io_range_from_ioreq_server;
 
         rc = -EINVAL;
-        if ( data->pad )
+        if ( data->flags )
             break;
 
         rc = ioreq_server_unmap_io_range(d, data->id, data->type,
@@ -1122,14 +1122,14 @@ static long xatp_permission_check(struct domain *d, unsigned int space)
     return xsm_add_to_physmap(XSM_TARGET, current->domain, d);
 }
 
-static unsigned int ioreq_server_max_frames(const struct domain *d)
+static unsigned int resource_ioreq_server_max_frames(struct domain *d,
+                                                     unsigned int id)
 {
     unsigned int nr = 0;
 
 #ifdef CONFIG_IOREQ_SERVER
-    if ( is_hvm_domain(d) )
-        /* One frame for the buf-ioreq ring, and one frame per 128 vcpus. */
-        nr = 1 + DIV_ROUND_UP(d->max_vcpus * sizeof(struct ioreq), PAGE_SIZE);
+    if ( is_hvm_domain(d) && id == (ioservid_t)id )
+        nr = ioreq_server_max_frames(d, id);
 #endif
 
     return nr;
@@ -1142,7 +1142,7 @@ static unsigned int ioreq_server_max_frames(const struct domain *d)
  * property of the domain), and describe the full resource (i.e. mapping the
  * result of this call will be the entire resource).
  */
-static unsigned int resource_max_frames(const struct domain *d,
+static unsigned int resource_max_frames(struct domain *d,
                                         unsigned int type, unsigned int id)
 {
     switch ( type )
@@ -1151,7 +1151,7 @@ static unsigned int resource_max_frames(const struct domain *d,
         return gnttab_resource_max_frames(d, id);
 
     case XENMEM_resource_ioreq_server:
-        return ioreq_server_max_frames(d);
+        return resource_ioreq_server_max_frames(d, id);
 
     case XENMEM_resource_vmtrace_buf:
         return d->vmtrace_size >> PAGE_SHIFT;
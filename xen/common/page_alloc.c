@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <xen/cpu.h>
 #include <xen/domain_page.h>
 #include <xen/event.h>
 #include <xen/init.h>
@@ -131,6 +132,7 @@
 #include <xen/numa.h>
 #include <xen/param.h>
 #include <xen/perfc.h>
+#include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <xen/types.h>
 #include <xen/sched.h>
@@ -247,10 +249,11 @@ static bool __read_mostly scrub_debug;
 static unsigned int dma_bitsize;
 integer_param("dma_bits", dma_bitsize);
 
-/* Offlined page list, protected by heap_lock. */
+/* Offlined page list, protected by page_offline_lock. */
 static PAGE_LIST_HEAD(page_offlined_list);
-/* Broken page list, protected by heap_lock. */
+/* Broken page list, protected by page_offline_lock. */
 static PAGE_LIST_HEAD(page_broken_list);
+static DEFINE_SPINLOCK(page_offline_lock);
 
 /*************************
  * BOOT-TIME ALLOCATOR
@@ -261,6 +264,7 @@ static PAGE_LIST_HEAD(page_broken_list);
  * stubs.
  */
 STATIC_IF(CONFIG_NUMA) mfn_t first_valid_mfn = INVALID_MFN_INITIALIZER;
+static DEFINE_SPINLOCK(first_valid_mfn_lock);
 
 struct bootmem_region {
     unsigned long s, e; /* MFNs @s through @e-1 inclusive are free */
@@ -469,11 +473,140 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 static unsigned long node_need_scrub[MAX_NUMNODES];
 
 static unsigned long *avail[MAX_NUMNODES];
+
+/*
+ * Each node's heap, avail[] and node_need_scrub[] entries are protected by
+ * the node's own lock, so that allocations from different nodes don't
+ * contend.  Where more than one is needed they are taken in node order.
+ * The lock also protects the node's scrubbing statistics.
+ */
+static struct heap_node {
+    spinlock_t heap_lock;
+    struct lock_profile_qhead profile_head;
+    /* Pages scrubbed by idle CPUs, and by allocations which had to wait. */
+    unsigned long idle_scrub_pages, sync_scrub_pages;
+    s_time_t idle_scrub_time, sync_scrub_time;
+} __cacheline_aligned heap_node[MAX_NUMNODES] = {
+    [0 ... MAX_NUMNODES - 1] = { .heap_lock = SPIN_LOCK_UNLOCKED },
+};
+#define heap_lock(node) (heap_node[node].heap_lock)
+
+static int __init cf_check heap_lock_prof_init(void)
+{
+    nodeid_t node;
+
+    /* Nothing can hold a heap lock yet, with just this cpu up. */
+    for_each_online_node ( node )
+    {
+        spin_lock_init_prof(&heap_node[node], heap_lock);
+        lock_profile_register_struct(LOCKPROF_TYPE_PERNODE, &heap_node[node],
+                                     node);
+    }
+
+    return 0;
+}
+presmp_initcall(heap_lock_prof_init);
+
+/*
+ * Sum of avail[], updated atomically outside of the node locks.  Pages are
+ * taken off it before looking for them in the heap, so it may transiently
+ * be lower (even negative) than what the heap holds.
+ */
 static long total_avail_pages;
 
-static DEFINE_SPINLOCK(heap_lock);
+/*
+ * Updates to outstanding_claims and d->outstanding_pages are serialised by
+ * claim_lock.  Allocations read outstanding_claims without it, see
+ * alloc_heap_pages() and domain_set_outstanding_pages().
+ */
+static DEFINE_SPINLOCK(claim_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/*
+ * Number of CPUs scrubbing each node.  Normally a single idle CPU scrubs a
+ * node, but while the node is short of clean memory up to opt_scrub_cpus
+ * idle CPUs scrub it in parallel, each working on different buddies.
+ */
+static atomic_t node_scrubbers[MAX_NUMNODES];
+
+static unsigned int __read_mostly opt_scrub_cpus = 4;
+integer_param("scrub-cpus", opt_scrub_cpus);
+
+/*
+ * Amount of clean free memory below which a node's scrubbing is urgent.
+ * Memory claimed by domains being built is about to be allocated, so it is
+ * added on top.
+ */
+static paddr_t __read_mostly opt_scrub_watermark = MB(256);
+size_param("scrub-watermark", opt_scrub_watermark);
+
+/* Idle CPUs which found nothing to scrub, to be kicked when that changes. */
+static cpumask_t scrub_idle_cpus;
+
+static bool node_scrub_urgent(nodeid_t node)
+{
+    unsigned long free = 0, dirty = node_need_scrub[node];
+    long claims = read_atomic(&outstanding_claims);
+    unsigned int zone;
+
+    if ( !avail[node] )
+        return false;
+
+    for ( zone = 0; zone < NR_ZONES; zone++ )
+        free += avail[node][zone];
+
+    return free - min(free, dirty) <
+           (opt_scrub_watermark >> PAGE_SHIFT) + max(claims, 0L);
+}
+
+/* Become one of the CPUs scrubbing @node, if there aren't too many yet. */
+static bool scrub_get_node(nodeid_t node)
+{
+    int nr = atomic_read(&node_scrubbers[node]);
+
+    while ( !nr ||
+            (nr < opt_scrub_cpus && node_scrub_urgent(node)) )
+    {
+        int old = atomic_cmpxchg(&node_scrubbers[node], nr, nr + 1);
+
+        if ( old == nr )
+            return true;
+        nr = old;
+    }
+
+    return false;
+}
+
+static void scrub_put_node(nodeid_t node)
+{
+    atomic_dec(&node_scrubbers[node]);
+}
+
+/*
+ * Wake up idle CPUs which found nothing to scrub, as @node now has dirty
+ * pages or needs more scrubbers.  Memory-only nodes are scrubbed by CPUs of
+ * other nodes.
+ */
+static void scrub_kick(nodeid_t node)
+{
+    const cpumask_t *cpus = &node_to_cpumask(node);
+    unsigned int cpu;
+
+    if ( cpumask_empty(cpus) )
+        cpus = &cpu_online_map;
+
+    /* Pairs with the barrier in scrub_free_pages(). */
+    smp_mb();
+
+    if ( !cpumask_intersects(cpus, &scrub_idle_cpus) )
+        return;
+
+    for_each_cpu ( cpu, cpus )
+        if ( cpumask_test_cpu(cpu, &scrub_idle_cpus) &&
+             cpumask_test_and_clear_cpu(cpu, &scrub_idle_cpus) )
+            smp_send_event_check_cpu(cpu);
+}
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -483,13 +616,13 @@ unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 
     /*
      * can test d->claimed_pages race-free because it can only change
-     * if d->page_alloc_lock and heap_lock are both held, see also
+     * if d->page_alloc_lock and claim_lock are both held, see also
      * domain_set_outstanding_pages below
      */
     if ( !d->outstanding_pages )
         goto out;
 
-    spin_lock(&heap_lock);
+    spin_lock(&claim_lock);
     /* adjust domain outstanding pages; may not go negative */
     dom_before = d->outstanding_pages;
     dom_after = dom_before - pages;
@@ -500,30 +633,38 @@ unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
     sys_before = outstanding_claims;
     sys_after = sys_before - (dom_before - dom_claimed);
     BUG_ON(sys_after < 0);
-    outstanding_claims = sys_after;
-    spin_unlock(&heap_lock);
+    write_atomic(&outstanding_claims, sys_after);
+    spin_unlock(&claim_lock);
 
 out:
     return d->tot_pages;
 }
 
+static bool page_cache_reclaim(void);
+
 int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
 {
-    int ret = -ENOMEM;
-    unsigned long claim, avail_pages;
+    int ret;
+    unsigned long claim;
+    nodeid_t node;
+    bool reclaimed = false;
+
+ retry:
+    ret = -ENOMEM;
 
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
-     * must always take the global heap_lock rather than only in the much
+     * must always take the global claim_lock rather than only in the much
      * rarer case that d->outstanding_pages is non-zero
      */
     nrspin_lock(&d->page_alloc_lock);
-    spin_lock(&heap_lock);
+    spin_lock(&claim_lock);
 
     /* pages==0 means "unset" the claim. */
     if ( pages == 0 )
     {
-        outstanding_claims -= d->outstanding_pages;
+        write_atomic(&outstanding_claims,
+                     outstanding_claims - d->outstanding_pages);
         d->outstanding_pages = 0;
         ret = 0;
         goto out;
@@ -543,36 +684,55 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
         goto out;
     }
 
-    /* how much memory is available? */
-    avail_pages = total_avail_pages;
-
-    avail_pages -= outstanding_claims;
-
     /*
      * Note, if domain has already allocated memory before making a claim
      * then the claim must take domain_tot_pages() into account
      */
     claim = pages - domain_tot_pages(d);
-    if ( claim > avail_pages )
+
+    /*
+     * Stake the claim before checking that it fits in available memory.
+     * alloc_heap_pages() takes pages off total_avail_pages before looking
+     * at the claims, so either it sees our claim or we see its allocation.
+     */
+    write_atomic(&outstanding_claims, outstanding_claims + claim);
+    smp_mb();
+    if ( outstanding_claims > read_atomic(&total_avail_pages) )
+    {
+        write_atomic(&outstanding_claims, outstanding_claims - claim);
         goto out;
+    }
 
-    /* yay, claim fits in available memory, stake the claim, success! */
+    /* yay, claim fits in available memory, success! */
     d->outstanding_pages = claim;
-    outstanding_claims += d->outstanding_pages;
     ret = 0;
 
 out:
-    spin_unlock(&heap_lock);
+    spin_unlock(&claim_lock);
     nrspin_unlock(&d->page_alloc_lock);
+
+    /* The memory may be sitting in per-cpu caches: get it back, once. */
+    if ( ret == -ENOMEM && !reclaimed && page_cache_reclaim() )
+    {
+        reclaimed = true;
+        goto retry;
+    }
+
+    /* The claimed memory will soon be allocated: get it scrubbed first. */
+    if ( !ret && pages )
+        for_each_online_node ( node )
+            if ( node_need_scrub[node] )
+                scrub_kick(node);
+
     return ret;
 }
 
 void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
-    spin_lock(&heap_lock);
+    spin_lock(&claim_lock);
     *outstanding_pages = outstanding_claims;
     *free_pages =  avail_domheap_pages();
-    spin_unlock(&heap_lock);
+    spin_unlock(&claim_lock);
 }
 
 static bool __read_mostly first_node_initialised;
@@ -662,6 +822,8 @@ static unsigned long low_mem_virq_th        = 0;
 static unsigned long low_mem_virq_orig      = 0;
 /* Order for current threshold */
 static unsigned int  low_mem_virq_th_order  = 0;
+/* Protects the above once set up, taken only when crossing a threshold */
+static DEFINE_SPINLOCK(low_mem_virq_lock);
 
 /* Perform bootstrapping checks and set bounds */
 static void __init setup_low_mem_virq(void)
@@ -717,9 +879,16 @@ static void __init setup_low_mem_virq(void)
 
 static void check_low_mem_virq(void)
 {
-    unsigned long avail_pages = total_avail_pages - outstanding_claims;
+    unsigned long avail_pages = read_atomic(&total_avail_pages) -
+                                read_atomic(&outstanding_claims);
+
+    if ( likely(avail_pages > read_atomic(&low_mem_virq_th) &&
+                avail_pages < read_atomic(&low_mem_virq_high)) )
+        return;
 
-    if ( unlikely(avail_pages <= low_mem_virq_th) )
+    spin_lock(&low_mem_virq_lock);
+
+    if ( avail_pages <= low_mem_virq_th )
     {
         send_global_virq(VIRQ_ENOMEM);
 
@@ -730,10 +899,8 @@ static void check_low_mem_virq(void)
         if ( low_mem_virq_th_order > 0 )
             low_mem_virq_th_order--;
         low_mem_virq_th     = 1UL << low_mem_virq_th_order;
-        return;
     }
-
-    if ( unlikely(avail_pages >= low_mem_virq_high) )
+    else if ( avail_pages >= low_mem_virq_high )
     {
         /* Reset hysteresis. Bring threshold up one order.
          * If we are back where originally set, set high
@@ -746,6 +913,8 @@ static void check_low_mem_virq(void)
         else
             low_mem_virq_high = 1UL << (low_mem_virq_th_order + 2);
     }
+
+    spin_unlock(&low_mem_virq_lock);
 }
 
 /* Pages that need a scrub are added to tail, otherwise to head. */
@@ -823,6 +992,10 @@ static void check_and_stop_scrub(struct page_info *head)
     }
 }
 
+/*
+ * Find a free buddy of at least 2^@order pages and take it off its free list.
+ * On success returns with the heap lock of the buddy's node held.
+ */
 static struct page_info *get_free_buddy(unsigned int zone_lo,
                                         unsigned int zone_hi,
                                         unsigned int order, unsigned int memflags,
@@ -872,10 +1045,15 @@ static struct page_info *get_free_buddy(unsigned int zone_lo,
      */
     for ( ; ; )
     {
+        if ( !avail[node] )
+            goto next_node;
+
+        spin_lock(&heap_lock(node));
+
         zone = zone_hi;
         do {
             /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < (1UL << order)) )
+            if ( avail[node][zone] < (1UL << order) )
                 continue;
 
             /* Find smallest order which can satisfy the request. */
@@ -901,6 +1079,9 @@ static struct page_info *get_free_buddy(unsigned int zone_lo,
             }
         } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
 
+        spin_unlock(&heap_lock(node));
+
+ next_node:
         if ( (memflags & MEMF_exact_node) && req_node != NUMA_NO_NODE )
             return NULL;
 
@@ -935,6 +1116,10 @@ static void init_free_page_fields(struct page_info *pg)
     page_set_owner(pg, NULL);
 }
 
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    struct domain *d);
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
@@ -944,10 +1129,12 @@ static struct page_info *alloc_heap_pages(
     nodeid_t node;
     unsigned int i, buddy_order, zone, first_dirty;
     unsigned long request = 1UL << order;
+    long avail_pages;
     struct page_info *pg;
     bool need_tlbflush = false;
     uint32_t tlbflush_timestamp = 0;
     unsigned int dirty_cnt = 0;
+    bool reclaimed = false;
     mfn_t mfn;
 
     /* Make sure there are enough bits in memflags for nodeID. */
@@ -959,18 +1146,24 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
-    spin_lock(&heap_lock);
+    if ( !order && (pg = page_cache_alloc(zone_lo, zone_hi, memflags, d)) )
+        return pg;
 
+ retry:
     /*
      * Claimed memory is considered unavailable unless the request
-     * is made by a domain with sufficient unclaimed pages.
+     * is made by a domain with sufficient unclaimed pages.  The pages are
+     * taken off total_avail_pages before looking at the claims, see
+     * domain_set_outstanding_pages().
      */
-    if ( (outstanding_claims + request > total_avail_pages) &&
+    avail_pages = arch_fetch_and_add(&total_avail_pages, -(long)request) -
+                  (long)request;
+    if ( (read_atomic(&outstanding_claims) > avail_pages) &&
           ((memflags & MEMF_no_refcount) ||
            !d || d->outstanding_pages < request) )
     {
-        spin_unlock(&heap_lock);
-        return NULL;
+        arch_fetch_and_add(&total_avail_pages, request);
+        goto fail;
     }
 
     pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
@@ -981,8 +1174,8 @@ static struct page_info *alloc_heap_pages(
     if ( !pg )
     {
         /* No suitable memory blocks. Fail the request. */
-        spin_unlock(&heap_lock);
-        return NULL;
+        arch_fetch_and_add(&total_avail_pages, request);
+        goto fail;
     }
 
     node = page_to_nid(pg);
@@ -1012,10 +1205,6 @@ static struct page_info *alloc_heap_pages(
 
     ASSERT(avail[node][zone] >= request);
     avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
-
-    check_low_mem_virq();
 
     if ( d != NULL )
         d->last_alloc_node = node;
@@ -1046,11 +1235,15 @@ static struct page_info *alloc_heap_pages(
         init_free_page_fields(&pg[i]);
     }
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(node));
+
+    check_low_mem_virq();
 
     if ( first_dirty != INVALID_DIRTY_IDX ||
          (scrub_debug && !(memflags & MEMF_no_scrub)) )
     {
+        s_time_t start = NOW();
+
         for ( i = 0; i < (1U << order); i++ )
         {
             if ( test_and_clear_bit(_PGC_need_scrub, &pg[i].count_info) )
@@ -1066,9 +1259,18 @@ static struct page_info *alloc_heap_pages(
 
         if ( dirty_cnt )
         {
-            spin_lock(&heap_lock);
+            spin_lock(&heap_lock(node));
             node_need_scrub[node] -= dirty_cnt;
-            spin_unlock(&heap_lock);
+            if ( !(memflags & MEMF_no_scrub) )
+            {
+                heap_node[node].sync_scrub_pages += dirty_cnt;
+                heap_node[node].sync_scrub_time += NOW() - start;
+            }
+            spin_unlock(&heap_lock(node));
+
+            /* Idle CPUs should have got there first: get more of them. */
+            if ( !(memflags & MEMF_no_scrub) )
+                scrub_kick(node);
         }
     }
 
@@ -1084,6 +1286,16 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(mfn_x(mfn) + i, !(memflags & MEMF_no_icache_flush));
 
     return pg;
+
+ fail:
+    /* The memory may be sitting in per-cpu caches: get it back, once. */
+    if ( !reclaimed && page_cache_reclaim() )
+    {
+        reclaimed = true;
+        goto retry;
+    }
+
+    return NULL;
 }
 
 /* Remove any offlined page in the buddy pointed to by head. */
@@ -1094,7 +1306,7 @@ static int reserve_offlined_page(struct page_info *head)
     struct page_info *cur_head;
     unsigned int cur_order, first_dirty;
 
-    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(spin_is_locked(&heap_lock(node)));
 
     cur_head = head;
 
@@ -1170,12 +1382,13 @@ static int reserve_offlined_page(struct page_info *head)
             continue;
 
         avail[node][zone]--;
-        total_avail_pages--;
-        ASSERT(total_avail_pages >= 0);
+        arch_fetch_and_add(&total_avail_pages, -1L);
 
+        spin_lock(&page_offline_lock);
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
+        spin_unlock(&page_offline_lock);
 
         count++;
     }
@@ -1183,13 +1396,11 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-static nodemask_t node_scrubbing;
-
 /*
  * If get_node is true this will return closest node that needs to be scrubbed,
- * with appropriate bit in node_scrubbing set.
+ * with this CPU accounted in its node_scrubbers.
  * If get_node is not set, this will return *a* node that needs to be scrubbed.
- * node_scrubbing bitmask will no be updated.
+ * node_scrubbers will not be updated.
  * If no node needs scrubbing then NUMA_NO_NODE is returned.
  */
 static unsigned int node_to_scrub(bool get_node)
@@ -1202,7 +1413,7 @@ static unsigned int node_to_scrub(bool get_node)
         node = 0;
 
     if ( node_need_scrub[node] &&
-         (!get_node || !node_test_and_set(node, node_scrubbing)) )
+         (!get_node || scrub_get_node(node)) )
         return node;
 
     /*
@@ -1244,10 +1455,10 @@ static unsigned int node_to_scrub(bool get_node)
              * then we'd need to take this lock every time we come in here.
              */
             if ( (dist < shortest || closest == NUMA_NO_NODE) &&
-                 !node_test_and_set(node, node_scrubbing) )
+                 scrub_get_node(node) )
             {
                 if ( closest != NUMA_NO_NODE )
-                    node_clear(closest, node_scrubbing);
+                    scrub_put_node(closest);
                 shortest = dist;
                 closest = node;
             }
@@ -1257,6 +1468,25 @@ static unsigned int node_to_scrub(bool get_node)
     return closest;
 }
 
+/*
+ * Find the dirty buddy closest to the end of a free list which no other CPU
+ * is scrubbing.  Unscrubbed pages are always at the end of the list.
+ */
+static struct page_info *scrub_find_dirty(struct page_list_head *list)
+{
+    struct page_info *pg, *tmp;
+
+    page_list_for_each_safe_reverse ( pg, tmp, list )
+    {
+        if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+            break;
+        if ( pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING )
+            return pg;
+    }
+
+    return NULL;
+}
+
 struct scrub_wait_state {
     struct page_info *pg;
     unsigned int first_dirty;
@@ -1291,31 +1521,44 @@ bool scrub_free_pages(void)
 
     node = node_to_scrub(true);
     if ( node == NUMA_NO_NODE )
-        return false;
+    {
+        if ( cpumask_test_cpu(cpu, &scrub_idle_cpus) )
+            return false;
 
-    spin_lock(&heap_lock);
+        /*
+         * Ask to be kicked when there is work, then look again in case some
+         * turned up before that (pairs with the barrier in scrub_kick()).
+         */
+        cpumask_set_cpu(cpu, &scrub_idle_cpus);
+        smp_mb();
+        node = node_to_scrub(true);
+        if ( node == NUMA_NO_NODE )
+            return false;
+    }
 
-    for ( zone = 0; zone < NR_ZONES; zone++ )
+    if ( cpumask_test_cpu(cpu, &scrub_idle_cpus) )
+        cpumask_clear_cpu(cpu, &scrub_idle_cpus);
+
+    spin_lock(&heap_lock(node));
+
+    /* Allocations prefer higher zones, so get those clean first. */
+    for ( zone = NR_ZONES; zone-- > 0; )
     {
         unsigned int order = MAX_ORDER;
 
         do {
-            while ( !page_list_empty(&heap(node, zone, order)) )
+            while ( (pg = scrub_find_dirty(&heap(node, zone, order))) != NULL )
             {
                 unsigned int i, dirty_cnt;
                 struct scrub_wait_state st;
+                s_time_t start;
 
-                /* Unscrubbed pages are always at the end of the list. */
-                pg = page_list_last(&heap(node, zone, order));
-                if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
-                    break;
-
-                ASSERT(pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING);
                 pg->u.free.scrub_state = BUDDY_SCRUBBING;
 
-                spin_unlock(&heap_lock);
+                spin_unlock(&heap_lock(node));
 
                 dirty_cnt = 0;
+                start = NOW();
 
                 for ( i = pg->u.free.first_dirty; i < (1U << order); i++)
                 {
@@ -1343,9 +1586,11 @@ bool scrub_free_pages(void)
                         smp_wmb();
                         pg->u.free.scrub_state = BUDDY_NOT_SCRUBBING;
 
-                        spin_lock(&heap_lock);
+                        spin_lock(&heap_lock(node));
                         node_need_scrub[node] -= dirty_cnt;
-                        spin_unlock(&heap_lock);
+                        heap_node[node].idle_scrub_pages += dirty_cnt;
+                        heap_node[node].idle_scrub_time += NOW() - start;
+                        spin_unlock(&heap_lock(node));
                         goto out_nolock;
                     }
 
@@ -1374,9 +1619,11 @@ bool scrub_free_pages(void)
                 st.first_dirty = (i >= (1U << order) - 1) ?
                     INVALID_DIRTY_IDX : i + 1;
                 st.drop = false;
-                spin_lock_cb(&heap_lock, scrub_continue, &st);
+                spin_lock_cb(&heap_lock(node), scrub_continue, &st);
 
                 node_need_scrub[node] -= dirty_cnt;
+                heap_node[node].idle_scrub_pages += dirty_cnt;
+                heap_node[node].idle_scrub_time += NOW() - start;
 
                 if ( st.drop )
                     goto out;
@@ -1398,13 +1645,25 @@ bool scrub_free_pages(void)
     }
 
  out:
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(node));
 
  out_nolock:
-    node_clear(node, node_scrubbing);
+    scrub_put_node(node);
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
+static void release_page_owner(struct page_info *pg, mfn_t mfn)
+{
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        page_set_tlbflush_timestamp(pg);
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+}
+
 static bool mark_page_free(struct page_info *pg, mfn_t mfn)
 {
     bool pg_offlined = false;
@@ -1444,20 +1703,16 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
         BUG();
     }
 
-    /* If a page has no owner it will need no safety TLB flush. */
-    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
-    if ( pg->u.free.need_tlbflush )
-        page_set_tlbflush_timestamp(pg);
-
-    /* This page is not a guest frame any more. */
-    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
-    set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+    release_page_owner(pg, mfn);
 
     return pg_offlined;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
+/*
+ * Free 2^@order set of pages to the heap of their node, with that node's heap
+ * lock held.
+ */
+static void __free_heap_pages(
     struct page_info *pg, unsigned int order, bool need_scrub)
 {
     unsigned long mask;
@@ -1467,8 +1722,7 @@ static void free_heap_pages(
     bool pg_offlined = false;
 
     ASSERT(order <= MAX_ORDER);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock(node)));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -1483,7 +1737,7 @@ static void free_heap_pages(
     }
 
     avail[node][zone] += 1 << order;
-    total_avail_pages += 1 << order;
+    arch_fetch_and_add(&total_avail_pages, 1L << order);
     if ( need_scrub )
     {
         node_need_scrub[node] += 1 << order;
@@ -1551,10 +1805,386 @@ static void free_heap_pages(
 
     if ( pg_offlined )
         reserve_offlined_page(pg);
+}
+
+static bool page_cache_free(struct page_info *pg);
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    unsigned int node = page_to_nid(pg);
+    bool kick;
+
+    if ( !order && !need_scrub && page_cache_free(pg) )
+        return;
+
+    spin_lock(&heap_lock(node));
+    kick = need_scrub && !node_need_scrub[node];
+    __free_heap_pages(pg, order, need_scrub);
+    spin_unlock(&heap_lock(node));
+
+    /* Idle CPUs may have gone to sleep with nothing to scrub. */
+    if ( kick )
+        scrub_kick(node);
+}
+
+/*
+ * Per-cpu page caches.
+ *
+ * Single clean pages freed on a cpu of their node are kept in a small per-cpu
+ * cache, and handed out again for order-0 allocations on that cpu without
+ * taking the node's heap lock.  An empty cache is refilled with one chunk
+ * from the heap, and the older half of a full one is returned to the heap
+ * under a single acquisition of its lock.
+ *
+ * As far as the heap is concerned, cached pages are allocated: they are in
+ * PGC_state_inuse without an owner and are not accounted in avail[] or
+ * total_avail_pages, although avail_domheap_pages() reports them as free.
+ * Requests the heap can't satisfy, claims included, hence have all caches
+ * returned to it before failing, and offlining a cached page first takes it
+ * out of its cache.  Only pages above the DMA zone are cached,
+ * serving requests which any such page satisfies.
+ *
+ * Each cache is only used by its own cpu but for these, which is what its
+ * lock is for.
+ */
+
+#define PAGE_CACHE_MAX          64
+#define PAGE_CACHE_REFILL_ORDER 4
+
+struct page_cache {
+    spinlock_t lock;
+    struct page_list_head list;
+    unsigned int nr;
+    bool enabled;
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+static bool __read_mostly opt_page_cache = true;
+boolean_param("page-cache", opt_page_cache);
+
+/* Lowest zone of cached pages. */
+static unsigned int page_cache_zone(void)
+{
+    return dma_bitsize ? min(bits_to_zone(dma_bitsize) + 1, NR_ZONES - 1U)
+                       : MEMZONE_XEN + 1;
+}
+
+/*
+ * Return a list of pages from a page cache to the heap of their node.  Their
+ * pending TLB flushes are done first, as the heap only knows about those of
+ * pages with an owner.
+ */
+static void page_cache_release(struct page_list_head *list)
+{
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    struct page_info *pg;
+    nodeid_t node;
+
+    if ( page_list_empty(list) )
+        return;
+
+    page_list_for_each ( pg, list )
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    node = page_to_nid(page_list_first(list));
+
+    spin_lock(&heap_lock(node));
+    while ( (pg = page_list_remove_head(list)) )
+    {
+        ASSERT(page_to_nid(pg) == node);
+        __free_heap_pages(pg, 0, false);
+    }
+    spin_unlock(&heap_lock(node));
+}
+
+/*
+ * Return (up to) the @nr least recently freed pages of @pc to the heap.
+ * Return how many there were.
+ */
+static unsigned int page_cache_drain(struct page_cache *pc, unsigned int nr)
+{
+    PAGE_LIST_HEAD(list);
+    struct page_info *pg;
+    unsigned int i;
+
+    spin_lock(&pc->lock);
+
+    for ( i = 0; i < nr && pc->nr; i++ )
+    {
+        pg = page_list_last(&pc->list);
+        page_list_del(pg, &pc->list);
+        page_list_add(pg, &list);
+        pc->nr--;
+    }
+
+    spin_unlock(&pc->lock);
+
+    page_cache_release(&list);
+
+    return i;
+}
+
+/* Return the pages of all caches to the heap.  Return whether there were any. */
+static bool page_cache_reclaim(void)
+{
+    unsigned int cpu;
+    bool found = false;
 
-    spin_unlock(&heap_lock);
+    if ( !opt_page_cache )
+        return false;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        if ( ACCESS_ONCE(pc->nr) && page_cache_drain(pc, PAGE_CACHE_MAX) )
+            found = true;
+    }
+
+    if ( found )
+        perfc_incr(page_cache_reclaim);
+
+    return found;
 }
 
+/* Number of pages in all caches, which the heap doesn't count as free. */
+static unsigned long page_cache_pages(void)
+{
+    unsigned long nr = 0;
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+        nr += ACCESS_ONCE(per_cpu(page_cache, cpu).nr);
+
+    return nr;
+}
+
+/* Take @pg out of the cache holding it, if any, and return it to the heap. */
+static void page_cache_evict(struct page_info *pg)
+{
+    nodeid_t node = page_to_nid(pg);
+    unsigned int cpu;
+
+    /* Cached pages are in use, without an owner or references. */
+    if ( !opt_page_cache || !page_state_is(pg, inuse) || page_get_owner(pg) ||
+         (pg->count_info & (PGC_xen_heap | PGC_count_mask)) )
+        return;
+
+    /* Pages are only cached by cpus of their node. */
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+        PAGE_LIST_HEAD(list);
+        struct page_info *iter;
+
+        if ( cpu_to_node(cpu) != node || !ACCESS_ONCE(pc->nr) )
+            continue;
+
+        spin_lock(&pc->lock);
+        page_list_for_each ( iter, &pc->list )
+        {
+            if ( iter != pg )
+                continue;
+
+            page_list_del(pg, &pc->list);
+            page_list_add(pg, &list);
+            pc->nr--;
+            break;
+        }
+        spin_unlock(&pc->lock);
+
+        if ( !page_list_empty(&list) )
+        {
+            page_cache_release(&list);
+            return;
+        }
+    }
+}
+
+static bool page_cache_refill(struct page_cache *pc, nodeid_t node)
+{
+    struct page_info *pg;
+    unsigned int i;
+
+    pg = alloc_heap_pages(page_cache_zone(), NR_ZONES - 1,
+                          PAGE_CACHE_REFILL_ORDER,
+                          MEMF_node(node) | MEMF_exact_node, NULL);
+    if ( !pg )
+        return false;
+
+    perfc_incr(page_cache_refill);
+
+    /* Scrubbed, and TLBs flushed, by alloc_heap_pages(). */
+    spin_lock(&pc->lock);
+    for ( i = 0; i < (1U << PAGE_CACHE_REFILL_ORDER); i++ )
+    {
+        pg[i].u.free.need_tlbflush = false;
+        page_list_add_tail(&pg[i], &pc->list);
+    }
+    pc->nr += 1U << PAGE_CACHE_REFILL_ORDER;
+    spin_unlock(&pc->lock);
+
+    return true;
+}
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    struct domain *d)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    nodeid_t node = cpu_to_node(smp_processor_id());
+    nodeid_t req_node = MEMF_get_node(memflags);
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    struct page_info *pg;
+
+    if ( !pc->enabled || scrub_debug || node >= MAX_NUMNODES ||
+         zone_lo > page_cache_zone() || zone_hi != NR_ZONES - 1 ||
+         (req_node != NUMA_NO_NODE && req_node != node) ||
+         (d && !nodemask_test(node, &d->node_affinity)) )
+        return NULL;
+
+    for ( ; ; )
+    {
+        PAGE_LIST_HEAD(offlining);
+
+        spin_lock(&pc->lock);
+        if ( (pg = page_list_remove_head(&pc->list)) )
+            pc->nr--;
+        spin_unlock(&pc->lock);
+
+        /*
+         * Refill without holding the lock, as alloc_heap_pages() may reclaim
+         * all caches.
+         */
+        if ( !pg )
+        {
+            if ( !page_cache_refill(pc, node) )
+                return NULL;
+            continue;
+        }
+
+        if ( likely(page_state_is(pg, inuse)) )
+            break;
+
+        /* Offlined while cached: have the heap retire it. */
+        page_list_add(pg, &offlining);
+        page_cache_release(&offlining);
+    }
+
+    perfc_incr(page_cache_alloc_hit);
+
+    if ( !(memflags & MEMF_no_tlbflush) )
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+    init_free_page_fields(pg);
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    flush_page_to_ram(mfn_x(page_to_mfn(pg)),
+                      !(memflags & MEMF_no_icache_flush));
+
+    if ( d != NULL )
+        d->last_alloc_node = node;
+
+    return pg;
+}
+
+static bool page_cache_free(struct page_info *pg)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned long x = ACCESS_ONCE(pg->count_info);
+
+    if ( !pc->enabled || scrub_debug ||
+         page_to_nid(pg) != cpu_to_node(smp_processor_id()) ||
+         page_to_zone(pg) < page_cache_zone() )
+        return false;
+
+    /*
+     * Pages being offlined (or broken) are left to the heap.  The page stays
+     * in use while cached, and mark_page_offline() may update it meanwhile,
+     * hence the cmpxchg().
+     */
+    if ( (x & (PGC_state | PGC_broken)) != PGC_state_inuse ||
+         cmpxchg(&pg->count_info, x, PGC_state_inuse) != x )
+        return false;
+
+    release_page_owner(pg, page_to_mfn(pg));
+
+    if ( pc->nr == PAGE_CACHE_MAX )
+    {
+        perfc_incr(page_cache_flush);
+        page_cache_drain(pc, PAGE_CACHE_MAX / 2);
+    }
+
+    spin_lock(&pc->lock);
+    page_list_add(pg, &pc->list);
+    pc->nr++;
+    spin_unlock(&pc->lock);
+    perfc_incr(page_cache_free_hit);
+
+    return true;
+}
+
+static int cf_check page_cache_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        /* Only initialise pc once: pages it was never drained of stay. */
+        if ( !pc->enabled )
+        {
+            spin_lock_init(&pc->lock);
+            INIT_PAGE_LIST_HEAD(&pc->list);
+            pc->nr = 0;
+            pc->enabled = true;
+        }
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+    case CPU_RESUME_FAILED:
+        if ( pc->enabled )
+        {
+            pc->enabled = false;
+            page_cache_drain(pc, PAGE_CACHE_MAX);
+        }
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block page_cache_cpu_nfb = {
+    .notifier_call = page_cache_cpu_callback,
+};
+
+static int __init cf_check page_cache_init(void)
+{
+    void *hcpu = (void *)(long)smp_processor_id();
+
+    if ( !opt_page_cache )
+        return 0;
+
+    page_cache_cpu_callback(&page_cache_cpu_nfb, CPU_UP_PREPARE, hcpu);
+    register_cpu_notifier(&page_cache_cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
 
 /*
  * Following rules applied for page offline:
@@ -1567,7 +2197,7 @@ static unsigned long mark_page_offline(struct page_info *pg, int broken)
     unsigned long nx, x, y = pg->count_info;
 
     ASSERT(page_is_ram_type(mfn_x(page_to_mfn(pg)), RAM_TYPE_CONVENTIONAL));
-    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(spin_is_locked(&heap_lock(page_to_nid(pg))));
 
     do {
         nx = x = y;
@@ -1661,7 +2291,10 @@ int offline_page(mfn_t mfn, int broken, uint32_t *status)
         return 0;
     }
 
-    spin_lock(&heap_lock);
+    /* A page in a per-cpu cache is free as far as offlining goes. */
+    page_cache_evict(pg);
+
+    spin_lock(&heap_lock(page_to_nid(pg)));
 
     old_info = mark_page_offline(pg, broken);
 
@@ -1669,14 +2302,14 @@ int offline_page(mfn_t mfn, int broken, uint32_t *status)
     {
         reserve_heap_page(pg);
 
-        spin_unlock(&heap_lock);
+        spin_unlock(&heap_lock(page_to_nid(pg)));
 
         *status = broken ? PG_OFFLINE_OFFLINED | PG_OFFLINE_BROKEN
                          : PG_OFFLINE_OFFLINED;
         return 0;
     }
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(page_to_nid(pg)));
 
     if ( (owner = page_get_owner_and_reference(pg)) )
     {
@@ -1738,7 +2371,7 @@ unsigned int online_page(mfn_t mfn, uint32_t *status)
 
     pg = mfn_to_page(mfn);
 
-    spin_lock(&heap_lock);
+    spin_lock(&heap_lock(page_to_nid(pg)));
 
     y = pg->count_info;
     do {
@@ -1753,7 +2386,9 @@ unsigned int online_page(mfn_t mfn, uint32_t *status)
 
         if ( (y & PGC_state) == PGC_state_offlined )
         {
+            spin_lock(&page_offline_lock);
             page_list_del(pg, &page_offlined_list);
+            spin_unlock(&page_offline_lock);
             *status = PG_ONLINE_ONLINED;
         }
         else if ( (y & PGC_state) == PGC_state_offlining )
@@ -1769,7 +2404,7 @@ unsigned int online_page(mfn_t mfn, uint32_t *status)
         nx = (x & ~PGC_state) | PGC_state_inuse;
     } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(page_to_nid(pg)));
 
     if ( (y & PGC_state) == PGC_state_offlined )
         free_heap_pages(pg, 0, false);
@@ -1788,10 +2423,10 @@ int query_page_offline(mfn_t mfn, uint32_t *status)
     }
 
     *status = 0;
-    spin_lock(&heap_lock);
-
     pg = mfn_to_page(mfn);
 
+    spin_lock(&heap_lock(page_to_nid(pg)));
+
     if ( page_state_is(pg, offlining) )
         *status |= PG_OFFLINE_STATUS_OFFLINE_PENDING;
     if ( pg->count_info & PGC_broken )
@@ -1799,7 +2434,7 @@ int query_page_offline(mfn_t mfn, uint32_t *status)
     if ( page_state_is(pg, offlined) )
         *status |= PG_OFFLINE_STATUS_OFFLINED;
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(page_to_nid(pg)));
 
     return 0;
 }
@@ -1876,9 +2511,9 @@ static void init_heap_pages(
      * etc.).
      * Update first_valid_mfn to ensure those regions are covered.
      */
-    spin_lock(&heap_lock);
+    spin_lock(&first_valid_mfn_lock);
     first_valid_mfn = mfn_min(page_to_mfn(pg), first_valid_mfn);
-    spin_unlock(&heap_lock);
+    spin_unlock(&first_valid_mfn_lock);
 
     if ( system_state < SYS_STATE_active && opt_bootscrub == BOOTSCRUB_IDLE )
         need_scrub = true;
@@ -2109,9 +2744,11 @@ static void __init scrub_heap_pages(void)
 
         process_pending_softirqs();
 
-        spin_lock(&heap_lock);
+        for_each_online_node ( i )
+            spin_lock(&heap_lock(i));
         on_selected_cpus(&all_worker_cpus, smp_scrub_heap_pages, NULL, 1);
-        spin_unlock(&heap_lock);
+        for_each_online_node ( i )
+            spin_unlock(&heap_lock(i));
 
         printk(".");
     }
@@ -2166,9 +2803,9 @@ static void __init scrub_heap_pages(void)
 
             process_pending_softirqs();
 
-            spin_lock(&heap_lock);
+            spin_lock(&heap_lock(i));
             on_selected_cpus(&node_cpus, smp_scrub_heap_pages, &region[i], 1);
-            spin_unlock(&heap_lock);
+            spin_unlock(&heap_lock(i));
 
             printk(".");
         }
@@ -2592,7 +3229,7 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + page_cache_pages();
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
@@ -2674,6 +3311,25 @@ static void cf_check dump_heap(unsigned char key)
             continue;
         printk("Node %d has %lu unscrubbed pages\n", i, node_need_scrub[i]);
     }
+
+    for ( i = 0; i < MAX_NUMNODES; i++ )
+    {
+        const struct heap_node *hn = &heap_node[i];
+
+        if ( !hn->idle_scrub_pages && !hn->sync_scrub_pages )
+            continue;
+        printk("Node %d scrubbed %lu pages in %"PRI_stime"us when idle, "
+               "%lu pages in %"PRI_stime"us on allocation\n",
+               i, hn->idle_scrub_pages, hn->idle_scrub_time / MICROSECS(1),
+               hn->sync_scrub_pages, hn->sync_scrub_time / MICROSECS(1));
+    }
+
+    for_each_online_cpu ( i )
+    {
+        if ( !per_cpu(page_cache, i).nr )
+            continue;
+        printk("CPU%d caches %u pages\n", i, per_cpu(page_cache, i).nr);
+    }
 }
 
 static __init int cf_check register_heap_trigger(void)
@@ -2724,7 +3380,7 @@ void unprepare_staticmem_pages(struct page_info *pg, unsigned long nr_mfns,
     mfn_t mfn = page_to_mfn(pg);
     unsigned long i;
 
-    spin_lock(&heap_lock);
+    spin_lock(&heap_lock(page_to_nid(pg)));
 
     for ( i = 0; i < nr_mfns; i++ )
     {
@@ -2739,7 +3395,7 @@ void unprepare_staticmem_pages(struct page_info *pg, unsigned long nr_mfns,
         pg[i].count_info |= PGC_static;
     }
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(page_to_nid(pg)));
 }
 
 void free_domstatic_page(struct page_info *page)
@@ -2783,7 +3439,7 @@ static bool prepare_staticmem_pages(struct page_info *pg, unsigned long nr_mfns,
     uint32_t tlbflush_timestamp = 0;
     unsigned long i;
 
-    spin_lock(&heap_lock);
+    spin_lock(&heap_lock(page_to_nid(pg)));
 
     for ( i = 0; i < nr_mfns; i++ )
     {
@@ -2809,7 +3465,7 @@ static bool prepare_staticmem_pages(struct page_info *pg, unsigned long nr_mfns,
         init_free_page_fields(&pg[i]);
     }
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(page_to_nid(pg)));
 
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
@@ -2820,7 +3476,7 @@ static bool prepare_staticmem_pages(struct page_info *pg, unsigned long nr_mfns,
     while ( i-- )
         pg[i].count_info = PGC_static | PGC_state_free;
 
-    spin_unlock(&heap_lock);
+    spin_unlock(&heap_lock(page_to_nid(pg)));
 
     return false;
 }
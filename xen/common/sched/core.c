@@ -64,6 +64,10 @@ boolean_param("sched_smt_power_savings", sched_smt_power_savings);
 int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
 integer_param("sched_ratelimit_us", sched_ratelimit_us);
 
+/* Queue wakeups to the runqueues of schedulers which support it. */
+static bool __read_mostly opt_sched_wake_inbox = true;
+boolean_param("sched_wake_inbox", opt_sched_wake_inbox);
+
 /* Number of vcpus per struct sched_unit. */
 bool __read_mostly sched_disable_smt_switching;
 cpumask_t sched_res_mask;
@@ -960,17 +964,38 @@ void vcpu_sleep_sync(struct vcpu *v)
     sync_vcpu_execstate(v);
 }
 
+static s_time_t sched_lock_wait_start(void)
+{
+    return unlikely(tb_init_done) ? NOW() : 0;
+}
+
+static void sched_lock_wait_trace(unsigned int cpu, s_time_t start)
+{
+    if ( unlikely(tb_init_done) && start )
+        TRACE_TIME(TRC_SCHED_LOCK_WAIT, cpu,
+                   min_t(s_time_t, NOW() - start, UINT32_MAX));
+}
+
 void vcpu_wake(struct vcpu *v)
 {
     unsigned long flags;
     spinlock_t *lock;
     struct sched_unit *unit = v->sched_unit;
+    s_time_t wait;
 
     TRACE_TIME(TRC_SCHED_WAKE, v->domain->domain_id, v->vcpu_id);
 
     rcu_read_lock(&sched_res_rculock);
 
+    /*
+     * Have the scheduler's IPIs sent once the lock is dropped, so that the
+     * CPUs they reach don't have to wait for it.
+     */
+    cpu_raise_softirq_batch_begin();
+
+    wait = sched_lock_wait_start();
     lock = unit_schedule_lock_irqsave(unit, &flags);
+    sched_lock_wait_trace(unit->res->master_cpu, wait);
 
     if ( likely(vcpu_runnable(v)) )
     {
@@ -996,7 +1021,142 @@ void vcpu_wake(struct vcpu *v)
 
     unit_schedule_unlock_irqrestore(lock, flags, unit);
 
+    cpu_raise_softirq_batch_finish();
+
+    rcu_read_unlock(&sched_res_rculock);
+}
+
+/*
+ * Queued wakeups.
+ *
+ * Waking up a vCPU takes the schedule lock of its processor which, with
+ * runqueues shared by many CPUs, may be contended by all of them as well as
+ * by the CPUs delivering events to their vCPUs.  Schedulers with such
+ * runqueues can provide a lock-free inbox for each of them, through their
+ * wake_inbox hook, for vcpu_unblock() to queue the vCPU to instead.  One of
+ * the CPUs of the runqueue then wakes up all of the queued vCPUs in a row,
+ * from SCHED_WAKE_SOFTIRQ, and sends the resulting IPIs in one go: the
+ * waking CPU itself if it is one of them, which costs no IPI, the vCPU's
+ * processor otherwise.  Schedulers without the hook, e.g. with per-CPU
+ * runqueues, keep waking vCPUs up straight away.
+ *
+ * A queued vCPU holds a reference to its domain until it has been woken up.
+ */
+
+/* Wake up a list of queued vCPUs, in the order they were queued. */
+static void vcpu_wake_list(struct vcpu *v)
+{
+    struct vcpu *list = NULL;
+
+    while ( v )
+    {
+        struct vcpu *next = v->wake_next;
+
+        v->wake_next = list;
+        list = v;
+        v = next;
+    }
+
+    if ( !list )
+        return;
+
+    cpu_raise_softirq_batch_begin();
+
+    while ( (v = list) != NULL )
+    {
+        struct domain *d = v->domain;
+
+        list = v->wake_next;
+
+        /*
+         * Allow the vCPU to be queued again before looking at its state, for
+         * no wakeup to get lost.
+         */
+        write_atomic(&v->wake_queued, false);
+        smp_mb();
+
+        vcpu_wake(v);
+        put_domain(d);
+    }
+
+    cpu_raise_softirq_batch_finish();
+}
+
+void sched_wake_inbox_flush(struct vcpu **inbox)
+{
+    vcpu_wake_list(xchg(inbox, NULL));
+}
+
+static bool vcpu_wake_enqueue(struct vcpu *v)
+{
+    unsigned int cpu = smp_processor_id(), target = read_atomic(&v->processor);
+    const struct sched_resource *sr;
+    struct vcpu **inbox, *head;
+    unsigned int kick;
+    bool queued = false;
+
+    if ( !opt_sched_wake_inbox || !cpu_online(target) )
+        return false;
+
+    rcu_read_lock(&sched_res_rculock);
+
+    sr = get_sched_res(target);
+    inbox = sched_wake_inbox(sr->scheduler, target);
+    if ( !inbox || !get_domain(v->domain) )
+        goto out;
+
+    queued = true;
+
+    /* If queued already, the pending wakeup will find the vCPU unblocked. */
+    if ( xchg(&v->wake_queued, true) )
+    {
+        put_domain(v->domain);
+        goto out;
+    }
+
+    TRACE_TIME(TRC_SCHED_WAKE_QUEUED, v->domain->domain_id, v->vcpu_id, target);
+
+    do {
+        head = read_atomic(inbox);
+        v->wake_next = head;
+    } while ( cmpxchg(inbox, head, v) != head );
+
+    if ( head )
+        goto out;
+
+    kick = sr->schedule_lock == get_sched_res(cpu)->schedule_lock ? cpu
+                                                                   : target;
+    cpu_raise_softirq(kick, SCHED_WAKE_SOFTIRQ);
+
+    /*
+     * Should that CPU have left the runqueue meanwhile, it won't drain the
+     * inbox: do it here.  Schedulers flush the inbox of a CPU leaving them
+     * after it has, and free it only after an RCU grace period.
+     */
+    smp_mb();
+    if ( sched_wake_inbox(get_sched_res(kick)->scheduler, kick) != inbox )
+        sched_wake_inbox_flush(inbox);
+
+ out:
     rcu_read_unlock(&sched_res_rculock);
+
+    return queued;
+}
+
+static void cf_check sched_wake_softirq(void)
+{
+    unsigned int cpu = smp_processor_id();
+    struct vcpu **inbox, *list = NULL;
+
+    rcu_read_lock(&sched_res_rculock);
+
+    inbox = sched_wake_inbox(get_sched_res(cpu)->scheduler, cpu);
+    if ( inbox )
+        list = xchg(inbox, NULL);
+
+    rcu_read_unlock(&sched_res_rculock);
+
+    vcpu_wake_list(list);
 }
 
 void vcpu_unblock(struct vcpu *v)
@@ -1017,7 +1177,8 @@ void vcpu_unblock(struct vcpu *v)
             clear_bit(_VPF_blocked, &v->pause_flags);
     }
 
-    vcpu_wake(v);
+    if ( !vcpu_wake_enqueue(v) )
+        vcpu_wake(v);
 }
 
 /*
@@ -2651,7 +2812,7 @@ static void cf_check schedule(void)
 {
     struct vcpu          *vnext, *vprev = current;
     struct sched_unit    *prev = vprev->sched_unit, *next = NULL;
-    s_time_t              now;
+    s_time_t              now, wait;
     struct sched_resource *sr;
     spinlock_t           *lock;
     int cpu = smp_processor_id();
@@ -2663,7 +2824,9 @@ static void cf_check schedule(void)
 
     rcu_read_lock(&sched_res_rculock);
 
+    wait = sched_lock_wait_start();
     lock = pcpu_schedule_lock_irq(cpu);
+    sched_lock_wait_trace(cpu, wait);
 
     sr = get_sched_res(cpu);
     gran = sr->granularity;
@@ -2992,6 +3155,7 @@ void __init scheduler_init(void)
     int i;
 
     scheduler_enable();
+    open_softirq(SCHED_WAKE_SOFTIRQ, sched_wake_softirq);
 
     for ( i = 0; i < NUM_SCHEDULERS; i++)
     {
@@ -0,0 +1,125 @@
+/******************************************************************************
+ * Credit2 runqueues.
+ *
+ * Runnable units are kept sorted by decreasing credit, units with the same
+ * credit in the order they were inserted, in a red-black tree with the
+ * leftmost (i.e. highest credit) node cached.  Inserting a unit hence costs
+ * O(log n), and so does removing it, while looking at the head of the
+ * runqueue is O(1) and walking it in order amortised O(1) per step.
+ *
+ * Credits of units on a runqueue may only be changed in a way which keeps
+ * their order, as reset_credit() does by adding the same amount to all of
+ * them and clipping the result.
+ *
+ * Nothing here needs more of a unit than its int credit and its struct
+ * rb_node runq_elem.  Whoever includes this header (credit2.c, and the
+ * ordering tests in tools/tests/credit2-runq) has to define struct
+ * csched2_unit with those two fields first.
+ */
+
+#ifndef __XEN_SCHED_CREDIT2_RUNQ_H__
+#define __XEN_SCHED_CREDIT2_RUNQ_H__
+
+#include <xen/rbtree.h>
+
+struct csched2_runq {
+    struct rb_root root;
+    struct rb_node *first;             /* Cached leftmost node               */
+};
+
+static inline void runq_init(struct csched2_runq *runq)
+{
+    runq->root = RB_ROOT;
+    runq->first = NULL;
+}
+
+static inline bool runq_empty(const struct csched2_runq *runq)
+{
+    return !runq->first;
+}
+
+static inline void runq_elem_init(struct csched2_unit *svc)
+{
+    RB_CLEAR_NODE(&svc->runq_elem);
+}
+
+static inline bool unit_on_runq(const struct csched2_unit *svc)
+{
+    return !RB_EMPTY_NODE(&svc->runq_elem);
+}
+
+static inline struct csched2_unit *runq_elem(struct rb_node *node)
+{
+    return node ? rb_entry(node, struct csched2_unit, runq_elem) : NULL;
+}
+
+static inline struct csched2_unit *runq_first(const struct csched2_runq *runq)
+{
+    return runq_elem(runq->first);
+}
+
+static inline struct csched2_unit *runq_next(const struct csched2_unit *svc)
+{
+    return runq_elem(rb_next(&svc->runq_elem));
+}
+
+static inline void runq_link(struct csched2_runq *runq,
+                             struct csched2_unit *svc)
+{
+    struct rb_node **link = &runq->root.rb_node, *parent = NULL;
+    bool leftmost = true;
+
+    while ( *link )
+    {
+        parent = *link;
+
+        /* Go after units with the same credit, to keep them in FIFO order. */
+        if ( svc->credit > runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &runq->root);
+
+    if ( leftmost )
+        runq->first = &svc->runq_elem;
+}
+
+static inline void runq_unlink(struct csched2_runq *runq,
+                               struct csched2_unit *svc)
+{
+    if ( runq->first == &svc->runq_elem )
+        runq->first = rb_next(&svc->runq_elem);
+
+    rb_erase(&svc->runq_elem, &runq->root);
+    RB_CLEAR_NODE(&svc->runq_elem);
+}
+
+/* Position of a unit in its runqueue.  This is O(n): use for tracing only. */
+static inline unsigned int runq_pos(const struct csched2_unit *svc)
+{
+    const struct rb_node *node = &svc->runq_elem;
+    unsigned int pos = 0;
+
+    while ( (node = rb_prev(node)) != NULL )
+        pos++;
+
+    return pos;
+}
+
+#endif /* __XEN_SCHED_CREDIT2_RUNQ_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,50 @@
+/******************************************************************************
+ * Credit2 spreading of busy units over SMT cores.
+ *
+ * A unit which would keep running on a core together with other busy threads
+ * is better off on a fully idle core, if there is one it may run on.  Moving
+ * it costs it its cache though, so this is only done once it has been running
+ * for at least the migration resistance since it was last switched in.  That
+ * is tracked in switch_time, rather than start_time, as burn_credits() moves
+ * the latter forward every time credits get accounted, i.e. right before the
+ * decision is taken.
+ *
+ * The decision only depends on the unit's switch_time and on the current
+ * time, so tools/tests/credit2-smt checks it against a stub csched2_unit
+ * which has just an s_time_t switch_time.  credit2.c includes this after
+ * its own, complete, definition of the structure.
+ */
+
+#ifndef __XEN_SCHED_CREDIT2_SMT_H__
+#define __XEN_SCHED_CREDIT2_SMT_H__
+
+/* svc is about to start running (again), after some other unit or idle. */
+static inline void unit_switch_in(struct csched2_unit *svc, s_time_t now)
+{
+    svc->switch_time = now;
+}
+
+/*
+ * Should svc, running on a core with busy_threads busy threads (including
+ * its own), move to one of idle, the fully idle cores it may run on?
+ */
+static inline bool smt_spread_wanted(const struct csched2_unit *svc,
+                                     unsigned int busy_threads,
+                                     const cpumask_t *idle, s_time_t now,
+                                     s_time_t resist)
+{
+    return busy_threads >= 2 && now - svc->switch_time >= resist &&
+           !cpumask_empty(idle);
+}
+
+#endif /* __XEN_SCHED_CREDIT2_SMT_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
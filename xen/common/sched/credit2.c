@@ -13,6 +13,7 @@
 #include <xen/init.h>
 #include <xen/lib.h>
 #include <xen/param.h>
+#include <xen/rbtree.h>
 #include <xen/sched.h>
 #include <xen/sections.h>
 #include <xen/domain.h>
@@ -62,6 +63,7 @@
 #define TRC_CSCHED2_SCHEDULE         TRC_SCHED_CLASS_EVT(CSCHED2, 21)
 #define TRC_CSCHED2_RATELIMIT        TRC_SCHED_CLASS_EVT(CSCHED2, 22)
 #define TRC_CSCHED2_RUNQ_CAND_CHECK  TRC_SCHED_CLASS_EVT(CSCHED2, 23)
+#define TRC_CSCHED2_CORE_BUSY        TRC_SCHED_CLASS_EVT(CSCHED2, 24)
 
 /*
  * TODO:
@@ -403,6 +405,12 @@ static int __read_mostly opt_underload_balance_tolerance = 0;
 integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 static int __read_mostly opt_overload_balance_tolerance = -3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
+/*
+ * Whether to move busy units off cores with other busy threads, when there
+ * are fully idle cores (see "Hyperthreading (SMT) support" below).
+ */
+static bool __read_mostly opt_smt_balance = true;
+boolean_param("credit2_smt_balance", opt_smt_balance);
 /*
  * Domains subject to a cap receive a replenishment of their runtime budget
  * once every opt_cap_period interval. Default is 10 ms. The amount of budget
@@ -490,6 +498,39 @@ custom_param("credit2_runqueue", parse_credit2_runqueue);
 static unsigned int __read_mostly opt_max_cpus_runqueue = MAX_CPUS_RUNQ;
 integer_param("sched_credit2_max_cpus_runqueue", opt_max_cpus_runqueue);
 
+/*
+ * Schedule Unit
+ */
+struct csched2_unit {
+    struct csched2_dom *sdom;          /* Up-pointer to domain                */
+    struct sched_unit *unit;           /* Up-pointer, to schedule unit        */
+    struct csched2_runqueue_data *rqd; /* Up-pointer to the runqueue          */
+
+    int credit;                        /* Current amount of credit            */
+    unsigned int weight;               /* Weight of this unit                 */
+    unsigned int residual;             /* Reminder of div(max_weight/weight)  */
+    unsigned flags;                    /* Status flags (16 bits would be ok,  */
+    s_time_t budget;                   /* Current budget (if domains has cap) */
+                                       /* but clear_bit() does not like that) */
+    s_time_t budget_quota;             /* Budget to which unit is entitled    */
+
+    s_time_t start_time;               /* Time we were scheduled (for credit) */
+    s_time_t switch_time;              /* Time we were last switched in       */
+
+    /* Individual contribution to load                                        */
+    s_time_t load_last_update;         /* Last time average was updated       */
+    s_time_t avgload;                  /* Decaying queue load                 */
+
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
+    struct list_head parked_elem;      /* On the parked_units list            */
+    struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
+    struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
+    int tickled_cpu;                   /* Cpu that will pick us (-1 if none)  */
+};
+
+#include "credit2-runq.h"
+#include "credit2-smt.h"
+
 /*
  * Per-runqueue data
  */
@@ -497,7 +538,7 @@ struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
 
     struct list_head rql;      /* List of runqueues                          */
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct csched2_runq runq;  /* Runnable units, by credit                  */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -517,6 +558,11 @@ struct csched2_runqueue_data {
     struct list_head svc;      /* List of all units assigned to the runqueue */
     unsigned int max_weight;   /* Max weight of the units in this runqueue   */
     unsigned int pick_bias;    /* Last picked pcpu. Start from it next time  */
+
+    struct lock_profile_qhead profile_head; /* Lock profiling of lock         */
+
+    struct vcpu *wake_inbox;   /* Queued wakeups (see vcpu_unblock())        */
+    struct rcu_head rcu;       /* Freeing, once wakers are done with inbox   */
 };
 
 /*
@@ -545,33 +591,10 @@ struct csched2_pcpu {
 };
 
 /*
- * Schedule Unit
+ * Inbox of the runqueue of each CPU, for wakers to look up without any lock
+ * (see csched2_wake_inbox()), unlike the CPU's data which may go at any time.
  */
-struct csched2_unit {
-    struct csched2_dom *sdom;          /* Up-pointer to domain                */
-    struct sched_unit *unit;           /* Up-pointer, to schedule unit        */
-    struct csched2_runqueue_data *rqd; /* Up-pointer to the runqueue          */
-
-    int credit;                        /* Current amount of credit            */
-    unsigned int weight;               /* Weight of this unit                 */
-    unsigned int residual;             /* Reminder of div(max_weight/weight)  */
-    unsigned flags;                    /* Status flags (16 bits would be ok,  */
-    s_time_t budget;                   /* Current budget (if domains has cap) */
-                                       /* but clear_bit() does not like that) */
-    s_time_t budget_quota;             /* Budget to which unit is entitled    */
-
-    s_time_t start_time;               /* Time we were scheduled (for credit) */
-
-    /* Individual contribution to load                                        */
-    s_time_t load_last_update;         /* Last time average was updated       */
-    s_time_t avgload;                  /* Decaying queue load                 */
-
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
-    struct list_head parked_elem;      /* On the parked_units list            */
-    struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
-    struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
-    int tickled_cpu;                   /* Cpu that will pick us (-1 if none)  */
-};
+static DEFINE_PER_CPU(struct vcpu **, wake_inbox);
 
 /*
  * Domain
@@ -655,9 +678,9 @@ static inline bool has_cap(const struct csched2_unit *svc)
  *    sched_smt_power_savings is set at boot, and it allows as more cores as
  *    possible to stay in low power states, minimizing power consumption.
  *
- * This logic is entirely implemented in runq_tickle(), and that is enough.
- * In fact, in this scheduler, placement of an unit on one of the pcpus of a
- * runq, _always_ happens by means of tickling:
+ * This logic is mostly implemented in runq_tickle(). In fact, in this
+ * scheduler, placement of an unit on one of the pcpus of a runq, _always_
+ * happens by means of tickling:
  *  - when an unit wakes up, it calls csched2_unit_wake(), which calls
  *    runq_tickle();
  *  - when a migration is initiated in schedule.c, we call csched2_res_pick(),
@@ -670,6 +693,17 @@ static inline bool has_cap(const struct csched2_unit *svc)
  *  - when a migration is initiated in sched_credit2.c, by calling  migrate()
  *    directly, that again temporarily use a random pcpu from the new runq,
  *    and then calls runq_tickle(), by itself.
+ *
+ * That is not enough for units which keep running, though: two of them may
+ * end up sharing a core, e.g. if they were placed when there were no fully
+ * idle cores, and stay there while other cores become idle. So, unless
+ * sched_smt_power_savings is set (or credit2_smt_balance=false), such units
+ * are moved on fully idle cores:
+ *  - of their own runq, by smt_spread() in csched2_schedule(), which makes
+ *    the unit go through csched2_context_saved(), and hence runq_tickle();
+ *  - of other runqs of the same NUMA node, by balance_smt() in
+ *    balance_load(), which migrate()s the unit, and looks at the runqs of
+ *    the same socket first.
  */
 
 /*
@@ -710,6 +744,49 @@ void smt_idle_mask_clear(unsigned int cpu, cpumask_t *mask)
         cpumask_andnot(mask, mask, cpu_siblings);
 }
 
+/*
+ * How many threads of the core of cpu are busy (or about to be, having been
+ * tickled), among the ones in rqd.
+ */
+static unsigned int core_busy_threads(const struct csched2_runqueue_data *rqd,
+                                      unsigned int cpu)
+{
+    unsigned int rcpu, busy = 0;
+
+    for_each_cpu ( rcpu, &csched2_pcpu(cpu)->sibling_mask )
+        if ( !cpumask_test_cpu(rcpu, &rqd->idle) ||
+             cpumask_test_cpu(rcpu, &rqd->tickled) )
+            busy++;
+
+    return busy;
+}
+
+static inline bool smt_balance_enabled(void)
+{
+    return opt_smt_balance && !sched_smt_power_savings;
+}
+
+/* Trace how busy the core of cpu is, after cpu went idle or busy. */
+static void trace_core_busy(const struct csched2_runqueue_data *rqd,
+                            unsigned int cpu)
+{
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            uint16_t cpu, core, socket;
+            uint8_t busy, threads;
+        } d = {
+            .cpu     = cpu,
+            .core    = cpu_to_core(cpu),
+            .socket  = cpu_to_socket(cpu),
+            .busy    = core_busy_threads(rqd, cpu),
+            .threads = cpumask_weight(&csched2_pcpu(cpu)->sibling_mask),
+        };
+
+        trace_time(TRC_CSCHED2_CORE_BUSY, sizeof(d), &d);
+    }
+}
+
 /*
  * In csched2_res_pick(), it may not be possible to actually look at remote
  * runqueues (the trylock-s on their spinlocks can fail!). If that happens,
@@ -831,16 +908,6 @@ static s_time_t c2t(const struct csched2_runqueue_data *rqd, s_time_t credit,
  * Runqueue related code.
  */
 
-static inline int unit_on_runq(const struct csched2_unit *svc)
-{
-    return !list_empty(&svc->runq_elem);
-}
-
-static inline struct csched2_unit * runq_elem(struct list_head *elem)
-{
-    return list_entry(elem, struct csched2_unit, runq_elem);
-}
-
 static inline bool same_node(unsigned int cpua, unsigned int cpub)
 {
     return cpu_to_node(cpua) == cpu_to_node(cpub);
@@ -923,6 +990,25 @@ cpu_runqueue_siblings_match(const struct csched2_runqueue_data *rqd,
     return tot_sibls + nr_sibls <= max_cpus_runq;
 }
 
+static void free_runqueue(struct csched2_runqueue_data *rqd)
+{
+#ifdef CONFIG_DEBUG_LOCK_PROFILE
+    if ( rqd )
+        xfree(rqd->profile_head.elem_q);
+#endif
+    xfree(rqd);
+}
+
+static void cf_check free_runqueue_rcu(struct rcu_head *head)
+{
+    struct csched2_runqueue_data *rqd =
+        container_of(head, struct csched2_runqueue_data, rcu);
+
+    /* Flushed when its last CPU left, and by wakers which came late. */
+    ASSERT(!rqd->wake_inbox);
+    free_runqueue(rqd);
+}
+
 static struct csched2_runqueue_data *
 cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
 {
@@ -933,10 +1019,12 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
     unsigned long flags;
     int rqi = 0;
     unsigned int min_rqs, max_cpus_runq;
-    bool rqi_unused = false;
+    bool rqi_unused = false, rqd_added = false;
 
     /* Prealloc in case we need it - not allowed with interrupts off. */
     rqd_new = xzalloc(struct csched2_runqueue_data);
+    if ( rqd_new )
+        spin_lock_init_prof(rqd_new, lock);
 
     /*
      * While respecting the limit of not having more than the max number of
@@ -1033,6 +1121,7 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
         }
         rqd = rqd_new;
         rqd_new = NULL;
+        rqd_added = true;
 
         list_add(&rqd->rql, rqd_ins);
         rqd->pick_bias = cpu;
@@ -1046,7 +1135,10 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
  out:
     write_unlock_irqrestore(&prv->lock, flags);
 
-    xfree(rqd_new);
+    if ( rqd_added )
+        lock_profile_register_struct(LOCKPROF_TYPE_RUNQ, rqd, rqd->id);
+
+    free_runqueue(rqd_new);
 
     return rqd;
 }
@@ -1430,10 +1522,8 @@ update_load(const struct scheduler *ops,
 
 static void runq_insert(struct csched2_unit *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
-    int pos = 0;
+    struct csched2_runq *runq = &c2rqd(cpu)->runq;
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
 
@@ -1445,16 +1535,7 @@ static void runq_insert(struct csched2_unit *svc)
     ASSERT(!svc->unit->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
-    {
-        struct csched2_unit * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
-
-        pos++;
-    }
-    list_add_tail(&svc->runq_elem, iter);
+    runq_link(runq, svc);
 
     if ( unlikely(tb_init_done) )
     {
@@ -1464,7 +1545,7 @@ static void runq_insert(struct csched2_unit *svc)
         } d = {
             .unit = svc->unit->unit_id,
             .dom  = svc->unit->domain->domain_id,
-            .pos  = pos,
+            .pos  = runq_pos(svc),
         };
 
         trace_time(TRC_CSCHED2_RUNQ_POS, sizeof(d), &d);
@@ -1474,7 +1555,7 @@ static void runq_insert(struct csched2_unit *svc)
 static inline void runq_remove(struct csched2_unit *svc)
 {
     ASSERT(unit_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+    runq_unlink(&svc->rqd->runq, svc);
 }
 
 static void burn_credits(struct csched2_runqueue_data *rqd,
@@ -2032,6 +2113,9 @@ unpark_parked_units(const struct scheduler *ops, struct list_head *units)
     struct csched2_unit *svc, *tmp;
     spinlock_t *lock;
 
+    /* Tickle the CPUs once all the units are back in their runqueues. */
+    cpu_raise_softirq_batch_begin();
+
     list_for_each_entry_safe ( svc, tmp, units, parked_elem )
     {
         unsigned long flags;
@@ -2072,6 +2156,8 @@ unpark_parked_units(const struct scheduler *ops, struct list_head *units)
 
         unit_schedule_unlock_irqrestore(lock, flags, svc->unit);
     }
+
+    cpu_raise_softirq_batch_finish();
 }
 
 static inline void do_replenish(struct csched2_dom *sdom)
@@ -2184,7 +2270,7 @@ csched2_alloc_udata(const struct scheduler *ops, struct sched_unit *unit,
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    runq_elem_init(svc);
 
     svc->sdom = dd;
     svc->unit = unit;
@@ -2692,20 +2778,116 @@ static bool unit_is_migrateable(const struct csched2_unit *svc,
            cpumask_intersects(cpumask_scratch_cpu(cpu), &rqd->active);
 }
 
+/*
+ * Levels of the topology at which load balancing happens, from the nearest
+ * to the farthest. Balancing within a core is done by smt_spread().
+ */
+enum {
+    BALANCE_LEVEL_SOCKET,       /* Runqueues in the same socket */
+    BALANCE_LEVEL_NODE,         /* Runqueues in the same NUMA node */
+    BALANCE_LEVEL_ALL,          /* Any runqueue */
+    BALANCE_LEVEL_NR
+};
+
+static unsigned int balance_level(const struct csched2_runqueue_data *lrqd,
+                                  const struct csched2_runqueue_data *orqd)
+{
+    if ( same_socket(lrqd->pick_bias, orqd->pick_bias) )
+        return BALANCE_LEVEL_SOCKET;
+    if ( same_node(lrqd->pick_bias, orqd->pick_bias) )
+        return BALANCE_LEVEL_NODE;
+    return BALANCE_LEVEL_ALL;
+}
+
+/* Is the load difference between lrqd and orqd worth moving units around? */
+static bool load_imbalanced(const struct csched2_private *prv,
+                            const struct csched2_runqueue_data *lrqd,
+                            const struct csched2_runqueue_data *orqd,
+                            s_time_t load_delta)
+{
+    s_time_t load_max = max(lrqd->b_avgload, orqd->b_avgload);
+    unsigned int cpus_max = max(lrqd->nr_cpus, orqd->nr_cpus);
+
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            uint16_t lrq_id, orq_id;
+            uint32_t load_delta;
+        } d = {
+            .lrq_id     = lrqd->id,
+            .orq_id     = orqd->id,
+            .load_delta = load_delta,
+        };
+
+        trace_time(TRC_CSCHED2_LOAD_CHECK, sizeof(d), &d);
+    }
+
+    /*
+     * If we're under 100% capacaty, only shift if load difference
+     * is > 1.  otherwise, shift if under 12.5%
+     */
+    if ( load_max < ((s_time_t)cpus_max << prv->load_precision_shift) )
+        return load_delta >= (1ULL << (prv->load_precision_shift +
+                                       opt_underload_balance_tolerance));
+
+    return load_delta >= (1ULL << (prv->load_precision_shift +
+                                   opt_overload_balance_tolerance));
+}
+
+/*
+ * Move one of the units running on a core of st->lrqd together with other
+ * busy threads to st->orqd, which has fully idle cores the unit can use.
+ * st->orqd is locked.
+ */
+static void balance_smt(const struct scheduler *ops, balance_state_t *st,
+                        s_time_t now)
+{
+    struct csched2_unit *svc;
+
+    list_for_each_entry ( svc, &st->lrqd->svc, rqd_elem )
+    {
+        const struct sched_unit *unit = svc->unit;
+        unsigned int cpu = sched_unit_master(unit);
+
+        if ( !(svc->flags & CSFLAG_scheduled) || curr_on_cpu(cpu) != unit ||
+             core_busy_threads(st->lrqd, cpu) < 2 ||
+             !unit_is_migrateable(svc, st->orqd) )
+            continue;
+
+        /* unit_is_migrateable() left hard affinity & online in scratch. */
+        if ( !cpumask_intersects(cpumask_scratch_cpu(cpu), &st->orqd->smt_idle) )
+            continue;
+
+        SCHED_STAT_CRANK(smt_balance);
+        migrate(ops, svc, st->orqd, now);
+        break;
+    }
+}
+
 static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched2_private *prv = csched2_priv(ops);
     struct list_head *push_iter, *pull_iter;
     bool inner_load_updated = 0;
-    struct csched2_runqueue_data *rqd, *max_delta_rqd;
+    struct csched2_runqueue_data *rqd, *smt_rqd;
+    struct csched2_runqueue_data *max_delta_rqd[BALANCE_LEVEL_NR];
+    s_time_t max_delta[BALANCE_LEVEL_NR];
+    unsigned int level, smt_level;
+    bool smt_contended = false;
 
     balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
 
     /*
      * Basic algorithm: Push, pull, or swap.
-     * - Find the runqueue with the furthest load distance
+     * - Find the runqueue with the furthest load distance, among the
+     *   nearest ones in the topology (same socket, then same node, then
+     *   any) where the distance is big enough
      * - Find a pair that makes the difference the least (where one
      * on either side may be empty).
+     *
+     * If loads are balanced enough, but we have cores with more than one
+     * busy thread, look for the nearest runqueue with fully idle cores, and
+     * move one of the units there.
      */
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
@@ -2713,33 +2895,62 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 
     update_runq_load(ops, st.lrqd, 0, now);
 
+    if ( smt_balance_enabled() )
+    {
+        unsigned int rcpu;
+
+        for_each_cpu ( rcpu, &st.lrqd->active )
+            if ( !cpumask_test_cpu(rcpu, &st.lrqd->idle) &&
+                 core_busy_threads(st.lrqd, rcpu) > 1 )
+            {
+                smt_contended = true;
+                break;
+            }
+    }
+
 retry:
-    max_delta_rqd = NULL;
+    for ( level = 0; level < BALANCE_LEVEL_NR; level++ )
+    {
+        max_delta_rqd[level] = NULL;
+        max_delta[level] = 0;
+    }
+    smt_rqd = NULL;
+    smt_level = BALANCE_LEVEL_NR;
+
     if ( !read_trylock(&prv->lock) )
         return;
 
-    st.load_delta = 0;
-
     list_for_each_entry ( rqd, &prv->rql, rql )
     {
         s_time_t delta;
 
         st.orqd = rqd;
 
-        if ( st.orqd == st.lrqd
+        if ( st.orqd == st.lrqd || !st.orqd->nr_cpus
              || !spin_trylock(&st.orqd->lock) )
             continue;
 
         update_runq_load(ops, st.orqd, 0, now);
 
+        level = balance_level(st.lrqd, st.orqd);
+
         delta = st.lrqd->b_avgload - st.orqd->b_avgload;
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        if ( delta > max_delta[level] )
+        {
+            max_delta[level] = delta;
+            max_delta_rqd[level] = rqd;
+        }
+
+        /* Not worth losing memory locality for, though. */
+        if ( smt_contended && level < smt_level &&
+             level <= BALANCE_LEVEL_NODE &&
+             !cpumask_empty(&st.orqd->smt_idle) )
         {
-            st.load_delta = delta;
-            max_delta_rqd = rqd;
+            smt_level = level;
+            smt_rqd = rqd;
         }
 
         spin_unlock(&st.orqd->lock);
@@ -2747,55 +2958,27 @@ retry:
 
     /* Minimize holding the private scheduler lock. */
     read_unlock(&prv->lock);
-    if ( !max_delta_rqd )
-        goto out;
-
-    {
-        s_time_t load_max;
-        int cpus_max;
 
+    for ( level = 0; level < BALANCE_LEVEL_NR; level++ )
+        if ( max_delta_rqd[level] &&
+             load_imbalanced(prv, st.lrqd, max_delta_rqd[level],
+                             max_delta[level]) )
+            break;
 
-        load_max = st.lrqd->b_avgload;
-        if ( st.orqd->b_avgload > load_max )
-            load_max = st.orqd->b_avgload;
-
-        cpus_max = max(st.lrqd->nr_cpus, st.orqd->nr_cpus);
-
-        if ( unlikely(tb_init_done) )
-        {
-            struct {
-                uint16_t lrq_id, orq_id;
-                uint32_t load_delta;
-            } d = {
-                .lrq_id     = st.lrqd->id,
-                .orq_id     = st.orqd->id,
-                .load_delta = st.load_delta,
-            };
-
-            trace_time(TRC_CSCHED2_LOAD_CHECK, sizeof(d), &d);
-        }
-
-        /*
-         * If we're under 100% capacaty, only shift if load difference
-         * is > 1.  otherwise, shift if under 12.5%
-         */
-        if ( load_max < ((s_time_t)cpus_max << prv->load_precision_shift) )
-        {
-            if ( st.load_delta < (1ULL << (prv->load_precision_shift +
-                                           opt_underload_balance_tolerance)) )
-                 goto out;
-        }
-        else
-            if ( st.load_delta < (1ULL << (prv->load_precision_shift +
-                                           opt_overload_balance_tolerance)) )
-                goto out;
+    if ( level < BALANCE_LEVEL_NR )
+    {
+        st.orqd = max_delta_rqd[level];
+        st.load_delta = max_delta[level];
     }
+    else if ( smt_rqd )
+        st.orqd = smt_rqd;
+    else
+        goto out;
 
     /* Try to grab the other runqueue lock; if it's been taken in the
      * meantime, try the process over again.  This can't deadlock
      * because if it doesn't get any other rqd locks, it will simply
      * give up and return. */
-    st.orqd = max_delta_rqd;
     if ( !spin_trylock(&st.orqd->lock) )
         goto retry;
 
@@ -2803,6 +2986,12 @@ retry:
     if ( unlikely(st.orqd->id < 0) )
         goto out_up;
 
+    if ( level == BALANCE_LEVEL_NR )
+    {
+        balance_smt(ops, &st, now);
+        goto out_up;
+    }
+
     if ( unlikely(tb_init_done) )
     {
         struct {
@@ -3216,7 +3405,7 @@ csched2_unit_insert(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     /* csched2_res_pick() expects the pcpu lock to be held */
     lock = unit_schedule_lock_irq(unit);
@@ -3254,7 +3443,7 @@ csched2_unit_remove(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     SCHED_STAT_CRANK(unit_remove);
 
@@ -3276,7 +3465,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(cpu);
-    struct list_head *runq = &rqd->runq;
+    const struct csched2_unit *swait = runq_first(&rqd->runq);
     const struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3314,16 +3503,8 @@ csched2_runtime(const struct scheduler *ops, int cpu,
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
-    {
-        struct csched2_unit *swait = runq_elem(runq->next);
-
-        if ( ! is_idle_unit(swait->unit)
-             && swait->credit > 0 )
-        {
-            rt_credit = snext->credit - swait->credit;
-        }
-    }
+    if ( swait && ! is_idle_unit(swait->unit) && swait->credit > 0 )
+        rt_credit = snext->credit - swait->credit;
 
     /*
      * The next guy on the runqueue may actually have a higher credit,
@@ -3372,7 +3553,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_unit *scurr,
                int cpu, s_time_t now)
 {
-    struct list_head *iter, *temp;
+    struct csched2_unit *svc;
     const struct sched_resource *sr = get_sched_res(cpu);
     struct csched2_unit *snext = NULL;
     struct csched2_private *prv = csched2_priv(sr->scheduler);
@@ -3455,10 +3636,8 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         snext = csched2_unit(sched_idle_unit(cpu));
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    for ( svc = runq_first(&rqd->runq); svc; svc = runq_next(svc) )
     {
-        struct csched2_unit * svc = list_entry(iter, struct csched2_unit, runq_elem);
-
         if ( unlikely(tb_init_done) )
         {
             struct {
@@ -3562,6 +3741,40 @@ runq_candidate(struct csched2_runqueue_data *rqd,
     return snext;
 }
 
+/*
+ * Should svc, which is running on cpu and would keep doing so, rather be
+ * moved on a fully idle core of rqd, as its core has other busy threads?
+ *
+ * If yes, cpu will go idle, and csched2_context_saved() will queue svc
+ * back and tickle the best cpu for it, which runq_tickle() looks for in
+ * rqd->smt_idle first. For that cpu to be on an idle core, we want one in
+ * svc's soft-affinity, if it has any.
+ */
+static bool smt_spread(const struct csched2_runqueue_data *rqd,
+                       const struct csched2_unit *svc, unsigned int cpu,
+                       s_time_t now)
+{
+    const struct sched_unit *unit = svc->unit;
+    cpumask_t *mask = cpumask_scratch_cpu(cpu);
+
+    if ( !smt_balance_enabled() || cpumask_empty(&rqd->smt_idle) ||
+         (svc->flags & CSFLAG_pinned) )
+        return false;
+
+    cpumask_and(mask, &rqd->smt_idle, cpupool_domain_master_cpumask(unit->domain));
+    cpumask_and(mask, mask, unit->cpu_hard_affinity);
+    if ( has_soft_affinity(unit) )
+        cpumask_and(mask, mask, unit->cpu_soft_affinity);
+
+    if ( !smt_spread_wanted(svc, core_busy_threads(rqd, cpu), mask, now,
+                            CSCHED2_MIGRATE_RESIST) )
+        return false;
+
+    SCHED_STAT_CRANK(smt_spread);
+
+    return true;
+}
+
 /*
  * This function is in the critical path. It is designed to be simple and
  * fast for the common case.
@@ -3652,8 +3865,15 @@ static void cf_check csched2_schedule(
         snext = csched2_unit(sched_idle_unit(sched_cpu));
     }
     else
+    {
         snext = runq_candidate(rqd, scurr, sched_cpu, now);
 
+        /* Nothing better to run than scurr: should it move to an idle core? */
+        if ( snext == scurr && !is_idle_unit(currunit) &&
+             smt_spread(rqd, scurr, sched_cpu, now) )
+            snext = csched2_unit(sched_idle_unit(sched_cpu));
+    }
+
     /* If switching from a non-idle runnable unit, put it
      * back on the runqueue. */
     if ( snext != scurr
@@ -3674,6 +3894,7 @@ static void cf_check csched2_schedule(
 
             runq_remove(snext);
             __set_bit(__CSFLAG_scheduled, &snext->flags);
+            unit_switch_in(snext, now);
         }
         else
             update_load(ops, rqd, snext, 0, now);
@@ -3683,6 +3904,7 @@ static void cf_check csched2_schedule(
         {
             __cpumask_clear_cpu(sched_cpu, &rqd->idle);
             smt_idle_mask_clear(sched_cpu, &rqd->smt_idle);
+            trace_core_busy(rqd, sched_cpu);
         }
 
         /*
@@ -3699,10 +3921,10 @@ static void cf_check csched2_schedule(
          * returned the first unit in the runqueue, for various reasons
          * (e.g., affinity). Only trigger a reset when it does.
          */
-        if ( list_empty(&rqd->runq) )
+        if ( runq_empty(&rqd->runq) )
             top_credit = snext->credit;
         else
-            top_credit = max(snext->credit, runq_elem(rqd->runq.next)->credit);
+            top_credit = max(snext->credit, runq_first(&rqd->runq)->credit);
         if ( top_credit <= CSCHED2_CREDIT_RESET )
         {
             reset_credit(sched_cpu, now, snext);
@@ -3733,6 +3955,7 @@ static void cf_check csched2_schedule(
             {
                 __cpumask_clear_cpu(sched_cpu, &rqd->idle);
                 smt_idle_mask_clear(sched_cpu, &rqd->smt_idle);
+                trace_core_busy(rqd, sched_cpu);
             }
         }
         else if ( !cpumask_test_cpu(sched_cpu, &rqd->idle) )
@@ -3740,6 +3963,7 @@ static void cf_check csched2_schedule(
             __cpumask_set_cpu(sched_cpu, &rqd->idle);
             cpumask_andnot(cpumask_scratch, &rqd->idle, &rqd->tickled);
             smt_idle_mask_set(sched_cpu, cpumask_scratch, &rqd->smt_idle);
+            trace_core_busy(rqd, sched_cpu);
         }
         /* Make sure avgload gets updated periodically even
          * if there's no activity */
@@ -3878,7 +4102,7 @@ csched2_dump(const struct scheduler *ops)
 
     list_for_each_entry ( rqd, &prv->rql, rql )
     {
-        struct list_head *iter, *runq = &rqd->runq;
+        const struct csched2_unit *svc;
 
         loop = 0;
         /* We need the lock to scan the runqueue. */
@@ -3890,15 +4114,10 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( svc = runq_first(&rqd->runq); svc; svc = runq_next(svc) )
         {
-            const struct csched2_unit *svc = runq_elem(iter);
-
-            if ( svc )
-            {
-                printk("\t%3u: ", loop++);
-                csched2_dump_unit(prv, svc);
-            }
+            printk("\t%3u: ", loop++);
+            csched2_dump_unit(prv, svc);
         }
         spin_unlock(&rqd->lock);
     }
@@ -3950,8 +4169,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         BUG_ON(!cpumask_empty(&rqd->active));
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
-        INIT_LIST_HEAD(&rqd->runq);
-        spin_lock_init(&rqd->lock);
+        runq_init(&rqd->runq);
         prv->active_queues++;
     }
 
@@ -3991,6 +4209,7 @@ init_pdata(struct csched2_private *prv, struct csched2_pcpu *spc,
 
     rqd = spc->rqd;
     init_cpu_runqueue(prv, spc, cpu, rqd);
+    per_cpu(wake_inbox, cpu) = &rqd->wake_inbox;
 
     return rqd;
 }
@@ -4058,6 +4277,7 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 
     /* Find the old runqueue and remove this cpu from it */
     rqd = spc->rqd;
+    per_cpu(wake_inbox, cpu) = NULL;
 
     /* No need to save IRQs here, they're already disabled */
     spin_lock(&rqd->lock);
@@ -4091,7 +4311,11 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 
     write_unlock_irqrestore(&prv->lock, flags);
 
-    return;
+    /*
+     * Wakeups may have been queued for this cpu to deal with, now that it
+     * won't anymore (see vcpu_unblock()).
+     */
+    sched_wake_inbox_flush(&rqd->wake_inbox);
 }
 
 static void cf_check
@@ -4119,10 +4343,24 @@ csched2_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 
     write_unlock_irqrestore(&prv->lock, flags);
 
-    xfree(rqd);
+    if ( rqd )
+    {
+        lock_profile_deregister_struct(LOCKPROF_TYPE_RUNQ, rqd);
+        call_rcu(&rqd->rcu, free_runqueue_rcu);
+    }
     xfree(pcpu);
 }
 
+/*
+ * Wakeups of units of a runqueue are queued to it, rather than each taking
+ * its lock, contended by all of its CPUs (see vcpu_unblock()).
+ */
+static struct vcpu **cf_check
+csched2_wake_inbox(const struct scheduler *ops, unsigned int cpu)
+{
+    return per_cpu(wake_inbox, cpu);
+}
+
 static int __init cf_check
 csched2_global_init(void)
 {
@@ -4243,6 +4481,7 @@ static const struct scheduler sched_credit2_def = {
     .switch_sched   = csched2_switch_sched,
     .alloc_domdata  = csched2_alloc_domdata,
     .free_domdata   = csched2_free_domdata,
+    .wake_inbox     = csched2_wake_inbox,
 };
 
 REGISTER_SCHEDULER(sched_credit2_def);
@@ -362,6 +362,9 @@ struct scheduler {
     void         (*dump_cpu_state) (const struct scheduler *ops, int cpu);
     void         (*move_timers)    (const struct scheduler *ops,
                                     struct sched_resource *sr);
+    /* Inbox of the runqueue of cpu for queued wakeups, NULL if none. */
+    struct vcpu **(*wake_inbox)    (const struct scheduler *ops,
+                                    unsigned int cpu);
 };
 
 static inline int sched_init(struct scheduler *s)
@@ -523,6 +526,12 @@ static inline void sched_move_timers(const struct scheduler *s,
         s->move_timers(s, sr);
 }
 
+static inline struct vcpu **sched_wake_inbox(const struct scheduler *s,
+                                             unsigned int cpu)
+{
+    return s->wake_inbox ? s->wake_inbox(s, cpu) : NULL;
+}
+
 static inline void sched_unit_pause_nosync(const struct sched_unit *unit)
 {
     struct vcpu *v;
@@ -661,6 +670,7 @@ void free_cpu_rm_data(struct cpu_rm_data *mem, unsigned int cpu);
 int schedule_cpu_rm(unsigned int cpu, struct cpu_rm_data *data);
 int sched_move_domain(struct domain *d, struct cpupool *c);
 void sched_migrate_timers(unsigned int cpu);
+void sched_wake_inbox_flush(struct vcpu **inbox);
 struct cpupool *cpupool_get_by_id(unsigned int poolid);
 void cpupool_put(struct cpupool *pool);
 int cpupool_add_domain(struct domain *d, unsigned int poolid);
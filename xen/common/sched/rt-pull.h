@@ -0,0 +1,137 @@
+/******************************************************************************
+ * RTDS pulling of units from other runqueues.
+ *
+ * When rescheduling, a CPU takes over a unit waiting in another runqueue if
+ * it has a higher priority than what the CPU would run.  The lock of the
+ * CPU's own runqueue being held already, the private scheduler lock and the
+ * lock of the other runqueue can only be trylocked (see the Locking comment
+ * in rt.c).  Should either be contended, the CPU reschedules right away to
+ * try again: the locks are only ever held briefly, while the unit it may be
+ * after could otherwise wait, in a runqueue with all of its CPUs busy, until
+ * something unrelated happens there, missing its deadline.
+ *
+ * The trylock handling is easy to get wrong and hard to hit in a real
+ * system, hence tools/tests/rt-pull drives it with contended locks.  Both
+ * rt.c and that test provide the structures and the runqueue and priority
+ * helpers, up to and including runq_pick(), before the #include.
+ */
+
+#ifndef __XEN_SCHED_RT_PULL_H__
+#define __XEN_SCHED_RT_PULL_H__
+
+/* A lock runq_pull() needed was contended: have cpu try again. */
+static inline void runq_pull_retry(unsigned int cpu)
+{
+    SCHED_STAT_CRANK(rtds_pull_trylock_failed);
+    cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
+}
+
+/*
+ * Pull to cpu, which is in rqd, the highest priority unit that can run on
+ * it among the ones waiting in the runqueue with the highest priority front
+ * (as far as the front of the other runqueues can be known without their
+ * locks), if it has a higher priority than snext.
+ *
+ * Only trylocks are used. If they fail, cpu is made to reschedule, for
+ * trying again.
+ *
+ * Returns the pulled unit, which is in rqd's runqueue, or NULL.
+ */
+static struct rt_unit *
+runq_pull(const struct scheduler *ops, struct rt_runqueue_data *rqd,
+          const struct rt_unit *snext, unsigned int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue_data *iter_rqd, *src = NULL;
+    const struct rt_prio *best = NULL;
+    struct rt_unit *svc = NULL;
+
+    if ( read_atomic(&prv->nr_runqueues) < 2 )
+        return NULL;
+
+    if ( !read_trylock(&prv->lock) )
+    {
+        runq_pull_retry(cpu);
+        return NULL;
+    }
+
+    list_for_each_entry ( iter_rqd, &prv->rql, rql )
+    {
+        const struct rt_prio *head = &iter_rqd->head;
+
+        if ( iter_rqd == rqd || read_atomic(&head->level) == RTDS_PRIO_NONE )
+            continue;
+
+        if ( (!is_idle_unit(snext->unit) && compare_prio(snext, head) >= 0) ||
+             (best && (read_atomic(&head->level) > read_atomic(&best->level) ||
+                       (read_atomic(&head->level) == read_atomic(&best->level) &&
+                        read_atomic(&head->deadline) >=
+                        read_atomic(&best->deadline)))) )
+            continue;
+
+        best = head;
+        src = iter_rqd;
+    }
+
+    if ( !src )
+        goto out;
+
+    if ( !spin_trylock(&src->lock) )
+    {
+        runq_pull_retry(cpu);
+        goto out;
+    }
+
+    svc = runq_pick(src, cpumask_of(cpu), cpu);
+
+    if ( svc && unit_runnable_state(svc->unit) &&
+         (is_idle_unit(snext->unit) || compare_unit_priority(svc, snext) > 0) )
+    {
+        q_remove(src, svc);
+        replq_remove(src, svc);
+
+        /* Both runqueue locks are held, so the unit's lock can change. */
+        sched_set_res(svc->unit, get_sched_res(cpu));
+
+        replq_insert(rqd, svc);
+        runq_insert(rqd, svc);
+
+        SCHED_STAT_CRANK(rtds_pull);
+
+        if ( unlikely(tb_init_done) )
+        {
+            struct {
+                uint16_t unit, dom;
+                uint16_t cpu, runq;
+            } d = {
+                .unit = svc->unit->unit_id,
+                .dom  = svc->unit->domain->domain_id,
+                .cpu  = cpu,
+                .runq = src->id,
+            };
+
+            trace_time(TRC_RTDS_RUNQ_PULL, sizeof(d), &d);
+        }
+    }
+    else
+        svc = NULL;
+
+    spin_unlock(&src->lock);
+
+ out:
+    read_unlock(&prv->lock);
+
+    return svc;
+}
+
+#endif /* __XEN_SCHED_RT_PULL_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -13,6 +13,7 @@
 
 #include <xen/init.h>
 #include <xen/lib.h>
+#include <xen/param.h>
 #include <xen/sched.h>
 #include <xen/domain.h>
 #include <xen/delay.h>
@@ -65,28 +66,76 @@
  * When an UNIT has no task but with budget left, its budget is preserved.
  *
  * Queue scheme:
- * A global runqueue and a global depletedqueue for each CPU pool.
+ * The CPUs of a CPU pool are arranged in runqueues, each one with a
+ * runqueue, a depletedqueue and a replenishment queue. By default there is
+ * only one of them, for the whole pool (see opt_runqueue below).
  * The runqueue holds all runnable UNITs with budget,
  * sorted by priority_level and deadline;
  * The depletedqueue holds all UNITs without budget, unsorted;
  *
+ * With more than one runqueue, global EDF is kept among the CPUs of each of
+ * them, and approximated across them by moving units around (as Linux's
+ * SCHED_DEADLINE does, between its per-CPU runqueues):
+ * - units are pushed: when none of the CPUs of its runqueue can run a unit
+ *   that became runnable straight away, a CPU of another runqueue which
+ *   is idle, or runs a lower priority unit, is tickled;
+ * - units are pulled: when rescheduling, a CPU takes over a unit waiting in
+ *   another runqueue if it has a higher priority than what it would run.
+ *
  * Note: cpumask and cpupool is supported.
  */
 
 /*
  * Locking:
- * A global system lock is used to protect the RunQ and DepletedQ.
- * The global lock is referenced by sched_res->schedule_lock
- * from all physical cpus.
+ * Each runqueue has a lock, protecting its queues and the units which are
+ * assigned to its CPUs. It is referenced by sched_res->schedule_lock
+ * from all the physical cpus of the runqueue.
  *
  * The lock is already grabbed when calling wake/sleep/schedule/ functions
  * in schedule.c
  *
  * The functions involes RunQ and needs to grab locks are:
  *    unit_insert, unit_remove, context_saved, runq_insert
+ *
+ * The private scheduler lock (a rwlock) protects the list of runqueues and
+ * of domains. It nests outside of the runqueue locks: when it is needed
+ * with a runqueue lock held, as when pulling a unit from another runqueue,
+ * only trylocks are used, for it and for the lock of the other runqueue, and
+ * the CPU reschedules to try again if they fail (see rt-pull.h).
  */
 
 
+/*
+ * Arrangement of the CPUs of a pool in runqueues, see rtds_runqueue in
+ * docs/misc/xen-command-line.pandoc. It can be changed for each pool, with
+ * XEN_SYSCTL_SCHEDOP_putinfo, while the pool has no CPUs.
+ */
+static const char *const opt_runqueue_str[] = {
+    [XEN_SYSCTL_RTDS_RUNQUEUE_CPU] = "cpu",
+    [XEN_SYSCTL_RTDS_RUNQUEUE_CORE] = "core",
+    [XEN_SYSCTL_RTDS_RUNQUEUE_SOCKET] = "socket",
+    [XEN_SYSCTL_RTDS_RUNQUEUE_NODE] = "node",
+    [XEN_SYSCTL_RTDS_RUNQUEUE_ALL] = "all"
+};
+static unsigned int __read_mostly opt_runqueue = XEN_SYSCTL_RTDS_RUNQUEUE_ALL;
+
+static int __init cf_check parse_rtds_runqueue(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_runqueue_str); i++ )
+    {
+        if ( !strcmp(s, opt_runqueue_str[i]) )
+        {
+            opt_runqueue = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+custom_param("rtds_runqueue", parse_rtds_runqueue);
+
 /*
  * Default parameters:
  * Period and budget in default is 10 and 4 ms, respectively
@@ -172,27 +221,74 @@
 #define TRC_RTDS_BUDGET_REPLENISH TRC_SCHED_CLASS_EVT(RTDS, 4)
 #define TRC_RTDS_SCHED_TASKLET    TRC_SCHED_CLASS_EVT(RTDS, 5)
 #define TRC_RTDS_SCHEDULE         TRC_SCHED_CLASS_EVT(RTDS, 6)
+#define TRC_RTDS_RUNQ_PULL        TRC_SCHED_CLASS_EVT(RTDS, 7)
 
 static void cf_check repl_timer_handler(void *data);
 
 /*
- * System-wide private data, include global RunQueue/DepletedQ
- * Global lock is referenced by sched_res->schedule_lock from all
- * physical cpus. It can be grabbed via unit_schedule_lock_irq()
+ * System-wide private data, include the list of runqueues.
  */
 struct rt_private {
-    spinlock_t lock;            /* the global coarse-grained lock */
+    rwlock_t lock;              /* protects the lists below */
     struct list_head sdom;      /* list of availalbe domains, used for dump */
+    struct list_head rql;       /* list of runqueues, ordered by id */
+    unsigned int nr_runqueues;  /* number of runqueues in rql */
+    unsigned int runqueue;      /* arrangement, XEN_SYSCTL_RTDS_RUNQUEUE_* */
+
+    cpumask_t tickled;          /* cpus been tickled */
+};
+
+/*
+ * Priority of a unit, in a form which can be looked at by CPUs not holding
+ * the lock protecting the unit: the values are only updated with the lock
+ * held, but may be read without it, to pick CPUs to push units to or
+ * runqueues to pull units from. Decisions are checked with the proper
+ * locks held, where needed.
+ */
+struct rt_prio {
+    unsigned int level;         /* priority_level, RTDS_PRIO_NONE if none */
+    s_time_t deadline;          /* cur_deadline */
+};
+#define RTDS_PRIO_NONE UINT_MAX
+
+/*
+ * Runqueue: its lock is referenced by sched_res->schedule_lock from all
+ * the physical cpus in it. It can be grabbed via unit_schedule_lock_irq()
+ */
+struct rt_runqueue_data {
+    spinlock_t lock;            /* the lock of the runqueue */
+    struct list_head rql;       /* on the list of runqueues of rt_private */
+    unsigned int id;            /* runqueue id, for dumps and traces */
+    unsigned int refcnt;        /* cpus with data allocated pointing to us */
+    unsigned int peer_cpu;      /* one of our cpus, to match the topology */
+    cpumask_t cpus;             /* cpus of the runqueue */
+    const struct scheduler *ops;
 
     struct list_head runq;      /* ordered list of runnable units */
     struct list_head depletedq; /* unordered list of depleted units */
+    struct rt_prio head;        /* priority of the unit at the front of runq */
 
     struct timer repl_timer;    /* replenishment timer */
     struct list_head replq;     /* ordered list of units that need replenishment */
 
-    cpumask_t tickled;          /* cpus been tickled */
+    struct lock_profile_qhead profile_head; /* Lock profiling of lock */
+};
+
+/*
+ * Physical CPU
+ */
+struct rt_pcpu {
+    struct rt_runqueue_data *rqd; /* runqueue the cpu is in */
 };
 
+/*
+ * Priority of what each CPU is running (RTDS_PRIO_NONE if idle), for the
+ * CPUs of other runqueues to push units to it. This is per-CPU data rather
+ * than in struct rt_pcpu, as the latter is freed as soon as a CPU leaves
+ * the pool, while the CPUs of other runqueues may still look at it.
+ */
+static DEFINE_PER_CPU(struct rt_prio, rt_curr_prio);
+
 /*
  * Virtual CPU
  */
@@ -239,19 +335,15 @@ static inline struct rt_unit *rt_unit(const struct sched_unit *unit)
     return unit->priv;
 }
 
-static inline struct list_head *rt_runq(const struct scheduler *ops)
-{
-    return &rt_priv(ops)->runq;
-}
-
-static inline struct list_head *rt_depletedq(const struct scheduler *ops)
+static inline struct rt_pcpu *rt_pcpu(unsigned int cpu)
 {
-    return &rt_priv(ops)->depletedq;
+    return get_sched_res(cpu)->sched_priv;
 }
 
-static inline struct list_head *rt_replq(const struct scheduler *ops)
+/* The runqueue of a unit is the one of the resource it is assigned to. */
+static inline struct rt_runqueue_data *unit_rqd(const struct rt_unit *svc)
 {
-    return &rt_priv(ops)->replq;
+    return rt_pcpu(sched_unit_master(svc->unit))->rqd;
 }
 
 static inline bool has_extratime(const struct rt_unit *svc)
@@ -302,6 +394,27 @@ compare_unit_priority(const struct rt_unit *v1, const struct rt_unit *v2)
     return prio;
 }
 
+static void set_prio(struct rt_prio *p, const struct rt_unit *svc)
+{
+    write_atomic(&p->level, svc ? svc->priority_level : RTDS_PRIO_NONE);
+    write_atomic(&p->deadline, svc ? svc->cur_deadline : STIME_MAX);
+}
+
+/*
+ * As compare_unit_priority(), v2 being given as a struct rt_prio:
+ * if v1 priority >= p priority, return value > 0
+ */
+static s_time_t
+compare_prio(const struct rt_unit *v1, const struct rt_prio *p)
+{
+    unsigned int level = read_atomic(&p->level);
+
+    if ( level == v1->priority_level )
+        return read_atomic(&p->deadline) - v1->cur_deadline;
+
+    return (s_time_t)level - v1->priority_level;
+}
+
 /*
  * Debug related code, dump unit/cpu information
  */
@@ -351,58 +464,66 @@ rt_dump_unit(const struct scheduler *ops, const struct rt_unit *svc)
 static void cf_check
 rt_dump_pcpu(const struct scheduler *ops, int cpu)
 {
-    struct rt_private *prv = rt_priv(ops);
     const struct rt_unit *svc;
     unsigned long flags;
+    spinlock_t *lock;
 
-    spin_lock_irqsave(&prv->lock, flags);
-    printk("CPU[%02d]\n", cpu);
+    lock = pcpu_schedule_lock_irqsave(cpu, &flags);
+    printk("CPU[%02d] runq=%u\n", cpu, rt_pcpu(cpu)->rqd->id);
     /* current UNIT (nothing to say if that's the idle unit). */
     svc = rt_unit(curr_on_cpu(cpu));
     if ( svc && !is_idle_unit(svc->unit) )
     {
         rt_dump_unit(ops, svc);
     }
-    spin_unlock_irqrestore(&prv->lock, flags);
+    pcpu_schedule_unlock_irqrestore(lock, flags, cpu);
 }
 
 static void cf_check
 rt_dump(const struct scheduler *ops)
 {
-    struct list_head *runq, *depletedq, *replq, *iter;
+    struct list_head *iter;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue_data *rqd;
     const struct rt_unit *svc;
     const struct rt_dom *sdom;
     unsigned long flags;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    read_lock_irqsave(&prv->lock, flags);
+
+    printk("Runqueues arrangement: %s\n", opt_runqueue_str[prv->runqueue]);
 
     if ( list_empty(&prv->sdom) )
         goto out;
 
-    runq = rt_runq(ops);
-    depletedq = rt_depletedq(ops);
-    replq = rt_replq(ops);
-
-    printk("Global RunQueue info:\n");
-    list_for_each ( iter, runq )
+    list_for_each_entry ( rqd, &prv->rql, rql )
     {
-        svc = q_elem(iter);
-        rt_dump_unit(ops, svc);
-    }
+        /* IRQs already disabled. */
+        spin_lock(&rqd->lock);
 
-    printk("Global DepletedQueue info:\n");
-    list_for_each ( iter, depletedq )
-    {
-        svc = q_elem(iter);
-        rt_dump_unit(ops, svc);
-    }
+        printk("RunQueue %u cpus=%*pbl info:\n", rqd->id,
+               CPUMASK_PR(&rqd->cpus));
+        list_for_each ( iter, &rqd->runq )
+        {
+            svc = q_elem(iter);
+            rt_dump_unit(ops, svc);
+        }
 
-    printk("Global Replenishment Events info:\n");
-    list_for_each ( iter, replq )
-    {
-        svc = replq_elem(iter);
-        rt_dump_unit(ops, svc);
+        printk("RunQueue %u DepletedQueue info:\n", rqd->id);
+        list_for_each ( iter, &rqd->depletedq )
+        {
+            svc = q_elem(iter);
+            rt_dump_unit(ops, svc);
+        }
+
+        printk("RunQueue %u Replenishment Events info:\n", rqd->id);
+        list_for_each ( iter, &rqd->replq )
+        {
+            svc = replq_elem(iter);
+            rt_dump_unit(ops, svc);
+        }
+
+        spin_unlock(&rqd->lock);
     }
 
     printk("Domain info:\n");
@@ -415,13 +536,17 @@ rt_dump(const struct scheduler *ops)
 
         for_each_sched_unit ( sdom->dom, unit )
         {
+            spinlock_t *lock = unit_schedule_lock(unit);
+
             svc = rt_unit(unit);
             rt_dump_unit(ops, svc);
+
+            unit_schedule_unlock(lock, unit);
         }
     }
 
  out:
-    spin_unlock_irqrestore(&prv->lock, flags);
+    read_unlock_irqrestore(&prv->lock, flags);
 }
 
 /*
@@ -522,19 +647,28 @@ deadline_queue_insert(struct rt_unit * (*qelem)(struct list_head *),
 #define deadline_replq_insert(...) \
   deadline_queue_insert(&replq_elem, ##__VA_ARGS__)
 
+/* Publish the priority of the front of the runqueue, for pulls. */
+static inline void
+runq_update_head(struct rt_runqueue_data *rqd)
+{
+    set_prio(&rqd->head,
+             list_empty(&rqd->runq) ? NULL : q_elem(rqd->runq.next));
+}
+
 static inline void
-q_remove(struct rt_unit *svc)
+q_remove(struct rt_runqueue_data *rqd, struct rt_unit *svc)
 {
     ASSERT( unit_on_q(svc) );
     list_del_init(&svc->q_elem);
+    runq_update_head(rqd);
 }
 
 static inline void
-replq_remove(const struct scheduler *ops, struct rt_unit *svc)
+replq_remove(struct rt_runqueue_data *rqd, struct rt_unit *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
+    struct list_head *replq = &rqd->replq;
 
+    ASSERT( spin_is_locked(&rqd->lock) );
     ASSERT( unit_on_replq(svc) );
 
     if ( deadline_queue_remove(replq, &svc->replq_elem) )
@@ -548,10 +682,10 @@ replq_remove(const struct scheduler *ops, struct rt_unit *svc)
         if ( !list_empty(replq) )
         {
             const struct rt_unit *svc_next = replq_elem(replq->next);
-            set_timer(&prv->repl_timer, svc_next->cur_deadline);
+            set_timer(&rqd->repl_timer, svc_next->cur_deadline);
         }
         else
-            stop_timer(&prv->repl_timer);
+            stop_timer(&rqd->repl_timer);
     }
 }
 
@@ -561,28 +695,29 @@ replq_remove(const struct scheduler *ops, struct rt_unit *svc)
  * Insert svc without budget in DepletedQ unsorted;
  */
 static void
-runq_insert(const struct scheduler *ops, struct rt_unit *svc)
+runq_insert(struct rt_runqueue_data *rqd, struct rt_unit *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *runq = rt_runq(ops);
+    struct list_head *runq = &rqd->runq;
 
-    ASSERT( spin_is_locked(&prv->lock) );
+    ASSERT( spin_is_locked(&rqd->lock) );
     ASSERT( !unit_on_q(svc) );
     ASSERT( unit_on_replq(svc) );
 
     /* add svc to runq if svc still has budget or its extratime is set */
     if ( svc->cur_budget > 0 ||
          has_extratime(svc) )
-        deadline_runq_insert(svc, &svc->q_elem, runq);
+    {
+        if ( deadline_runq_insert(svc, &svc->q_elem, runq) )
+            runq_update_head(rqd);
+    }
     else
-        list_add(&svc->q_elem, &prv->depletedq);
+        list_add(&svc->q_elem, &rqd->depletedq);
 }
 
 static void
-replq_insert(const struct scheduler *ops, struct rt_unit *svc)
+replq_insert(struct rt_runqueue_data *rqd, struct rt_unit *svc)
 {
-    struct list_head *replq = rt_replq(ops);
-    struct rt_private *prv = rt_priv(ops);
+    struct list_head *replq = &rqd->replq;
 
     ASSERT( !unit_on_replq(svc) );
 
@@ -591,7 +726,7 @@ replq_insert(const struct scheduler *ops, struct rt_unit *svc)
      * at the front of the event list.
      */
     if ( deadline_replq_insert(svc, &svc->replq_elem, replq) )
-        set_timer(&prv->repl_timer, svc->cur_deadline);
+        set_timer(&rqd->repl_timer, svc->cur_deadline);
 }
 
 /*
@@ -601,9 +736,9 @@ replq_insert(const struct scheduler *ops, struct rt_unit *svc)
  * changed.
  */
 static void
-replq_reinsert(const struct scheduler *ops, struct rt_unit *svc)
+replq_reinsert(struct rt_runqueue_data *rqd, struct rt_unit *svc)
 {
-    struct list_head *replq = rt_replq(ops);
+    struct list_head *replq = &rqd->replq;
     const struct rt_unit *rearm_svc = svc;
     bool rearm = false;
 
@@ -628,7 +763,7 @@ replq_reinsert(const struct scheduler *ops, struct rt_unit *svc)
         rearm = deadline_replq_insert(svc, &svc->replq_elem, replq);
 
     if ( rearm )
-        set_timer(&rt_priv(ops)->repl_timer, rearm_svc->cur_deadline);
+        set_timer(&rqd->repl_timer, rearm_svc->cur_deadline);
 }
 
 /*
@@ -685,11 +820,13 @@ rt_init(struct scheduler *ops)
     if ( prv == NULL )
         goto err;
 
-    spin_lock_init(&prv->lock);
+    rwlock_init(&prv->lock);
     INIT_LIST_HEAD(&prv->sdom);
-    INIT_LIST_HEAD(&prv->runq);
-    INIT_LIST_HEAD(&prv->depletedq);
-    INIT_LIST_HEAD(&prv->replq);
+    INIT_LIST_HEAD(&prv->rql);
+    prv->runqueue = opt_runqueue;
+
+    printk(XENLOG_INFO " runqueues arrangement: %s\n",
+           opt_runqueue_str[prv->runqueue]);
 
     ops->sched_data = prv;
     rc = 0;
@@ -706,22 +843,187 @@ rt_deinit(struct scheduler *ops)
 {
     struct rt_private *prv = rt_priv(ops);
 
-    ASSERT(prv->repl_timer.status == TIMER_STATUS_invalid ||
-           prv->repl_timer.status == TIMER_STATUS_killed);
+    ASSERT(list_empty(&prv->rql));
 
     ops->sched_data = NULL;
     xfree(prv);
 }
 
+/*
+ * Runqueue related code.
+ */
+
+static bool
+cpu_runqueue_match(const struct rt_private *prv,
+                   const struct rt_runqueue_data *rqd, unsigned int cpu)
+{
+    unsigned int peer_cpu = rqd->peer_cpu;
+
+    switch ( prv->runqueue )
+    {
+    case XEN_SYSCTL_RTDS_RUNQUEUE_ALL:
+        return true;
+    case XEN_SYSCTL_RTDS_RUNQUEUE_NODE:
+        return cpu_to_node(peer_cpu) == cpu_to_node(cpu);
+    case XEN_SYSCTL_RTDS_RUNQUEUE_SOCKET:
+        return cpu_to_socket(peer_cpu) == cpu_to_socket(cpu);
+    case XEN_SYSCTL_RTDS_RUNQUEUE_CORE:
+        return cpu_to_socket(peer_cpu) == cpu_to_socket(cpu) &&
+               cpu_to_core(peer_cpu) == cpu_to_core(cpu);
+    }
+
+    /* XEN_SYSCTL_RTDS_RUNQUEUE_CPU never finds an existing runqueue. */
+    return false;
+}
+
+static void free_runqueue(struct rt_runqueue_data *rqd)
+{
+#ifdef CONFIG_DEBUG_LOCK_PROFILE
+    if ( rqd )
+        xfree(rqd->profile_head.elem_q);
+#endif
+    xfree(rqd);
+}
+
+/*
+ * Find the runqueue cpu goes in, creating it if it doesn't exist yet, and
+ * take a reference to it.
+ */
+static struct rt_runqueue_data *
+cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue_data *rqd, *rqd_new;
+    struct list_head *rqd_ins = &prv->rql;
+    unsigned long flags;
+    unsigned int rqi = 0;
+    bool rqd_added = false;
+
+    /* Prealloc in case we need it - not allowed with interrupts off. */
+    rqd_new = xzalloc(struct rt_runqueue_data);
+    if ( rqd_new )
+        spin_lock_init_prof(rqd_new, lock);
+
+    write_lock_irqsave(&prv->lock, flags);
+
+    list_for_each_entry ( rqd, &prv->rql, rql )
+        if ( cpu_runqueue_match(prv, rqd, cpu) )
+            goto out;
+
+    /* Use the lowest free id, keeping the list ordered. */
+    list_for_each_entry ( rqd, &prv->rql, rql )
+    {
+        if ( rqd->id != rqi )
+            break;
+        rqi++;
+        rqd_ins = &rqd->rql;
+    }
+
+    rqd = rqd_new;
+    if ( !rqd )
+    {
+        rqd = ERR_PTR(-ENOMEM);
+        goto unlock;
+    }
+    rqd_new = NULL;
+    rqd_added = true;
+
+    rqd->id = rqi;
+    rqd->peer_cpu = cpu;
+    rqd->ops = ops;
+    INIT_LIST_HEAD(&rqd->runq);
+    INIT_LIST_HEAD(&rqd->depletedq);
+    INIT_LIST_HEAD(&rqd->replq);
+    set_prio(&rqd->head, NULL);
+    list_add(&rqd->rql, rqd_ins);
+    prv->nr_runqueues++;
+
+ out:
+    rqd->refcnt++;
+
+ unlock:
+    write_unlock_irqrestore(&prv->lock, flags);
+
+    if ( rqd_added )
+        lock_profile_register_struct(LOCKPROF_TYPE_RUNQ, rqd, rqd->id);
+
+    free_runqueue(rqd_new);
+
+    return rqd;
+}
+
+static void *cf_check
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_pcpu *spc;
+    struct rt_runqueue_data *rqd;
+
+    spc = xzalloc(struct rt_pcpu);
+    if ( spc == NULL )
+        return ERR_PTR(-ENOMEM);
+
+    rqd = cpu_add_to_runqueue(ops, cpu);
+    if ( IS_ERR(rqd) )
+    {
+        xfree(spc);
+        return rqd;
+    }
+
+    spc->rqd = rqd;
+
+    return spc;
+}
+
+static void cf_check
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_pcpu *spc = pcpu;
+    struct rt_runqueue_data *rqd;
+    unsigned long flags;
+
+    if ( !spc )
+        return;
+
+    write_lock_irqsave(&prv->lock, flags);
+
+    rqd = spc->rqd;
+    ASSERT(rqd && rqd->refcnt);
+
+    if ( !--rqd->refcnt )
+    {
+        list_del(&rqd->rql);
+        prv->nr_runqueues--;
+    }
+    else
+        rqd = NULL;
+
+    write_unlock_irqrestore(&prv->lock, flags);
+
+    if ( rqd )
+    {
+        ASSERT(rqd->repl_timer.status == TIMER_STATUS_invalid ||
+               rqd->repl_timer.status == TIMER_STATUS_killed);
+        lock_profile_deregister_struct(LOCKPROF_TYPE_RUNQ, rqd);
+        free_runqueue(rqd);
+    }
+
+    xfree(spc);
+}
+
 /* Change the scheduler of cpu to us (RTDS). */
 static spinlock_t *cf_check
 rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
                 void *pdata, void *vdata)
 {
     struct rt_private *prv = rt_priv(new_ops);
+    struct rt_pcpu *spc = pdata;
     struct rt_unit *svc = vdata;
+    struct rt_runqueue_data *rqd;
+
+    ASSERT(spc && svc && is_idle_unit(svc->unit));
 
-    ASSERT(!pdata && svc && is_idle_unit(svc->unit));
+    rqd = spc->rqd;
 
     /*
      * We are holding the runqueue lock already (it's been taken in
@@ -729,46 +1031,33 @@ rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
      * another scheduler, but that is how things need to be, for
      * preventing races.
      */
-    ASSERT(get_sched_res(cpu)->schedule_lock != &prv->lock);
+    ASSERT(get_sched_res(cpu)->schedule_lock != &rqd->lock);
+
+    write_lock(&prv->lock);
 
     /*
      * If we are the absolute first cpu being switched toward this
-     * scheduler (in which case we'll see TIMER_STATUS_invalid), or the
-     * first one that is added back to the cpupool that had all its cpus
+     * runqueue (in which case we'll see TIMER_STATUS_invalid), or the
+     * first one that is added back to a runqueue that had all its cpus
      * removed (in which case we'll see TIMER_STATUS_killed), it's our
      * job to (re)initialize the timer.
      */
-    if ( prv->repl_timer.status == TIMER_STATUS_invalid ||
-         prv->repl_timer.status == TIMER_STATUS_killed )
+    if ( rqd->repl_timer.status == TIMER_STATUS_invalid ||
+         rqd->repl_timer.status == TIMER_STATUS_killed )
     {
-        init_timer(&prv->repl_timer, repl_timer_handler, (void *)new_ops, cpu);
-        dprintk(XENLOG_DEBUG, "RTDS: timer initialized on cpu %u\n", cpu);
+        init_timer(&rqd->repl_timer, repl_timer_handler, rqd, cpu);
+        dprintk(XENLOG_DEBUG, "RTDS: runq %u timer initialized on cpu %u\n",
+                rqd->id, cpu);
     }
 
-    sched_idle_unit(cpu)->priv = vdata;
+    cpumask_set_cpu(cpu, &rqd->cpus);
+    set_prio(&per_cpu(rt_curr_prio, cpu), NULL);
 
-    return &prv->lock;
-}
+    write_unlock(&prv->lock);
 
-static void move_repl_timer(struct rt_private *prv, unsigned int old_cpu)
-{
-    cpumask_t *online = get_sched_res(old_cpu)->cpupool->res_valid;
-    unsigned int new_cpu = cpumask_cycle(old_cpu, online);
+    sched_idle_unit(cpu)->priv = vdata;
 
-    /*
-     * Make sure the timer run on one of the cpus that are still available
-     * to this scheduler. If there aren't any left, it means it's the time
-     * to just kill it.
-     */
-    if ( new_cpu >= nr_cpu_ids )
-    {
-        kill_timer(&prv->repl_timer);
-        dprintk(XENLOG_DEBUG, "RTDS: timer killed on cpu %d\n", old_cpu);
-    }
-    else
-    {
-        migrate_timer(&prv->repl_timer, new_cpu);
-    }
+    return &rqd->lock;
 }
 
 static void cf_check
@@ -776,31 +1065,67 @@ rt_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
     unsigned long flags;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_pcpu *spc = pcpu;
+    struct rt_runqueue_data *rqd;
+    unsigned int new_cpu = nr_cpu_ids;
+    bool move_timer;
+
+    ASSERT(spc && spc->rqd);
+    rqd = spc->rqd;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    write_lock_irqsave(&prv->lock, flags);
+    /* No need to save IRQs here, they're already disabled */
+    spin_lock(&rqd->lock);
 
-    if ( prv->repl_timer.cpu == cpu )
-        move_repl_timer(prv, cpu);
+    cpumask_clear_cpu(cpu, &rqd->cpus);
+    cpumask_clear_cpu(cpu, &prv->tickled);
 
-    spin_unlock_irqrestore(&prv->lock, flags);
+    if ( !cpumask_empty(&rqd->cpus) )
+    {
+        new_cpu = cpumask_cycle(cpu, &rqd->cpus);
+        if ( rqd->peer_cpu == cpu )
+            rqd->peer_cpu = new_cpu;
+    }
+    else
+        ASSERT(list_empty(&rqd->runq) && list_empty(&rqd->depletedq) &&
+               list_empty(&rqd->replq));
+
+    move_timer = rqd->repl_timer.cpu == cpu;
+
+    spin_unlock(&rqd->lock);
+    write_unlock_irqrestore(&prv->lock, flags);
+
+    /*
+     * Make sure the timer run on one of the cpus that are still in the
+     * runqueue. If there aren't any left, it means it's the time to just
+     * kill it. This is done without holding the runqueue lock, which the
+     * timer handler takes.
+     */
+    if ( new_cpu >= nr_cpu_ids )
+    {
+        kill_timer(&rqd->repl_timer);
+        dprintk(XENLOG_DEBUG, "RTDS: runq %u timer killed on cpu %d\n",
+                rqd->id, cpu);
+    }
+    else if ( move_timer )
+        migrate_timer(&rqd->repl_timer, new_cpu);
 }
 
 static void cf_check
 rt_move_timers(const struct scheduler *ops, struct sched_resource *sr)
 {
+    const struct rt_pcpu *spc = sr->sched_priv;
+    struct rt_runqueue_data *rqd = spc->rqd;
     unsigned long flags;
-    struct rt_private *prv = rt_priv(ops);
-    unsigned int old_cpu;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    spin_lock_irqsave(&rqd->lock, flags);
 
-    old_cpu = prv->repl_timer.cpu;
-    if ( prv->repl_timer.status != TIMER_STATUS_invalid &&
-         prv->repl_timer.status != TIMER_STATUS_killed &&
-         !cpumask_test_cpu(old_cpu, sr->cpupool->res_valid) )
-        move_repl_timer(prv, old_cpu);
+    if ( rqd->repl_timer.status != TIMER_STATUS_invalid &&
+         rqd->repl_timer.status != TIMER_STATUS_killed &&
+         !cpumask_test_cpu(rqd->repl_timer.cpu, &rqd->cpus) )
+        migrate_timer(&rqd->repl_timer, sr->master_cpu);
 
-    spin_unlock_irqrestore(&prv->lock, flags);
+    spin_unlock_irqrestore(&rqd->lock, flags);
 }
 
 static void *cf_check
@@ -817,10 +1142,10 @@ rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
     INIT_LIST_HEAD(&sdom->sdom_elem);
     sdom->dom = dom;
 
-    /* spinlock here to insert the dom */
-    spin_lock_irqsave(&prv->lock, flags);
+    /* lock here to insert the dom */
+    write_lock_irqsave(&prv->lock, flags);
     list_add_tail(&sdom->sdom_elem, &(prv->sdom));
-    spin_unlock_irqrestore(&prv->lock, flags);
+    write_unlock_irqrestore(&prv->lock, flags);
 
     return sdom;
 }
@@ -835,9 +1160,9 @@ rt_free_domdata(const struct scheduler *ops, void *data)
     {
         unsigned long flags;
 
-        spin_lock_irqsave(&prv->lock, flags);
+        write_lock_irqsave(&prv->lock, flags);
         list_del_init(&sdom->sdom_elem);
-        spin_unlock_irqrestore(&prv->lock, flags);
+        write_unlock_irqrestore(&prv->lock, flags);
 
         xfree(sdom);
     }
@@ -909,10 +1234,12 @@ rt_unit_insert(const struct scheduler *ops, struct sched_unit *unit)
 
     if ( !unit_on_q(svc) && unit_runnable(unit) )
     {
-        replq_insert(ops, svc);
+        struct rt_runqueue_data *rqd = unit_rqd(svc);
+
+        replq_insert(rqd, svc);
 
         if ( !unit->is_running )
-            runq_insert(ops, svc);
+            runq_insert(rqd, svc);
     }
     unit_schedule_unlock_irq(lock, unit);
 
@@ -935,10 +1262,10 @@ rt_unit_remove(const struct scheduler *ops, struct sched_unit *unit)
 
     lock = unit_schedule_lock_irq(unit);
     if ( unit_on_q(svc) )
-        q_remove(svc);
+        q_remove(unit_rqd(svc), svc);
 
     if ( unit_on_replq(svc) )
-        replq_remove(ops,svc);
+        replq_remove(unit_rqd(svc), svc);
 
     unit_schedule_unlock_irq(lock, unit);
 }
@@ -1012,9 +1339,10 @@ burn_budget(const struct scheduler *ops, struct rt_unit *svc, s_time_t now)
  * lock is grabbed before calling this function
  */
 static struct rt_unit *
-runq_pick(const struct scheduler *ops, const cpumask_t *mask, unsigned int cpu)
+runq_pick(const struct rt_runqueue_data *rqd, const cpumask_t *mask,
+          unsigned int cpu)
 {
-    struct list_head *runq = rt_runq(ops);
+    const struct list_head *runq = &rqd->runq;
     struct list_head *iter;
     struct rt_unit *svc = NULL;
     struct rt_unit *iter_svc = NULL;
@@ -1056,6 +1384,8 @@ runq_pick(const struct scheduler *ops, const cpumask_t *mask, unsigned int cpu)
     return svc;
 }
 
+#include "rt-pull.h"
+
 /*
  * schedule function for rt scheduler.
  * The lock is already grabbed in schedule.c, no need to lock here
@@ -1067,8 +1397,9 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     const unsigned int cur_cpu = smp_processor_id();
     const unsigned int sched_cpu = sched_get_resource_cpu(cur_cpu);
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue_data *rqd = rt_pcpu(sched_cpu)->rqd;
     struct rt_unit *const scurr = rt_unit(currunit);
-    struct rt_unit *snext = NULL;
+    struct rt_unit *snext = NULL, *pulled;
     bool migrated = false;
 
     if ( unlikely(tb_init_done) )
@@ -1101,7 +1432,7 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     {
         while ( true )
         {
-            snext = runq_pick(ops, cpumask_of(sched_cpu), cur_cpu);
+            snext = runq_pick(rqd, cpumask_of(sched_cpu), cur_cpu);
 
             if ( snext == NULL )
             {
@@ -1111,8 +1442,8 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
             if ( unit_runnable_state(snext->unit) )
                 break;
 
-            q_remove(snext);
-            replq_remove(ops, snext);
+            q_remove(rqd, snext);
+            replq_remove(rqd, snext);
         }
 
         /* if scurr has higher priority and budget, still pick scurr */
@@ -1122,6 +1453,14 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
              ( is_idle_unit(snext->unit) ||
                compare_unit_priority(scurr, snext) > 0 ) )
             snext = scurr;
+
+        /* a unit waiting in another runqueue may have a higher priority */
+        pulled = runq_pull(ops, rqd, snext, sched_cpu);
+        if ( pulled )
+        {
+            snext = pulled;
+            migrated = true;
+        }
     }
 
     if ( snext != scurr &&
@@ -1135,7 +1474,7 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     {
         if ( snext != scurr )
         {
-            q_remove(snext);
+            q_remove(rqd, snext);
             __set_bit(__RTDS_scheduled, &snext->flags);
         }
         if ( sched_unit_master(snext->unit) != sched_cpu )
@@ -1148,6 +1487,9 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     }
     currunit->next_task = snext->unit;
     snext->unit->migrated = migrated;
+
+    set_prio(&per_cpu(rt_curr_prio, sched_cpu),
+             is_idle_unit(snext->unit) ? NULL : snext);
 }
 
 /*
@@ -1166,8 +1508,10 @@ rt_unit_sleep(const struct scheduler *ops, struct sched_unit *unit)
         cpu_raise_softirq(sched_unit_master(unit), SCHEDULE_SOFTIRQ);
     else if ( unit_on_q(svc) )
     {
-        q_remove(svc);
-        replq_remove(ops, svc);
+        struct rt_runqueue_data *rqd = unit_rqd(svc);
+
+        q_remove(rqd, svc);
+        replq_remove(rqd, svc);
     }
     else if ( svc->flags & RTDS_delayed_runq_add )
         __clear_bit(__RTDS_delayed_runq_add, &svc->flags);
@@ -1179,11 +1523,15 @@ rt_unit_sleep(const struct scheduler *ops, struct sched_unit *unit)
  * Called by wake() and context_saved()
  * We have a running candidate here, the kick logic is:
  * Among all the cpus that are within the cpu affinity
- * 1) if there are any idle CPUs, kick one.
+ * 1) if there are any idle CPUs in the unit's runqueue, kick one.
       For cache benefit, we check new->cpu as first
- * 2) now all pcpus are busy;
- *    among all the running units, pick lowest priority one
- *    if snext has higher priority, kick it.
+ * 2) if there are any idle CPUs in other runqueues, kick one: it will pull
+ *    the unit when rescheduling (see runq_pull()).
+ * 3) now all pcpus are busy;
+ *    among all the running units of the unit's runqueue, pick the lowest
+ *    priority one; if new has higher priority, kick it.
+ * 4) else do the same among the units running in other runqueues, as
+ *    far as they can be known without their locks.
  *
  * TODO:
  * 1) what if these two units belongs to the same domain?
@@ -1195,27 +1543,31 @@ static void
 runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
 {
     struct rt_private *prv = rt_priv(ops);
+    const struct rt_runqueue_data *rqd;
     const struct rt_unit *latest_deadline_unit = NULL; /* lowest priority */
     const struct rt_unit *iter_svc;
     const struct sched_unit *iter_unit;
-    int cpu = 0, cpu_to_tickle = 0;
+    const struct rt_prio *latest_remote = NULL;
+    unsigned int cpu, cpu_to_tickle = 0, remote_cpu = nr_cpu_ids;
     cpumask_t *not_tickled = cpumask_scratch_cpu(smp_processor_id());
     const cpumask_t *online;
 
     if ( new == NULL || is_idle_unit(new->unit) )
         return;
 
+    rqd = unit_rqd(new);
     online = cpupool_domain_master_cpumask(new->unit->domain);
     cpumask_and(not_tickled, online, new->unit->cpu_hard_affinity);
     cpumask_andnot(not_tickled, not_tickled, &prv->tickled);
+    cpumask_and(not_tickled, not_tickled, &rqd->cpus);
 
     /*
-     * 1) If there are any idle CPUs, kick one.
+     * 1) If there are any idle CPUs in our runqueue, kick one.
      *    For cache benefit,we first search new->cpu.
      *    The same loop also find the one with lowest priority.
      */
     cpu = cpumask_test_or_cycle(sched_unit_master(new->unit), not_tickled);
-    while ( cpu!= nr_cpu_ids )
+    while ( cpu != nr_cpu_ids )
     {
         iter_unit = curr_on_cpu(cpu);
         if ( is_idle_unit(iter_unit) )
@@ -1233,7 +1585,42 @@ runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
         cpu = cpumask_cycle(cpu, not_tickled);
     }
 
-    /* 2) candicate has higher priority, kick out lowest priority unit */
+    /*
+     * 2) If there are any idle CPUs in other runqueues, kick one. The
+     *    same loop also finds the one running the lowest priority unit.
+     *    What they run is only looked at, without their locks, through
+     *    rt_curr_prio.
+     */
+    if ( read_atomic(&prv->nr_runqueues) > 1 )
+    {
+        cpumask_and(not_tickled, online, new->unit->cpu_hard_affinity);
+        cpumask_andnot(not_tickled, not_tickled, &prv->tickled);
+        cpumask_andnot(not_tickled, not_tickled, &rqd->cpus);
+
+        for_each_cpu ( cpu, not_tickled )
+        {
+            const struct rt_prio *p = &per_cpu(rt_curr_prio, cpu);
+
+            if ( read_atomic(&p->level) == RTDS_PRIO_NONE )
+            {
+                SCHED_STAT_CRANK(tickled_idle_cpu);
+                SCHED_STAT_CRANK(rtds_push);
+                cpu_to_tickle = cpu;
+                goto out;
+            }
+            if ( latest_remote == NULL ||
+                 read_atomic(&p->level) > read_atomic(&latest_remote->level) ||
+                 (read_atomic(&p->level) == read_atomic(&latest_remote->level) &&
+                  read_atomic(&p->deadline) >
+                  read_atomic(&latest_remote->deadline)) )
+            {
+                latest_remote = p;
+                remote_cpu = cpu;
+            }
+        }
+    }
+
+    /* 3) candicate has higher priority, kick out lowest priority unit */
     if ( latest_deadline_unit != NULL &&
          compare_unit_priority(latest_deadline_unit, new) < 0 )
     {
@@ -1242,6 +1629,15 @@ runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
         goto out;
     }
 
+    /* 4) same, for the units running in other runqueues */
+    if ( latest_remote != NULL && compare_prio(new, latest_remote) > 0 )
+    {
+        SCHED_STAT_CRANK(tickled_busy_cpu);
+        SCHED_STAT_CRANK(rtds_push);
+        cpu_to_tickle = remote_cpu;
+        goto out;
+    }
+
     /* didn't tickle any cpu */
     SCHED_STAT_CRANK(tickled_no_cpu);
     return;
@@ -1272,6 +1668,7 @@ static void cf_check
 rt_unit_wake(const struct scheduler *ops, struct sched_unit *unit)
 {
     struct rt_unit * const svc = rt_unit(unit);
+    struct rt_runqueue_data *rqd = unit_rqd(svc);
     s_time_t now;
     bool missed;
 
@@ -1322,14 +1719,14 @@ rt_unit_wake(const struct scheduler *ops, struct sched_unit *unit)
          * and queue a new one (to occur at our new deadline).
          */
         if ( missed )
-           replq_reinsert(ops, svc);
+           replq_reinsert(rqd, svc);
         return;
     }
 
     /* Replenishment event got cancelled when we blocked. Add it back. */
-    replq_insert(ops, svc);
+    replq_insert(rqd, svc);
     /* insert svc to runq/depletedq because svc is not in queue now */
-    runq_insert(ops, svc);
+    runq_insert(rqd, svc);
 
     runq_tickle(ops, svc);
 }
@@ -1352,11 +1749,11 @@ rt_context_saved(const struct scheduler *ops, struct sched_unit *unit)
     if ( __test_and_clear_bit(__RTDS_delayed_runq_add, &svc->flags) &&
          likely(unit_runnable(unit)) )
     {
-        runq_insert(ops, svc);
+        runq_insert(unit_rqd(svc), svc);
         runq_tickle(ops, svc);
     }
     else
-        replq_remove(ops, svc);
+        replq_remove(unit_rqd(svc), svc);
 
 out:
     unit_schedule_unlock_irq(lock, unit);
@@ -1371,9 +1768,9 @@ rt_dom_cntl(
     struct domain *d,
     struct xen_domctl_scheduler_op *op)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_unit *svc;
-    const struct sched_unit *unit;
+    struct sched_unit *unit;
+    spinlock_t *lock;
     unsigned long flags;
     int rc = 0;
     struct xen_domctl_schedparam_vcpu local_sched;
@@ -1393,14 +1790,14 @@ rt_dom_cntl(
             rc = -EINVAL;
             break;
         }
-        spin_lock_irqsave(&prv->lock, flags);
         for_each_sched_unit ( d, unit )
         {
+            lock = unit_schedule_lock_irqsave(unit, &flags);
             svc = rt_unit(unit);
             svc->period = MICROSECS(op->u.rtds.period); /* transfer to nanosec */
             svc->budget = MICROSECS(op->u.rtds.budget);
+            unit_schedule_unlock_irqrestore(lock, flags, unit);
         }
-        spin_unlock_irqrestore(&prv->lock, flags);
         break;
     case XEN_DOMCTL_SCHEDOP_getvcpuinfo:
     case XEN_DOMCTL_SCHEDOP_putvcpuinfo:
@@ -1421,15 +1818,16 @@ rt_dom_cntl(
 
             if ( op->cmd == XEN_DOMCTL_SCHEDOP_getvcpuinfo )
             {
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_unit(d->vcpu[local_sched.vcpuid]->sched_unit);
+                unit = d->vcpu[local_sched.vcpuid]->sched_unit;
+                lock = unit_schedule_lock_irqsave(unit, &flags);
+                svc = rt_unit(unit);
                 local_sched.u.rtds.budget = svc->budget / MICROSECS(1);
                 local_sched.u.rtds.period = svc->period / MICROSECS(1);
                 if ( has_extratime(svc) )
                     local_sched.u.rtds.flags |= XEN_DOMCTL_SCHEDRT_extra;
                 else
                     local_sched.u.rtds.flags &= ~XEN_DOMCTL_SCHEDRT_extra;
-                spin_unlock_irqrestore(&prv->lock, flags);
+                unit_schedule_unlock_irqrestore(lock, flags, unit);
 
                 if ( copy_to_guest_offset(op->u.v.vcpus, index,
                                           &local_sched, 1) )
@@ -1449,15 +1847,16 @@ rt_dom_cntl(
                     break;
                 }
 
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_unit(d->vcpu[local_sched.vcpuid]->sched_unit);
+                unit = d->vcpu[local_sched.vcpuid]->sched_unit;
+                lock = unit_schedule_lock_irqsave(unit, &flags);
+                svc = rt_unit(unit);
                 svc->period = period;
                 svc->budget = budget;
                 if ( local_sched.u.rtds.flags & XEN_DOMCTL_SCHEDRT_extra )
                     __set_bit(__RTDS_extratime, &svc->flags);
                 else
                     __clear_bit(__RTDS_extratime, &svc->flags);
-                spin_unlock_irqrestore(&prv->lock, flags);
+                unit_schedule_unlock_irqrestore(lock, flags, unit);
             }
             /* Process a most 64 vCPUs without checking for preemptions. */
             if ( (++index > 63) && hypercall_preempt_check() )
@@ -1472,22 +1871,55 @@ rt_dom_cntl(
     return rc;
 }
 
+static int cf_check
+rt_sys_cntl(const struct scheduler *ops, struct xen_sysctl_scheduler_op *sc)
+{
+    struct xen_sysctl_rtds_schedule *params = &sc->u.sched_rtds;
+    struct rt_private *prv = rt_priv(ops);
+    unsigned long flags;
+    int rc = 0;
+
+    switch ( sc->cmd )
+    {
+    case XEN_SYSCTL_SCHEDOP_putinfo:
+        if ( params->runqueue >= ARRAY_SIZE(opt_runqueue_str) )
+            return -EINVAL;
+
+        write_lock_irqsave(&prv->lock, flags);
+        /* CPUs are matched to runqueues when added: they all must be out. */
+        if ( !list_empty(&prv->rql) )
+            rc = -EBUSY;
+        else
+            prv->runqueue = params->runqueue;
+        write_unlock_irqrestore(&prv->lock, flags);
+        if ( rc )
+            return rc;
+        fallthrough;
+
+    case XEN_SYSCTL_SCHEDOP_getinfo:
+        params->runqueue = prv->runqueue;
+        break;
+    }
+
+    return 0;
+}
+
 /*
- * The replenishment timer handler picks units
- * from the replq and does the actual replenishment.
+ * The replenishment timer handler of a runqueue picks units
+ * from its replq and does the actual replenishment.
  */
 static void cf_check repl_timer_handler(void *data)
 {
     s_time_t now;
-    const struct scheduler *ops = data;
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
-    struct list_head *runq = rt_runq(ops);
+    struct rt_runqueue_data *rqd = data;
+    const struct scheduler *ops = rqd->ops;
+    struct list_head *replq = &rqd->replq;
+    struct list_head *runq = &rqd->runq;
     struct list_head *iter, *tmp;
     struct rt_unit *svc;
     LIST_HEAD(tmp_replq);
 
-    spin_lock_irq(&prv->lock);
+    spin_lock_irq(&rqd->lock);
 
     now = NOW();
 
@@ -1510,8 +1942,8 @@ static void cf_check repl_timer_handler(void *data)
 
         if ( unit_on_q(svc) )
         {
-            q_remove(svc);
-            runq_insert(ops, svc);
+            q_remove(rqd, svc);
+            runq_insert(rqd, svc);
         }
     }
 
@@ -1548,9 +1980,9 @@ static void cf_check repl_timer_handler(void *data)
      * the one in the front.
      */
     if ( !list_empty(replq) )
-        set_timer(&prv->repl_timer, replq_elem(replq->next)->cur_deadline);
+        set_timer(&rqd->repl_timer, replq_elem(replq->next)->cur_deadline);
 
-    spin_unlock_irq(&prv->lock);
+    spin_unlock_irq(&rqd->lock);
 }
 
 static const struct scheduler sched_rtds_def = {
@@ -1563,6 +1995,8 @@ static const struct scheduler sched_rtds_def = {
     .dump_settings  = rt_dump,
     .init           = rt_init,
     .deinit         = rt_deinit,
+    .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
     .switch_sched   = rt_switch_sched,
     .deinit_pdata   = rt_deinit_pdata,
     .alloc_domdata  = rt_alloc_domdata,
@@ -1573,6 +2007,7 @@ static const struct scheduler sched_rtds_def = {
     .remove_unit    = rt_unit_remove,
 
     .adjust         = rt_dom_cntl,
+    .adjust_global  = rt_sys_cntl,
 
     .pick_resource  = rt_res_pick,
     .do_schedule    = rt_schedule,
@@ -123,18 +123,21 @@ void cpu_raise_softirq_batch_begin(void)
     ++this_cpu(batching);
 }
 
+/* Batches may nest, the outermost one sending the IPIs. */
 void cpu_raise_softirq_batch_finish(void)
 {
     unsigned int cpu, this_cpu = smp_processor_id();
     cpumask_t *mask = &per_cpu(batch_mask, this_cpu);
 
     ASSERT(per_cpu(batching, this_cpu));
+    if ( --per_cpu(batching, this_cpu) )
+        return;
+
     for_each_cpu ( cpu, mask )
         if ( !softirq_pending(cpu) )
             __cpumask_clear_cpu(cpu, mask);
     smp_send_event_check_mask(mask);
     cpumask_clear(mask);
-    --per_cpu(batching, this_cpu);
 }
 
 void raise_softirq(unsigned int nr)
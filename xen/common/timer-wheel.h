@@ -0,0 +1,250 @@
+/******************************************************************************
+ * Hierarchical timer wheel.
+ *
+ * Timers which are not due for a while are kept in buckets of a wheel rather
+ * than on the timer heap, making setting and stopping them O(1).  Level 0 of
+ * the wheel has TIMER_WHEEL_SIZE buckets of 2^TIMER_WHEEL_SHIFT ns each, and
+ * every level above has buckets TIMER_WHEEL_LVL_SHIFT times as coarse; a timer
+ * goes to the lowest level which can hold it, i.e. the further away it expires
+ * the coarser its bucket.  Timers expiring before level 0 starts, or beyond
+ * the last level, are for the heap.
+ *
+ * Timers are never run from the wheel at the granularity of their bucket:
+ * once a bucket starts, its timers are taken off the wheel together, to be
+ * added again, to a lower level or to the heap, according to what is left
+ * until they expire.  Each timer hence keeps its exact expiry time, and is
+ * moved at most TIMER_WHEEL_LEVELS times, while most of those which get
+ * stopped or set again beforehand never reach the heap at all.
+ *
+ * Every bucket records the earliest expiry time of the timers added to it.
+ * This is not updated as timers are removed, so it may be earlier than any
+ * timer still in the bucket: this only means waking up early.
+ *
+ * The wheel only touches the expires, wheel_elem and wheel_level fields of
+ * a timer (an s_time_t, a struct list_head, and an unsigned int or narrower).
+ * struct timer must be complete, with at least those, where this is
+ * included: timer.c, and tools/tests/timer-wheel which checks and benchmarks
+ * the wheel against a copy of timer.c's heap.
+ */
+
+#ifndef __XEN_TIMER_WHEEL_H__
+#define __XEN_TIMER_WHEEL_H__
+
+#include <xen/list.h>
+
+#define TIMER_WHEEL_SHIFT      17   /* Level 0 buckets of 131us             */
+#define TIMER_WHEEL_LVL_SHIFT  3    /* Each level 8 times as coarse         */
+#define TIMER_WHEEL_LEVELS     4    /* Up to 4.2s ahead                     */
+#define TIMER_WHEEL_BITS       6
+#define TIMER_WHEEL_SIZE       (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK       (TIMER_WHEEL_SIZE - 1)
+
+struct timer_wheel_bucket {
+    struct list_head timers;
+    s_time_t first;                    /* Earliest expiry added since empty  */
+};
+
+struct timer_wheel {
+    s_time_t clk;                      /* Buckets up to this time are empty  */
+    s_time_t next;                     /* No timer expires before this       */
+    uint64_t pending[TIMER_WHEEL_LEVELS];  /* Non-empty buckets              */
+    struct timer_wheel_bucket bucket[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+static inline unsigned int timer_wheel_shift(unsigned int lvl)
+{
+    return TIMER_WHEEL_SHIFT + lvl * TIMER_WHEEL_LVL_SHIFT;
+}
+
+static inline void timer_wheel_init(struct timer_wheel *w)
+{
+    unsigned int lvl, i;
+
+    w->clk = 0;
+    w->next = STIME_MAX;
+
+    for ( lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++ )
+    {
+        w->pending[lvl] = 0;
+        for ( i = 0; i < TIMER_WHEEL_SIZE; i++ )
+        {
+            INIT_LIST_HEAD(&w->bucket[lvl][i].timers);
+            w->bucket[lvl][i].first = STIME_MAX;
+        }
+    }
+}
+
+static inline bool timer_wheel_empty(const struct timer_wheel *w)
+{
+    uint64_t pending = 0;
+    unsigned int lvl;
+
+    for ( lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++ )
+        pending |= w->pending[lvl];
+
+    return !pending;
+}
+
+/*
+ * Level of the wheel for a timer expiring at @expires, or -1 if it is for the
+ * heap.  A level only takes timers at least one of its buckets ahead of the
+ * wheel's clock, and less than all of its buckets but one: the bucket the
+ * clock is in is therefore always empty, and no two slots of time pending on
+ * the same level can share a bucket.
+ */
+static inline int timer_wheel_level(const struct timer_wheel *w,
+                                    s_time_t expires)
+{
+    s_time_t delta = expires - w->clk;
+    unsigned int lvl;
+
+    if ( delta < ((s_time_t)1 << TIMER_WHEEL_SHIFT) )
+        return -1;
+
+    for ( lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++ )
+        if ( delta < ((s_time_t)TIMER_WHEEL_MASK << timer_wheel_shift(lvl)) )
+            return lvl;
+
+    return -1;
+}
+
+static inline struct timer_wheel_bucket *
+timer_wheel_bucket(struct timer_wheel *w, const struct timer *t)
+{
+    unsigned int lvl = t->wheel_level;
+
+    return &w->bucket[lvl][(t->expires >> timer_wheel_shift(lvl)) &
+                           TIMER_WHEEL_MASK];
+}
+
+/* Add @t to level @lvl of @w. Return TRUE if new earliest timer. */
+static inline bool timer_wheel_add(struct timer_wheel *w, struct timer *t,
+                                   unsigned int lvl)
+{
+    struct timer_wheel_bucket *b;
+
+    t->wheel_level = lvl;
+    b = timer_wheel_bucket(w, t);
+
+    list_add_tail(&t->wheel_elem, &b->timers);
+    w->pending[lvl] |= 1ULL << (b - w->bucket[lvl]);
+
+    if ( t->expires < b->first )
+        b->first = t->expires;
+    if ( t->expires >= w->next )
+        return false;
+
+    w->next = t->expires;
+    return true;
+}
+
+static inline void timer_wheel_del(struct timer_wheel *w, struct timer *t)
+{
+    unsigned int lvl = t->wheel_level;
+    struct timer_wheel_bucket *b = timer_wheel_bucket(w, t);
+
+    list_del(&t->wheel_elem);
+
+    if ( list_empty(&b->timers) )
+    {
+        w->pending[lvl] &= ~(1ULL << (b - w->bucket[lvl]));
+        b->first = STIME_MAX;
+    }
+}
+
+/*
+ * Move the timers of all buckets which have started by @now onto @list, and
+ * advance the clock of @w to @now.  The caller is to add them again.
+ */
+static inline void timer_wheel_collect(struct timer_wheel *w, s_time_t now,
+                                       struct list_head *list)
+{
+    unsigned int lvl, i, n;
+
+    if ( now <= w->clk )
+        return;
+
+    for ( lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++ )
+    {
+        unsigned int shift = timer_wheel_shift(lvl);
+        s_time_t clk = w->clk >> shift;
+
+        if ( !w->pending[lvl] )
+            continue;
+
+        n = min((now >> shift) - clk, (s_time_t)TIMER_WHEEL_SIZE);
+
+        for ( i = 1; i <= n; i++ )
+        {
+            unsigned int idx = (clk + i) & TIMER_WHEEL_MASK;
+            struct timer_wheel_bucket *b = &w->bucket[lvl][idx];
+
+            if ( !(w->pending[lvl] & (1ULL << idx)) )
+                continue;
+
+            list_splice_init(&b->timers, list->prev);
+            w->pending[lvl] &= ~(1ULL << idx);
+            b->first = STIME_MAX;
+        }
+    }
+
+    w->clk = now;
+}
+
+/*
+ * Earliest time at which the wheel may need collecting.  Pending slots of
+ * each level follow the clock's, so the first pending bucket after it holds
+ * the earliest timers of the level.
+ */
+static inline s_time_t timer_wheel_next(struct timer_wheel *w)
+{
+    s_time_t next = STIME_MAX;
+    unsigned int lvl;
+
+    for ( lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++ )
+    {
+        uint64_t pending = w->pending[lvl];
+        unsigned int start, idx;
+
+        if ( !pending )
+            continue;
+
+        start = ((w->clk >> timer_wheel_shift(lvl)) + 1) & TIMER_WHEEL_MASK;
+        if ( start )
+            pending = (pending >> start) |
+                      (pending << (TIMER_WHEEL_SIZE - start));
+        idx = (start + ffs64(pending) - 1) & TIMER_WHEEL_MASK;
+
+        if ( w->bucket[lvl][idx].first < next )
+            next = w->bucket[lvl][idx].first;
+    }
+
+    w->next = next;
+    return next;
+}
+
+/* Any timer on @w, or NULL if empty. */
+static inline struct timer *timer_wheel_any(const struct timer_wheel *w)
+{
+    unsigned int lvl;
+
+    for ( lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++ )
+        if ( w->pending[lvl] )
+            return list_first_entry(
+                &w->bucket[lvl][ffs64(w->pending[lvl]) - 1].timers,
+                struct timer, wheel_elem);
+
+    return NULL;
+}
+
+#endif /* __XEN_TIMER_WHEEL_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
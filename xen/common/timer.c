@@ -25,16 +25,23 @@
 #include <asm/system.h>
 #include <asm/atomic.h>
 
+#include "timer-wheel.h"
+
 /* We program the time hardware this far behind the closest deadline. */
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Keep timers which are not due for a while on the timer wheel. */
+static bool __read_mostly opt_timer_wheel = true;
+boolean_param("timer_wheel", opt_timer_wheel);
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
     struct timer  *running;
     struct list_head inactive;
+    struct timer_wheel wheel;
 } __cacheline_aligned;
 
 static DEFINE_PER_CPU(struct timers, timers);
@@ -193,6 +200,11 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        /* The wheel's deadline is left as is: waking up early is harmless. */
+        timer_wheel_del(&timers->wheel, t);
+        rc = 0;
+        break;
     default:
         rc = 0;
         BUG();
@@ -209,6 +221,26 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    /* Timers which are not due for a while go on the wheel. */
+    if ( opt_timer_wheel )
+    {
+        int lvl;
+
+        /* An empty wheel can be brought up to date. */
+        if ( timer_wheel_empty(&timers->wheel) )
+            timers->wheel.clk = max(timers->wheel.clk, NOW());
+
+        lvl = timer_wheel_level(&timers->wheel, t->expires);
+        if ( lvl >= 0 )
+        {
+            perfc_incr(timer_wheel);
+            t->status = TIMER_STATUS_in_wheel;
+            return timer_wheel_add(&timers->wheel, t, lvl);
+        }
+    }
+
+    perfc_incr(timer_heap);
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -463,6 +495,7 @@ static void cf_check timer_softirq_action(void)
     struct timer  *t, **heap, *next;
     struct timers *ts;
     s_time_t       now, deadline;
+    LIST_HEAD(cascade);
 
     ts = &this_cpu(timers);
     heap = ts->heap;
@@ -499,6 +532,17 @@ static void cf_check timer_softirq_action(void)
 
     now = NOW();
 
+    /* Move timers off wheel buckets which have started, closer to the heap. */
+    timer_wheel_collect(&ts->wheel, now, &cascade);
+    while ( !list_empty(&cascade) )
+    {
+        t = list_first_entry(&cascade, struct timer, wheel_elem);
+        list_del(&t->wheel_elem);
+        t->status = TIMER_STATUS_invalid;
+        add_entry(t);
+        perfc_incr(timer_wheel_cascade);
+    }
+
     /* Execute ready heap timers. */
     while ( (heap_metadata(heap)->size != 0) &&
             ((t = heap[1])->expires < now) )
@@ -524,9 +568,9 @@ static void cf_check timer_softirq_action(void)
         add_entry(t);
     }
 
-    /* Find earliest deadline from head of linked list and top of heap. */
-    deadline = STIME_MAX;
-    if ( heap_metadata(heap)->size != 0 )
+    /* Find earliest deadline from head of linked list, heap and wheel. */
+    deadline = timer_wheel_next(&ts->wheel);
+    if ( (heap_metadata(heap)->size != 0) && (heap[1]->expires < deadline) )
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
@@ -560,7 +604,7 @@ static void cf_check dump_timerq(unsigned char key)
     struct timers *ts;
     unsigned long  flags;
     s_time_t       now = NOW();
-    unsigned int   i, j;
+    unsigned int   i, j, l;
 
     printk("Dumping timer queues:\n");
 
@@ -574,10 +618,25 @@ static void cf_check dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list; t != NULL; t = t->list_next )
             dump_timer(t, now);
+        for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+            for ( j = 0; j < TIMER_WHEEL_SIZE; j++ )
+                list_for_each_entry ( t, &ts->wheel.bucket[l][j].timers,
+                                      wheel_elem )
+                    dump_timer(t, now);
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
 
+/* Any active timer of @ts, or NULL if there are none. */
+static struct timer *first_entry(struct timers *ts)
+{
+    if ( heap_metadata(ts->heap)->size )
+        return ts->heap[1];
+    if ( ts->list )
+        return ts->list;
+    return timer_wheel_any(&ts->wheel);
+}
+
 static void migrate_timers_from_cpu(unsigned int old_cpu)
 {
     unsigned int new_cpu = cpumask_any(&cpu_online_map);
@@ -601,8 +660,7 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
-    while ( (t = heap_metadata(old_ts->heap)->size
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+    while ( (t = first_entry(old_ts)) != NULL )
     {
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
@@ -636,6 +694,7 @@ static void free_percpu_timers(unsigned int cpu)
     struct timers *ts = &per_cpu(timers, cpu);
 
     ASSERT(heap_metadata(ts->heap)->size == 0);
+    ASSERT(timer_wheel_empty(&ts->wheel));
     if ( heap_metadata(ts->heap)->limit )
     {
         xfree(ts->heap);
@@ -660,6 +719,7 @@ static int cf_check cpu_callback(
             INIT_LIST_HEAD(&ts->inactive);
             spin_lock_init(&ts->lock);
             ts->heap = dummy_heap;
+            timer_wheel_init(&ts->wheel);
         }
         break;
 
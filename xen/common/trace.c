@@ -30,8 +30,8 @@
 #include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <xen/sections.h>
-#include <xen/cpu.h>
 #include <asm/atomic.h>
+#include <asm/hardirq.h>
 #include <public/sysctl.h>
 
 #ifdef CONFIG_COMPAT
@@ -54,17 +54,48 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
-static u32 data_size __read_mostly;
+/* MFNs of the pages of the buffer, within t_info. */
+static DEFINE_PER_CPU_READ_MOSTLY(const uint32_t *, t_mfns);
+static DEFINE_PER_CPU_READ_MOSTLY(unsigned int, t_nr_pages);
+static DEFINE_PER_CPU_READ_MOSTLY(uint32_t, data_size);
 
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
-static u32 t_buf_highwater;
+static DEFINE_PER_CPU_READ_MOSTLY(uint32_t, t_buf_highwater);
+
+/*
+ * Offset up to which space has been claimed by writers.  Ahead of prod while
+ * records are being written.
+ */
+static DEFINE_PER_CPU(uint32_t, t_reserve);
+
+/* Number of trace() calls in progress, > 1 if one was interrupted. */
+static DEFINE_PER_CPU(unsigned int, t_nesting);
+
+/*
+ * MFNs of all pages ever allocated for the buffer of each cpu.  Pages are
+ * never freed, as consumers may still have them mapped, but reused when
+ * resizing.
+ */
+static struct {
+    uint32_t *mfns;
+    unsigned int nr;
+} *t_pools;
 
 /* Number of records lost due to per-CPU trace buffer being full. */
 static DEFINE_PER_CPU(unsigned long, lost_records);
 static DEFINE_PER_CPU(unsigned long, lost_records_first_tsc);
 
+/*
+ * Bogus prod and cons found by a writer in NMI context, where printk() could
+ * deadlock on the console lock.  Reported by the next tb_control() call.
+ */
+struct t_bogus {
+    uint32_t prod, cons;
+    bool found;
+};
+static DEFINE_PER_CPU(struct t_bogus, t_bogus);
+
 /* a flag recording whether initialization has been done */
 /* or more properly, if the tbuf subsystem is enabled right now */
 bool __read_mostly tb_init_done;
@@ -75,21 +106,6 @@ static cpumask_t tb_cpu_mask;
 /* which tracing events are enabled */
 static u32 tb_event_mask = TRC_ALL;
 
-static int cf_check cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     return DIV_ROUND_UP(offsetof(struct t_info, mfn_offset[NR_CPUS]),
@@ -101,9 +117,9 @@ static uint32_t calc_tinfo_first_offset(void)
  * in the currently sized struct t_info and allows prod and cons to
  * reach double the value without overflow.
  * The t_info layout is fixed and cant be changed without breaking xentrace.
- * Initialize t_info_pages based on number of trace pages.
  */
-static int calculate_tbuf_size(unsigned int pages, uint16_t t_info_first_offset)
+static unsigned int calculate_tbuf_size(unsigned int pages,
+                                        uint16_t t_info_first_offset)
 {
     struct t_buf dummy_size;
     typeof(dummy_size.prod) max_size;
@@ -111,7 +127,6 @@ static int calculate_tbuf_size(unsigned int pages, uint16_t t_info_first_offset)
     typeof(dummy_pages.tbuf_size) max_pages;
     typeof(dummy_pages.mfn_offset[0]) max_mfn_offset;
     unsigned int max_cpus = nr_cpu_ids;
-    unsigned int t_info_words;
 
     /* force maximum value for an unsigned type */
     max_size = -1;
@@ -125,16 +140,17 @@ static int calculate_tbuf_size(unsigned int pages, uint16_t t_info_first_offset)
         max_pages = max_size;
 
     /*
-     * max mfn_offset holds up to n pages per cpu
-     * The array of mfns for the highest cpu can start at the maximum value
-     * mfn_offset can hold. So reduce the number of cpus and also the mfn_offset.
+     * max mfn_offset holds up to n pages per cpu, plus the word holding the
+     * size of its buffer.  The array of mfns for the highest cpu can start
+     * at the maximum value mfn_offset can hold. So reduce the number of cpus
+     * and also the mfn_offset.
      */
-    max_mfn_offset -= t_info_first_offset;
+    max_mfn_offset -= t_info_first_offset + 1;
     max_cpus--;
     if ( max_cpus )
         max_mfn_offset /= max_cpus;
-    if ( max_mfn_offset < max_pages )
-        max_pages = max_mfn_offset;
+    if ( max_mfn_offset - 1 < max_pages )
+        max_pages = max_mfn_offset - 1;
 
     if ( pages > max_pages )
     {
@@ -144,163 +160,253 @@ static int calculate_tbuf_size(unsigned int pages, uint16_t t_info_first_offset)
         pages = max_pages;
     }
 
-    /*
-     * NB this calculation is correct, because t_info_first_offset is
-     * in words, not bytes
-     */
-    t_info_words = nr_cpu_ids * pages + t_info_first_offset;
-    t_info_pages = PFN_UP(t_info_words * sizeof(uint32_t));
-    printk(XENLOG_INFO "xentrace: requesting %u t_info pages "
-           "for %u trace pages on %u cpus\n",
-           t_info_pages, pages, nr_cpu_ids);
     return pages;
 }
 
+/*
+ * Wait for trace() calls in progress to complete on all CPUs.  tb_init_done
+ * needs to be clear, so no new ones start.
+ *
+ * Writers don't use barriers, for the sake of speed.  Interrupting each CPU
+ * guarantees that a writer has either observed tb_init_done being clear
+ * before writing anything, or is visible in t_nesting.
+ */
+static void cf_check trace_sync(void *unused)
+{
+    smp_mb();
+}
+
+static void trace_quiesce(void)
+{
+    unsigned int cpu;
+
+    ASSERT(!tb_init_done);
+
+    smp_mb();
+    on_selected_cpus(&cpu_online_map, trace_sync, NULL, 1);
+
+    for_each_online_cpu ( cpu )
+        while ( read_atomic(&per_cpu(t_nesting, cpu)) )
+            cpu_relax();
+}
+
+/*
+ * Make sure the pool of the cpu holds at least the given number of pages.
+ */
+static int grow_pool(unsigned int cpu, unsigned int pages)
+{
+    uint32_t *mfns;
+
+    if ( t_pools[cpu].nr >= pages )
+        return 0;
+
+    mfns = xmalloc_array(uint32_t, pages);
+    if ( !mfns )
+        return -ENOMEM;
+    if ( t_pools[cpu].nr )
+        memcpy(mfns, t_pools[cpu].mfns, t_pools[cpu].nr * sizeof(*mfns));
+    xfree(t_pools[cpu].mfns);
+    t_pools[cpu].mfns = mfns;
+
+    while ( t_pools[cpu].nr < pages )
+    {
+        void *p = alloc_xenheap_pages(0, MEMF_bits(32 + PAGE_SHIFT));
+
+        if ( !p )
+        {
+            printk(XENLOG_INFO "xentrace: memory allocation failed "
+                   "on cpu %u after %u pages\n", cpu, t_pools[cpu].nr);
+            return -ENOMEM;
+        }
+
+        share_xen_page_with_privileged_guests(virt_to_page(p), SHARE_rw);
+        mfns[t_pools[cpu].nr++] = virt_to_mfn(p);
+    }
+
+    return 0;
+}
+
 /**
- * alloc_trace_bufs - performs initialization of the per-cpu trace buffers.
+ * resize_trace_bufs - (re)allocate the per-cpu trace buffers.
+ * @pages: new size of the buffer of each cpu, in pages, 0 for no buffer.
  *
  * This function is called at start of day in order to initialize the per-cpu
  * trace buffers.  The trace buffers are then available for debugging use, via
  * the %TRACE_xD macros exported in <xen/trace.h>.
  *
- * This function may also be called later when enabling trace buffers
- * via the SET_SIZE hypercall.
+ * This function may also be called later when sizing trace buffers via the
+ * SET_SIZE and SET_CPU_SIZE hypercalls, with tracing disabled.  The contents
+ * of all buffers are discarded.
  */
-static int alloc_trace_bufs(unsigned int pages)
+static int resize_trace_bufs(const unsigned int *pages)
 {
-    int i, cpu;
-    /* Start after a fixed-size array of NR_CPUS */
+    uint16_t t_info_first_offset = calc_tinfo_first_offset();
+    unsigned int cpu, i, words, nr_pages, common = 0;
     uint32_t *t_info_mfn_list;
-    uint16_t t_info_first_offset;
-    uint16_t offset;
-
-    if ( t_info )
-        return -EBUSY;
-
-    if ( pages == 0 )
-        return -EINVAL;
+    int rc;
 
-    /* Calculate offset in units of u32 of first mfn */
-    t_info_first_offset = calc_tinfo_first_offset();
+    ASSERT(!tb_init_done);
 
-    pages = calculate_tbuf_size(pages, t_info_first_offset);
+    if ( !t_pools )
+    {
+        t_pools = xzalloc_array(typeof(*t_pools), nr_cpu_ids);
+        if ( !t_pools )
+            return -ENOMEM;
+    }
 
-    t_info = alloc_xenheap_pages(get_order_from_pages(t_info_pages), 0);
-    if ( t_info == NULL )
-        goto out_fail;
+    /* Lay out t_info, with the size of each buffer ahead of its mfns. */
+    words = t_info_first_offset;
+    for_each_online_cpu ( cpu )
+    {
+        if ( !pages[cpu] )
+            continue;
 
-    memset(t_info, 0, t_info_pages*PAGE_SIZE);
+        if ( words + 1 > (typeof(t_info->mfn_offset[0]))-1 )
+            return -E2BIG;
+        words += 1 + pages[cpu];
 
-    t_info_mfn_list = (uint32_t *)t_info;
+        if ( !common )
+            common = pages[cpu];
+        else if ( common != pages[cpu] )
+            common = -1;
+    }
 
-    t_info->tbuf_size = pages;
+    if ( words == t_info_first_offset )
+        return -EINVAL;
 
-    /*
-     * Allocate buffers for all of the cpus.
-     * If any fails, deallocate what you have so far and exit.
-     */
-    for_each_online_cpu(cpu)
+    for_each_online_cpu ( cpu )
     {
-        offset = t_info_first_offset + (cpu * pages);
-        t_info->mfn_offset[cpu] = offset;
-
-        for ( i = 0; i < pages; i++ )
+        rc = grow_pool(cpu, pages[cpu]);
+        if ( rc )
         {
-            void *p = alloc_xenheap_pages(0, MEMF_bits(32 + PAGE_SHIFT));
-            if ( !p )
-            {
-                printk(XENLOG_INFO "xentrace: memory allocation failed "
-                       "on cpu %d after %d pages\n", cpu, i);
-                t_info_mfn_list[offset + i] = 0;
-                goto out_dealloc;
-            }
-            t_info_mfn_list[offset + i] = virt_to_mfn(p);
+            printk(XENLOG_WARNING "xentrace: allocation failed!\n");
+            return rc;
         }
     }
 
-    /*
-     * Initialize buffers for all of the cpus.
-     */
-    for_each_online_cpu(cpu)
+    nr_pages = PFN_UP(words * sizeof(uint32_t));
+    if ( nr_pages > t_info_pages )
     {
-        struct t_buf *buf;
+        /*
+         * The old t_info isn't freed, as consumers may still have it mapped,
+         * just as the pages of the buffers.
+         */
+        struct t_info *new = alloc_xenheap_pages(
+            get_order_from_pages(nr_pages), 0);
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
+        if ( !new )
+        {
+            printk(XENLOG_WARNING "xentrace: allocation failed!\n");
+            return -ENOMEM;
+        }
 
-        offset = t_info->mfn_offset[cpu];
+        nr_pages = 1U << get_order_from_pages(nr_pages);
+        for ( i = 0; i < nr_pages; i++ )
+            share_xen_page_with_privileged_guests(virt_to_page(new) + i,
+                                                  SHARE_ro);
 
-        /* Initialize the buffer metadata */
-        per_cpu(t_bufs, cpu) = buf = mfn_to_virt(t_info_mfn_list[offset]);
-        buf->cons = buf->prod = 0;
+        printk(XENLOG_INFO "xentrace: using %u t_info pages "
+               "for %u words on %u cpus\n",
+               nr_pages, words, num_online_cpus());
 
-        printk(XENLOG_INFO "xentrace: p%d mfn %x offset %u\n",
-                   cpu, t_info_mfn_list[offset], offset);
+        /* Writers may still be reading the old t_info. */
+        if ( t_info )
+            trace_quiesce();
 
-        /* Now share the trace pages */
-        for ( i = 0; i < pages; i++ )
-            share_xen_page_with_privileged_guests(
-                mfn_to_page(_mfn(t_info_mfn_list[offset + i])), SHARE_rw);
+        t_info = new;
+        t_info_pages = nr_pages;
     }
+    else if ( t_info )
+        trace_quiesce();
 
-    /* Finally, share the t_info page */
-    for(i = 0; i < t_info_pages; i++)
-        share_xen_page_with_privileged_guests(
-            virt_to_page(t_info) + i, SHARE_ro);
-
-    data_size  = (pages * PAGE_SIZE - sizeof(struct t_buf));
-    t_buf_highwater = data_size >> 1; /* 50% high water */
-    opt_tbuf_size = pages;
-
-    printk("xentrace: initialised\n");
-    smp_wmb(); /* above must be visible before tb_init_done flag set */
-    tb_init_done = 1;
+    memset(t_info, 0, t_info_pages * PAGE_SIZE);
+    t_info_mfn_list = (uint32_t *)t_info;
 
-    return 0;
+    t_info->tbuf_size = common != -1 ? common : 0;
 
-out_dealloc:
-    for_each_online_cpu(cpu)
+    words = t_info_first_offset;
+    for_each_online_cpu ( cpu )
     {
-        offset = t_info->mfn_offset[cpu];
-        if ( !offset )
-            continue;
-        for ( i = 0; i < pages; i++ )
+        struct t_buf *buf = NULL;
+
+        if ( pages[cpu] )
         {
-            uint32_t mfn = t_info_mfn_list[offset + i];
-            if ( !mfn )
-                break;
-            ASSERT(!(mfn_to_page(_mfn(mfn))->count_info & PGC_allocated));
-            free_xenheap_pages(mfn_to_virt(mfn), 0);
+            t_info_mfn_list[words] = pages[cpu];
+            t_info->mfn_offset[cpu] = ++words;
+            memcpy(&t_info_mfn_list[words], t_pools[cpu].mfns,
+                   pages[cpu] * sizeof(uint32_t));
+            words += pages[cpu];
+
+            buf = mfn_to_virt(t_pools[cpu].mfns[0]);
+            buf->cons = buf->prod = 0;
+
+            per_cpu(t_mfns, cpu) = &t_info_mfn_list[t_info->mfn_offset[cpu]];
+            per_cpu(t_nr_pages, cpu) = pages[cpu];
+            per_cpu(data_size, cpu) =
+                pages[cpu] * PAGE_SIZE - sizeof(struct t_buf);
+            /* 50% high water */
+            per_cpu(t_buf_highwater, cpu) = per_cpu(data_size, cpu) >> 1;
+            per_cpu(t_reserve, cpu) = 0;
+            per_cpu(lost_records, cpu) = 0;
+
+            printk(XENLOG_INFO "xentrace: p%u mfn %x offset %u pages %u\n",
+                   cpu, t_info_mfn_list[words - pages[cpu]],
+                   t_info->mfn_offset[cpu], pages[cpu]);
         }
+
+        per_cpu(t_bufs, cpu) = buf;
     }
-    free_xenheap_pages(t_info, get_order_from_pages(t_info_pages));
-    t_info = NULL;
-out_fail:
-    printk(XENLOG_WARNING "xentrace: allocation failed! Tracing disabled.\n");
-    return -ENOMEM;
-}
 
+    opt_tbuf_size = common != -1 ? common : 0;
+
+    return 0;
+}
 
 /**
  * tb_set_size - handle the logic involved with dynamically allocating tbufs
  *
- * This function is called when the SET_SIZE hypercall is done.
+ * This function is called when the SET_SIZE and SET_CPU_SIZE hypercalls are
+ * done, and sets the size of the buffers of the cpus in @mask.
  */
-static int tb_set_size(unsigned int pages)
+static int tb_set_size(const cpumask_t *mask, unsigned int pages)
 {
-    /*
-     * Setting size is a one-shot operation. It can be done either at
-     * boot time or via control tools, but not by both. Once buffers
-     * are created they cannot be destroyed.
-     */
-    if ( opt_tbuf_size && pages != opt_tbuf_size )
-    {
-        printk(XENLOG_INFO "xentrace: tb_set_size from %d to %d "
-               "not implemented\n",
-               opt_tbuf_size, pages);
+    unsigned int *new_pages, cpu;
+    bool changed = false;
+    int rc;
+
+    if ( pages == 0 )
         return -EINVAL;
+
+    pages = calculate_tbuf_size(pages, calc_tinfo_first_offset());
+
+    new_pages = xzalloc_array(unsigned int, nr_cpu_ids);
+    if ( !new_pages )
+        return -ENOMEM;
+
+    for_each_online_cpu ( cpu )
+    {
+        new_pages[cpu] = per_cpu(t_bufs, cpu) ? per_cpu(t_nr_pages, cpu) : 0;
+        if ( cpumask_test_cpu(cpu, mask) && new_pages[cpu] != pages )
+        {
+            new_pages[cpu] = pages;
+            changed = true;
+        }
     }
 
-    return alloc_trace_bufs(pages);
+    /*
+     * Buffers can only be resized while tracing is disabled.  Setting the
+     * current size again is fine at any time.
+     */
+    if ( !changed )
+        rc = 0;
+    else if ( tb_init_done )
+        rc = -EBUSY;
+    else
+        rc = resize_trace_bufs(new_pages);
+
+    xfree(new_pages);
+
+    return rc;
 }
 
 int trace_will_trace_event(u32 event)
@@ -339,11 +445,10 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
-        if ( alloc_trace_bufs(opt_tbuf_size) )
+        if ( tb_set_size(&cpu_online_map, opt_tbuf_size) )
         {
             printk("xentrace: allocation size %d failed, disabling\n",
                    opt_tbuf_size);
@@ -359,6 +464,24 @@ void __init init_trace_bufs(void)
     }
 }
 
+/* Report bogus prod and cons found in NMI context. */
+static void report_bogus(void)
+{
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( !ACCESS_ONCE(per_cpu(t_bogus, cpu).found) )
+            continue;
+
+        smp_rmb();
+        printk(XENLOG_WARNING
+               "trc#%u: bogus prod (%08x) and/or cons (%08x) in NMI\n",
+               cpu, per_cpu(t_bogus, cpu).prod, per_cpu(t_bogus, cpu).cons);
+        ACCESS_ONCE(per_cpu(t_bogus, cpu).found) = false;
+    }
+}
+
 /**
  * tb_control - sysctl operations on trace buffers.
  * @tbc: a pointer to a struct xen_sysctl_tbuf_op to be filled out
@@ -370,6 +493,8 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
 
     spin_lock(&lock);
 
+    report_bogus();
+
     switch ( tbc->cmd )
     {
     case XEN_SYSCTL_TBUFOP_get_info:
@@ -393,11 +518,29 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
         tb_event_mask = tbc->evt_mask;
         break;
     case XEN_SYSCTL_TBUFOP_set_size:
-        rc = tb_set_size(tbc->size);
+        rc = tb_set_size(&cpu_online_map, tbc->size);
+        break;
+    case XEN_SYSCTL_TBUFOP_set_cpu_size:
+    {
+        cpumask_var_t mask;
+
+        if ( !t_info )
+        {
+            rc = -EINVAL;
+            break;
+        }
+
+        rc = xenctl_bitmap_to_cpumask(&mask, &tbc->cpu_mask);
+        if ( !rc )
+        {
+            rc = tb_set_size(mask, tbc->size);
+            free_cpumask_var(mask);
+        }
+    }
         break;
     case XEN_SYSCTL_TBUFOP_enable:
         /* Enable trace buffers. Check buffers are already allocated. */
-        if ( opt_tbuf_size == 0 )
+        if ( !t_info )
             rc = -EINVAL;
         else
             tb_init_done = 1;
@@ -408,19 +551,28 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
          * Disable trace buffers. Just stops new records from being written,
          * does not deallocate any memory.
          */
-        int i;
+        unsigned int i;
+
+        if ( !tb_init_done )
+            break;
 
         tb_init_done = 0;
-        smp_wmb();
-        /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
-        for_each_online_cpu(i)
+        trace_quiesce();
+
+        /*
+         * After this hypercall returns, no more records should be placed
+         * into the buffers.  Publish records a writer interrupted just while
+         * publishing its own may have left behind, and clear any lost-record
+         * info so we don't get phantom lost records next time we start
+         * tracing.
+         */
+        for_each_online_cpu ( i )
         {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
+            struct t_buf *buf = per_cpu(t_bufs, i);
+
+            if ( buf )
+                buf->prod = per_cpu(t_reserve, i);
+            per_cpu(lost_records, i) = 0;
         }
     }
         break;
@@ -444,29 +596,33 @@ static inline unsigned int calc_rec_size(bool cycles, unsigned int extra)
     return rec_size;
 }
 
-static inline bool bogus(u32 prod, u32 cons)
+static inline bool bogus(uint32_t prod, uint32_t cons, uint32_t data_size)
 {
     if ( unlikely(prod & 3) || unlikely(prod >= 2 * data_size) ||
          unlikely(cons & 3) || unlikely(cons >= 2 * data_size) )
     {
         tb_init_done = 0;
-        printk(XENLOG_WARNING "trc#%u: bogus prod (%08x) and/or cons (%08x)\n",
-               smp_processor_id(), prod, cons);
+        if ( !in_nmi_handler() )
+            printk(XENLOG_WARNING
+                   "trc#%u: bogus prod (%08x) and/or cons (%08x)\n",
+                   smp_processor_id(), prod, cons);
+        else if ( !this_cpu(t_bogus).found )
+        {
+            this_cpu(t_bogus).prod = prod;
+            this_cpu(t_bogus).cons = cons;
+            smp_wmb();
+            ACCESS_ONCE(this_cpu(t_bogus).found) = true;
+        }
         return 1;
     }
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline uint32_t calc_unconsumed_bytes(uint32_t prod, uint32_t cons,
+                                             uint32_t data_size)
 {
-    uint32_t prod = buf->prod, cons = buf->cons;
-    int32_t x;
-
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return data_size;
+    int32_t x = prod - cons;
 
-    x = prod - cons;
     if ( x < 0 )
         x += 2*data_size;
 
@@ -476,16 +632,10 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline uint32_t calc_bytes_to_wrap(uint32_t prod, uint32_t data_size)
 {
-    uint32_t prod = buf->prod, cons = buf->cons;
-    int32_t x;
+    int32_t x = data_size - prod;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return 0;
-
-    x = data_size - prod;
     if ( x <= 0 )
         x += data_size;
 
@@ -495,90 +645,53 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
+static inline uint32_t calc_bytes_avail(uint32_t prod, uint32_t cons,
+                                        uint32_t data_size)
 {
-    return data_size - calc_unconsumed_bytes(buf);
-}
-
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
-                                 unsigned char **next_page,
-                                 uint32_t *offset_in_page)
-{
-    u32 x = buf->prod, cons = buf->cons;
-    uint16_t per_cpu_mfn_offset;
-    uint32_t per_cpu_mfn_nr;
-    uint32_t *mfn_list;
-    uint32_t mfn;
-    unsigned char *this_page;
-
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
-    if ( !tb_init_done || bogus(x, cons) )
-        return NULL;
-
-    if ( x >= data_size )
-        x -= data_size;
-
-    ASSERT(x < data_size);
-
-    /* add leading header to get total offset of next record */
-    x += sizeof(struct t_buf);
-    *offset_in_page = x & ~PAGE_MASK;
-
-    /* offset into array of mfns */
-    per_cpu_mfn_nr = x >> PAGE_SHIFT;
-    per_cpu_mfn_offset = t_info->mfn_offset[smp_processor_id()];
-    mfn_list = (uint32_t *)t_info;
-    mfn = mfn_list[per_cpu_mfn_offset + per_cpu_mfn_nr];
-    this_page = mfn_to_virt(mfn);
-    if (per_cpu_mfn_nr + 1 >= opt_tbuf_size)
-    {
-        /* reached end of buffer? */
-        *next_page = NULL;
-    }
-    else
-    {
-        mfn = mfn_list[per_cpu_mfn_offset + per_cpu_mfn_nr + 1];
-        *next_page = mfn_to_virt(mfn);
-    }
-    return this_page;
+    return data_size - calc_unconsumed_bytes(prod, cons, data_size);
 }
 
-static inline void __insert_record(struct t_buf *buf,
-                                   unsigned long event,
-                                   unsigned int extra,
-                                   bool cycles,
-                                   unsigned int rec_size,
-                                   const void *extra_data)
+/*
+ * Write a record at offset *pos of the buffer of the current cpu, which the
+ * caller has claimed the space for, and advance *pos past it.
+ */
+static void __insert_record(uint32_t *pos,
+                            unsigned long event,
+                            unsigned int extra,
+                            bool cycles,
+                            unsigned int rec_size,
+                            const void *extra_data)
 {
     struct t_rec split_rec, *rec;
     uint32_t *dst;
-    unsigned char *this_page, *next_page;
+    unsigned char *this_page, *next_page = NULL;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
-    uint32_t offset;
-    uint32_t remaining;
+    const uint32_t *mfns = this_cpu(t_mfns);
+    uint32_t data_size = this_cpu(data_size);
+    uint32_t x = *pos, page_nr, offset, remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
-    if ( !this_page )
-        return;
+    if ( x >= data_size )
+        x -= data_size;
+
+    ASSERT(x < data_size);
+
+    /* add leading header to get total offset of next record */
+    x += sizeof(struct t_buf);
+    offset = x & ~PAGE_MASK;
+    page_nr = x >> PAGE_SHIFT;
+    this_page = mfn_to_virt(mfns[page_nr]);
 
     remaining = PAGE_SIZE - offset;
 
     if ( unlikely(rec_size > remaining) )
     {
-        if ( next_page == NULL )
-        {
-            /* access beyond end of buffer */
-            printk(XENLOG_WARNING
-                   "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
-                   __func__, data_size, next, buf->cons, rec_size, remaining);
-            return;
-        }
+        /* Wrap records keep records from crossing the end of the buffer. */
+        ASSERT(page_nr + 1 < this_cpu(t_nr_pages));
+        next_page = mfn_to_virt(mfns[page_nr + 1]);
         rec = &split_rec;
     } else {
         rec = (struct t_rec*)(this_page + offset);
@@ -604,19 +717,16 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
 
-    smp_wmb();
-
-    next += rec_size;
-    if ( next >= 2*data_size )
-        next -= 2*data_size;
-    ASSERT(next < 2*data_size);
-    buf->prod = next;
+    x = *pos + rec_size;
+    if ( x >= 2*data_size )
+        x -= 2*data_size;
+    ASSERT(x < 2*data_size);
+    *pos = x;
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
-                                      unsigned int size)
+static inline void insert_wrap_record(uint32_t *pos, unsigned int size)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
+    u32 space_left = calc_bytes_to_wrap(*pos, this_cpu(data_size));
     unsigned int extra_space = space_left - sizeof(u32);
     bool cycles = false;
 
@@ -630,13 +740,14 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+    __insert_record(pos, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
                     space_left, NULL);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline void insert_lost_records(uint32_t *pos, unsigned long lost,
+                                       uint64_t first_tsc)
 {
     struct __packed {
         u32 lost_records;
@@ -646,15 +757,45 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
-    ed.first_tsc = this_cpu(lost_records_first_tsc);
+    ed.lost_records = lost;
+    ed.first_tsc = first_tsc;
 
-    this_cpu(lost_records) = 0;
-
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+    __insert_record(pos, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
                     LOST_REC_SIZE, &ed);
 }
 
+/*
+ * Space needed for a record of rec_size octets at offset pos, including a
+ * lost records record if lost, and wrap records as required.
+ */
+static unsigned int calc_total_size(uint32_t pos, uint32_t data_size,
+                                    unsigned int rec_size, bool lost)
+{
+    unsigned int bytes_to_wrap = calc_bytes_to_wrap(pos, data_size);
+    unsigned int total_size = 0;
+
+    /* First, check to see if we need to include a lost_record. */
+    if ( lost )
+    {
+        if ( LOST_REC_SIZE > bytes_to_wrap )
+        {
+            total_size += bytes_to_wrap;
+            bytes_to_wrap = data_size;
+        }
+        total_size += LOST_REC_SIZE;
+        bytes_to_wrap -= LOST_REC_SIZE;
+
+        /* LOST_REC might line up perfectly with the buffer wrap */
+        if ( bytes_to_wrap == 0 )
+            bytes_to_wrap = data_size;
+    }
+
+    if ( rec_size > bytes_to_wrap )
+        total_size += bytes_to_wrap;
+
+    return total_size + rec_size;
+}
+
 /*
  * Notification is performed in qtasklet to avoid deadlocks with contexts
  * which __trace_var() may be called from (e.g., scheduler critical regions).
@@ -673,14 +814,21 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
  * @extra_data: pointer to additional trace data
  *
  * Logs a trace record into the appropriate buffer.
+ *
+ * Records are written without locking, and may be written from any context,
+ * including NMI handlers.  Only the current cpu writes to its buffer, so
+ * writers only need to claim space atomically with respect to writers
+ * interrupting them.  The outermost writer publishes the records of all of
+ * them once they are complete.
  */
 void trace(uint32_t event, unsigned int extra, const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
-    u32 bytes_to_tail, bytes_to_wrap;
+    uint32_t data_size, reserve, next, cons;
     unsigned int rec_size, total_size;
-    bool started_below_highwater;
+    unsigned long lost = 0;
+    uint64_t lost_first_tsc = 0;
+    bool notify = false;
     bool cycles = event & TRC_HD_CYCLE_FLAG;
 
     if( !tb_init_done )
@@ -712,99 +860,105 @@ void trace(uint32_t event, unsigned int extra, const void *extra_data)
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return;
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
+    /*
+     * Writers interrupting us leave t_nesting as they found it, so this
+     * doesn't need to be atomic.  See trace_quiesce() for the ordering
+     * against tb_init_done.
+     */
+    this_cpu(t_nesting)++;
+    barrier();
 
     buf = this_cpu(t_bufs);
+    if ( unlikely(!buf) || unlikely(!ACCESS_ONCE(tb_init_done)) )
+        goto out;
 
-    if ( unlikely(!buf) )
-    {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
-
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+    data_size = this_cpu(data_size);
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
 
-    /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
+    /* Claim the lost records, to report them ahead of this one. */
+    if ( unlikely(this_cpu(lost_records)) )
+    {
+        lost_first_tsc = this_cpu(lost_records_first_tsc);
+        lost = xchg(&this_cpu(lost_records), 0);
+    }
 
-    /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
+    /* Claim space for everything, retrying if interrupted by a writer. */
+    do {
+        reserve = read_atomic(&this_cpu(t_reserve));
+        cons = read_atomic(&buf->cons);
+        if ( bogus(reserve, cons, data_size) )
+            goto out;
 
-    /*
-     * Calculate expected total size to commit this record by
-     * doing a dry-run.
-     */
-    total_size = 0;
+        total_size = calc_total_size(reserve, data_size, rec_size, lost);
 
-    /* First, check to see if we need to include a lost_record.
-     */
-    if ( this_cpu(lost_records) )
-    {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
+        /* Do we have enough space for everything? */
+        if ( total_size > calc_bytes_avail(reserve, cons, data_size) )
         {
-            total_size += bytes_to_wrap;
-            bytes_to_wrap = data_size;
+            /* Give back the lost records, and add this one. */
+            if ( arch_fetch_and_add(&this_cpu(lost_records), lost + 1) == 0 )
+                this_cpu(lost_records_first_tsc) =
+                    lost ? lost_first_tsc : (u64)get_cycles();
+            goto out;
         }
-        total_size += LOST_REC_SIZE;
-        bytes_to_wrap -= LOST_REC_SIZE;
-
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
-    }
 
-    if ( rec_size > bytes_to_wrap )
-    {
-        total_size += bytes_to_wrap;
-    }
-    total_size += rec_size;
-
-    /* Do we have enough space for everything? */
-    if ( total_size > bytes_to_tail )
-    {
-        if ( ++this_cpu(lost_records) == 1 )
-            this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        next = reserve + total_size;
+        if ( next >= 2*data_size )
+            next -= 2*data_size;
+    } while ( cmpxchg(&this_cpu(t_reserve), reserve, next) != reserve );
 
     /*
      * Now, actually write information
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-
-    if ( this_cpu(lost_records) )
+    if ( lost )
     {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
-        {
-            insert_wrap_record(buf, LOST_REC_SIZE);
-            bytes_to_wrap = data_size;
-        }
-        insert_lost_records(buf);
-        bytes_to_wrap -= LOST_REC_SIZE;
-
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
+        if ( LOST_REC_SIZE > calc_bytes_to_wrap(reserve, data_size) )
+            insert_wrap_record(&reserve, LOST_REC_SIZE);
+        insert_lost_records(&reserve, lost, lost_first_tsc);
     }
 
-    if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+    if ( rec_size > calc_bytes_to_wrap(reserve, data_size) )
+        insert_wrap_record(&reserve, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    __insert_record(&reserve, event, extra, cycles, rec_size, extra_data);
+
+    ASSERT(reserve == next);
+
+    if ( this_cpu(t_nesting) > 1 )
+        goto out;
+
+    /*
+     * Publish the records, including any of writers which interrupted us,
+     * up to the point where no more turn up.  Records of writers
+     * interrupting us after that are published by the next record, or
+     * when disabling tracing.
+     */
+    notify = calc_unconsumed_bytes(read_atomic(&buf->prod), cons, data_size) <
+             this_cpu(t_buf_highwater);
+    do {
+        next = read_atomic(&this_cpu(t_reserve));
+        smp_wmb(); /* Records must be visible before prod. */
+        write_atomic(&buf->prod, next);
+        barrier();
+    } while ( next != read_atomic(&this_cpu(t_reserve)) );
+
+    /*
+     * Notify trace buffer consumer that we've crossed the high water mark.
+     * Scheduling the tasklet takes a lock, so leave it to the consumer's
+     * polling in NMI context.
+     */
+    cons = read_atomic(&buf->cons);
+    notify = notify && !in_nmi_handler() && !bogus(next, cons, data_size) &&
+             calc_unconsumed_bytes(next, cons, data_size) >=
+             this_cpu(t_buf_highwater);
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+ out:
+    barrier();
+    this_cpu(t_nesting)--;
 
-    /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( notify )
         tasklet_schedule(&trace_notify_dom0_tasklet);
 }
 
@@ -23,8 +23,14 @@
  * Adapted for Xen by Dan Magenheimer (dan.magenheimer@oracle.com)
  */
 
+#include <xen/cpu.h>
+#include <xen/hypfs.h>
+#include <xen/init.h>
 #include <xen/irq.h>
+#include <xen/keyhandler.h>
 #include <xen/mm.h>
+#include <xen/param.h>
+#include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <asm/time.h>
 #include <asm/page.h>
@@ -382,28 +388,17 @@ void xmem_pool_destroy(struct xmem_pool *pool)
     free_xenheap_pages(pool,pool_order);
 }
 
-void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
+/*
+ * Allocate a block of (rounded) size bytes.  Called and returns with the pool
+ * lock held, which is dropped meanwhile to grow the pool.
+ */
+static struct bhdr *pool_alloc_locked(unsigned long size,
+                                      struct xmem_pool *pool)
 {
     struct bhdr *b, *b2, *next_b, *region;
     int fl, sl;
     unsigned long tmp_size;
 
-    ASSERT_ALLOC_CONTEXT();
-
-    if ( size < MIN_BLOCK_SIZE )
-        size = MIN_BLOCK_SIZE;
-    else
-    {
-        tmp_size = ROUNDUP_SIZE(size);
-        /* Guard against overflow. */
-        if ( tmp_size < size )
-            return NULL;
-        size = tmp_size;
-    }
-
-    /* Rounding up the requested size and calculating fl and sl */
-
-    spin_lock(&pool->lock);
  retry_find:
     MAPPING_SEARCH(&size, &fl, &sl);
 
@@ -412,14 +407,15 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
     {
         /* Not found */
         if ( size > (pool->grow_size - 2 * BHDR_OVERHEAD) )
-            goto out_locked;
+            return NULL;
         if ( pool->max_size && (pool->num_regions * pool->grow_size
                                 > pool->max_size) )
-            goto out_locked;
+            return NULL;
         spin_unlock(&pool->lock);
-        if ( (region = pool->get_mem(pool->grow_size)) == NULL )
-            goto out;
+        region = pool->get_mem(pool->grow_size);
         spin_lock(&pool->lock);
+        if ( region == NULL )
+            return NULL;
         ADD_REGION(region, pool->grow_size, pool);
         goto retry_find;
     }
@@ -452,30 +448,72 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
 
     pool->used_size += (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
 
+    return b;
+}
+
+static unsigned long pool_block_size(unsigned long size)
+{
+    unsigned long tmp_size;
+
+    if ( size < MIN_BLOCK_SIZE )
+        return MIN_BLOCK_SIZE;
+
+    tmp_size = ROUNDUP_SIZE(size);
+    /* Guard against overflow. */
+    return tmp_size < size ? 0 : tmp_size;
+}
+
+void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
+{
+    struct bhdr *b;
+
+    ASSERT_ALLOC_CONTEXT();
+
+    /* Rounding up the requested size and calculating fl and sl */
+    if ( !(size = pool_block_size(size)) )
+        return NULL;
+
+    spin_lock(&pool->lock);
+    b = pool_alloc_locked(size, pool);
     spin_unlock(&pool->lock);
-    return (void *)b->ptr.buffer;
 
-    /* Failed alloc */
- out_locked:
+    return b ? (void *)b->ptr.buffer : NULL;
+}
+
+/*
+ * Allocate up to nr blocks of size bytes into obj[], taking the pool lock
+ * once.  Returns the number of blocks allocated.
+ */
+static unsigned int xmem_pool_alloc_batch(unsigned long size,
+                                          struct xmem_pool *pool,
+                                          void **obj, unsigned int nr)
+{
+    struct bhdr *b;
+    unsigned int i;
+
+    if ( !(size = pool_block_size(size)) )
+        return 0;
+
+    spin_lock(&pool->lock);
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( !(b = pool_alloc_locked(size, pool)) )
+            break;
+        obj[i] = b->ptr.buffer;
+    }
     spin_unlock(&pool->lock);
 
- out:
-    return NULL;
+    return i;
 }
 
-void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+/* Free a block, with the pool lock held. */
+static void pool_free_locked(void *ptr, struct xmem_pool *pool)
 {
     struct bhdr *b, *tmp_b;
     int fl = 0, sl = 0;
 
-    ASSERT_ALLOC_CONTEXT();
-
-    if ( unlikely(ptr == NULL) )
-        return;
-
     b = (struct bhdr *)((char *) ptr - BHDR_OVERHEAD);
 
-    spin_lock(&pool->lock);
     b->size |= FREE_BLOCK;
     pool->used_size -= (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
     b->ptr.free_ptr = (struct free_ptr) { NULL, NULL};
@@ -504,14 +542,39 @@ void xmem_pool_free(void *ptr, struct xmem_pool *pool)
         pool->put_mem(b);
         pool->num_regions--;
         pool->used_size -= BHDR_OVERHEAD; /* sentinel block header */
-        goto out;
+        return;
     }
 
     INSERT_BLOCK(b, pool, fl, sl);
 
     tmp_b->size |= PREV_FREE;
     tmp_b->prev_hdr = b;
- out:
+}
+
+void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+{
+    ASSERT_ALLOC_CONTEXT();
+
+    if ( unlikely(ptr == NULL) )
+        return;
+
+    spin_lock(&pool->lock);
+    pool_free_locked(ptr, pool);
+    spin_unlock(&pool->lock);
+}
+
+/* Free the nr blocks in obj[], taking the pool lock once. */
+static void xmem_pool_free_batch(struct xmem_pool *pool, void *const *obj,
+                                 unsigned int nr)
+{
+    unsigned int i;
+
+    if ( !nr )
+        return;
+
+    spin_lock(&pool->lock);
+    for ( i = 0; i < nr; i++ )
+        pool_free_locked(obj[i], pool);
     spin_unlock(&pool->lock);
 }
 
@@ -569,6 +632,299 @@ static void tlsf_init(void)
     BUG_ON(!xenpool);
 }
 
+/*
+ * Per-cpu caches.
+ *
+ * Small blocks freed to xenpool are kept in per-cpu magazines, one per size
+ * class, and handed out again by the same cpu without taking the pool lock.
+ * An empty magazine is refilled to half its capacity, and the older half of
+ * a full one is returned to the pool, taking the lock once.  A block is
+ * cached in the largest class not exceeding its size, and handed out for
+ * requests up to the size of that class.
+ */
+
+#define CACHE_CLASS_STEP    16
+#define CACHE_MAX_SIZE      1024 /* Largest cached block size */
+#define CACHE_CLASS_BYTES   4096 /* Limit of cached bytes per class and cpu */
+#define CACHE_MAG_MAX       32
+
+static const unsigned short cache_class_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, CACHE_MAX_SIZE,
+};
+#define NR_CACHE_CLASSES ARRAY_SIZE(cache_class_size)
+
+/* Smallest class holding (size - 1) / CACHE_CLASS_STEP, and its capacity */
+static uint8_t __read_mostly cache_class[CACHE_MAX_SIZE / CACHE_CLASS_STEP];
+static uint8_t __read_mostly cache_mag_size[NR_CACHE_CLASSES];
+
+struct xmalloc_cache {
+    struct xmalloc_mag {
+        unsigned int nr;
+        void *obj[CACHE_MAG_MAX];
+    } mag[NR_CACHE_CLASSES];
+
+    /* Statistics */
+    unsigned long alloc_hits, alloc_refills;
+    unsigned long free_hits, free_flushes;
+};
+
+static DEFINE_PER_CPU(struct xmalloc_cache *, xmalloc_cache);
+
+/* Caching would hide use-after-free from pool poisoning, so off for it. */
+static bool __read_mostly opt_xmalloc_cache =
+    !IS_ENABLED(CONFIG_XMEM_POOL_POISON);
+boolean_param("xmalloc-cache", opt_xmalloc_cache);
+
+static void *xmalloc_cache_alloc(unsigned long size)
+{
+    struct xmalloc_cache *c = this_cpu(xmalloc_cache);
+    struct xmalloc_mag *mag;
+    unsigned int cls;
+
+    if ( !c || size > CACHE_MAX_SIZE )
+        return NULL;
+
+    cls = cache_class[(size - 1) / CACHE_CLASS_STEP];
+    mag = &c->mag[cls];
+
+    if ( likely(mag->nr) )
+        c->alloc_hits++;
+    else
+    {
+        c->alloc_refills++;
+        mag->nr = xmem_pool_alloc_batch(cache_class_size[cls], xenpool,
+                                        mag->obj, cache_mag_size[cls] / 2);
+        if ( !mag->nr )
+            return NULL;
+    }
+
+    return mag->obj[--mag->nr];
+}
+
+static bool xmalloc_cache_free(void *p)
+{
+    struct xmalloc_cache *c = this_cpu(xmalloc_cache);
+    const struct bhdr *b = p - BHDR_OVERHEAD;
+    unsigned long size = b->size & BLOCK_SIZE_MASK;
+    struct xmalloc_mag *mag;
+    unsigned int cls;
+
+    if ( !c || size < cache_class_size[0] || size > CACHE_MAX_SIZE )
+        return false;
+
+    cls = cache_class[(size - 1) / CACHE_CLASS_STEP];
+    if ( cache_class_size[cls] > size )
+        cls--;
+    mag = &c->mag[cls];
+
+    if ( likely(mag->nr < cache_mag_size[cls]) )
+        c->free_hits++;
+    else
+    {
+        unsigned int n = mag->nr / 2;
+
+        c->free_flushes++;
+        xmem_pool_free_batch(xenpool, mag->obj, n);
+        mag->nr -= n;
+        memmove(mag->obj, mag->obj + n, mag->nr * sizeof(*mag->obj));
+    }
+
+    mag->obj[mag->nr++] = p;
+
+    return true;
+}
+
+static void xmalloc_cache_drain(struct xmalloc_cache *c)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_CACHE_CLASSES; i++ )
+    {
+        xmem_pool_free_batch(xenpool, c->mag[i].obj, c->mag[i].nr);
+        c->mag[i].nr = 0;
+    }
+}
+
+static unsigned long xmalloc_cache_bytes(const struct xmalloc_cache *c)
+{
+    unsigned long bytes = 0;
+    unsigned int i;
+
+    for ( i = 0; i < NR_CACHE_CLASSES; i++ )
+        bytes += c->mag[i].nr * cache_class_size[i];
+
+    return bytes;
+}
+
+static void cf_check dump_xmalloc(unsigned char key)
+{
+    const struct xmalloc_cache *c;
+    unsigned int cpu;
+
+    printk("xmalloc pool: %lu bytes used, %lu pages\n",
+           xenpool->used_size, xenpool->num_regions);
+
+    if ( !opt_xmalloc_cache )
+    {
+        printk("per-cpu caches disabled\n");
+        return;
+    }
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( !(c = per_cpu(xmalloc_cache, cpu)) )
+            continue;
+
+        printk("CPU%u: %lu bytes cached, alloc %lu hits %lu refills, "
+               "free %lu hits %lu flushes\n",
+               cpu, xmalloc_cache_bytes(c), c->alloc_hits, c->alloc_refills,
+               c->free_hits, c->free_flushes);
+    }
+}
+
+#ifdef CONFIG_HYPFS
+
+static struct {
+    unsigned long used, cached;
+    unsigned long alloc_hits, alloc_refills, free_hits, free_flushes;
+} hypfs_stats;
+/* Held from filling in hypfs_stats until copying a value out. */
+static DEFINE_SPINLOCK(hypfs_stats_lock);
+
+static int cf_check xmalloc_stat_read(const struct hypfs_entry *entry,
+                                      XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    const struct xmalloc_cache *c;
+    unsigned int cpu;
+    int rc;
+
+    spin_lock(&hypfs_stats_lock);
+
+    memset(&hypfs_stats, 0, sizeof(hypfs_stats));
+    hypfs_stats.used = xenpool ? xenpool->used_size : 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( !(c = per_cpu(xmalloc_cache, cpu)) )
+            continue;
+
+        hypfs_stats.cached += xmalloc_cache_bytes(c);
+        hypfs_stats.alloc_hits += c->alloc_hits;
+        hypfs_stats.alloc_refills += c->alloc_refills;
+        hypfs_stats.free_hits += c->free_hits;
+        hypfs_stats.free_flushes += c->free_flushes;
+    }
+
+    rc = hypfs_read_leaf(entry, uaddr);
+
+    spin_unlock(&hypfs_stats_lock);
+
+    return rc;
+}
+
+static const struct hypfs_funcs xmalloc_stat_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = xmalloc_stat_read,
+    .write = hypfs_write_deny,
+    .getsize = hypfs_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+#define XMALLOC_STAT_INIT(var, nam)                                     \
+    static HYPFS_FIXEDSIZE_INIT(xmalloc_stat_##var, XEN_HYPFS_TYPE_UINT, \
+                                nam, hypfs_stats.var,                   \
+                                &xmalloc_stat_funcs, 0)
+
+static HYPFS_DIR_INIT(xmalloc_dir, "xmalloc");
+XMALLOC_STAT_INIT(used, "used");
+XMALLOC_STAT_INIT(cached, "cached");
+XMALLOC_STAT_INIT(alloc_hits, "alloc-hits");
+XMALLOC_STAT_INIT(alloc_refills, "alloc-refills");
+XMALLOC_STAT_INIT(free_hits, "free-hits");
+XMALLOC_STAT_INIT(free_flushes, "free-flushes");
+
+static int __init cf_check xmalloc_hypfs_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &xmalloc_dir, true);
+    hypfs_add_leaf(&xmalloc_dir, &xmalloc_stat_used, true);
+    hypfs_add_leaf(&xmalloc_dir, &xmalloc_stat_cached, true);
+    hypfs_add_leaf(&xmalloc_dir, &xmalloc_stat_alloc_hits, true);
+    hypfs_add_leaf(&xmalloc_dir, &xmalloc_stat_alloc_refills, true);
+    hypfs_add_leaf(&xmalloc_dir, &xmalloc_stat_free_hits, true);
+    hypfs_add_leaf(&xmalloc_dir, &xmalloc_stat_free_flushes, true);
+
+    return 0;
+}
+__initcall(xmalloc_hypfs_init);
+
+#endif /* CONFIG_HYPFS */
+
+static int cf_check cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct xmalloc_cache *c = per_cpu(xmalloc_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        /* Without a cache the cpu uses the pool directly. */
+        if ( !c )
+            per_cpu(xmalloc_cache, cpu) = xzalloc(struct xmalloc_cache);
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        if ( c )
+        {
+            per_cpu(xmalloc_cache, cpu) = NULL;
+            xmalloc_cache_drain(c);
+            xfree(c);
+        }
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback,
+};
+
+static int __init cf_check xmalloc_cache_init(void)
+{
+    void *hcpu = (void *)(long)smp_processor_id();
+    unsigned int i, cls = 0;
+
+    register_keyhandler('X', dump_xmalloc, "dump xmalloc info", 1);
+
+    if ( !opt_xmalloc_cache )
+        return 0;
+
+    for ( i = 0; i < ARRAY_SIZE(cache_class); i++ )
+    {
+        while ( (i + 1) * CACHE_CLASS_STEP > cache_class_size[cls] )
+            cls++;
+        cache_class[i] = cls;
+    }
+
+    for ( i = 0; i < NR_CACHE_CLASSES; i++ )
+        cache_mag_size[i] = min(CACHE_MAG_MAX,
+                                CACHE_CLASS_BYTES / cache_class_size[i]);
+
+    if ( !xenpool )
+        tlsf_init();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, hcpu);
+    register_cpu_notifier(&cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(xmalloc_cache_init);
+
 /*
  * xmalloc()
  */
@@ -625,7 +981,7 @@ void *_xmalloc(unsigned long size, unsigned long align)
     if ( !xenpool )
         tlsf_init();
 
-    if ( size < PAGE_SIZE )
+    if ( size < PAGE_SIZE && !(p = xmalloc_cache_alloc(size)) )
         p = xmem_pool_alloc(size, xenpool);
     if ( p == NULL )
         return xmalloc_whole_pages(size - align + MEM_ALIGN, align);
@@ -737,5 +1093,6 @@ void xfree(void *p)
     /* Strip alignment padding. */
     p = strip_padding(p);
 
-    xmem_pool_free(p, xenpool);
+    if ( !xmalloc_cache_free(p) )
+        xmem_pool_free(p, xenpool);
 }
@@ -17,6 +17,8 @@ typedef struct {
 #define irq_enter()     (local_irq_count(smp_processor_id())++)
 #define irq_exit()      (local_irq_count(smp_processor_id())--)
 
+#define in_nmi_handler() false
+
 #endif /* __ASM_GENERIC_HARDIRQ_H */
 
 /*
@@ -982,6 +982,29 @@ struct xen_domctl_paging_mempool {
     uint64_aligned_t size; /* Size in bytes. */
 };
 
+/*
+ * XEN_DOMCTL_get_relinquish_progress (x86 only).
+ *
+ * Follow the release of a dying domain's memory, which may go on for a while
+ * for large domains.  Idle CPUs help freeing most of it in a first stage;
+ * pages still in use, like page tables, are then released in order by the
+ * CPU destroying the domain.
+ */
+struct xen_domctl_relinquish_progress {
+    /* OUT: Stage of the release of the domain's memory. */
+#define XEN_DOMCTL_RELINQUISH_none   0 /* Not started yet */
+#define XEN_DOMCTL_RELINQUISH_pages  1 /* Freeing pages, with idle CPUs */
+#define XEN_DOMCTL_RELINQUISH_in_use 2 /* Releasing pages still in use */
+#define XEN_DOMCTL_RELINQUISH_done   3 /* All resources released */
+    uint32_t state;
+    /* OUT: Idle CPUs helping at the moment. */
+    uint32_t nr_helpers;
+    /* OUT: Pages the domain still holds. */
+    uint64_aligned_t pages_left;
+    /* OUT: Pages freed in the first stage so far. */
+    uint64_aligned_t pages_freed;
+};
+
 #if defined(__i386__) || defined(__x86_64__)
 struct xen_domctl_vcpu_msr {
     uint32_t         index;
@@ -1325,6 +1348,7 @@ struct xen_domctl {
 #define XEN_DOMCTL_set_paging_mempool_size       86
 #define XEN_DOMCTL_dt_overlay                    87
 #define XEN_DOMCTL_gsi_permission                88
+#define XEN_DOMCTL_get_relinquish_progress       89
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -1388,6 +1412,7 @@ struct xen_domctl {
         struct xen_domctl_vuart_op          vuart_op;
         struct xen_domctl_vmtrace_op        vmtrace_op;
         struct xen_domctl_paging_mempool    paging_mempool;
+        struct xen_domctl_relinquish_progress relinquish_progress;
 #if defined(__arm__) || defined(__aarch64__)
         struct xen_domctl_dt_overlay        dt_overlay;
 #endif
@@ -44,13 +44,25 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * If <flags> contains XEN_DMOP_posted_ring then a posted write ring (see
+ * struct ioreq_ring in ioreq.h) is allocated for each vCPU, through which
+ * writes to ranges mapped with XEN_DMOP_IO_RANGE_posted are passed without
+ * the vCPU waiting for their emulation.  The rings can only be accessed
+ * through the XENMEM_acquire_resource memory op.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - flags */
+    uint8_t flags;
+
+#define _XEN_DMOP_posted_ring 0
+#define XEN_DMOP_posted_ring (1u << _XEN_DMOP_posted_ring)
+
+    uint8_t pad[2];
     /* OUT - server id */
     ioservid_t id;
 };
@@ -114,6 +126,12 @@ typedef struct xen_dm_op_get_ioreq_server_info xen_dm_op_get_ioreq_server_info_t
  *
  * NOTE: unless an emulation request falls entirely within a range mapped
  * by a secondary emulator, it will not be passed to that emulator.
+ *
+ * If <flags> contains XEN_DMOP_IO_RANGE_posted when mapping a range, writes
+ * falling entirely within it are posted to the ring of the writing vCPU,
+ * provided the IOREQ Server was created with XEN_DMOP_posted_ring.  They
+ * are passed synchronously if the ring is full.  <flags> must be zero when
+ * unmapping, which also stops writes to the range being posted.
  */
 #define XEN_DMOP_map_io_range_to_ioreq_server 3
 #define XEN_DMOP_unmap_io_range_from_ioreq_server 4
@@ -121,7 +139,12 @@ typedef struct xen_dm_op_get_ioreq_server_info xen_dm_op_get_ioreq_server_info_t
 struct xen_dm_op_ioreq_server_range {
     /* IN - server id */
     ioservid_t id;
-    uint16_t pad;
+    /* IN - flags */
+    uint16_t flags;
+
+#define _XEN_DMOP_IO_RANGE_posted 0
+#define XEN_DMOP_IO_RANGE_posted (1u << _XEN_DMOP_IO_RANGE_posted)
+
     /* IN - type of range */
     uint32_t type;
 # define XEN_DMOP_IO_RANGE_PORT   0 /* I/O port range */
@@ -81,6 +81,32 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Posted write ring, one page per vCPU for IOREQ Servers created with
+ * XEN_DMOP_posted_ring (see dm_op.h).
+ *
+ * Xen produces writes of the vCPU into ring[prod], the emulator consumes
+ * them from ring[cons].  Both indexes wrap at IOREQ_RING_SLOT_NUM, and one
+ * slot is always left free so that a full ring can be told from an empty
+ * one.  Only type, addr, data, count, size, df and dir are meaningful:
+ * data_is_ptr is never set, and there is no response.
+ *
+ * To batch notifications, Xen only signals the vCPU's ioreq event channel
+ * when it finds the ring to have been empty.  The emulator must therefore
+ * re-check prod after updating cons (with a full barrier in between), before
+ * waiting for the next event.  It must also consume the rings of all vCPUs
+ * before handling a synchronous request, so that the request is ordered
+ * after the writes posted ahead of it.
+ */
+#define IOREQ_RING_SLOT_NUM       127 /* 32 bytes each, plus a 32-byte header */
+struct ioreq_ring {
+    uint32_t prod;          /* written by Xen */
+    uint32_t cons;          /* written by the emulator */
+    uint32_t pad[6];
+    struct ioreq ring[IOREQ_RING_SLOT_NUM];
+}; /* NB. Size of this structure must be no greater than one page. */
+typedef struct ioreq_ring ioreq_ring_t;
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
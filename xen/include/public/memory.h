@@ -664,6 +664,8 @@ struct xen_mem_acquire_resource {
 
 #define XENMEM_resource_ioreq_server_frame_bufioreq 0
 #define XENMEM_resource_ioreq_server_frame_ioreq(n) (1 + (n))
+/* Posted write ring of vCPU n (see XEN_DMOP_posted_ring in hvm/dm_op.h). */
+#define XENMEM_resource_ioreq_server_frame_ring(n) (0x100 + (n))
 
     /*
      * IN/OUT - If the tools domain is PV then, upon return, frame_list
@@ -61,6 +61,11 @@ struct xen_sysctl_tbuf_op {
 #define XEN_SYSCTL_TBUFOP_set_size     3
 #define XEN_SYSCTL_TBUFOP_enable       4
 #define XEN_SYSCTL_TBUFOP_disable      5
+/*
+ * Set the size of the buffers of the cpus in cpu_mask to size pages, with
+ * tracing disabled.  Buffers need to have been allocated with set_size.
+ */
+#define XEN_SYSCTL_TBUFOP_set_cpu_size 6
     uint32_t cmd;
     /* IN/OUT variables */
     struct xenctl_bitmap cpu_mask;
@@ -582,7 +587,10 @@ struct xen_sysctl_page_offline_op {
 /* Record-type: */
 #define LOCKPROF_TYPE_GLOBAL      0   /* global lock, idx meaningless */
 #define LOCKPROF_TYPE_PERDOM      1   /* per-domain lock, idx is domid */
-#define LOCKPROF_TYPE_N           2   /* number of types */
+#define LOCKPROF_TYPE_PERNODE     2   /* per-NUMA-node lock, idx is node id */
+#define LOCKPROF_TYPE_RUNQ        3   /* scheduler runqueue lock, idx is
+                                         runqueue id */
+#define LOCKPROF_TYPE_N           4   /* number of types */
 struct xen_sysctl_lockprof_data {
     char     name[40];     /* lock name (may include up to 2 %d specifiers) */
     int32_t  type;         /* LOCKPROF_TYPE_??? */
@@ -783,6 +791,20 @@ struct xen_sysctl_credit2_schedule {
     uint32_t ratelimit_us;
 };
 
+struct xen_sysctl_rtds_schedule {
+    /*
+     * How the CPUs of the pool are arranged in runqueues: one per CPU, per
+     * core, per socket, per NUMA node, or one for all of them. Can only be
+     * changed while the pool has no CPUs.
+     */
+#define XEN_SYSCTL_RTDS_RUNQUEUE_CPU    0
+#define XEN_SYSCTL_RTDS_RUNQUEUE_CORE   1
+#define XEN_SYSCTL_RTDS_RUNQUEUE_SOCKET 2
+#define XEN_SYSCTL_RTDS_RUNQUEUE_NODE   3
+#define XEN_SYSCTL_RTDS_RUNQUEUE_ALL    4
+    uint32_t runqueue;
+};
+
 /* XEN_SYSCTL_scheduler_op */
 /* Set or get info? */
 #define XEN_SYSCTL_SCHEDOP_putinfo 0
@@ -797,6 +819,7 @@ struct xen_sysctl_scheduler_op {
         } sched_arinc653;
         struct xen_sysctl_credit_schedule sched_credit;
         struct xen_sysctl_credit2_schedule sched_credit2;
+        struct xen_sysctl_rtds_schedule sched_rtds;
     } u;
 };
 
@@ -100,6 +100,8 @@
 #define TRC_SCHED_SWITCH_INFNEXT (TRC_SCHED_VERBOSE + 15)
 #define TRC_SCHED_SHUTDOWN_CODE  (TRC_SCHED_VERBOSE + 16)
 #define TRC_SCHED_SWITCH_INFCONT (TRC_SCHED_VERBOSE + 17)
+#define TRC_SCHED_WAKE_QUEUED    (TRC_SCHED_VERBOSE + 18)
+#define TRC_SCHED_LOCK_WAIT      (TRC_SCHED_VERBOSE + 19)
 
 #define TRC_DOM0_DOM_ADD         (TRC_DOM0_DOMOPS + 1)
 #define TRC_DOM0_DOM_REM         (TRC_DOM0_DOMOPS + 2)
@@ -306,9 +308,11 @@ struct t_buf {
 /* Structure used to pass MFNs to the trace buffers back to trace consumers.
  * Offset is an offset into the mapped structure where the mfn list will be held.
  * MFNs will be at ((unsigned long *)(t_info))+(t_info->cpu_offset[cpu]).
+ * The size in pages of the buffer of a cpu is in the uint32_t preceding its
+ * MFN list.  tbuf_size is 0 if buffers differ in size.
  */
 struct t_info {
-    uint16_t tbuf_size; /* Size in pages of each trace buffer */
+    uint16_t tbuf_size; /* Size in pages of each trace buffer, or 0 */
     uint16_t mfn_offset[];  /* Offset within t_info structure of the page list per cpu */
     /* MFN lists immediately after the header */
 };
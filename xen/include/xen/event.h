@@ -220,7 +220,11 @@ int evtchn_reset(struct domain *d, bool resuming);
  */
 struct evtchn_port_ops {
     void (*init)(struct domain *d, struct evtchn *evtchn);
-    void (*set_pending)(struct vcpu *v, struct evtchn *evtchn);
+    /*
+     * Returns false if the event was pending already, i.e. the notification
+     * was merged with an earlier one.
+     */
+    bool (*set_pending)(struct vcpu *v, struct evtchn *evtchn);
     void (*clear_pending)(struct domain *d, struct evtchn *evtchn);
     void (*unmask)(struct domain *d, struct evtchn *evtchn);
     bool (*is_pending)(const struct domain *d, const struct evtchn *evtchn);
@@ -241,12 +245,14 @@ static inline void evtchn_port_init(struct domain *d, struct evtchn *evtchn)
         d->evtchn_port_ops->init(d, evtchn);
 }
 
-static inline void evtchn_port_set_pending(struct domain *d,
+static inline bool evtchn_port_set_pending(struct domain *d,
                                            unsigned int vcpu_id,
                                            struct evtchn *evtchn)
 {
-    if ( evtchn_usable(evtchn) )
-        d->evtchn_port_ops->set_pending(d->vcpu[vcpu_id], evtchn);
+    if ( !evtchn_usable(evtchn) )
+        return false;
+
+    return d->evtchn_port_ops->set_pending(d->vcpu[vcpu_id], evtchn);
 }
 
 static inline void evtchn_port_clear_pending(struct domain *d,
@@ -34,6 +34,10 @@ struct ioreq_vcpu {
     struct vcpu      *vcpu;
     evtchn_port_t    ioreq_evtchn;
     bool             pending;
+
+    /* Posted write ring, and Xen's copy of its producer index */
+    struct ioreq_page ring;
+    unsigned int     ring_prod;
 };
 
 #define NR_IO_RANGE_TYPES (XEN_DMOP_IO_RANGE_PCI + 1)
@@ -53,7 +57,10 @@ struct ioreq_server {
     spinlock_t             bufioreq_lock;
     evtchn_port_t          bufioreq_evtchn;
     struct rangeset        *range[NR_IO_RANGE_TYPES];
+    /* Ranges writes to which are posted, if HANDLE_POSTED() */
+    struct rangeset        *posted[NR_IO_RANGE_TYPES];
     bool                   enabled;
+    bool                   posted_ring;
     uint8_t                bufioreq_handling;
 };
 
@@ -83,12 +90,15 @@ static inline bool ioreq_needs_completion(const ioreq_t *ioreq)
 #define HANDLE_BUFIOREQ(s) \
     ((s)->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF)
 
+#define HANDLE_POSTED(s) ((s)->posted_ring)
+
 bool domain_has_ioreq_server(const struct domain *d);
 
 bool vcpu_ioreq_pending(struct vcpu *v);
 bool vcpu_ioreq_handle_completion(struct vcpu *v);
 bool is_ioreq_server_page(struct domain *d, const struct page_info *page);
 
+unsigned int ioreq_server_max_frames(struct domain *d, ioservid_t id);
 int ioreq_server_get_frame(struct domain *d, ioservid_t id,
                            unsigned int idx, mfn_t *mfn);
 int ioreq_server_map_mem_type(struct domain *d, ioservid_t id,
@@ -13,6 +13,10 @@ PERFCOUNTER(ipis,                   "#IPIs")
 
 PERFCOUNTER(rcu_idle_timer,         "RCU: idle_timer")
 
+PERFCOUNTER(timer_heap,             "timer: heap insertions")
+PERFCOUNTER(timer_wheel,            "timer: wheel insertions")
+PERFCOUNTER(timer_wheel_cascade,    "timer: wheel cascades")
+
 /* Generic scheduler counters (applicable to all schedulers) */
 PERFCOUNTER(sched_irq,              "sched: timer")
 PERFCOUNTER(sched_run,              "sched: runs through scheduler")
@@ -79,8 +83,37 @@ PERFCOUNTER(credit_reset,           "csched2: credit_reset")
 PERFCOUNTER(deferred_to_tickled_cpu,"csched2: deferred_to_tickled_cpu")
 PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
 PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
+PERFCOUNTER(smt_spread,             "csched2: smt_spread")
+PERFCOUNTER(smt_balance,            "csched2: smt_balance")
+#endif
+
+/* RTDS specific counters */
+#ifdef CONFIG_SCHED_RTDS
+PERFCOUNTER(rtds_push,              "rtds: push")
+PERFCOUNTER(rtds_pull,              "rtds: pull")
+PERFCOUNTER(rtds_pull_trylock_failed, "rtds: pull_trylock_failed")
 #endif
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+/* per-cpu page caches */
+PERFCOUNTER(page_cache_alloc_hit,   "page cache: alloc hits")
+PERFCOUNTER(page_cache_refill,      "page cache: refills")
+PERFCOUNTER(page_cache_free_hit,    "page cache: free hits")
+PERFCOUNTER(page_cache_flush,       "page cache: flushes")
+PERFCOUNTER(page_cache_reclaim,     "page cache: reclaims")
+
+/* ioreq server selection and posted writes */
+#ifdef CONFIG_IOREQ_SERVER
+PERFCOUNTER(ioreq_select,           "ioreq: select")
+PERFCOUNTER(ioreq_select_last,      "ioreq: select last segment")
+PERFCOUNTER(ioreq_select_index,     "ioreq: select index")
+PERFCOUNTER(ioreq_select_none,      "ioreq: select no server")
+PERFCOUNTER(ioreq_select_scan,      "ioreq: select scan")
+PERFCOUNTER(ioreq_index_update,     "ioreq: index update")
+PERFCOUNTER(ioreq_posted,           "ioreq: posted writes")
+PERFCOUNTER(ioreq_posted_notify,    "ioreq: posted write notifications")
+PERFCOUNTER(ioreq_posted_full,      "ioreq: posted write ring full")
+#endif
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -168,6 +168,15 @@ struct vcpu_io {
     ioreq_t              req;
     /* Arch specific info pertaining to the io request */
     struct arch_vcpu_io  info;
+    /*
+     * Segment of the last ioreq server selection, valid as long as the
+     * domain's selection index still has generation gen.
+     */
+    struct {
+        unsigned long    gen, start, end;
+        unsigned int     id;
+        uint8_t          type;
+    } last;
 };
 
 struct vcpu
@@ -261,6 +270,10 @@ struct vcpu
     unsigned long    pause_flags;
     atomic_t         pause_count;
 
+    /* Wakeup pending in a runqueue's inbox (see vcpu_unblock()). */
+    bool             wake_queued;
+    struct vcpu     *wake_next;
+
     /* VCPU paused for vm_event replies. */
     atomic_t         vm_event_pause_count;
     /* VCPU paused by system controller. */
@@ -271,11 +284,19 @@ struct vcpu
      * protects:
      *  - entries in the freelist
      *  - maptrack_head
-     *  - maptrack_tail
+     * Freed entries are pushed onto maptrack_freed without holding the
+     * lock, and moved to the freelist as a whole under the lock.
      */
     spinlock_t       maptrack_freelist_lock;
     unsigned int     maptrack_head;
-    unsigned int     maptrack_tail;
+    unsigned int     maptrack_freed;
+
+    /*
+     * Interdomain notifications sent by this vCPU, and how many of them found
+     * the remote port pending already.  Only updated by the vCPU itself.
+     */
+    unsigned long    evtchn_sends;
+    unsigned long    evtchn_sends_coalesced;
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
     evtchn_port_t    virq_to_evtchn[NR_VIRQS];
@@ -632,6 +653,9 @@ struct domain
     struct {
         rspinlock_t             lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        /* Selection index, read under RCU by ioreq_server_select() */
+        struct ioreq_index      *index;
+        unsigned long           index_gen;
     } ioreq_server;
 #endif
 
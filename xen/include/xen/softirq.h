@@ -6,6 +6,7 @@ enum {
     TIMER_SOFTIRQ = 0,
     RCU_SOFTIRQ,
     SCHED_SLAVE_SOFTIRQ,
+    SCHED_WAKE_SOFTIRQ,
     SCHEDULE_SOFTIRQ,
     NEW_TLBFLUSH_CLOCK_PERIOD_SOFTIRQ,
     TASKLET_SOFTIRQ,
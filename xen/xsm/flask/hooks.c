@@ -839,6 +839,9 @@ static int cf_check flask_domctl(struct domain *d, unsigned int cmd,
     case XEN_DOMCTL_set_paging_mempool_size:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SETPAGINGMEMPOOL);
 
+    case XEN_DOMCTL_get_relinquish_progress:
+        return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__GETDOMAININFO);
+
     default:
         return avc_unknown_permission("domctl", cmd);
     }